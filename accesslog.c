@@ -0,0 +1,179 @@
+#include "accesslog.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ACCESS_LOG_MASK (ACCESS_LOG_ENTRIES - 1)
+// Room one formatted entry can take; the URL is at most four bytes per character when escaped
+#define ACCESS_LOG_LINE (160 + 4 * ACCESS_LOG_URL)
+#define ACCESS_LOG_BATCH 65536
+
+// The request line as Apache logs it: quotes and control characters escaped
+static size_t escapeUrl(char *out, const char *url, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    size_t used = 0;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char) url[i];
+        if (c == '"' || c == '\\') {
+            out[used++] = '\\';
+            out[used++] = (char) c;
+        } else if (c < 0x20 || c == 0x7f) {
+            out[used++] = '\\';
+            out[used++] = 'x';
+            out[used++] = hex[c >> 4];
+            out[used++] = hex[c & 15];
+        } else {
+            out[used++] = (char) c;
+        }
+    }
+    return used;
+}
+
+/*
+ * Common Log Format, followed by whether the cache answered and how long
+ * the request took:
+ * 127.0.0.1 - - [18/Oct/2026:12:00:00 +0000] "GET http://host/path HTTP/1.0" 200 1234 HIT 85us
+ */
+static size_t formatEntry(const AccessEntry *entry, char *out, char *stamp, int64_t *stampTime) {
+    // Requests come in bursts within one second; the date is formatted once per second
+    if (entry->time != *stampTime) {
+        time_t seconds = (time_t) entry->time;
+        struct tm tm;
+        gmtime_r(&seconds, &tm);
+        strftime(stamp, 32, "%d/%b/%Y:%H:%M:%S +0000", &tm);
+        *stampTime = entry->time;
+    }
+    char client[INET_ADDRSTRLEN];
+    struct in_addr address;
+    address.s_addr = entry->client;
+    inet_ntop(AF_INET, &address, client, sizeof(client));
+    char url[4 * ACCESS_LOG_URL];
+    size_t urlLength = escapeUrl(url, entry->url, entry->urlLength);
+    int written = snprintf(out, ACCESS_LOG_LINE, "%s - - [%s] \"GET %.*s HTTP/1.0\" %u %lld %s %uus\n", client, stamp,
+                           (int) urlLength, url, entry->statusCode, (long long) entry->bodyBytes,
+                           entry->cached ? "HIT" : "MISS", entry->durationUs);
+    return written < 0 ? 0 : (size_t) written < ACCESS_LOG_LINE ? (size_t) written : ACCESS_LOG_LINE - 1;
+}
+
+static int writeAll(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= (size_t) written;
+    }
+    return 0;
+}
+
+/*
+ * The consumer: takes whatever the worker has published, formats it into
+ * one buffer and writes that with a single call. Slots are handed back as
+ * soon as they have been formatted, before the write, so a slow disk only
+ * ever holds up this thread.
+ */
+static void *accessLogWriter(void *arg) {
+    AccessLog *log = arg;
+    char batch[ACCESS_LOG_BATCH];
+    char stamp[32];
+    int64_t stampTime = -1;
+    for (;;) {
+        // Read stopping first: once it is set, the head read after it is final
+        int stopping = __atomic_load_n(&log->stopping, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = log->tail;
+        if (tail == head) {
+            if (stopping) {
+                return NULL;
+            }
+            struct timespec pause = {0, ACCESS_LOG_POLL_MS * 1000000L};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        size_t length = 0;
+        uint64_t first = tail;
+        while (tail != head && length + ACCESS_LOG_LINE <= sizeof(batch)) {
+            length += formatEntry(&log->ring[tail & ACCESS_LOG_MASK], batch + length, stamp, &stampTime);
+            tail++;
+        }
+        __atomic_store_n(&log->tail, tail, __ATOMIC_RELEASE);
+        if (writeAll(log->fd, batch, length) == -1) {
+            log->failed += (unsigned long) (tail - first);
+        }
+        log->batches++;
+    }
+}
+
+/**
+ * @brief Opens the log file for appending and starts the writer thread.
+ *
+ * Every worker opens its own after fork(): threads do not survive a fork.
+ * Lines of different workers never mix, as each batch is one write() to a
+ * file opened with O_APPEND.
+ *
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int accessLogOpen(AccessLog *log, const char *path) {
+    memset(log, 0, sizeof(*log));
+    log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log->fd == -1) {
+        return -1;
+    }
+    log->ring = malloc(sizeof(AccessEntry) * ACCESS_LOG_ENTRIES);
+    if (log->ring == NULL) {
+        close(log->fd);
+        return -1;
+    }
+    int error = pthread_create(&log->writer, NULL, accessLogWriter, log);
+    if (error != 0) {
+        free(log->ring);
+        close(log->fd);
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief The next free slot for the producer to fill, or NULL when the ring is full.
+ *
+ * Never waits: with the writer behind, the entry is the caller's to drop
+ * and count.
+ */
+AccessEntry *accessLogReserve(AccessLog *log) {
+    if (log->head - log->tailSeen == ACCESS_LOG_ENTRIES) {
+        // Only look at the consumer's cache line when the last look said full
+        log->tailSeen = __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE);
+        if (log->head - log->tailSeen == ACCESS_LOG_ENTRIES) {
+            return NULL;
+        }
+    }
+    return &log->ring[log->head & ACCESS_LOG_MASK];
+}
+
+/**
+ * @brief Hands the slot from accessLogReserve() to the writer.
+ */
+void accessLogPublish(AccessLog *log) {
+    __atomic_store_n(&log->head, log->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Writes out what is still in the ring and stops the writer.
+ */
+void accessLogClose(AccessLog *log) {
+    __atomic_store_n(&log->stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(log->writer, NULL);
+    free(log->ring);
+    close(log->fd);
+}
@@ -0,0 +1,55 @@
+#ifndef CPROXY_ACCESSLOG_H
+#define CPROXY_ACCESSLOG_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+// Ring slots per worker, a power of two; a full ring drops entries instead of waiting
+#define ACCESS_LOG_ENTRIES 4096
+// The writer looks for new entries this often while the ring is empty
+#define ACCESS_LOG_POLL_MS 20
+// Longest URL kept in an entry; longer ones are cut
+#define ACCESS_LOG_URL 200
+
+/**
+ * @brief One request as the worker hands it to the writer; formatted only there.
+ */
+typedef struct AccessEntry {
+    int64_t time;           // Seconds since the epoch
+    uint32_t client;        // IPv4 address, network byte order
+    uint16_t statusCode;
+    uint8_t cached;
+    uint8_t urlLength;
+    int64_t bodyBytes;
+    uint32_t durationUs;
+    char url[ACCESS_LOG_URL];
+} AccessEntry;
+
+/**
+ * @brief An access log fed through a single-producer single-consumer ring.
+ *
+ * The worker's event loop is the only producer and a thread of its own the
+ * only consumer. The producer fills a slot in place and publishes it by
+ * moving head; the consumer formats what is between tail and head into one
+ * buffer, writes it with a single write() and moves tail. Neither side
+ * takes a lock or makes a system call on the other's behalf, and head and
+ * tail sit on separate cache lines.
+ */
+typedef struct AccessLog {
+    uint64_t head __attribute__((aligned(64)));     // Written by the producer only
+    uint64_t tailSeen;      // The producer's last look at tail
+    uint64_t tail __attribute__((aligned(64)));     // Written by the consumer only
+    int stopping;
+    int fd;
+    unsigned long batches;  // write() calls the writer made
+    unsigned long failed;   // Entries lost to failed writes
+    AccessEntry *ring;
+    pthread_t writer;
+} AccessLog;
+
+int accessLogOpen(AccessLog *log, const char *path);
+AccessEntry *accessLogReserve(AccessLog *log);
+void accessLogPublish(AccessLog *log);
+void accessLogClose(AccessLog *log);
+
+#endif //CPROXY_ACCESSLOG_H
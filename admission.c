@@ -0,0 +1,132 @@
+#include "admission.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "cproxy.h"
+
+#define ROWS 4
+
+static const uint64_t rowSeeds[ROWS] = {0x9e3779b97f4a7c15ULL, 0xbf58476d1ce4e5b9ULL, 0x94d049bb133111ebULL,
+                                        0xd6e8feb86659fd93ULL};
+
+/**
+ * @brief Sets up a sketch for about entries distinct keys.
+ *
+ * threshold is how many times a key must have been asked for lately before
+ * admissionAdmit() lets its response into the cache.
+ *
+ * @return 0 on success, CPROXY_ERR_NOMEM if the counters cannot be mapped.
+ */
+int admissionInit(Admission *admission, size_t entries, unsigned int threshold) {
+    size_t words = 1;
+    while (words * 16 < entries) {
+        words *= 2;
+    }
+    admission->mappingLength = sizeof(unsigned long) + ROWS * words * sizeof(uint64_t);
+    void *mapping = mmap(NULL, admission->mappingLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        admission->words = NULL;
+        return CPROXY_ERR_NOMEM;
+    }
+    // The counters first, so every word is aligned
+    admission->words = mapping;
+    admission->additions = (unsigned long *) (admission->words + ROWS * words);
+    admission->rowMask = words - 1;
+    admission->sampleSize = ADMISSION_SAMPLE_FACTOR * 16 * words;
+    admission->threshold = threshold;
+    return 0;
+}
+
+void admissionFree(Admission *admission) {
+    if (admission->words != NULL) {
+        munmap(admission->words, admission->mappingLength);
+        admission->words = NULL;
+    }
+}
+
+/**
+ * @brief FNV-1a of a key, finalized so that every bit of the result depends on every byte.
+ */
+uint64_t admissionHash(const char *key, size_t length) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// The word of a key's counter in a row and the counter's shift within it
+static uint64_t *counterOf(const Admission *admission, uint64_t hash, int row, unsigned int *shift) {
+    uint64_t h = (hash ^ rowSeeds[row]) * 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 29;
+    *shift = (unsigned int) (h >> 60) * 4;
+    return &admission->words[(size_t) row * (admission->rowMask + 1) + (h & admission->rowMask)];
+}
+
+// Every counter halved; concurrent additions land before or after a word's halving, never in between
+static void admissionAge(Admission *admission) {
+    size_t words = ROWS * (admission->rowMask + 1);
+    for (size_t i = 0; i < words; i++) {
+        uint64_t old = __atomic_load_n(&admission->words[i], __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&admission->words[i], &old, (old >> 1) & 0x7777777777777777ULL, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+    }
+    __atomic_fetch_sub(admission->additions, admission->sampleSize / 2, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Counts one more request for the key with the given admissionHash().
+ */
+void admissionRecord(Admission *admission, uint64_t hash) {
+    for (int row = 0; row < ROWS; row++) {
+        unsigned int shift;
+        uint64_t *word = counterOf(admission, hash, row, &shift);
+        uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+        while (((old >> shift) & 15) != 15 &&
+               !__atomic_compare_exchange_n(word, &old, old + ((uint64_t) 1 << shift), 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
+    // Only the process that completes the sample ages it
+    if (__atomic_add_fetch(admission->additions, 1, __ATOMIC_RELAXED) == admission->sampleSize) {
+        admissionAge(admission);
+    }
+}
+
+/**
+ * @brief How many times the key was asked for lately, at most 15; never an underestimate until aged.
+ */
+unsigned int admissionEstimate(const Admission *admission, uint64_t hash) {
+    unsigned int estimate = 15;
+    for (int row = 0; row < ROWS; row++) {
+        unsigned int shift;
+        const uint64_t *word = counterOf(admission, hash, row, &shift);
+        unsigned int counter = (unsigned int) (__atomic_load_n(word, __ATOMIC_RELAXED) >> shift) & 15;
+        if (counter < estimate) {
+            estimate = counter;
+        }
+    }
+    return estimate;
+}
+
+/**
+ * @brief Counts a request for a response about to be stored and tells whether to store it.
+ *
+ * The cache has no capacity to evict from, so there is no victim to weigh
+ * the candidate against as in W-TinyLFU: a response is stored once its key
+ * has been asked for threshold times lately, and the body of a key seen
+ * once only goes to whoever asked for it.
+ *
+ * @return 1 to store the response, 0 to only relay it.
+ */
+int admissionAdmit(Admission *admission, const char *key) {
+    uint64_t hash = admissionHash(key, strlen(key));
+    admissionRecord(admission, hash);
+    return admissionEstimate(admission, hash) >= admission->threshold;
+}
@@ -0,0 +1,42 @@
+#ifndef CPROXY_ADMISSION_H
+#define CPROXY_ADMISSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Distinct keys the sketch is sized for by default; it takes 4 bits per key and row
+#define ADMISSION_ENTRIES (1 << 20)
+// Additions per counter before every counter is halved
+#define ADMISSION_SAMPLE_FACTOR 10
+
+/**
+ * @brief Count-min sketch of how often keys were asked for lately, the
+ * frequency filter of W-TinyLFU.
+ *
+ * Four rows of 4-bit counters, sixteen to a word, indexed by independent
+ * hashes of the key; a key's estimate is the smallest of its four counters,
+ * which other keys can only inflate. Once a sample of ADMISSION_SAMPLE_FACTOR
+ * additions per counter has been counted every counter is halved, so what
+ * was popular long ago fades and a counter saturating at 15 is no limit.
+ *
+ * The counters live in a shared anonymous mapping and are updated with
+ * compare-and-swap, so worker processes forked after admissionInit() count
+ * into the same sketch and each sees the popularity of the whole proxy.
+ */
+typedef struct Admission {
+    uint64_t *words;            // rows * (rowMask + 1) words of counters
+    unsigned long *additions;   // Since the last halving, in the same mapping
+    size_t mappingLength;
+    size_t rowMask;             // Words per row - 1, a power of two minus one
+    unsigned long sampleSize;
+    unsigned int threshold;     // Estimate at which admissionAdmit() stores a response
+} Admission;
+
+int admissionInit(Admission *admission, size_t entries, unsigned int threshold);
+void admissionFree(Admission *admission);
+uint64_t admissionHash(const char *key, size_t length);
+void admissionRecord(Admission *admission, uint64_t hash);
+unsigned int admissionEstimate(const Admission *admission, uint64_t hash);
+int admissionAdmit(Admission *admission, const char *key);
+
+#endif //CPROXY_ADMISSION_H
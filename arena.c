@@ -0,0 +1,67 @@
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN sizeof(void *)
+#define ARENA_MIN_BLOCK 1024
+
+void arenaInit(Arena *arena, void *initial, size_t initialSize) {
+    arena->initial = initial;
+    arena->initialSize = initialSize;
+    arena->blocks = NULL;
+    arena->cursor = initial;
+    arena->end = (char *) initial + initialSize;
+}
+
+/**
+ * @brief Returns size bytes aligned for any pointer, or NULL if malloc fails.
+ */
+void *arenaAlloc(Arena *arena, size_t size) {
+    uintptr_t aligned = ((uintptr_t) arena->cursor + ARENA_ALIGN - 1) & ~(uintptr_t) (ARENA_ALIGN - 1);
+    if (arena->cursor != NULL && aligned + size <= (uintptr_t) arena->end) {
+        arena->cursor = (char *) (aligned + size);
+        return (void *) aligned;
+    }
+
+    // Out of room: chain a new block at least twice the size of the previous one
+    size_t blockSize = arena->blocks != NULL ? arena->blocks->size * 2 : ARENA_MIN_BLOCK;
+    if (blockSize < size) {
+        blockSize = size;
+    }
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + blockSize);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->size = blockSize;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->cursor = block->data + size;
+    arena->end = block->data + blockSize;
+    return block->data;
+}
+
+char *arenaStrndup(Arena *arena, const char *str, size_t len) {
+    char *copy = arenaAlloc(arena, len + 1);
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+/**
+ * @brief Releases everything allocated from the arena.
+ *
+ * O(1) when the request fitted in the first block, which is the common case.
+ */
+void arenaReset(Arena *arena) {
+    while (arena->blocks != NULL) {
+        ArenaBlock *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    arena->cursor = arena->initial;
+    arena->end = arena->initial + arena->initialSize;
+}
@@ -0,0 +1,32 @@
+#ifndef CPROXY_ARENA_H
+#define CPROXY_ARENA_H
+
+#include <stddef.h>
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+/**
+ * @brief Bump allocator for everything that lives exactly as long as one request.
+ *
+ * Allocation is a pointer increment into a caller-provided first block;
+ * overflow blocks come from malloc. Individual allocations are never freed,
+ * the whole arena is reset at once.
+ */
+typedef struct Arena {
+    char *cursor;
+    char *end;
+    char *initial;          // Caller-provided first block
+    size_t initialSize;
+    ArenaBlock *blocks;     // Overflow blocks, newest first
+} Arena;
+
+void arenaInit(Arena *arena, void *initial, size_t initialSize);
+void *arenaAlloc(Arena *arena, size_t size);
+char *arenaStrndup(Arena *arena, const char *str, size_t len);
+void arenaReset(Arena *arena);
+
+#endif //CPROXY_ARENA_H
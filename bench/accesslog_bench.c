@@ -0,0 +1,127 @@
+// What logging a request costs the event loop.
+//
+// Entries are produced as fast as one thread can: once through the access
+// log's ring, where the writer thread formats and writes them in batches,
+// and once the synchronous way, formatted with snprintf() and written with
+// one write() per request. For the ring, the producer's cost per entry is
+// what the request path pays; entries the writer could not keep up with
+// are dropped and counted. A second, paced run produces at a steady rate
+// the writer can follow and should drop nothing.
+//
+// Usage: accesslog_bench [entries]
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static long countLines(const char *path) {
+    FILE *file = fopen(path, "r");
+    long lines = 0;
+    int c;
+    while (file != NULL && (c = getc(file)) != EOF) {
+        lines += c == '\n';
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+    return lines;
+}
+
+static void fillEntry(AccessEntry *entry, long i) {
+    static const char url[] = "http://bench.example.com/static/images/logo.png";
+    entry->time = (int64_t) time(NULL);
+    entry->client = 0x0100007f;
+    entry->statusCode = 200;
+    entry->cached = (uint8_t) (i & 1);
+    entry->bodyBytes = 4096 + i % 1000;
+    entry->durationUs = (uint32_t) (50 + i % 300);
+    entry->urlLength = sizeof(url) - 1;
+    memcpy(entry->url, url, sizeof(url) - 1);
+}
+
+// Produce entries, pausing every 256 when paced; returns seconds spent producing
+static double produce(AccessLog *log, long entries, int paced, long *dropped) {
+    double busy = 0;
+    *dropped = 0;
+    for (long i = 0; i < entries; i += 256) {
+        double start = nowSeconds();
+        for (long j = i; j < i + 256 && j < entries; j++) {
+            AccessEntry *entry = accessLogReserve(log);
+            if (entry == NULL) {
+                (*dropped)++;
+                continue;
+            }
+            fillEntry(entry, j);
+            accessLogPublish(log);
+        }
+        busy += nowSeconds() - start;
+        if (paced) {
+            // 256 entries every 2 ms: 128k requests a second
+            struct timespec pause = {0, 2000000L};
+            nanosleep(&pause, NULL);
+        }
+    }
+    return busy;
+}
+
+int main(int argc, char *argv[]) {
+    long entries = argc > 1 ? atol(argv[1]) : 1000000;
+    char path[] = "/tmp/accesslog_bench.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    AccessLog log;
+    for (int paced = 0; paced <= 1; paced++) {
+        long count = paced ? entries / 10 : entries;
+        truncate(path, 0);
+        if (accessLogOpen(&log, path) == -1) {
+            perror(path);
+            return EXIT_FAILURE;
+        }
+        long dropped;
+        double busy = produce(&log, count, paced, &dropped);
+        accessLogClose(&log);
+        printf("ring %-7s %8ld entries: %6.1f ns each on the request path, %ld dropped, %ld written in %lu batches\n",
+               paced ? "paced:" : "burst:", count, busy / (double) count * 1e9, dropped, countLines(path),
+               log.batches);
+    }
+
+    // The synchronous way: format and write on the request path
+    truncate(path, 0);
+    fd = open(path, O_WRONLY | O_APPEND);
+    AccessEntry entry;
+    double start = nowSeconds();
+    for (long i = 0; i < entries; i++) {
+        char line[512];
+        fillEntry(&entry, i);
+        int length = snprintf(line, sizeof(line), "127.0.0.1 - - [18/Oct/2026:12:00:00 +0000] \"GET %.*s HTTP/1.0\" %u "
+                              "%lld %s %uus\n", (int) entry.urlLength, entry.url, entry.statusCode,
+                              (long long) entry.bodyBytes, entry.cached ? "HIT" : "MISS", entry.durationUs);
+        if (write(fd, line, (size_t) length) != length) {
+            perror("write");
+            return EXIT_FAILURE;
+        }
+    }
+    double seconds = nowSeconds() - start;
+    close(fd);
+    printf("write() per request: %6.1f ns each on the request path\n", seconds / (double) entries * 1e9);
+    unlink(path);
+    return EXIT_SUCCESS;
+}
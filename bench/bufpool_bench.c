@@ -0,0 +1,180 @@
+// Resident memory of idle client connections: pooled buffers vs per-connection buffers.
+//
+// Opens N idle connections to a one-worker cproxy_c and reads the worker's
+// VmRSS before and after. For comparison it allocates N connections with
+// the per-connection request and send buffers the server used before the
+// pool (4 KB + 8 KB), touched the way a connection that has served one
+// request leaves them.
+//
+// Usage: bufpool_bench [connections]
+
+#include <dirent.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef CPROXY_BINARY
+#define CPROXY_BINARY "./cproxy_c"
+#endif
+
+#define BENCH_PORT 18100
+
+typedef struct NaiveConn {
+    void *header[24];       // Roughly the bookkeeping part of a connection
+    char request[4096];
+    char pending[8192];
+} NaiveConn;
+
+static long readRssKb(pid_t pid) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+    FILE *status = fopen(path, "r");
+    if (status == NULL) {
+        return -1;
+    }
+    long rss = -1;
+    while (fgets(line, sizeof(line), status) != NULL) {
+        if (strncmp(line, "VmRSS:", 6) == 0) {
+            rss = strtol(line + 6, NULL, 10);
+            break;
+        }
+    }
+    fclose(status);
+    return rss;
+}
+
+// The master forks the worker; find it through /proc
+static pid_t findChild(pid_t parent) {
+    DIR *proc = opendir("/proc");
+    struct dirent *entry;
+    pid_t child = -1;
+    while (proc != NULL && (entry = readdir(proc)) != NULL) {
+        char path[300], comm[64];
+        int pid, ppid;
+        char state;
+        snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+        FILE *stat = fopen(path, "r");
+        if (stat == NULL) {
+            continue;
+        }
+        if (fscanf(stat, "%d %63s %c %d", &pid, comm, &state, &ppid) == 4 && ppid == parent) {
+            child = pid;
+        }
+        fclose(stat);
+    }
+    if (proc != NULL) {
+        closedir(proc);
+    }
+    return child;
+}
+
+static int connectLoopback(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static long measurePooled(int connections) {
+    char limit[16];
+    snprintf(limit, sizeof(limit), "%d", connections + 16);
+    pid_t master = fork();
+    if (master == 0) {
+        execl(CPROXY_BINARY, "cproxy_c", "-l", "18100", "-w", "1", "-c", limit, (char *) NULL);
+        perror("execl " CPROXY_BINARY);
+        _exit(127);
+    }
+
+    int probe = -1;
+    for (int attempt = 0; attempt < 100 && probe == -1; attempt++) {
+        usleep(20000);
+        probe = connectLoopback(BENCH_PORT);
+    }
+    if (probe == -1) {
+        kill(master, SIGTERM);
+        return -1;
+    }
+    close(probe);
+    usleep(50000);
+    pid_t worker = findChild(master);
+    long before = readRssKb(worker);
+
+    int *fds = malloc(sizeof(int) * (size_t) connections);
+    int opened = 0;
+    for (int i = 0; i < connections; i++) {
+        fds[i] = connectLoopback(BENCH_PORT);
+        if (fds[i] == -1) {
+            fprintf(stderr, "connect failed after %d connections\n", i);
+            break;
+        }
+        opened++;
+    }
+    usleep(200000);     // Let the worker accept everything
+    long after = readRssKb(worker);
+
+    for (int i = 0; i < opened; i++) {
+        close(fds[i]);
+    }
+    free(fds);
+    kill(master, SIGTERM);
+    waitpid(master, NULL, 0);
+    if (opened != connections) {
+        return -1;
+    }
+    return after - before;
+}
+
+static long measureNaive(int connections) {
+    long before = readRssKb(getpid());
+    NaiveConn **conns = malloc(sizeof(NaiveConn *) * (size_t) connections);
+    for (int i = 0; i < connections; i++) {
+        conns[i] = malloc(sizeof(NaiveConn));
+        memset(conns[i], 0, sizeof(NaiveConn));
+    }
+    long after = readRssKb(getpid());
+    for (int i = 0; i < connections; i++) {
+        free(conns[i]);
+    }
+    free(conns);
+    return after - before;
+}
+
+int main(int argc, char *argv[]) {
+    int connections = argc > 1 ? atoi(argv[1]) : 10000;
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t) connections + 64) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    long pooled = measurePooled(connections);
+    long naive = measureNaive(connections);
+    double scale = 10000.0 / connections;
+
+    if (pooled < 0) {
+        fprintf(stderr, "pooled measurement failed (raise the open file limit?)\n");
+        return EXIT_FAILURE;
+    }
+    printf("idle connections:            %d\n", connections);
+    printf("pooled (cproxy_c worker):    %8.1f MB per 10k\n", pooled * scale / 1024.0);
+    printf("per-connection buffers:      %8.1f MB per 10k\n", naive * scale / 1024.0);
+    printf("saving:                      %8.1fx\n", pooled > 0 ? (double) naive / (double) pooled : 0.0);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,153 @@
+// Cache index startup: mapped snapshot + journal replay vs walking the tree.
+//
+// Builds a synthetic cache of N file-backed objects (sparse files spread
+// over 1000 hosts and 100 directories per host), then measures:
+//   - a full rescan, i.e. rebuilding the index by walking the object tree
+//     as a restart without a snapshot has to (with warm dentry and inode
+//     caches; a cold volume is slower still),
+//   - writing a snapshot,
+//   - startup with the snapshot: cacheIndexOpen() mapping it and replaying
+//     a journal of J records stored after it.
+//
+// Usage: cacheindex_bench [objects] [journal records]
+
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cacheindex.h"
+
+#define HOSTS 1000
+#define DIRS_PER_HOST 100
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int removeEntry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void) st;
+    (void) type;
+    (void) ftw;
+    remove(path);
+    return 0;
+}
+
+static off_t objectSize(long i) {
+    return 200 + (off_t) ((unsigned long) i * 2654435761u % 100000);
+}
+
+static int buildTree(const char *root, long objects) {
+    char path[512];
+    if (mkdir(root, 0777) == -1) {
+        return -1;
+    }
+    for (int host = 0; host < HOSTS; host++) {
+        snprintf(path, sizeof(path), "%s/host%d.example.com", root, host);
+        mkdir(path, 0777);
+        snprintf(path, sizeof(path), "%s/host%d.example.com/objects", root, host);
+        mkdir(path, 0777);
+        for (int dir = 0; dir < DIRS_PER_HOST; dir++) {
+            snprintf(path, sizeof(path), "%s/host%d.example.com/objects/%d", root, host, dir);
+            if (mkdir(path, 0777) == -1) {
+                return -1;
+            }
+        }
+    }
+    for (long i = 0; i < objects; i++) {
+        snprintf(path, sizeof(path), "%s/host%ld.example.com/objects/%ld/%ld", root, i % HOSTS,
+                 i / HOSTS % DIRS_PER_HOST, i);
+        // Sparse: only the metadata matters here
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd == -1 || ftruncate(fd, objectSize(i)) == -1) {
+            return -1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    long objects = argc > 1 ? atol(argv[1]) : 1000000;
+    long journalRecords = argc > 2 ? atol(argv[2]) : 10000;
+    char dir[] = "/tmp/cproxy-indexbench-XXXXXX";
+    if (objects < 1 || mkdtemp(dir) == NULL) {
+        perror("scratch directory");
+        return EXIT_FAILURE;
+    }
+    char root[sizeof(dir) + 16];
+    char indexDir[sizeof(dir) + 32];
+    snprintf(root, sizeof(root), "%s/cache", dir);
+    snprintf(indexDir, sizeof(indexDir), "%s/cache/.index", dir);
+
+    double start = nowSeconds();
+    if (buildTree(root, objects) == -1) {
+        perror("building the synthetic cache");
+        nftw(dir, removeEntry, 64, FTW_DEPTH | FTW_PHYS);
+        return EXIT_FAILURE;
+    }
+    printf("synthetic cache:   %ld objects under %d hosts, built in %.1f s\n", objects, HOSTS,
+           nowSeconds() - start);
+
+    // Without a snapshot the only source of truth is the tree itself
+    CacheIndex index;
+    if (cacheIndexOpen(&index, indexDir, root) == -1) {
+        perror("cacheIndexOpen");
+        return EXIT_FAILURE;
+    }
+    start = nowSeconds();
+    cacheIndexStartRescan(&index);
+    while (cacheIndexRescanStep(&index, 1u << 20)) {
+    }
+    double rescan = nowSeconds() - start;
+    size_t found = index.entries;
+
+    start = nowSeconds();
+    int saved = cacheIndexSnapshot(&index);
+    double snapshot = nowSeconds() - start;
+    struct stat st;
+    char snapshotPath[sizeof(indexDir) + 16];
+    snprintf(snapshotPath, sizeof(snapshotPath), "%s/snapshot", indexDir);
+    if (saved == -1 || stat(snapshotPath, &st) == -1) {
+        fprintf(stderr, "snapshot failed\n");
+        return EXIT_FAILURE;
+    }
+
+    // Objects stored after the snapshot only exist in the journal
+    char path[512];
+    for (long j = 0; j < journalRecords; j++) {
+        snprintf(path, sizeof(path), "%s/late.example.com/%ld", root, j);
+        cacheIndexRecord(&index, path, (uint64_t) objectSize(j), 0);
+    }
+    cacheIndexClose(&index);
+
+    double startup = 0;
+    size_t loaded = 0;
+    for (int run = 0; run < 5; run++) {
+        start = nowSeconds();
+        cacheIndexOpen(&index, indexDir, root);
+        double elapsed = nowSeconds() - start;
+        loaded = index.entries;
+        cacheIndexClose(&index);
+        if (run == 0 || elapsed < startup) {
+            startup = elapsed;
+        }
+    }
+
+    printf("full rescan:       %10.1f ms  (%zu objects indexed)\n", rescan * 1e3, found);
+    printf("snapshot write:    %10.1f ms  (%.1f MB)\n", snapshot * 1e3, (double) st.st_size / (1 << 20));
+    printf("snapshot startup:  %10.2f ms  (%zu objects, %ld journal records replayed)\n", startup * 1e3, loaded,
+           journalRecords);
+    printf("speedup:           %10.0fx\n", rescan / startup);
+
+    nftw(dir, removeEntry, 64, FTW_DEPTH | FTW_PHYS);
+    return found == (size_t) objects && loaded == (size_t) (objects + journalRecords) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
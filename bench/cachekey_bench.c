@@ -0,0 +1,222 @@
+// Hit ratio of literal vs canonical cache keys, replaying a request log.
+//
+// Each line of the log contributes its first token containing "://" as a
+// request URL, so plain URL lists and access logs both work. Every URL is
+// keyed twice: literally, hostname plus path segments as splitURL() leaves
+// them (the key the cache used before canonicalizeURL()), and canonically
+// with the default rules. With an unbounded cache a request is a hit when
+// its key was seen before, so the two hit ratios differ only by the
+// spellings that canonicalization merges.
+//
+// Without a log, a synthetic one is replayed: Zipf-distributed requests
+// for a set of resources, each spelled the way different clients and
+// links tend to spell it (host case, ":80", "//", "./", escaped
+// unreserved characters, fragments, tracking parameters, parameter order).
+//
+// Usage: cachekey_bench [log file]
+//        cachekey_bench -s [requests] [resources]
+
+#define _XOPEN_SOURCE 700
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cachekey.h"
+
+typedef struct KeySet {
+    uint64_t *slots;
+    size_t size;            // Power of two
+    size_t count;
+} KeySet;
+
+typedef struct Replay {
+    unsigned long requests;
+    unsigned long rejected;     // Not a URL splitURL() accepts
+    unsigned long literalHits;
+    unsigned long canonicalHits;
+    KeySet literal;
+    KeySet canonical;
+    double canonicalizeSeconds;
+} Replay;
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// FNV-1a, then a finalizer; a 64-bit collision is negligible at log sizes
+static uint64_t keyHash(const char *key) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (; *key != '\0'; key++) {
+        hash ^= (unsigned char) *key;
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash | 1;
+}
+
+// Adds a key, returning 1 if it was already there
+static int keySetAdd(KeySet *set, const char *key) {
+    if (set->count * 2 >= set->size) {
+        size_t size = set->size > 0 ? set->size * 2 : 1024;
+        uint64_t *slots = calloc(size, sizeof(uint64_t));
+        if (slots == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < set->size; i++) {
+            if (set->slots[i] != 0) {
+                size_t j = set->slots[i] & (size - 1);
+                while (slots[j] != 0) {
+                    j = (j + 1) & (size - 1);
+                }
+                slots[j] = set->slots[i];
+            }
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->size = size;
+    }
+    uint64_t hash = keyHash(key);
+    size_t i = hash & (set->size - 1);
+    while (set->slots[i] != 0) {
+        if (set->slots[i] == hash) {
+            return 1;
+        }
+        i = (i + 1) & (set->size - 1);
+    }
+    set->slots[i] = hash;
+    set->count++;
+    return 0;
+}
+
+static void replayURL(Replay *replay, const char *url) {
+    char storage[1024];
+    RequestContext ctx;
+    requestContextInit(&ctx, storage, sizeof(storage));
+    replay->requests++;
+    if (splitURL(&ctx, url) != 0 || buildPath(&ctx) != 0) {
+        replay->rejected++;
+        requestContextFree(&ctx);
+        return;
+    }
+    double start = nowSeconds();
+    int error = canonicalizeURL(&ctx, &defaultKeyRules);
+    replay->canonicalizeSeconds += nowSeconds() - start;
+    if (error == 0) {
+        replay->literalHits += (unsigned long) keySetAdd(&replay->literal, ctx.currentPath);
+        replay->canonicalHits += (unsigned long) keySetAdd(&replay->canonical, ctx.cacheKey);
+    }
+    requestContextFree(&ctx);
+}
+
+static int replayLog(Replay *replay, const char *name) {
+    FILE *log = fopen(name, "r");
+    if (log == NULL) {
+        perror(name);
+        return -1;
+    }
+    char line[8192];
+    while (fgets(line, sizeof(line), log) != NULL) {
+        for (char *token = strtok(line, " \t\r\n\""); token != NULL; token = strtok(NULL, " \t\r\n\"")) {
+            if (strstr(token, "://") != NULL) {
+                replayURL(replay, token);
+                break;
+            }
+        }
+    }
+    fclose(log);
+    return 0;
+}
+
+// Same resource, the way one of many clients might spell it
+static void spellURL(char *url, size_t size, long resource, unsigned int variant) {
+    static const char *const hosts[] = {"www.example.com", "WWW.Example.com", "www.example.com.", "www.example.com:80"};
+    static const char *const paths[] = {"/static/%ld/app.js", "/static/%ld//app.js", "/static/./%ld/app.js",
+                                        "/static/x/../%ld/app.js", "/%%73tatic/%ld/app.js"};
+    static const char *const queries[] = {"?v=3&lang=en", "?lang=en&v=3", "?v=3&lang=en&utm_source=mail",
+                                          "?utm_campaign=x&v=3&lang=en&fbclid=abc", "?v=3&lang=en#top"};
+    char path[64];
+    snprintf(path, sizeof(path), paths[variant / 4 % 5], resource);
+    // Half the resources have no query at all
+    const char *query = resource % 2 == 0 ? queries[variant / 20 % 5] : "";
+    snprintf(url, size, "http://%s%s%s", hosts[variant % 4], path, query);
+}
+
+static void replaySynthetic(Replay *replay, long requests, long resources) {
+    // Zipf(0.9) popularity through the inverse of its cumulative distribution
+    double *cumulative = malloc(sizeof(double) * (size_t) resources);
+    if (cumulative == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    double total = 0;
+    for (long i = 0; i < resources; i++) {
+        total += 1.0 / pow((double) (i + 1), 0.9);
+        cumulative[i] = total;
+    }
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    char url[256];
+    for (long n = 0; n < requests; n++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        double target = (double) (state >> 11) / 9007199254740992.0 * total;
+        long low = 0, high = resources - 1;
+        while (low < high) {
+            long middle = (low + high) / 2;
+            if (cumulative[middle] < target) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        // Most clients spell a URL the common way
+        unsigned int variant = (state >> 40) % 4 == 0 ? (unsigned int) (state >> 20) % 100 : 0;
+        spellURL(url, sizeof(url), low, variant);
+        replayURL(replay, url);
+    }
+    free(cumulative);
+}
+
+int main(int argc, char *argv[]) {
+    Replay replay;
+    memset(&replay, 0, sizeof(replay));
+    if (argc > 1 && strcmp(argv[1], "-s") != 0) {
+        if (replayLog(&replay, argv[1]) == -1) {
+            return EXIT_FAILURE;
+        }
+    } else {
+        long requests = argc > 2 ? atol(argv[2]) : 1000000;
+        long resources = argc > 3 ? atol(argv[3]) : 50000;
+        if (requests < 1 || resources < 1) {
+            fprintf(stderr, "usage: cachekey_bench [log file] | -s [requests] [resources]\n");
+            return EXIT_FAILURE;
+        }
+        replaySynthetic(&replay, requests, resources);
+    }
+
+    unsigned long keyed = replay.requests - replay.rejected;
+    if (keyed == 0) {
+        fprintf(stderr, "no URLs found\n");
+        return EXIT_FAILURE;
+    }
+    double literalRatio = (double) replay.literalHits / (double) keyed;
+    double canonicalRatio = (double) replay.canonicalHits / (double) keyed;
+    printf("requests:          %lu (%lu not splittable)\n", replay.requests, replay.rejected);
+    printf("literal keys:      %10zu distinct, hit ratio %6.2f%%\n", replay.literal.count, 100 * literalRatio);
+    printf("canonical keys:    %10zu distinct, hit ratio %6.2f%%\n", replay.canonical.count, 100 * canonicalRatio);
+    printf("gain:              %+.2f points, %.1f%% fewer origin fetches\n", 100 * (canonicalRatio - literalRatio),
+           literalRatio < 1 ? 100 * (canonicalRatio - literalRatio) / (1 - literalRatio) : 0.0);
+    printf("canonicalizeURL:   %.0f ns per URL\n", replay.canonicalizeSeconds * 1e9 / (double) keyed);
+    free(replay.literal.slots);
+    free(replay.canonical.slots);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,137 @@
+// Object placement over several cache roots.
+//
+// Places N keys (URLs of 1000 hosts) on R roots with cacheSetPick() and
+// reports how evenly they spread, then what fraction of keys moves when:
+//   - one root goes down (only that root's keys should move, ~1/R),
+//   - it comes back (they should all return home),
+//   - an extra root is configured (~1/(R+1) should move, all to it).
+// Also times a pick.
+//
+// Usage: cacheset_bench [keys] [roots]
+
+#define _XOPEN_SOURCE 700
+
+#include <ftw.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cacheset.h"
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int removeEntry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void) st;
+    (void) type;
+    (void) ftw;
+    remove(path);
+    return 0;
+}
+
+// Shard index of every key; -1 when none is up
+static void place(CacheSet *set, long keys, int *owner) {
+    char storage[512];
+    char url[128];
+    RequestContext ctx;
+    for (long i = 0; i < keys; i++) {
+        requestContextInit(&ctx, storage, sizeof(storage));
+        snprintf(url, sizeof(url), "http://host%ld.example.com/objects/%ld", i % 1000, i);
+        CacheShard *shard = splitURL(&ctx, url) == 0 ? cacheSetPick(set, &ctx) : NULL;
+        owner[i] = shard != NULL ? (int) (shard - set->shards) : -1;
+        requestContextFree(&ctx);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    long keys = argc > 1 ? atol(argv[1]) : 200000;
+    int roots = argc > 2 ? atoi(argv[2]) : 4;
+    char dir[] = "/tmp/cproxy-setbench-XXXXXX";
+    if (keys < 1 || roots < 2 || roots >= CACHE_MAX_SHARDS || mkdtemp(dir) == NULL) {
+        fprintf(stderr, "usage: cacheset_bench [keys] [roots (2 to %d)]\n", CACHE_MAX_SHARDS - 1);
+        return EXIT_FAILURE;
+    }
+    char names[CACHE_MAX_SHARDS][sizeof(dir) + 16];
+    const char *paths[CACHE_MAX_SHARDS];
+    for (int r = 0; r <= roots; r++) {
+        snprintf(names[r], sizeof(names[r]), "%s/disk%d", dir, r);
+        paths[r] = names[r];
+    }
+
+    static CacheSet set;
+    int *before = malloc(sizeof(int) * (size_t) keys);
+    int *after = malloc(sizeof(int) * (size_t) keys);
+    if (before == NULL || after == NULL || cacheSetInit(&set, paths, (unsigned int) roots, 0) != 0) {
+        fprintf(stderr, "could not set up %d roots under %s\n", roots, dir);
+        return EXIT_FAILURE;
+    }
+
+    double start = nowSeconds();
+    place(&set, keys, before);
+    double pickNs = (nowSeconds() - start) * 1e9 / (double) keys;
+
+    long counts[CACHE_MAX_SHARDS] = {0};
+    for (long i = 0; i < keys; i++) {
+        counts[before[i]]++;
+    }
+    double mean = (double) keys / roots;
+    double variance = 0;
+    long most = 0;
+    for (int r = 0; r < roots; r++) {
+        variance += ((double) counts[r] - mean) * ((double) counts[r] - mean) / roots;
+        most = counts[r] > most ? counts[r] : most;
+    }
+    printf("keys:              %ld over %d roots, %d ring points each\n", keys, roots, CACHE_RING_POINTS);
+    printf("spread:            stddev %.1f%% of the mean, largest root %.1f%% above it\n",
+           100 * sqrt(variance) / mean, 100 * ((double) most - mean) / mean);
+    printf("pick:              %.0f ns per key (URL split included)\n", pickNs);
+
+    // A disk fails: only its keys may move
+    int failed = roots / 2;
+    set.shards[failed].up = 0;
+    place(&set, keys, after);
+    long moved = 0, strays = 0;
+    for (long i = 0; i < keys; i++) {
+        if (after[i] != before[i]) {
+            moved++;
+            strays += before[i] != failed;
+        }
+    }
+    printf("root down:         %.2f%% of keys moved (its share %.2f%%), %ld from other roots\n",
+           100.0 * (double) moved / (double) keys, 100.0 * (double) counts[failed] / (double) keys, strays);
+
+    // It comes back: everything returns
+    set.shards[failed].up = 1;
+    place(&set, keys, after);
+    long home = 0;
+    for (long i = 0; i < keys; i++) {
+        home += after[i] == before[i];
+    }
+    printf("root back:         %.2f%% of keys at their original root\n", 100.0 * (double) home / (double) keys);
+    cacheSetClose(&set);
+
+    // One more disk: keys move only onto it
+    cacheSetInit(&set, paths, (unsigned int) roots + 1, 0);
+    place(&set, keys, after);
+    moved = 0;
+    strays = 0;
+    for (long i = 0; i < keys; i++) {
+        if (after[i] != before[i]) {
+            moved++;
+            strays += after[i] != roots;
+        }
+    }
+    printf("root added:        %.2f%% of keys moved (ideal %.2f%%), %ld between old roots\n",
+           100.0 * (double) moved / (double) keys, 100.0 / (roots + 1), strays);
+    cacheSetClose(&set);
+
+    free(before);
+    free(after);
+    nftw(dir, removeEntry, 64, FTW_DEPTH | FTW_PHYS);
+    return strays == 0 && home == keys ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,990 @@
+// Replays request logs through cache eviction policies, to size a cache
+// before deploying it.
+//
+// Every request is keyed the way the proxy keys it: splitURL(),
+// buildPath() and canonicalizeURL() with the default rules. The trace is
+// then replayed through LRU, CLOCK, LFU, ARC and W-TinyLFU at several
+// capacities, each policy and capacity on a thread of its own, and the
+// object and byte hit ratios of each are printed, with the bytes each
+// wrote to the cache. LRU+admit is LRU behind the proxy's -A filter: a
+// miss is stored only once the admission sketch has seen its key -A times
+// (2 by default), which shows what the filter costs in hits and saves in
+// writes.
+//
+// A log line is either an access log line, whose quoted request line holds
+// the URL and is followed by the status and the body size (the proxy's own
+// -a log, and the common log format of other proxies), or a line whose
+// first token containing "://" is the URL, optionally followed by the
+// size. Only 200 responses are replayed, since nothing else is cached.
+// Objects without a size count as one byte, so their byte hit ratio is
+// their object hit ratio.
+//
+// Reading keeps the work per line small: logs are mapped, split between
+// threads at line boundaries, and each thread remembers the key of the
+// URLs it saw last, so a popular URL is canonicalized once. Objects get
+// dense 32-bit ids and the replayed trace is an array of those, so a
+// policy's state is a few arrays indexed by id. Expect about 16 bytes per
+// request while reading and 4 while replaying.
+//
+// Usage: cachesim_bench [-t threads] [-c capacity,...] [-w warm-up %] [-A requests] log...
+//        capacities in bytes with an optional K, M, G or T suffix, or as a
+//        percentage of all objects' bytes ("5%"); 1%,5%,10%,25%,50% by default
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "cachekey.h"
+
+#define NIL UINT32_MAX
+#define MAX_THREADS 64
+#define MAX_CAPACITIES 16
+#define MAX_URL 4096
+// Per reading thread: URL hash to cache key, direct mapped
+#define MEMO_SLOTS (1u << 17)
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Eight bytes per step; a 64-bit collision is negligible at log sizes
+static uint64_t hashBytes(const char *data, size_t length) {
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ length;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x100000001b3ULL;
+        hash ^= hash >> 29;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, length - i);
+    return mix64(hash ^ tail);
+}
+
+// ---- Reading logs ----
+
+/**
+ * @brief One thread's share of a log, read into cache key hashes and sizes.
+ */
+typedef struct Chunk {
+    const char *start;
+    const char *end;
+    uint64_t *keys;
+    uint32_t *sizes;
+    size_t count;
+    size_t capacity;
+    unsigned long lines;
+    unsigned long skipped;      // Not a 200 response
+    unsigned long rejected;     // No URL, or not one splitURL() accepts
+    uint64_t *memoUrls;
+    uint64_t *memoKeys;
+} Chunk;
+
+// Digits at p, or NULL if there are none; "-" reads as 0
+static const char *parseNumber(const char *p, const char *end, uint64_t *value) {
+    while (p < end && *p == ' ') {
+        p++;
+    }
+    if (p < end && *p == '-') {
+        *value = 0;
+        return p + 1;
+    }
+    const char *start = p;
+    uint64_t n = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        n = n * 10 + (uint64_t) (*p - '0');
+    }
+    *value = n;
+    return p > start ? p : NULL;
+}
+
+/**
+ * @brief Finds the URL of a log line and what the line says about the response.
+ *
+ * @return 0 with the URL in url and urlLength, -1 if the line has none.
+ */
+static int parseLine(const char *line, const char *end, const char **url, size_t *urlLength, uint64_t *status,
+                     uint64_t *size) {
+    *status = 200;
+    *size = 0;
+    const char *quote = memchr(line, '"', (size_t) (end - line));
+    if (quote != NULL) {
+        // "GET http://host/path HTTP/1.0" 200 1234
+        const char *requestEnd = memchr(quote + 1, '"', (size_t) (end - quote - 1));
+        if (requestEnd == NULL) {
+            return -1;
+        }
+        const char *start = memchr(quote + 1, ' ', (size_t) (requestEnd - quote - 1));
+        if (start == NULL) {
+            return -1;
+        }
+        start++;
+        const char *stop = memchr(start, ' ', (size_t) (requestEnd - start));
+        *url = start;
+        *urlLength = (size_t) ((stop != NULL ? stop : requestEnd) - start);
+        const char *after = parseNumber(requestEnd + 1, end, status);
+        if (after != NULL) {
+            parseNumber(after, end, size);
+        }
+        return 0;
+    }
+    // A URL list: the first token holding "://", perhaps followed by a size
+    for (const char *p = line; p < end;) {
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        const char *tokenEnd = p;
+        while (tokenEnd < end && *tokenEnd != ' ' && *tokenEnd != '\t' && *tokenEnd != '\r') {
+            tokenEnd++;
+        }
+        if (memmem(p, (size_t) (tokenEnd - p), "://", 3) != NULL) {
+            *url = p;
+            *urlLength = (size_t) (tokenEnd - p);
+            parseNumber(tokenEnd, end, size);
+            return 0;
+        }
+        p = tokenEnd + 1;
+    }
+    return -1;
+}
+
+// The hash of the URL's cache key, or 0 if splitURL() rejects it
+static uint64_t keyOf(const char *url, size_t length) {
+    char copy[MAX_URL];
+    char storage[2048];
+    if (length >= sizeof(copy)) {
+        return 0;
+    }
+    memcpy(copy, url, length);
+    copy[length] = '\0';
+    RequestContext ctx;
+    requestContextInit(&ctx, storage, sizeof(storage));
+    uint64_t key = 0;
+    if (splitURL(&ctx, copy) == 0 && buildPath(&ctx) == 0 && canonicalizeURL(&ctx, &defaultKeyRules) == 0) {
+        key = hashBytes(ctx.cacheKey, strlen(ctx.cacheKey)) | 1;
+    }
+    requestContextFree(&ctx);
+    return key;
+}
+
+static void *readChunk(void *arg) {
+    Chunk *chunk = arg;
+    for (const char *line = chunk->start; line < chunk->end;) {
+        const char *newline = memchr(line, '\n', (size_t) (chunk->end - line));
+        const char *end = newline != NULL ? newline : chunk->end;
+        chunk->lines++;
+        const char *url;
+        size_t urlLength;
+        uint64_t status, size;
+        if (parseLine(line, end, &url, &urlLength, &status, &size) != 0) {
+            chunk->rejected++;
+        } else if (status != 200) {
+            chunk->skipped++;
+        } else {
+            uint64_t urlHash = hashBytes(url, urlLength);
+            size_t slot = urlHash & (MEMO_SLOTS - 1);
+            uint64_t key;
+            if (chunk->memoUrls[slot] == urlHash) {
+                key = chunk->memoKeys[slot];
+            } else {
+                key = keyOf(url, urlLength);
+                chunk->memoUrls[slot] = urlHash;
+                chunk->memoKeys[slot] = key;
+            }
+            if (key == 0) {
+                chunk->rejected++;
+            } else {
+                if (chunk->count == chunk->capacity) {
+                    chunk->capacity = chunk->capacity != 0 ? 2 * chunk->capacity : 1 << 16;
+                    chunk->keys = realloc(chunk->keys, chunk->capacity * sizeof(uint64_t));
+                    chunk->sizes = realloc(chunk->sizes, chunk->capacity * sizeof(uint32_t));
+                    if (chunk->keys == NULL || chunk->sizes == NULL) {
+                        perror("realloc");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                chunk->keys[chunk->count] = key;
+                chunk->sizes[chunk->count] = size > UINT32_MAX ? UINT32_MAX : (uint32_t) size;
+                chunk->count++;
+            }
+        }
+        line = end + 1;
+    }
+    return NULL;
+}
+
+// ---- The trace: object ids in request order ----
+
+typedef struct Trace {
+    uint32_t *ids;
+    size_t count;
+    size_t capacity;
+    uint32_t *sizes;            // Largest size seen per object, at least 1
+    size_t objects;
+    size_t sizesCapacity;
+    uint64_t *slotKeys;         // Cache key hash to id, open addressing
+    uint32_t *slotIds;
+    size_t slotMask;
+    uint64_t footprint;         // Bytes of all objects
+    unsigned long lines;
+    unsigned long skipped;
+    unsigned long rejected;
+} Trace;
+
+static void *allocate(size_t size) {
+    void *memory = calloc(1, size);
+    if (memory == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    return memory;
+}
+
+static void traceGrowSlots(Trace *trace) {
+    size_t oldSize = trace->slotMask + 1;
+    uint64_t *oldKeys = trace->slotKeys;
+    uint32_t *oldIds = trace->slotIds;
+    size_t size = oldKeys != NULL ? 2 * oldSize : 1 << 16;
+    trace->slotKeys = allocate(size * sizeof(uint64_t));
+    trace->slotIds = allocate(size * sizeof(uint32_t));
+    trace->slotMask = size - 1;
+    for (size_t i = 0; oldKeys != NULL && i < oldSize; i++) {
+        if (oldKeys[i] != 0) {
+            size_t slot = oldKeys[i] & trace->slotMask;
+            while (trace->slotKeys[slot] != 0) {
+                slot = (slot + 1) & trace->slotMask;
+            }
+            trace->slotKeys[slot] = oldKeys[i];
+            trace->slotIds[slot] = oldIds[i];
+        }
+    }
+    free(oldKeys);
+    free(oldIds);
+}
+
+static void traceAdd(Trace *trace, uint64_t key, uint32_t size) {
+    if (2 * (trace->objects + 1) > trace->slotMask + 1) {
+        traceGrowSlots(trace);
+    }
+    size_t slot = key & trace->slotMask;
+    while (trace->slotKeys[slot] != 0 && trace->slotKeys[slot] != key) {
+        slot = (slot + 1) & trace->slotMask;
+    }
+    if (size == 0) {
+        size = 1;
+    }
+    uint32_t id;
+    if (trace->slotKeys[slot] == 0) {
+        if (trace->objects == NIL) {
+            fprintf(stderr, "more than %u objects\n", NIL);
+            exit(EXIT_FAILURE);
+        }
+        if (trace->objects == trace->sizesCapacity) {
+            trace->sizesCapacity = trace->sizesCapacity != 0 ? 2 * trace->sizesCapacity : 1 << 16;
+            trace->sizes = realloc(trace->sizes, trace->sizesCapacity * sizeof(uint32_t));
+        }
+        id = (uint32_t) trace->objects++;
+        trace->slotKeys[slot] = key;
+        trace->slotIds[slot] = id;
+        trace->sizes[id] = size;
+        trace->footprint += size;
+    } else {
+        id = trace->slotIds[slot];
+        if (size > trace->sizes[id]) {
+            trace->footprint += size - trace->sizes[id];
+            trace->sizes[id] = size;
+        }
+    }
+    if (trace->count == trace->capacity) {
+        trace->capacity = trace->capacity != 0 ? 2 * trace->capacity : 1 << 20;
+        trace->ids = realloc(trace->ids, trace->capacity * sizeof(uint32_t));
+    }
+    if (trace->ids == NULL || trace->sizes == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    trace->ids[trace->count++] = id;
+}
+
+static int traceRead(Trace *trace, const char *name, Chunk *chunks, int threads) {
+    int fd = open(name, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(name);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    const char *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(name);
+        return -1;
+    }
+    madvise((void *) data, (size_t) st.st_size, MADV_SEQUENTIAL);
+    const char *end = data + st.st_size;
+
+    // Equal shares, each ending after a newline
+    pthread_t workers[MAX_THREADS];
+    const char *start = data;
+    for (int t = 0; t < threads; t++) {
+        const char *stop = t == threads - 1 ? end : data + (size_t) st.st_size / (size_t) threads * (size_t) (t + 1);
+        if (stop < start) {
+            stop = start;
+        }
+        const char *newline = stop < end ? memchr(stop, '\n', (size_t) (end - stop)) : NULL;
+        stop = newline != NULL ? newline + 1 : end;
+        chunks[t].start = start;
+        chunks[t].end = stop;
+        chunks[t].count = 0;
+        start = stop;
+        if (pthread_create(&workers[t], NULL, readChunk, &chunks[t]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // In log order, so the trace is the log's
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+        for (size_t i = 0; i < chunks[t].count; i++) {
+            traceAdd(trace, chunks[t].keys[i], chunks[t].sizes[i]);
+        }
+    }
+    munmap((void *) data, (size_t) st.st_size);
+    return 0;
+}
+
+// ---- Policies ----
+
+enum {
+    POLICY_LRU,
+    POLICY_CLOCK,
+    POLICY_LFU,
+    POLICY_ARC,
+    POLICY_TINYLFU,
+    POLICY_ADMIT,
+    POLICY_COUNT
+};
+
+static const char *const policyNames[POLICY_COUNT] = {"LRU", "CLOCK", "LFU", "ARC", "W-TinyLFU", "LRU+admit"};
+
+typedef struct List {
+    uint32_t head;          // Most recent
+    uint32_t tail;
+    uint64_t bytes;
+} List;
+
+/**
+ * @brief One policy at one capacity replaying the trace.
+ *
+ * Objects are linked into the policy's lists through prev and next, and
+ * where says which list an object is on; 0 is none, so not cached.
+ */
+typedef struct Sim {
+    const Trace *trace;
+    int policy;
+    uint64_t capacity;
+    size_t warmup;          // Requests replayed before counting starts
+    unsigned int admitAfter;    // The proxy's -A, for LRU+admit
+    uint32_t *prev;
+    uint32_t *next;
+    uint8_t *where;
+    uint64_t hits;
+    uint64_t requests;
+    uint64_t hitBytes;
+    uint64_t bytes;
+    uint64_t writtenBytes;  // Of the objects stored
+} Sim;
+
+static const List emptyList = {NIL, NIL, 0};
+
+static void listPush(Sim *sim, List *list, uint8_t tag, uint32_t id) {
+    sim->prev[id] = NIL;
+    sim->next[id] = list->head;
+    if (list->head != NIL) {
+        sim->prev[list->head] = id;
+    } else {
+        list->tail = id;
+    }
+    list->head = id;
+    list->bytes += sim->trace->sizes[id];
+    sim->where[id] = tag;
+}
+
+static void listRemove(Sim *sim, List *list, uint32_t id) {
+    uint32_t prev = sim->prev[id], next = sim->next[id];
+    if (prev != NIL) {
+        sim->next[prev] = next;
+    } else {
+        list->head = next;
+    }
+    if (next != NIL) {
+        sim->prev[next] = prev;
+    } else {
+        list->tail = prev;
+    }
+    list->bytes -= sim->trace->sizes[id];
+    sim->where[id] = 0;
+}
+
+static void listMove(Sim *sim, List *from, List *to, uint8_t tag, uint32_t id) {
+    listRemove(sim, from, id);
+    listPush(sim, to, tag, id);
+}
+
+static void record(Sim *sim, size_t i, uint32_t id, int hit) {
+    if (i < sim->warmup) {
+        return;
+    }
+    uint64_t size = sim->trace->sizes[id];
+    sim->requests++;
+    sim->bytes += size;
+    if (hit) {
+        sim->hits++;
+        sim->hitBytes += size;
+    }
+}
+
+static void stored(Sim *sim, size_t i, uint32_t id) {
+    if (i >= sim->warmup) {
+        sim->writtenBytes += sim->trace->sizes[id];
+    }
+}
+
+// The sketch W-TinyLFU and the proxy's admission filter share, sized for the objects that fit
+static void sketchInit(const Sim *sim, Admission *sketch) {
+    uint64_t meanSize = sim->trace->footprint / sim->trace->objects;
+    if (admissionInit(sketch, (size_t) (sim->capacity / (meanSize != 0 ? meanSize : 1)), sim->admitAfter) != 0) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// With a filter, what the proxy does with -A: a miss is stored only once the sketch has seen it often enough
+static void replayLru(Sim *sim, Admission *filter) {
+    const Trace *trace = sim->trace;
+    List lru = emptyList;
+    for (size_t i = 0; i < trace->count; i++) {
+        uint32_t id = trace->ids[i];
+        int hit = sim->where[id] != 0;
+        record(sim, i, id, hit);
+        if (hit) {
+            listMove(sim, &lru, &lru, 1, id);
+        } else if (trace->sizes[id] <= sim->capacity) {
+            if (filter != NULL) {
+                admissionRecord(filter, mix64(id));
+                if (admissionEstimate(filter, mix64(id)) < filter->threshold) {
+                    continue;
+                }
+            }
+            while (lru.bytes + trace->sizes[id] > sim->capacity) {
+                listRemove(sim, &lru, lru.tail);
+            }
+            listPush(sim, &lru, 1, id);
+            stored(sim, i, id);
+        }
+    }
+}
+
+// Second chance: the hand passes over an object referenced since it last came by
+static void replayClock(Sim *sim) {
+    const Trace *trace = sim->trace;
+    List ring = emptyList;
+    enum { RESIDENT = 1, REFERENCED = 2 };
+    for (size_t i = 0; i < trace->count; i++) {
+        uint32_t id = trace->ids[i];
+        int hit = sim->where[id] != 0;
+        record(sim, i, id, hit);
+        if (hit) {
+            sim->where[id] = REFERENCED;
+        } else if (trace->sizes[id] <= sim->capacity) {
+            while (ring.bytes + trace->sizes[id] > sim->capacity) {
+                uint32_t hand = ring.tail;
+                if (sim->where[hand] == REFERENCED) {
+                    listMove(sim, &ring, &ring, RESIDENT, hand);
+                } else {
+                    listRemove(sim, &ring, hand);
+                }
+            }
+            listPush(sim, &ring, RESIDENT, id);
+            stored(sim, i, id);
+        }
+    }
+}
+
+/**
+ * @brief LFU over the cached objects: a min-heap on the number of hits,
+ * the least recently used first among equals.
+ */
+typedef struct Lfu {
+    uint32_t *heap;
+    uint32_t *position;
+    uint32_t *uses;
+    uint64_t *lastUse;
+    size_t count;
+} Lfu;
+
+static int lfuBefore(const Lfu *lfu, uint32_t a, uint32_t b) {
+    return lfu->uses[a] != lfu->uses[b] ? lfu->uses[a] < lfu->uses[b] : lfu->lastUse[a] < lfu->lastUse[b];
+}
+
+static void lfuPlace(Lfu *lfu, size_t at, uint32_t id) {
+    lfu->heap[at] = id;
+    lfu->position[id] = (uint32_t) at;
+}
+
+static void lfuUp(Lfu *lfu, size_t at) {
+    uint32_t id = lfu->heap[at];
+    while (at > 0 && lfuBefore(lfu, id, lfu->heap[(at - 1) / 2])) {
+        lfuPlace(lfu, at, lfu->heap[(at - 1) / 2]);
+        at = (at - 1) / 2;
+    }
+    lfuPlace(lfu, at, id);
+}
+
+static void lfuDown(Lfu *lfu, size_t at) {
+    uint32_t id = lfu->heap[at];
+    for (;;) {
+        size_t child = 2 * at + 1;
+        if (child >= lfu->count) {
+            break;
+        }
+        if (child + 1 < lfu->count && lfuBefore(lfu, lfu->heap[child + 1], lfu->heap[child])) {
+            child++;
+        }
+        if (!lfuBefore(lfu, lfu->heap[child], id)) {
+            break;
+        }
+        lfuPlace(lfu, at, lfu->heap[child]);
+        at = child;
+    }
+    lfuPlace(lfu, at, id);
+}
+
+static void replayLfu(Sim *sim) {
+    const Trace *trace = sim->trace;
+    Lfu lfu = {allocate(trace->objects * sizeof(uint32_t)), allocate(trace->objects * sizeof(uint32_t)),
+               allocate(trace->objects * sizeof(uint32_t)), allocate(trace->objects * sizeof(uint64_t)), 0};
+    uint64_t used = 0;
+    for (size_t i = 0; i < trace->count; i++) {
+        uint32_t id = trace->ids[i];
+        int hit = sim->where[id] != 0;
+        record(sim, i, id, hit);
+        lfu.lastUse[id] = i;
+        if (hit) {
+            lfu.uses[id]++;
+            lfuDown(&lfu, lfu.position[id]);
+        } else if (trace->sizes[id] <= sim->capacity) {
+            while (used + trace->sizes[id] > sim->capacity) {
+                uint32_t victim = lfu.heap[0];
+                sim->where[victim] = 0;
+                used -= trace->sizes[victim];
+                lfuPlace(&lfu, 0, lfu.heap[--lfu.count]);
+                lfuDown(&lfu, 0);
+            }
+            sim->where[id] = 1;
+            used += trace->sizes[id];
+            lfu.uses[id] = 1;
+            lfu.heap[lfu.count++] = id;
+            lfuUp(&lfu, lfu.count - 1);
+            stored(sim, i, id);
+        }
+    }
+    free(lfu.heap);
+    free(lfu.position);
+    free(lfu.uses);
+    free(lfu.lastUse);
+}
+
+/**
+ * @brief ARC with the list sizes and the target p counted in bytes.
+ *
+ * T1 holds objects seen once recently, T2 those seen at least twice; B1
+ * and B2 remember what each evicted, and a hit there moves p towards the
+ * list that would have kept it.
+ */
+enum { ARC_T1 = 1, ARC_T2, ARC_B1, ARC_B2 };
+
+typedef struct Arc {
+    List t1, t2, b1, b2;
+    uint64_t p;
+} Arc;
+
+static void arcReplace(Sim *sim, Arc *arc, uint64_t size, int inB2) {
+    while (arc->t1.bytes + arc->t2.bytes + size > sim->capacity) {
+        if (arc->t1.tail != NIL &&
+            (arc->t1.bytes > arc->p || (inB2 && arc->t1.bytes == arc->p) || arc->t2.tail == NIL)) {
+            listMove(sim, &arc->t1, &arc->b1, ARC_B1, arc->t1.tail);
+        } else {
+            listMove(sim, &arc->t2, &arc->b2, ARC_B2, arc->t2.tail);
+        }
+    }
+}
+
+static void replayArc(Sim *sim) {
+    const Trace *trace = sim->trace;
+    uint64_t c = sim->capacity;
+    Arc arc = {emptyList, emptyList, emptyList, emptyList, 0};
+    for (size_t i = 0; i < trace->count; i++) {
+        uint32_t id = trace->ids[i];
+        uint64_t size = trace->sizes[id];
+        uint8_t where = sim->where[id];
+        record(sim, i, id, where == ARC_T1 || where == ARC_T2);
+        if (where == ARC_T1) {
+            listMove(sim, &arc.t1, &arc.t2, ARC_T2, id);
+        } else if (where == ARC_T2) {
+            listMove(sim, &arc.t2, &arc.t2, ARC_T2, id);
+        } else if (where == ARC_B1) {
+            uint64_t delta = arc.b2.bytes > arc.b1.bytes ? (uint64_t) ((double) size * arc.b2.bytes / arc.b1.bytes) : size;
+            arc.p = arc.p + delta < c ? arc.p + delta : c;
+            listRemove(sim, &arc.b1, id);
+            arcReplace(sim, &arc, size, 0);
+            listPush(sim, &arc.t2, ARC_T2, id);
+            stored(sim, i, id);
+        } else if (where == ARC_B2) {
+            uint64_t delta = arc.b1.bytes > arc.b2.bytes ? (uint64_t) ((double) size * arc.b1.bytes / arc.b2.bytes) : size;
+            arc.p = arc.p > delta ? arc.p - delta : 0;
+            listRemove(sim, &arc.b2, id);
+            arcReplace(sim, &arc, size, 1);
+            listPush(sim, &arc.t2, ARC_T2, id);
+            stored(sim, i, id);
+        } else if (size <= c) {
+            arcReplace(sim, &arc, size, 0);
+            listPush(sim, &arc.t1, ARC_T1, id);
+            stored(sim, i, id);
+        }
+        // The history stays within c for T1 and B1 together and 2c for all four
+        while (arc.t1.bytes + arc.b1.bytes > c && arc.b1.tail != NIL) {
+            listRemove(sim, &arc.b1, arc.b1.tail);
+        }
+        while (arc.t1.bytes + arc.t2.bytes + arc.b1.bytes + arc.b2.bytes > 2 * c && arc.b2.tail != NIL) {
+            listRemove(sim, &arc.b2, arc.b2.tail);
+        }
+    }
+}
+
+/**
+ * @brief W-TinyLFU: an LRU window of 1% of the capacity in front of a
+ * segmented LRU, 80% of it protected. What leaves the window enters the
+ * main cache only if the sketch has seen it more often than what it would
+ * evict.
+ */
+enum { TINY_WINDOW = 1, TINY_PROBATION, TINY_PROTECTED };
+
+static void replayTinyLfu(Sim *sim) {
+    const Trace *trace = sim->trace;
+    uint64_t windowCapacity = sim->capacity / 100;
+    uint64_t mainCapacity = sim->capacity - windowCapacity;
+    uint64_t protectedCapacity = mainCapacity / 5 * 4;
+    List window = emptyList, probation = emptyList, protectedList = emptyList;
+    Admission sketch;
+    sketchInit(sim, &sketch);
+    for (size_t i = 0; i < trace->count; i++) {
+        uint32_t id = trace->ids[i];
+        uint8_t where = sim->where[id];
+        record(sim, i, id, where != 0);
+        admissionRecord(&sketch, mix64(id));
+        if (where == TINY_WINDOW) {
+            listMove(sim, &window, &window, TINY_WINDOW, id);
+        } else if (where == TINY_PROTECTED) {
+            listMove(sim, &protectedList, &protectedList, TINY_PROTECTED, id);
+        } else if (where == TINY_PROBATION) {
+            listMove(sim, &probation, &protectedList, TINY_PROTECTED, id);
+            while (protectedList.bytes > protectedCapacity) {
+                listMove(sim, &protectedList, &probation, TINY_PROBATION, protectedList.tail);
+            }
+        } else if (trace->sizes[id] <= sim->capacity) {
+            // The window is part of the cache: whatever enters it is written
+            listPush(sim, &window, TINY_WINDOW, id);
+            stored(sim, i, id);
+            while (window.bytes > windowCapacity) {
+                uint32_t candidate = window.tail;
+                uint64_t size = trace->sizes[candidate];
+                listRemove(sim, &window, candidate);
+                int admitted = size <= mainCapacity;
+                while (admitted && probation.bytes + protectedList.bytes + size > mainCapacity) {
+                    List *from = probation.tail != NIL ? &probation : &protectedList;
+                    if (admissionEstimate(&sketch, mix64(candidate)) <= admissionEstimate(&sketch, mix64(from->tail))) {
+                        admitted = 0;
+                    } else {
+                        listRemove(sim, from, from->tail);
+                    }
+                }
+                if (admitted) {
+                    listPush(sim, &probation, TINY_PROBATION, candidate);
+                }
+            }
+        }
+    }
+    admissionFree(&sketch);
+}
+
+static void simRun(Sim *sim) {
+    size_t objects = sim->trace->objects;
+    sim->prev = allocate(objects * sizeof(uint32_t));
+    sim->next = allocate(objects * sizeof(uint32_t));
+    sim->where = allocate(objects);
+    switch (sim->policy) {
+        case POLICY_LRU:
+            replayLru(sim, NULL);
+            break;
+        case POLICY_CLOCK:
+            replayClock(sim);
+            break;
+        case POLICY_LFU:
+            replayLfu(sim);
+            break;
+        case POLICY_ARC:
+            replayArc(sim);
+            break;
+        case POLICY_TINYLFU:
+            replayTinyLfu(sim);
+            break;
+        default: {
+            Admission filter;
+            sketchInit(sim, &filter);
+            replayLru(sim, &filter);
+            admissionFree(&filter);
+            break;
+        }
+    }
+    free(sim->prev);
+    free(sim->next);
+    free(sim->where);
+}
+
+typedef struct Jobs {
+    Sim *sims;
+    size_t count;
+    size_t taken;
+} Jobs;
+
+static void *runJobs(void *arg) {
+    Jobs *jobs = arg;
+    for (;;) {
+        size_t job = __atomic_fetch_add(&jobs->taken, 1, __ATOMIC_RELAXED);
+        if (job >= jobs->count) {
+            return NULL;
+        }
+        simRun(&jobs->sims[job]);
+    }
+}
+
+// ---- Main ----
+
+typedef struct Capacity {
+    uint64_t bytes;
+    double percent;         // Of the footprint, or 0 for an absolute size
+} Capacity;
+
+static int parseCapacities(char *list, Capacity *capacities, size_t *count) {
+    *count = 0;
+    for (char *item = strtok(list, ","); item != NULL; item = strtok(NULL, ",")) {
+        char *end;
+        double value = strtod(item, &end);
+        if (end == item || value <= 0 || *count == MAX_CAPACITIES) {
+            return -1;
+        }
+        Capacity *capacity = &capacities[(*count)++];
+        capacity->percent = 0;
+        switch (*end) {
+            case '%':
+                capacity->percent = value;
+                break;
+            case 'T':
+                value *= 1024;
+                // fall through
+            case 'G':
+                value *= 1024;
+                // fall through
+            case 'M':
+                value *= 1024;
+                // fall through
+            case 'K':
+                value *= 1024;
+                break;
+            case '\0':
+                break;
+            default:
+                return -1;
+        }
+        capacity->bytes = (uint64_t) value;
+    }
+    return *count > 0 ? 0 : -1;
+}
+
+static void formatBytes(char *out, size_t size, uint64_t bytes) {
+    static const char *const units[] = {"B", "KB", "MB", "GB", "TB"};
+    double value = (double) bytes;
+    int unit = 0;
+    while (value >= 1024 && unit < 4) {
+        value /= 1024;
+        unit++;
+    }
+    snprintf(out, size, "%.1f %s", value, units[unit]);
+}
+
+// One row per capacity: hit ratios, or the bytes stored as a share of those requested
+static void printTable(const char *title, const Sim *sims, const Capacity *capacities, size_t count, int writes) {
+    printf("%-18s", title);
+    for (int p = 0; p < POLICY_COUNT; p++) {
+        printf(" %13s", policyNames[p]);
+    }
+    printf("\n");
+    for (size_t c = 0; c < count; c++) {
+        char label[32];
+        formatBytes(label, sizeof(label), capacities[c].bytes);
+        if (capacities[c].percent > 0) {
+            size_t length = strlen(label);
+            snprintf(label + length, sizeof(label) - length, " %g%%", capacities[c].percent);
+        }
+        printf("%-18s", label);
+        for (int p = 0; p < POLICY_COUNT; p++) {
+            const Sim *sim = &sims[c * POLICY_COUNT + (size_t) p];
+            if (writes) {
+                printf(" %13.1f", sim->bytes != 0 ? 100.0 * (double) sim->writtenBytes / (double) sim->bytes : 0);
+            } else {
+                printf("   %5.1f %5.1f", sim->requests != 0 ? 100.0 * (double) sim->hits / (double) sim->requests : 0,
+                       sim->bytes != 0 ? 100.0 * (double) sim->hitBytes / (double) sim->bytes : 0);
+            }
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = online > 0 ? (int) (online < MAX_THREADS ? online : MAX_THREADS) : 1;
+    double warmupPercent = 0;
+    unsigned int admitAfter = 2;
+    char defaultCapacities[] = "1%,5%,10%,25%,50%";
+    char *capacityList = defaultCapacities;
+    int option;
+    while ((option = getopt(argc, argv, "t:c:w:A:")) != -1) {
+        switch (option) {
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'c':
+                capacityList = optarg;
+                break;
+            case 'w':
+                warmupPercent = atof(optarg);
+                break;
+            case 'A':
+                admitAfter = (unsigned int) atoi(optarg);
+                break;
+            default:
+                optind = argc + 1;
+                break;
+        }
+    }
+    Capacity capacities[MAX_CAPACITIES];
+    size_t capacityCount;
+    if (optind >= argc || threads < 1 || threads > MAX_THREADS || warmupPercent < 0 || warmupPercent >= 100 || admitAfter < 1 || admitAfter > 15 ||
+        parseCapacities(capacityList, capacities, &capacityCount) != 0) {
+        fprintf(stderr, "Usage: %s [-t threads] [-c capacity,...] [-w warm-up %%] [-A requests] log...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Trace trace = {0};
+    Chunk chunks[MAX_THREADS];
+    memset(chunks, 0, sizeof(chunks));
+    for (int t = 0; t < threads; t++) {
+        chunks[t].memoUrls = allocate(MEMO_SLOTS * sizeof(uint64_t));
+        chunks[t].memoKeys = allocate(MEMO_SLOTS * sizeof(uint64_t));
+    }
+    double start = nowSeconds();
+    for (int i = optind; i < argc; i++) {
+        if (traceRead(&trace, argv[i], chunks, threads) != 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    double readSeconds = nowSeconds() - start;
+    for (int t = 0; t < threads; t++) {
+        trace.lines += chunks[t].lines;
+        trace.skipped += chunks[t].skipped;
+        trace.rejected += chunks[t].rejected;
+        free(chunks[t].keys);
+        free(chunks[t].sizes);
+        free(chunks[t].memoUrls);
+        free(chunks[t].memoKeys);
+    }
+    free(trace.slotKeys);
+    free(trace.slotIds);
+    if (trace.count == 0) {
+        fprintf(stderr, "no cacheable requests in %lu lines\n", trace.lines);
+        return EXIT_FAILURE;
+    }
+
+    char footprint[32];
+    formatBytes(footprint, sizeof(footprint), trace.footprint);
+    printf("%lu lines, %zu requests replayed (%lu not 200, %lu without a usable URL)\n", trace.lines, trace.count,
+           trace.skipped, trace.rejected);
+    printf("%zu objects, %s in all\n", trace.objects, footprint);
+    printf("read and keyed in %.2f s: %.0f million lines a minute on %d thread%s\n\n", readSeconds,
+           (double) trace.lines / readSeconds * 60 / 1e6, threads, threads > 1 ? "s" : "");
+
+    size_t jobCount = capacityCount * POLICY_COUNT;
+    Jobs jobs = {allocate(jobCount * sizeof(Sim)), jobCount, 0};
+    for (size_t c = 0; c < capacityCount; c++) {
+        if (capacities[c].percent > 0) {
+            capacities[c].bytes = (uint64_t) ((double) trace.footprint * capacities[c].percent / 100);
+        }
+        for (int p = 0; p < POLICY_COUNT; p++) {
+            Sim *sim = &jobs.sims[c * POLICY_COUNT + (size_t) p];
+            sim->trace = &trace;
+            sim->policy = p;
+            sim->capacity = capacities[c].bytes;
+            sim->warmup = (size_t) ((double) trace.count * warmupPercent / 100);
+            sim->admitAfter = admitAfter;
+        }
+    }
+    start = nowSeconds();
+    pthread_t workers[MAX_THREADS];
+    int workerCount = threads < (int) jobCount ? threads : (int) jobCount;
+    for (int t = 0; t < workerCount; t++) {
+        if (pthread_create(&workers[t], NULL, runJobs, &jobs) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+    for (int t = 0; t < workerCount; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    double simSeconds = nowSeconds() - start;
+
+    printTable("hit % (obj/byte)", jobs.sims, capacities, capacityCount, 0);
+    printf("\n");
+    printTable("written, % of bytes", jobs.sims, capacities, capacityCount, 1);
+    printf("\n%zu replays in %.2f s: %.1f million requests a second over all of them\n", jobCount, simSeconds,
+           (double) trace.count * (double) jobCount / simSeconds / 1e6);
+    free(jobs.sims);
+    free(trace.ids);
+    free(trace.sizes);
+    return EXIT_SUCCESS;
+}
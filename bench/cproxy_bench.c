@@ -0,0 +1,612 @@
+// End-to-end benchmark of the proxy server over loopback, against a local origin.
+//
+// The origin runs in this process: a pool of threads answering
+// GET /o/<id> with an object whose size follows from the id, so both
+// sides agree on it without any shared state. Its behaviour is
+// configurable: the object size distribution, a delay before the response
+// header, a per-connection bandwidth limit, and whether the response
+// carries a Content-Length or runs until the connection closes.
+//
+// cproxy_c is started with a scratch cache directory and driven by client
+// threads, one connection per request, through three workloads:
+//   cold   every request for an object never seen before: all misses
+//   warm   uniform requests over a set of objects fetched beforehand: all hits
+//   mixed  Zipf-distributed requests over ten times that many objects
+// Each reports throughput, the p50/p99/p999 latency from connect to the
+// last byte, the share answered from the cache (requests the origin did
+// not see) and the CPU time of the proxy's processes per request.
+//
+// Usage: cproxy_bench [-w workers] [-c clients] [-s seconds] [-n objects]
+//                     [-z fixed:<bytes> | uniform:<min>-<max> | pareto:<min>]
+//                     [-L origin delay ms] [-b origin bytes/s] [-e sized|chunked]
+//                     [cold|warm|mixed]...
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "timing.h"
+
+#ifndef CPROXY_BINARY
+#define CPROXY_BINARY "./cproxy_c"
+#endif
+
+#define BENCH_PORT 18200
+#define ORIGIN_MIN_THREADS 64
+#define ORIGIN_SLICE 16384
+#define PARETO_SHAPE 1.2
+#define PARETO_CAP (64L << 20)
+#define COLD_IDS 1000000000ULL
+
+typedef enum {
+    SIZES_FIXED,
+    SIZES_UNIFORM,
+    SIZES_PARETO
+} SizeDistribution;
+
+// What the origin stand-in does; read-only once the threads run
+static SizeDistribution sizeDistribution = SIZES_FIXED;
+static long sizeMin = 4096;
+static long sizeMax = 4096;
+static unsigned int originDelayMs = 0;
+static long originBandwidth = 0;        // Bytes per second and connection, 0 for no limit
+static int originChunked = 0;           // No Content-Length: the body ends when the connection closes
+static int originListenFd = -1;
+static int originPort = 0;
+static unsigned long originRequests = 0;   // Atomic: fetches the origin answered
+static char originBody[ORIGIN_SLICE];
+
+typedef enum {
+    WORKLOAD_COLD,
+    WORKLOAD_WARM,
+    WORKLOAD_MIXED
+} Workload;
+
+static const char *const workloadNames[] = {"cold", "warm", "mixed"};
+
+typedef struct ClientThread {
+    pthread_t thread;
+    Workload workload;
+    uint64_t rng;
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long long bytes;
+    TimingHistogram latency;
+} ClientThread;
+
+static volatile int clientsRunning = 1;
+static unsigned long objectCount = 1000;
+static uint64_t nextColdId = COLD_IDS;     // Atomic
+static uint64_t nextFillId = 0;            // Atomic, while the warm set is fetched
+static double *zipfCdf = NULL;             // Over 10 * objectCount ids, for the mixed workload
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static double uniform01(uint64_t *state) {
+    *state = mix64(*state + 0x9e3779b97f4a7c15ULL);
+    return (double) (*state >> 11) / 9007199254740992.0;
+}
+
+static long objectSize(uint64_t id) {
+    uint64_t state = id;
+    double u = uniform01(&state);
+    switch (sizeDistribution) {
+        case SIZES_UNIFORM:
+            return sizeMin + (long) (u * (double) (sizeMax - sizeMin + 1));
+        case SIZES_PARETO: {
+            double size = (double) sizeMin / pow(1.0 - u, 1.0 / PARETO_SHAPE);
+            return size > (double) PARETO_CAP ? PARETO_CAP : (long) size;
+        }
+        default:
+            return sizeMin;
+    }
+}
+
+static void sleepNs(uint64_t ns) {
+    struct timespec pause = {(time_t) (ns / 1000000000), (long) (ns % 1000000000)};
+    nanosleep(&pause, NULL);
+}
+
+static int sendAll(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        length -= (size_t) sent;
+    }
+    return 0;
+}
+
+static void originServe(int fd) {
+    char request[4096];
+    size_t length = 0;
+    while (length < sizeof(request) - 1) {
+        ssize_t n = recv(fd, request + length, sizeof(request) - 1 - length, 0);
+        if (n <= 0) {
+            return;
+        }
+        length += (size_t) n;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL) {
+            break;
+        }
+    }
+    if (strncmp(request, "GET /o/", 7) != 0) {
+        sendAll(fd, "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n", 46);
+        return;
+    }
+    long size = objectSize(strtoull(request + 7, NULL, 10));
+    __atomic_fetch_add(&originRequests, 1, __ATOMIC_RELAXED);
+    if (originDelayMs > 0) {
+        sleepNs((uint64_t) originDelayMs * 1000000);
+    }
+
+    char header[160];
+    int headerLength = originChunked
+                       ? snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\n\r\n")
+                       : snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                                  "Content-Length: %ld\r\n\r\n", size);
+    if (sendAll(fd, header, (size_t) headerLength) == -1) {
+        return;
+    }
+    uint64_t start = timingNow();
+    long sent = 0;
+    while (sent < size) {
+        size_t slice = size - sent < ORIGIN_SLICE ? (size_t) (size - sent) : ORIGIN_SLICE;
+        if (sendAll(fd, originBody, slice) == -1) {
+            return;
+        }
+        sent += (long) slice;
+        if (originBandwidth > 0) {
+            // Hold each connection to its rate: wait until the bytes sent so far are due
+            uint64_t due = start + (uint64_t) ((double) sent / (double) originBandwidth * 1e9);
+            uint64_t now = timingNow();
+            if (due > now) {
+                sleepNs(due - now);
+            }
+        }
+    }
+}
+
+static void *originMain(void *arg) {
+    (void) arg;
+    for (;;) {
+        int fd = accept(originListenFd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // The listener was shut down
+            return NULL;
+        }
+        originServe(fd);
+        close(fd);
+    }
+}
+
+static int listenLoopback(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t) port);
+    socklen_t addrLength = sizeof(addr);
+    if (fd == -1 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(fd, 1024) == -1 ||
+        getsockname(fd, (struct sockaddr *) &addr, &addrLength) == -1) {
+        return -1;
+    }
+    originPort = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int connectLoopback(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t) port);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    // A stuck request counts as an error instead of hanging the run
+    struct timeval timeout = {30, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+/*
+ * One request through the proxy on a connection of its own.
+ *
+ * @return Bytes received, header included, or -1 if the request failed or
+ * was not answered with a 200.
+ */
+static long proxyGet(uint64_t id, char *buffer, size_t size) {
+    int fd = connectLoopback(BENCH_PORT);
+    if (fd == -1) {
+        return -1;
+    }
+    char request[128];
+    int length = snprintf(request, sizeof(request), "GET http://127.0.0.1:%d/o/%llu HTTP/1.0\r\n\r\n", originPort,
+                          (unsigned long long) id);
+    long received = 0;
+    int ok = sendAll(fd, request, (size_t) length) == 0;
+    ssize_t n;
+    while (ok && (n = recv(fd, buffer, size, 0)) != 0) {
+        if (n == -1) {
+            ok = 0;
+            break;
+        }
+        if (received == 0 && (n < 12 || memcmp(buffer + 8, " 200", 4) != 0)) {
+            ok = 0;
+        }
+        received += n;
+    }
+    close(fd);
+    return ok && received > 0 ? received : -1;
+}
+
+static uint64_t zipfPick(uint64_t *rng) {
+    double u = uniform01(rng);
+    size_t low = 0, high = 10 * objectCount - 1;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (zipfCdf[middle] < u) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static void *clientMain(void *arg) {
+    ClientThread *client = arg;
+    char *buffer = malloc(65536);
+    while (clientsRunning) {
+        uint64_t id;
+        switch (client->workload) {
+            case WORKLOAD_COLD:
+                id = __atomic_fetch_add(&nextColdId, 1, __ATOMIC_RELAXED);
+                break;
+            case WORKLOAD_WARM:
+                id = (uint64_t) (uniform01(&client->rng) * (double) objectCount);
+                break;
+            default:
+                id = zipfPick(&client->rng);
+                break;
+        }
+        uint64_t start = timingNow();
+        long received = proxyGet(id, buffer, 65536);
+        if (received == -1) {
+            client->errors++;
+            continue;
+        }
+        histogramRecord(&client->latency, timingNow() - start);
+        client->requests++;
+        client->bytes += (unsigned long long) received;
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Fetch ids 0..objectCount-1 once, so the warm workload finds them cached
+static void *fillMain(void *arg) {
+    ClientThread *client = arg;
+    char *buffer = malloc(65536);
+    uint64_t id;
+    while ((id = __atomic_fetch_add(&nextFillId, 1, __ATOMIC_RELAXED)) < objectCount) {
+        if (proxyGet(id, buffer, 65536) == -1) {
+            client->errors++;
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+// CPU time of the proxy's master and its workers, in clock ticks
+static unsigned long long proxyCpuTicks(pid_t proxy) {
+    DIR *proc = opendir("/proc");
+    struct dirent *entry;
+    unsigned long long ticks = 0;
+    while (proc != NULL && (entry = readdir(proc)) != NULL) {
+        if (!isdigit((unsigned char) entry->d_name[0])) {
+            continue;
+        }
+        char path[300], line[1024];
+        snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+        FILE *stat = fopen(path, "r");
+        if (stat == NULL) {
+            continue;
+        }
+        char *fields = fgets(line, sizeof(line), stat) != NULL ? strrchr(line, ')') : NULL;
+        fclose(stat);
+        int ppid;
+        unsigned long long user, system;
+        // After the command: state, ppid, then ten fields before utime and stime
+        if (fields != NULL &&
+            sscanf(fields + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &ppid, &user, &system) == 3 &&
+            (atoi(entry->d_name) == proxy || ppid == proxy)) {
+            ticks += user + system;
+        }
+    }
+    if (proc != NULL) {
+        closedir(proc);
+    }
+    return ticks;
+}
+
+static pid_t startProxy(int workers, const char *cacheDir) {
+    char portArg[16], workersArg[16];
+    snprintf(portArg, sizeof(portArg), "%d", BENCH_PORT);
+    snprintf(workersArg, sizeof(workersArg), "%d", workers);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl(CPROXY_BINARY, "cproxy_c", "-l", portArg, "-w", workersArg, "-d", cacheDir, (char *) NULL);
+        perror("execl " CPROXY_BINARY);
+        _exit(127);
+    }
+    // Wait until the listeners are up
+    for (int attempt = 0; attempt < 100; attempt++) {
+        int fd = connectLoopback(BENCH_PORT);
+        if (fd != -1) {
+            close(fd);
+            return pid;
+        }
+        usleep(20000);
+    }
+    kill(pid, SIGTERM);
+    return -1;
+}
+
+static void runWorkload(Workload workload, pid_t proxy, int threads, int seconds) {
+    ClientThread *clients = calloc((size_t) threads, sizeof(ClientThread));
+    unsigned long errors = 0;
+
+    if (workload == WORKLOAD_WARM && nextFillId < objectCount) {
+        for (int i = 0; i < threads; i++) {
+            pthread_create(&clients[i].thread, NULL, fillMain, &clients[i]);
+        }
+        for (int i = 0; i < threads; i++) {
+            pthread_join(clients[i].thread, NULL);
+            errors += clients[i].errors;
+        }
+        memset(clients, 0, (size_t) threads * sizeof(ClientThread));
+        if (errors > 0) {
+            fprintf(stderr, "%lu requests failed while fetching the warm set\n", errors);
+        }
+    }
+
+    unsigned long originBefore = __atomic_load_n(&originRequests, __ATOMIC_RELAXED);
+    unsigned long long cpuBefore = proxyCpuTicks(proxy);
+    uint64_t start = timingNow();
+    clientsRunning = 1;
+    for (int i = 0; i < threads; i++) {
+        clients[i].workload = workload;
+        clients[i].rng = mix64((uint64_t) i + 1 + (uint64_t) workload * 1000);
+        pthread_create(&clients[i].thread, NULL, clientMain, &clients[i]);
+    }
+    sleep((unsigned int) seconds);
+    clientsRunning = 0;
+
+    TimingHistogram latency;
+    memset(&latency, 0, sizeof(latency));
+    unsigned long requests = 0;
+    unsigned long long bytes = 0;
+    errors = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(clients[i].thread, NULL);
+        requests += clients[i].requests;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+        histogramMerge(&latency, &clients[i].latency);
+    }
+    double elapsed = (double) (timingNow() - start) / 1e9;
+    unsigned long long cpuTicks = proxyCpuTicks(proxy) - cpuBefore;
+    unsigned long fetched = __atomic_load_n(&originRequests, __ATOMIC_RELAXED) - originBefore;
+    free(clients);
+
+    double cpuUs = (double) cpuTicks * 1e6 / (double) sysconf(_SC_CLK_TCK);
+    double hitShare = requests > 0 && fetched < requests ? 100.0 * (double) (requests - fetched) / (double) requests
+                                                         : 0.0;
+    printf("%-8s %9lu %10.0f %9.1f %9.0f %9.0f %9.0f %6.1f %11.1f %7lu\n", workloadNames[workload], requests,
+           (double) requests / elapsed, (double) bytes / elapsed / 1e6,
+           (double) histogramPercentile(&latency, 50) / 1e3, (double) histogramPercentile(&latency, 99) / 1e3,
+           (double) histogramPercentile(&latency, 99.9) / 1e3, hitShare,
+           requests > 0 ? cpuUs / (double) requests : 0.0, errors);
+    fflush(stdout);
+}
+
+static int parseSizes(const char *spec) {
+    if (sscanf(spec, "fixed:%ld", &sizeMin) == 1) {
+        sizeDistribution = SIZES_FIXED;
+        sizeMax = sizeMin;
+    } else if (sscanf(spec, "uniform:%ld-%ld", &sizeMin, &sizeMax) == 2 && sizeMax >= sizeMin) {
+        sizeDistribution = SIZES_UNIFORM;
+    } else if (sscanf(spec, "pareto:%ld", &sizeMin) == 1) {
+        sizeDistribution = SIZES_PARETO;
+        sizeMax = PARETO_CAP;
+    } else {
+        return -1;
+    }
+    return sizeMin >= 0 ? 0 : -1;
+}
+
+static int removeEntry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void) st;
+    (void) flag;
+    (void) ftw;
+    remove(path);
+    return 0;
+}
+
+static void printUsage(const char *program) {
+    fprintf(stderr, "Usage: %s [-w workers] [-c clients] [-s seconds] [-n objects]\n", program);
+    fprintf(stderr, "          [-z fixed:<bytes> | uniform:<min>-<max> | pareto:<min>]\n");
+    fprintf(stderr, "          [-L origin delay ms] [-b origin bytes/s per connection] [-e sized|chunked]\n");
+    fprintf(stderr, "          [cold|warm|mixed]...\n");
+}
+
+int main(int argc, char *argv[]) {
+    int workers = 1, threads = 8, seconds = 3;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:c:s:n:z:L:b:e:")) != -1) {
+        switch (opt) {
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 'c':
+                threads = atoi(optarg);
+                break;
+            case 's':
+                seconds = atoi(optarg);
+                break;
+            case 'n':
+                objectCount = strtoul(optarg, NULL, 10);
+                break;
+            case 'z':
+                if (parseSizes(optarg) == -1) {
+                    printUsage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'L':
+                originDelayMs = (unsigned int) atoi(optarg);
+                break;
+            case 'b':
+                originBandwidth = atol(optarg);
+                break;
+            case 'e':
+                originChunked = strcmp(optarg, "chunked") == 0;
+                break;
+            default:
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (workers < 1 || threads < 1 || seconds < 1 || objectCount < 1) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    int run[3] = {1, 1, 1};
+    if (optind < argc) {
+        memset(run, 0, sizeof(run));
+        for (int i = optind; i < argc; i++) {
+            int known = 0;
+            for (int w = 0; w < 3; w++) {
+                if (strcmp(argv[i], workloadNames[w]) == 0) {
+                    run[w] = known = 1;
+                }
+            }
+            if (!known) {
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    // Zipf with exponent 0.99 over ten times the warm set: the warm set is the popular head
+    size_t ids = 10 * objectCount;
+    zipfCdf = malloc(ids * sizeof(double));
+    double total = 0;
+    for (size_t i = 0; i < ids; i++) {
+        total += 1.0 / pow((double) (i + 1), 0.99);
+        zipfCdf[i] = total;
+    }
+    for (size_t i = 0; i < ids; i++) {
+        zipfCdf[i] /= total;
+    }
+    for (size_t i = 0; i < sizeof(originBody); i++) {
+        originBody[i] = (char) ('a' + i % 26);
+    }
+
+    originListenFd = listenLoopback(0);
+    if (originListenFd == -1) {
+        perror("origin");
+        return EXIT_FAILURE;
+    }
+    int originThreads = 2 * threads > ORIGIN_MIN_THREADS ? 2 * threads : ORIGIN_MIN_THREADS;
+    pthread_t *origin = calloc((size_t) originThreads, sizeof(pthread_t));
+    for (int i = 0; i < originThreads; i++) {
+        pthread_create(&origin[i], NULL, originMain, NULL);
+    }
+
+    char cacheDir[] = "/tmp/cproxy-bench-XXXXXX";
+    if (mkdtemp(cacheDir) == NULL) {
+        perror("scratch directory");
+        return EXIT_FAILURE;
+    }
+    static const char *const sizeNames[] = {"fixed", "uniform", "pareto"};
+    printf("origin: %s sizes %ld-%ld bytes, %u ms delay, ", sizeNames[sizeDistribution], sizeMin, sizeMax,
+           originDelayMs);
+    if (originBandwidth > 0) {
+        printf("%ld bytes/s per connection, ", originBandwidth);
+    } else {
+        printf("no bandwidth limit, ");
+    }
+    printf("%s responses\n", originChunked ? "chunked (close-delimited)" : "sized");
+    printf("proxy: %d workers; %d clients, %d s per workload, %lu objects in the warm set\n\n", workers, threads,
+           seconds, objectCount);
+    fflush(stdout);
+    pid_t proxy = startProxy(workers, cacheDir);
+    if (proxy == -1) {
+        fprintf(stderr, "proxy did not start\n");
+        return EXIT_FAILURE;
+    }
+    printf("%-8s %9s %10s %9s %9s %9s %9s %6s %11s %7s\n", "workload", "requests", "req/s", "MB/s", "p50 us",
+           "p99 us", "p999 us", "hit %", "cpu us/req", "errors");
+    for (int w = 0; w < 3; w++) {
+        if (run[w]) {
+            runWorkload((Workload) w, proxy, threads, seconds);
+        }
+    }
+
+    kill(proxy, SIGTERM);
+    waitpid(proxy, NULL, 0);
+    shutdown(originListenFd, SHUT_RDWR);
+    for (int i = 0; i < originThreads; i++) {
+        pthread_join(origin[i], NULL);
+    }
+    close(originListenFd);
+    free(origin);
+    free(zipfCdf);
+    nftw(cacheDir, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,210 @@
+// Checksum throughput, and what verifying on open costs the cache.
+//
+// First CRC32C alone, in GB/s over buffers of a few sizes, with the
+// SSE4.2 instruction (when the CPU has it) and with the portable
+// slicing-by-8 code, after checking that both agree with each other and
+// with the standard check value on every length and alignment up to 256
+// and on some long buffers.
+//
+// Then the cache path: objects are stored through a Cache (small ones
+// packed, big ones as files), the cache is reopened as a fresh process
+// would, and every object is opened twice. The first round checks every
+// body, the second only the CACHE_VERIFY_SAMPLE share; both run from the
+// page cache, so the difference is the checksum. Last, one byte of a
+// stored file is flipped to see that the open that follows refuses it.
+//
+// Usage: crc32c_bench [megabytes of objects]
+
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "crc32c.h"
+#include "url.h"
+
+#define BUFFER_SIZE ((size_t) 1 << 24)
+// Bytes hashed per measurement
+#define HASHED ((size_t) 1 << 30)
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void checkAgreement(const unsigned char *data) {
+    if (crc32cUpdate(0, "123456789", 9) != 0xe3069283u || crc32cPortable(0, "123456789", 9) != 0xe3069283u) {
+        fprintf(stderr, "wrong check value\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t offset = 0; offset < 8; offset++) {
+        for (size_t length = 0; length <= 256; length++) {
+            uint32_t split = crc32cUpdate(crc32cUpdate(0, data + offset, length / 3), data + offset + length / 3,
+                                          length - length / 3);
+            if (crc32cUpdate(0, data + offset, length) != crc32cPortable(0, data + offset, length) ||
+                split != crc32cPortable(0, data + offset, length)) {
+                fprintf(stderr, "implementations disagree at offset %zu, length %zu\n", offset, length);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    // Long enough for the interleaved blocks of the hardware path
+    static const size_t longer[] = {767, 768, 1000, 24575, 24576, 30000, 100003, 1 << 20};
+    for (size_t i = 0; i < sizeof(longer) / sizeof(longer[0]); i++) {
+        if (crc32cUpdate(0, data + i, longer[i]) != crc32cPortable(0, data + i, longer[i])) {
+            fprintf(stderr, "implementations disagree at length %zu\n", longer[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static double throughput(uint32_t (*crc)(uint32_t, const void *, size_t), const unsigned char *data, size_t block) {
+    volatile uint32_t sink = 0;
+    size_t rounds = HASHED / block;
+    double start = nowSeconds();
+    for (size_t i = 0; i < rounds; i++) {
+        sink ^= crc(0, data + (i * block) % BUFFER_SIZE, block);
+    }
+    (void) sink;
+    return (double) (rounds * block) / (nowSeconds() - start) / 1e9;
+}
+
+static int removeEntry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void) st;
+    (void) flag;
+    (void) ftw;
+    return remove(path);
+}
+
+static size_t objectSize(size_t i) {
+    // 1 KB to 4 MB: packed objects and files
+    return (size_t) 1024 << (i * 2654435761u % 13);
+}
+
+static const char *pathOf(Cache *cache, RequestContext *ctx, char *storage, size_t size, size_t i) {
+    char url[64];
+    requestContextInit(ctx, storage, size);
+    snprintf(url, sizeof(url), "http://bench.example.com/object/%zu", i);
+    splitURL(ctx, url);
+    return cachePathFor(cache, ctx);
+}
+
+// Open every object once; returns the bytes opened
+static double openAll(Cache *cache, size_t count, off_t *bytes) {
+    *bytes = 0;
+    double start = nowSeconds();
+    for (size_t i = 0; i < count; i++) {
+        char storage[512];
+        RequestContext ctx;
+        CacheObject object;
+        const char *path = pathOf(cache, &ctx, storage, sizeof(storage), i);
+        if (cacheOpen(cache, path, &object) == -1) {
+            fprintf(stderr, "object %zu missing\n", i);
+            exit(EXIT_FAILURE);
+        }
+        *bytes += object.length;
+        close(object.fd);
+        requestContextFree(&ctx);
+    }
+    return nowSeconds() - start;
+}
+
+static void cacheBench(const unsigned char *data, size_t megabytes) {
+    char root[] = "/tmp/crc32c_bench.XXXXXX";
+    if (mkdtemp(root) == NULL) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    Cache cache;
+    cacheInit(&cache, root, CACHE_PACK_LIMIT);
+    size_t count = 0;
+    size_t stored = 0;
+    size_t fileObject = SIZE_MAX;
+    while (stored < megabytes << 20) {
+        char storage[512];
+        RequestContext ctx;
+        CacheFill fill;
+        size_t size = objectSize(count);
+        const char *path = pathOf(&cache, &ctx, storage, sizeof(storage), count);
+        if (cacheFillBegin(&cache, &ctx, path, (long) size, &fill) != 0 ||
+            cacheFillWrite(&fill, (const char *) data + count % 4096, size) != 0 || cacheFillCommit(&fill) != 0) {
+            fprintf(stderr, "storing object %zu failed\n", count);
+            exit(EXIT_FAILURE);
+        }
+        if (fileObject == SIZE_MAX && size > CACHE_PACK_LIMIT) {
+            fileObject = count;
+        }
+        requestContextFree(&ctx);
+        stored += size;
+        count++;
+    }
+    cacheClose(&cache);
+
+    // A new process has verified nothing yet
+    cacheInit(&cache, root, CACHE_PACK_LIMIT);
+    off_t bytes;
+    double first = openAll(&cache, count, &bytes);
+    unsigned long firstChecks = cache.verified;
+    double later = openAll(&cache, count, &bytes);
+    printf("cache:   %zu objects, %.1f MB\n", count, (double) bytes / 1e6);
+    printf("         first open %.2f GB/s (%lu checked), later opens %.2f GB/s (%lu checked)\n",
+           (double) bytes / first / 1e9, firstChecks, (double) bytes / later / 1e9, cache.verified - firstChecks);
+
+    if (fileObject != SIZE_MAX) {
+        char storage[512];
+        RequestContext ctx;
+        CacheObject object;
+        const char *path = pathOf(&cache, &ctx, storage, sizeof(storage), fileObject);
+        int fd = open(path, O_RDWR);
+        char byte;
+        if (fd == -1 || pread(fd, &byte, 1, 100) != 1) {
+            fprintf(stderr, "cannot damage %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+        byte ^= 1;
+        pwrite(fd, &byte, 1, 100);
+        close(fd);
+        // Reopened, so that this process has not verified the object yet
+        cacheClose(&cache);
+        cacheInit(&cache, root, CACHE_PACK_LIMIT);
+        int opened = cacheOpen(&cache, path, &object);
+        printf("damage:  a flipped bit is %s (%lu corrupt)\n", opened == -1 ? "caught" : "MISSED", cache.corrupt);
+        if (opened == 0) {
+            close(object.fd);
+        }
+        requestContextFree(&ctx);
+    }
+    cacheClose(&cache);
+    nftw(root, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int main(int argc, char *argv[]) {
+    size_t megabytes = argc > 1 ? (size_t) atol(argv[1]) : 256;
+    unsigned char *data = malloc(BUFFER_SIZE + 4096 + ((size_t) 4 << 20));
+    if (data == NULL) {
+        return EXIT_FAILURE;
+    }
+    unsigned long seed = 1;
+    for (size_t i = 0; i < BUFFER_SIZE + 4096 + ((size_t) 4 << 20); i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        data[i] = (unsigned char) (seed >> 56);
+    }
+    checkAgreement(data);
+
+    printf("crc32c:  %s\n", crc32cHardware() ? "SSE4.2 instruction" : "portable code only");
+    static const size_t blocks[] = {4096, 65536, 1 << 20};
+    for (size_t i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++) {
+        printf("         %7zu-byte blocks: hardware %6.2f GB/s, portable %5.2f GB/s\n", blocks[i],
+               throughput(crc32cUpdate, data, blocks[i]), throughput(crc32cPortable, data, blocks[i]));
+    }
+    cacheBench(data, megabytes);
+    free(data);
+    return EXIT_SUCCESS;
+}
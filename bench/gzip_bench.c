@@ -0,0 +1,267 @@
+// Disk saved and CPU spent by storing text bodies gzip-compressed.
+//
+// First the codec alone: each body is compressed at GZIP_LEVEL and
+// decoded again, and it reports the ratio and the CPU seconds per
+// GB of uncompressed text both ways (compressing is what the cache pays
+// once per object, decoding what a hit costs for a client that cannot
+// take gzip; a client that can gets the stored bytes with sendfile()).
+//
+// Then the cache path: every body is stored uncompressed, as a fill of a
+// text response would, queued on a CompressQueue and compressed in
+// COMPRESS_STEP_BUDGET steps into its gzip variant, after which the
+// bytes on disk are counted again.
+//
+// Bodies are the given files, or synthetic HTML, JSON and JavaScript
+// built from a small vocabulary, about as repetitive as the real thing.
+//
+// Usage: gzip_bench [files...]
+
+#define _XOPEN_SOURCE 700
+
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cachekey.h"
+#include "cacheset.h"
+#include "compress.h"
+#include "gzip.h"
+
+#define SYNTHETIC_BODIES 600
+
+typedef struct Body {
+    char *data;
+    size_t length;
+    const char *type;
+} Body;
+
+static const char *const words[] = {
+        "user", "account", "price", "order", "session", "value", "item", "list", "title", "description",
+        "content", "update", "create", "delete", "status", "result", "error", "message", "country", "language",
+        "the", "and", "for", "with", "from", "this", "that", "page", "click", "search", "product", "review",
+};
+
+static double cpuSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static const char *word(unsigned long *seed) {
+    *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return words[(*seed >> 33) % (sizeof(words) / sizeof(words[0]))];
+}
+
+// A body of roughly size bytes of the given kind
+static Body syntheticBody(int kind, size_t size, unsigned long seed) {
+    static const char *const types[] = {"text/html; charset=utf-8", "application/json", "application/javascript"};
+    Body body = {malloc(size + 256), 0, types[kind]};
+    while (body.length < size) {
+        const char *a = word(&seed), *b = word(&seed), *c = word(&seed);
+        unsigned long number = seed >> 40;
+        int n;
+        if (kind == 0) {
+            n = sprintf(body.data + body.length, "<div class=\"%s-%s\"><a href=\"/%s/%lu\">%s %s</a></div>\n", a, b,
+                        c, number, b, c);
+        } else if (kind == 1) {
+            n = sprintf(body.data + body.length, "{\"%s\":%lu,\"%s\":\"%s %s\",\"%s\":true},", a, number, b, c, a, c);
+        } else {
+            n = sprintf(body.data + body.length, "function %s_%s(%s){return this.%s[%lu]||%s;}\n", a, b, c, a,
+                        number % 97, b);
+        }
+        body.length += (size_t) n;
+    }
+    return body;
+}
+
+static int readBody(const char *path, Body *body) {
+    FILE *file = fopen(path, "rb");
+    struct stat st;
+    if (file == NULL || fstat(fileno(file), &st) == -1) {
+        if (file != NULL) {
+            fclose(file);
+        }
+        return -1;
+    }
+    body->length = (size_t) st.st_size;
+    body->data = malloc(body->length + 1);
+    body->type = "text/plain";
+    int ok = body->data != NULL && fread(body->data, 1, body->length, file) == body->length;
+    fclose(file);
+    return ok ? 0 : -1;
+}
+
+// Run a whole body through a stream into out, which must be big enough
+static size_t runStream(GzipStream *stream, const char *in, size_t length, char *out, size_t size, int compress) {
+    size_t produced = 0;
+    size_t offset = 0;
+    int result;
+    do {
+        size_t used, made;
+        result = gzipStreamStep(stream, in + offset, length - offset, &used, out + produced, size - produced, &made,
+                                compress);
+        offset += used;
+        produced += made;
+    } while (result == 0 && (offset < length || stream->pending));
+    return produced;
+}
+
+static void codecBench(const Body *bodies, size_t count) {
+    size_t raw = 0, packed = 0;
+    double deflateSeconds = 0, inflateSeconds = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t bound = bodies[i].length + bodies[i].length / 8 + 64;
+        char *compressed = malloc(bound);
+        char *decoded = malloc(bodies[i].length + 1);
+        GzipStream stream;
+        double start = cpuSeconds();
+        gzipStreamBegin(&stream, 1);
+        size_t length = runStream(&stream, bodies[i].data, bodies[i].length, compressed, bound, 1);
+        gzipStreamEnd(&stream);
+        double middle = cpuSeconds();
+        gzipStreamBegin(&stream, 0);
+        size_t back = runStream(&stream, compressed, length, decoded, bodies[i].length + 1, 0);
+        gzipStreamEnd(&stream);
+        inflateSeconds += cpuSeconds() - middle;
+        deflateSeconds += middle - start;
+        if (back != bodies[i].length || memcmp(decoded, bodies[i].data, back) != 0) {
+            fprintf(stderr, "body %zu did not survive the round trip\n", i);
+            exit(EXIT_FAILURE);
+        }
+        raw += bodies[i].length;
+        packed += length;
+        free(compressed);
+        free(decoded);
+    }
+    double gb = (double) raw / 1e9;
+    printf("codec:   %zu bodies, %.1f MB -> %.1f MB (%.1f%% saved)\n", count, (double) raw / 1e6,
+           (double) packed / 1e6, 100.0 * (1.0 - (double) packed / (double) raw));
+    printf("         compress %.2f CPU s/GB, decode %.2f CPU s/GB (level %d)\n", deflateSeconds / gb,
+           inflateSeconds / gb, GZIP_LEVEL);
+}
+
+static off_t diskBytes;
+
+static int countBytes(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void) path;
+    (void) ftw;
+    // Bodies are hard links into the blob directory: every link counts its share
+    if (flag == FTW_F) {
+        diskBytes += st->st_blocks * 512 / (off_t) st->st_nlink;
+    }
+    return 0;
+}
+
+static int removeEntry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void) st;
+    (void) flag;
+    (void) ftw;
+    return remove(path);
+}
+
+static off_t cacheBytes(const char *root) {
+    diskBytes = 0;
+    nftw(root, countBytes, 16, FTW_PHYS);
+    return diskBytes;
+}
+
+static void cacheBench(const Body *bodies, size_t count) {
+    char root[] = "/tmp/gzip_bench.XXXXXX";
+    if (mkdtemp(root) == NULL) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    const char *roots[] = {root};
+    CacheSet set;
+    CompressQueue queue;
+    cacheSetInit(&set, roots, 1, CACHE_PACK_LIMIT);
+    compressQueueInit(&queue);
+    off_t empty = cacheBytes(root);
+    size_t raw = 0;
+    for (size_t i = 0; i < count; i++) {
+        char storage[512];
+        char url[64];
+        RequestContext ctx;
+        CacheFill fill;
+        requestContextInit(&ctx, storage, sizeof(storage));
+        snprintf(url, sizeof(url), "http://bench.example.com/asset/%zu", i);
+        splitURL(&ctx, url);
+        canonicalizeURL(&ctx, &defaultKeyRules);
+        CacheShard *shard = cacheSetPick(&set, &ctx);
+        const char *path = cachePathFor(&shard->cache, &ctx);
+        if (cacheShardFillBegin(shard, &ctx, path, (long) bodies[i].length, &fill) != 0 ||
+            cacheFillWrite(&fill, bodies[i].data, bodies[i].length) != 0 || cacheShardFillCommit(&fill) != 0) {
+            fprintf(stderr, "storing body %zu failed\n", i);
+            exit(EXIT_FAILURE);
+        }
+        raw += bodies[i].length;
+        requestContextFree(&ctx);
+    }
+    off_t before = cacheBytes(root) - empty;
+
+    double start = cpuSeconds();
+    unsigned long steps = 0;
+    for (size_t i = 0; i < count; i++) {
+        char storage[512];
+        char url[64];
+        RequestContext ctx;
+        requestContextInit(&ctx, storage, sizeof(storage));
+        snprintf(url, sizeof(url), "http://bench.example.com/asset/%zu", i);
+        splitURL(&ctx, url);
+        canonicalizeURL(&ctx, &defaultKeyRules);
+        while (queue.count == COMPRESS_QUEUE_SIZE) {
+            compressQueueStep(&queue, COMPRESS_STEP_BUDGET);
+            steps++;
+        }
+        compressQueueAdd(&queue, cacheSetPick(&set, &ctx), &ctx, bodies[i].type, strlen(bodies[i].type),
+                         (long) bodies[i].length);
+        requestContextFree(&ctx);
+    }
+    while (compressQueueStep(&queue, COMPRESS_STEP_BUDGET)) {
+        steps++;
+    }
+    double seconds = cpuSeconds() - start;
+    for (unsigned int i = 0; i < set.count; i++) {
+        cacheMaintain(&set.shards[i].cache);
+    }
+    off_t after = cacheBytes(root) - empty;
+
+    printf("cache:   %lu compressed, %lu kept as they were, in %lu steps of %d KB\n", queue.compressed, queue.kept,
+           steps + 1, COMPRESS_STEP_BUDGET / 1024);
+    printf("         on disk %.1f MB -> %.1f MB (%.1f%% saved), %.2f CPU s/GB of text (%.2f in steps)\n",
+           (double) before / 1e6, (double) after / 1e6, 100.0 * (1.0 - (double) after / (double) before),
+           seconds / ((double) raw / 1e9), (double) queue.cpuNs / 1e9 / ((double) raw / 1e9));
+    compressQueueClose(&queue);
+    cacheSetClose(&set);
+    nftw(root, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int main(int argc, char *argv[]) {
+    size_t count = argc > 1 ? (size_t) argc - 1 : SYNTHETIC_BODIES;
+    Body *bodies = calloc(count, sizeof(Body));
+    if (bodies == NULL) {
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (argc > 1 && readBody(argv[i + 1], &bodies[i]) == -1) {
+            fprintf(stderr, "could not read %s\n", argv[i + 1]);
+            return EXIT_FAILURE;
+        }
+        if (argc == 1) {
+            // 2 KB to 512 KB, most of them small, as on a typical site
+            size_t size = (size_t) 2048 << (i * 2654435761u % 9);
+            bodies[i] = syntheticBody((int) (i % 3), size, i + 1);
+        }
+    }
+    codecBench(bodies, count);
+    cacheBench(bodies, count);
+    for (size_t i = 0; i < count; i++) {
+        free(bodies[i].data);
+    }
+    free(bodies);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,205 @@
+// Page cache footprint of large objects, with and without the policy.
+//
+// A large object is filled through a Cache and then read back the way a
+// hit is served, through a PageStream; after each step the bench counts
+// how much of the file sits in the page cache. The same is done with
+// plain write() and pread() for comparison. What the policy keeps out of
+// the page cache is what stays available for the hot small objects. Its
+// read comes from the disk; the plain run leaves the writeback for later
+// and reads its own dirty pages back from memory. A fill runs on the
+// event loop, so the longest single write of each is shown as well: that
+// is how long every other connection of the worker can be kept waiting.
+// Last, the cost of the residency probe every hit pays is timed on a
+// small object.
+//
+// Usage: pagecache_bench [megabytes]
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "pagecache.h"
+#include "url.h"
+
+#define CHUNK 65536
+#define PROBES 100000
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static double maxDouble(double a, double b) {
+    return a > b ? a : b;
+}
+
+// Megabytes of the file in the page cache
+static double residentMegabytes(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return 0;
+    }
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t pages = ((size_t) st.st_size + pageSize - 1) / pageSize;
+    unsigned char *vector = malloc(pages);
+    void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    size_t resident = 0;
+    if (vector != NULL && map != MAP_FAILED && mincore(map, (size_t) st.st_size, vector) == 0) {
+        for (size_t i = 0; i < pages; i++) {
+            resident += vector[i] & 1;
+        }
+    }
+    if (map != MAP_FAILED) {
+        munmap(map, (size_t) st.st_size);
+    }
+    free(vector);
+    close(fd);
+    return (double) (resident * pageSize) / (1 << 20);
+}
+
+// Read the whole file as a hit is served; returns MB/s
+static double readBack(const char *path, int policy, PageCacheStats *stats) {
+    static char buffer[CHUNK];
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    PageStream pages;
+    if (policy) {
+        pageStreamRead(&pages, fd, 0, st.st_size, stats);
+    }
+    double start = nowSeconds();
+    off_t done = 0;
+    ssize_t got;
+    while ((got = pread(fd, buffer, sizeof(buffer), done)) > 0) {
+        done += got;
+        if (policy) {
+            pageStreamReadTo(&pages, done);
+        }
+    }
+    if (policy) {
+        pageStreamEnd(&pages);
+    }
+    double seconds = nowSeconds() - start;
+    close(fd);
+    return (double) done / (1 << 20) / seconds;
+}
+
+static int removeEntry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void) st;
+    (void) flag;
+    (void) ftw;
+    return remove(path);
+}
+
+int main(int argc, char *argv[]) {
+    size_t megabytes = argc > 1 ? (size_t) atol(argv[1]) : 512;
+    char root[] = "/tmp/pagecache_bench.XXXXXX";
+    if (mkdtemp(root) == NULL) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    char *chunk = malloc(CHUNK);
+    for (size_t i = 0; i < CHUNK; i++) {
+        chunk[i] = (char) (i * 2654435761u >> 24);
+    }
+
+    // With the policy: a fill through the cache, then a read like a cold hit
+    Cache cache;
+    cacheInit(&cache, root, CACHE_PACK_LIMIT);
+    char storage[512];
+    RequestContext ctx;
+    CacheFill fill;
+    requestContextInit(&ctx, storage, sizeof(storage));
+    splitURL(&ctx, "http://bench.example.com/large.bin");
+    const char *path = cachePathFor(&cache, &ctx);
+    double longest = 0;
+    double start = nowSeconds();
+    int error = cacheFillBegin(&cache, &ctx, path, (long) (megabytes << 20), &fill);
+    for (size_t i = 0; error == 0 && i < (megabytes << 20) / CHUNK; i++) {
+        // Vary the chunks so that the dedup store has nothing to share
+        memcpy(chunk, &i, sizeof(i));
+        double writeStart = nowSeconds();
+        error = cacheFillWrite(&fill, chunk, CHUNK);
+        longest = maxDouble(longest, nowSeconds() - writeStart);
+    }
+    if (error != 0 || cacheFillCommit(&fill) != 0) {
+        fprintf(stderr, "storing the object failed\n");
+        return EXIT_FAILURE;
+    }
+    double fillRate = (double) megabytes / (nowSeconds() - start);
+    double afterFill = residentMegabytes(path);
+    double readRate = readBack(path, 1, &cache.pages);
+    double afterRead = residentMegabytes(path);
+    printf("policy:  fill %7.0f MB/s, %6.1f MB resident after; read %7.0f MB/s, %6.1f MB resident after\n",
+           fillRate, afterFill, readRate, afterRead);
+    printf("         %lu streamed, %.0f MB handed back, longest write %.2f ms\n", cache.pages.streamed,
+           (double) cache.pages.droppedBytes / (1 << 20), longest * 1e3);
+
+    // Without: the same bytes through plain write() and pread()
+    char plain[sizeof(root) + 16];
+    snprintf(plain, sizeof(plain), "%s/plain", root);
+    int fd = open(plain, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    longest = 0;
+    start = nowSeconds();
+    for (size_t i = 0; fd != -1 && i < (megabytes << 20) / CHUNK; i++) {
+        memcpy(chunk, &i, sizeof(i));
+        double writeStart = nowSeconds();
+        if (write(fd, chunk, CHUNK) != CHUNK) {
+            perror("write");
+            return EXIT_FAILURE;
+        }
+        longest = maxDouble(longest, nowSeconds() - writeStart);
+    }
+    close(fd);
+    fillRate = (double) megabytes / (nowSeconds() - start);
+    afterFill = residentMegabytes(plain);
+    readRate = readBack(plain, 0, NULL);
+    afterRead = residentMegabytes(plain);
+    printf("plain:   fill %7.0f MB/s, %6.1f MB resident after; read %7.0f MB/s, %6.1f MB resident after\n",
+           fillRate, afterFill, readRate, afterRead);
+    printf("         longest write %.2f ms\n", longest * 1e3);
+
+    // What every hit pays to be counted
+    CacheObject object;
+    requestContextFree(&ctx);
+    requestContextInit(&ctx, storage, sizeof(storage));
+    splitURL(&ctx, "http://bench.example.com/small.json");
+    path = cachePathFor(&cache, &ctx);
+    if (cacheFillBegin(&cache, &ctx, path, -1, &fill) != 0 || cacheFillWrite(&fill, chunk, 4000) != 0 ||
+        cacheFillCommit(&fill) != 0 || cacheOpen(&cache, path, &object) != 0) {
+        fprintf(stderr, "storing the small object failed\n");
+        return EXIT_FAILURE;
+    }
+    PageCacheStats stats = {0};
+    start = nowSeconds();
+    for (int i = 0; i < PROBES; i++) {
+        PageStream pages;
+        pageStreamRead(&pages, object.fd, object.offset, object.length, &stats);
+        pageStreamEnd(&pages);
+    }
+    printf("probe:   %.2f us per small hit, %.0f%% of its pages resident\n",
+           (nowSeconds() - start) / PROBES * 1e6, 100.0 * (double) stats.residentPages / (double) stats.probedPages);
+    close(object.fd);
+    requestContextFree(&ctx);
+    cacheClose(&cache);
+    free(chunk);
+    nftw(root, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,377 @@
+// Microbenchmarks of the per-request parsing kernels.
+//
+// Times splitURL(), splitAndStorePath(), buildPath(), get_last_value(),
+// the header scans of the receive loops, httpHeaderEnd() and
+// httpContentLength(), and the header index, httpHeadersParse() and
+// httpHeadersGet() next to httpHeaderFind(), over a corpus of proxy-style
+// URLs and origin response headers. Each kernel runs in rounds over the whole corpus; the
+// median round is reported, with the spread of the rounds around it, so
+// numbers from two commits can be compared once the spread is small. The
+// thread stays on the CPU it started on.
+//
+// Allocations are counted by wrapping malloc(): the parsers bump-allocate
+// from the request arena, so anything above 0 allocations/op means a
+// request outgrew its first arena block.
+//
+// Usage: parse_bench [ops per round] [rounds]
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "httpheader.h"
+#include "url.h"
+
+// ---- Counting allocations ----
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void __libc_free(void *pointer);
+
+static unsigned long allocations;
+
+void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+    allocations++;
+    return __libc_realloc(pointer, size);
+}
+
+void free(void *pointer) {
+    __libc_free(pointer);
+}
+#define COUNTS_ALLOCATIONS 1
+#else
+static unsigned long allocations;
+#define COUNTS_ALLOCATIONS 0
+#endif
+
+// ---- Corpus ----
+
+static const char *const urls[] = {
+    "http://www.josephwcarrillo.com/JosephWhitfieldCarrillo.jpg",
+    "http://www.josephwcarrillo.com/music/CDadvertisement.jpg",
+    "http://jsonplaceholder.typicode.com/posts/1",
+    "http://placekitten.com/200/300",
+    "http://www.josephwcarrillo.com",
+    "http://localhost:8099/big.bin",
+    "http://cdn.example.org/static/js/vendor/react/18.2.0/umd/react.production.min.js",
+    "http://images.example.net:8080/thumbs/2024/05/17/a9f3c1e2b7d84f0c/320x240.webp",
+    "http://api.example.com/v2/users/12345/repos?per_page=100&page=3",
+    "http://mirror.example.edu/debian/pool/main/o/openssl/libssl3_3.0.11-1_amd64.deb",
+    "http://example.com/",
+    "http://static.example.com/fonts/inter/Inter-Regular.woff2",
+    "http://news.example.co.uk/world/europe/2024/article-123456789.html",
+    "http://shop.example.com/products/search?q=running+shoes&size=42&color=blue&utm_source=newsletter&utm_medium=email",
+    "http://video.example.tv:8000/hls/live/channel-7/1080p/segment_000184213.ts",
+    "http://registry.example.io/v2/library/ubuntu/blobs/sha256:5a81c4b8502e4979e75bd8f91343b95b0d695ab67f241dbed0d1530a35bde1eb",
+    "http://tiles.example.org/osm/14/8345/5622.png",
+    "http://www.example.com/a/b/c/d/e/f/g/h/i/j/index.html",
+};
+
+// Response headers as origins send them, up to the blank line
+static const char *const responses[] = {
+    "HTTP/1.1 200 OK\r\n"
+    "Server: nginx/1.24.0\r\n"
+    "Date: Sun, 18 Oct 2026 12:00:00 GMT\r\n"
+    "Content-Type: image/jpeg\r\n"
+    "Content-Length: 48213\r\n"
+    "Last-Modified: Tue, 02 Jan 2024 08:14:51 GMT\r\n"
+    "Connection: close\r\n"
+    "ETag: \"659345bb-bc55\"\r\n"
+    "Accept-Ranges: bytes\r\n\r\n",
+
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Sun, 18 Oct 2026 12:00:00 GMT\r\n"
+    "Content-Type: application/json; charset=utf-8\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "Connection: close\r\n"
+    "Report-To: {\"group\":\"heroku-nel\",\"max_age\":3600,\"endpoints\":[{\"url\":\"https://nel.example.com/reports\"}]}\r\n"
+    "Reporting-Endpoints: heroku-nel=https://nel.example.com/reports\r\n"
+    "Nel: {\"report_to\":\"heroku-nel\",\"max_age\":3600,\"success_fraction\":0.005,\"failure_fraction\":0.05}\r\n"
+    "X-Powered-By: Express\r\n"
+    "X-Ratelimit-Limit: 1000\r\n"
+    "X-Ratelimit-Remaining: 999\r\n"
+    "X-Ratelimit-Reset: 1760788800\r\n"
+    "Vary: Origin, Accept-Encoding\r\n"
+    "Access-Control-Allow-Credentials: true\r\n"
+    "Cache-Control: max-age=43200\r\n"
+    "Pragma: no-cache\r\n"
+    "Expires: -1\r\n"
+    "X-Content-Type-Options: nosniff\r\n"
+    "Etag: W/\"53-hfEnumeNh6YirfjyjaujcOPPT+s\"\r\n"
+    "Via: 1.1 vegur\r\n"
+    "CF-Cache-Status: HIT\r\n"
+    "Age: 2381\r\n"
+    "Server: cloudflare\r\n"
+    "CF-RAY: 8d4f2a1b3c5d6e7f-FRA\r\n"
+    "alt-svc: h3=\":443\"; ma=86400\r\n\r\n",
+
+    "HTTP/1.1 200 OK\r\n"
+    "x-amz-id-2: Ws1cJ7Ljv+0Y4Uq5h0dZ2Rk1s7f0t6oGm7Zk9C1cW2f8y6sQ3wVb4nX5aE0rT9uI8oP7lK6jH5gF4dS3a=\r\n"
+    "x-amz-request-id: 4E3B5C7D9F1A2B3C\r\n"
+    "Date: Sun, 18 Oct 2026 12:00:00 GMT\r\n"
+    "Last-Modified: Wed, 13 Mar 2024 17:22:41 GMT\r\n"
+    "ETag: \"d41d8cd98f00b204e9800998ecf8427e-12\"\r\n"
+    "x-amz-server-side-encryption: AES256\r\n"
+    "x-amz-version-id: null\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "Content-Type: application/vnd.debian.binary-package\r\n"
+    "Server: AmazonS3\r\n"
+    "Content-Length: 2307524\r\n\r\n",
+
+    "HTTP/1.0 200 OK\r\n"
+    "Server: SimpleHTTP/0.6 Python/3.12.3\r\n"
+    "Date: Sun, 18 Oct 2026 12:00:00 GMT\r\n"
+    "Content-type: application/octet-stream\r\n"
+    "Content-Length: 1048576\r\n"
+    "Last-Modified: Sun, 18 Oct 2026 11:58:02 GMT\r\n\r\n",
+
+    "HTTP/1.1 301 Moved Permanently\r\n"
+    "Server: Apache/2.4.58 (Ubuntu)\r\n"
+    "Location: http://www.example.com/new/location/index.html\r\n"
+    "Content-Length: 245\r\n"
+    "Connection: close\r\n"
+    "Content-Type: text/html; charset=iso-8859-1\r\n\r\n",
+};
+
+#define URL_COUNT (sizeof(urls) / sizeof(urls[0]))
+#define RESPONSE_COUNT (sizeof(responses) / sizeof(responses[0]))
+#define RECEIVE_SIZE 16384
+
+// A first read from the origin: the header followed by as much body as fits
+static char receiveBuffers[RESPONSE_COUNT][RECEIVE_SIZE];
+static size_t receiveLengths[RESPONSE_COUNT];
+static size_t headerLengths[RESPONSE_COUNT];
+
+static RequestContext parsed[URL_COUNT];
+static char parsedStorage[URL_COUNT][2048];
+static char scratchStorage[2048];
+
+// Keeps the compiler from discarding results
+static volatile size_t sink;
+
+// ---- Kernels: op i works on corpus entry i modulo its size ----
+
+// The arena is rewound rather than reset: everything it handed out stays within the first block
+#define REWIND(ctx, body) do { char *cursor = (ctx)->arena.cursor; body; (ctx)->arena.cursor = cursor; } while (0)
+
+static void runSplitURL(long ops) {
+    RequestContext ctx;
+    requestContextInit(&ctx, scratchStorage, sizeof(scratchStorage));
+    for (long i = 0; i < ops; i++) {
+        REWIND(&ctx, sink += (size_t) splitURL(&ctx, urls[i % URL_COUNT]) + ctx.segmentCount);
+    }
+    requestContextFree(&ctx);
+}
+
+// Into a context of its own: the segments of the parsed URLs stay for buildPath()
+static void runSplitAndStorePath(long ops) {
+    RequestContext ctx;
+    requestContextInit(&ctx, scratchStorage, sizeof(scratchStorage));
+    for (long i = 0; i < ops; i++) {
+        REWIND(&ctx, sink += (size_t) splitAndStorePath(&ctx, parsed[i % URL_COUNT].filepath) + ctx.segmentCount);
+    }
+    requestContextFree(&ctx);
+}
+
+static void runBuildPath(long ops) {
+    for (long i = 0; i < ops; i++) {
+        RequestContext *ctx = &parsed[i % URL_COUNT];
+        REWIND(ctx, sink += (size_t) buildPath(ctx) + (size_t) ctx->currentPath[0]);
+    }
+}
+
+static void runGetLastValue(long ops) {
+    for (long i = 0; i < ops; i++) {
+        sink += (size_t) get_last_value(&parsed[i % URL_COUNT])[0];
+    }
+}
+
+static void runHeaderEnd(long ops) {
+    for (long i = 0; i < ops; i++) {
+        size_t r = (size_t) i % RESPONSE_COUNT;
+        sink += (size_t) (httpHeaderEnd(receiveBuffers[r], receiveLengths[r]) - receiveBuffers[r]);
+    }
+}
+
+// The header has arrived only in part: the whole buffer is scanned in vain
+static void runHeaderEndPartial(long ops) {
+    for (long i = 0; i < ops; i++) {
+        size_t r = (size_t) i % RESPONSE_COUNT;
+        sink += httpHeaderEnd(receiveBuffers[r], headerLengths[r] - 1) == NULL;
+    }
+}
+
+static void runContentLength(long ops) {
+    for (long i = 0; i < ops; i++) {
+        size_t r = (size_t) i % RESPONSE_COUNT;
+        sink += (size_t) httpContentLength(receiveBuffers[r], headerLengths[r]);
+    }
+}
+
+static HttpHeaders indexed[RESPONSE_COUNT];
+
+static void runHeadersParse(long ops) {
+    HttpHeaders headers;
+    for (long i = 0; i < ops; i++) {
+        size_t r = (size_t) i % RESPONSE_COUNT;
+        httpHeadersParse(&headers, receiveBuffers[r], headerLengths[r]);
+        sink += headers.fieldCount + (size_t) headers.known[HTTP_CONTENT_LENGTH].length;
+    }
+}
+
+// Three known headers and one not, as a freshness check would ask for them
+static void runHeadersGet(long ops) {
+    size_t length;
+    for (long i = 0; i < ops; i++) {
+        const HttpHeaders *headers = &indexed[(size_t) i % RESPONSE_COUNT];
+        sink += httpHeadersGet(headers, "Cache-Control", &length) != NULL;
+        sink += httpHeadersGet(headers, "ETag", &length) != NULL;
+        sink += httpHeadersGet(headers, "Last-Modified", &length) != NULL;
+        sink += httpHeadersGet(headers, "Expires", &length) != NULL;
+    }
+}
+
+// The same four by scanning the block each time, as before the index
+static void runHeaderFind(long ops) {
+    size_t length;
+    for (long i = 0; i < ops; i++) {
+        size_t r = (size_t) i % RESPONSE_COUNT;
+        sink += httpHeaderFind(receiveBuffers[r], headerLengths[r], "Cache-Control", &length) != NULL;
+        sink += httpHeaderFind(receiveBuffers[r], headerLengths[r], "ETag", &length) != NULL;
+        sink += httpHeaderFind(receiveBuffers[r], headerLengths[r], "Last-Modified", &length) != NULL;
+        sink += httpHeaderFind(receiveBuffers[r], headerLengths[r], "Expires", &length) != NULL;
+    }
+}
+
+typedef struct Kernel {
+    const char *name;
+    void (*run)(long ops);
+} Kernel;
+
+static const Kernel kernels[] = {
+    {"splitURL", runSplitURL},
+    {"splitAndStorePath", runSplitAndStorePath},
+    {"buildPath", runBuildPath},
+    {"get_last_value", runGetLastValue},
+    {"httpHeaderEnd", runHeaderEnd},
+    {"httpHeaderEnd partial", runHeaderEndPartial},
+    {"httpContentLength", runContentLength},
+    {"httpHeadersParse", runHeadersParse},
+    {"httpHeadersGet x4", runHeadersGet},
+    {"httpHeaderFind x4", runHeaderFind},
+};
+
+// ---- Harness ----
+
+static const char *const checkedNames[] = {
+    "Cache-Control", "Connection", "Content-Encoding", "Content-Length", "Content-Type", "ETag",
+    "Last-Modified", "Location", "Transfer-Encoding", "Vary", "Server", "Date", "Expires", "x-amz-request-id",
+    "Accept-Ranges", "content-type", "ETAG", "Age", "CF-RAY", "Missing",
+};
+
+// Every lookup through the index must find what scanning the block finds
+static int checkIndex(HttpHeaders *headers, const char *block, size_t length) {
+    httpHeadersParse(headers, block, length);
+    for (size_t i = 0; i < sizeof(checkedNames) / sizeof(checkedNames[0]); i++) {
+        size_t indexedLength = 0, foundLength = 0;
+        const char *fromIndex = httpHeadersGet(headers, checkedNames[i], &indexedLength);
+        const char *found = httpHeaderFind(block, length, checkedNames[i], &foundLength);
+        if (fromIndex != found || (found != NULL && indexedLength != foundLength)) {
+            return -1;
+        }
+    }
+    return httpHeadersContentLength(headers) == httpContentLength(block, length) ? 0 : -1;
+}
+
+static double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+    long ops = argc > 1 ? atol(argv[1]) : 2000000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 9;
+    if (ops < 1 || rounds < 1) {
+        fprintf(stderr, "Usage: %s [ops per round] [rounds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Migrations between cores show up as noise
+    int cpu = sched_getcpu();
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu >= 0 ? cpu : 0, &cpus);
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+
+    for (size_t i = 0; i < URL_COUNT; i++) {
+        requestContextInit(&parsed[i], parsedStorage[i], sizeof(parsedStorage[i]));
+        if (splitURL(&parsed[i], urls[i]) != 0 || buildPath(&parsed[i]) != 0) {
+            fprintf(stderr, "cannot parse %s\n", urls[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    for (size_t i = 0; i < RESPONSE_COUNT; i++) {
+        headerLengths[i] = strlen(responses[i]);
+        memcpy(receiveBuffers[i], responses[i], headerLengths[i]);
+        for (size_t j = headerLengths[i]; j < RECEIVE_SIZE - 1; j++) {
+            receiveBuffers[i][j] = (char) (j * 131 >> 3);
+        }
+        receiveLengths[i] = RECEIVE_SIZE - 1;
+        receiveBuffers[i][receiveLengths[i]] = '\0';
+        if (httpHeaderEnd(receiveBuffers[i], receiveLengths[i]) != receiveBuffers[i] + headerLengths[i] - 4) {
+            fprintf(stderr, "header end of response %zu not found\n", i);
+            return EXIT_FAILURE;
+        }
+        if (checkIndex(&indexed[i], receiveBuffers[i], headerLengths[i]) != 0) {
+            fprintf(stderr, "index of response %zu disagrees with httpHeaderFind()\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("%zu URLs, %zu responses; %ld ops per round, median of %d rounds\n\n", URL_COUNT, RESPONSE_COUNT, ops,
+           rounds);
+    printf("%-22s %10s %10s %10s\n", "kernel", "ns/op", "spread", "allocs/op");
+    double *times = malloc((size_t) rounds * sizeof(double));
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        kernels[k].run(ops / 10 + 1);
+        unsigned long before = allocations;
+        for (int r = 0; r < rounds; r++) {
+            double start = nowNs();
+            kernels[k].run(ops);
+            times[r] = (nowNs() - start) / (double) ops;
+        }
+        double perOp = (double) (allocations - before) / ((double) ops * rounds);
+        qsort(times, (size_t) rounds, sizeof(double), compareDoubles);
+        double median = times[rounds / 2];
+        double spread = median > 0 ? 100.0 * (times[rounds - 1] - times[0]) / 2 / median : 0.0;
+        if (COUNTS_ALLOCATIONS) {
+            printf("%-22s %10.2f %9.1f%% %10.2f\n", kernels[k].name, median, spread, perOp);
+        } else {
+            printf("%-22s %10.2f %9.1f%% %10s\n", kernels[k].name, median, spread, "-");
+        }
+    }
+    free(times);
+    return EXIT_SUCCESS;
+}
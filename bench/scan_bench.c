@@ -0,0 +1,212 @@
+// The vector byte scanners against their scalar reference, then their speed.
+//
+// First a differential check at every instruction set the CPU has:
+// scanHeaderEnd() and scanFirstOf() must return what the byte-by-byte
+// versions return on random data rich in CR, LF, ':' and '/', at every
+// length up to 300 and every alignment within a vector, and with the data
+// ending right before an unmapped page, so a load past the end would crash.
+//
+// Then nanoseconds per call for header-sized inputs: the end of headers of
+// a few sizes (and a 16 KB read holding none), and the end of a hostname
+// of a few lengths, which is what splitURL() looks for.
+//
+// Usage: scan_bench [random trials]
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scan.h"
+
+static const char *const levelNames[] = {"scalar", "sse2", "avx2"};
+
+static double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static unsigned long long rngState = 0x9e3779b97f4a7c15ULL;
+
+static unsigned int nextRandom(void) {
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return (unsigned int) (rngState >> 32);
+}
+
+// Mostly letters, with enough delimiters that matches land anywhere
+static void fillRandom(char *data, size_t length, unsigned int density) {
+    static const char delimiters[] = "\r\n\r\n:/";
+    for (size_t i = 0; i < length; i++) {
+        unsigned int r = nextRandom();
+        data[i] = r % density == 0 ? delimiters[(r >> 8) % 6] : (char) ('a' + (r >> 8) % 26);
+    }
+}
+
+static int checkOne(const char *data, size_t length) {
+    if (scanHeaderEnd(data, length) != scanHeaderEndScalar(data, length)) {
+        fprintf(stderr, "scanHeaderEnd differs at length %zu\n", length);
+        return -1;
+    }
+    if (scanFirstOf(data, length, ':', '/') != scanFirstOfScalar(data, length, ':', '/') ||
+        scanFirstOf(data, length, '/', '/') != scanFirstOfScalar(data, length, '/', '/')) {
+        fprintf(stderr, "scanFirstOf differs at length %zu\n", length);
+        return -1;
+    }
+    return 0;
+}
+
+static int checkLevel(char *guarded, size_t pageSize, long trials) {
+    char buffer[512];
+    // Every length and alignment, densities from sparse to packed
+    for (unsigned int density = 2; density <= 64; density *= 4) {
+        for (size_t offset = 0; offset < 32; offset++) {
+            for (size_t length = 0; length <= 300; length++) {
+                fillRandom(buffer + offset, length, density);
+                if (checkOne(buffer + offset, length) != 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+    // One terminator planted at every position of otherwise clean data, and a truncated one at the end
+    for (size_t length = 4; length <= 300; length++) {
+        for (size_t at = 0; at + 4 <= length; at++) {
+            memset(buffer, 'x', length);
+            memcpy(buffer + at, "\r\n\r\n", 4);
+            if (checkOne(buffer, length) != 0) {
+                return -1;
+            }
+        }
+        memset(buffer, 'x', length);
+        memcpy(buffer + length - 3, "\r\n\r", 3);
+        if (checkOne(buffer, length) != 0) {
+            return -1;
+        }
+    }
+    // Data that ends at an unmapped page
+    for (long t = 0; t < trials; t++) {
+        size_t length = nextRandom() % 1024;
+        char *data = guarded + pageSize - length;
+        fillRandom(data, length, 2 + nextRandom() % 200);
+        if (checkOne(data, length) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static const char headerLine[] = "X-Example-Header: some value of typical length\r\n";
+
+// A header of about the given size, ending in a blank line, at the start of a 16 KB read
+static size_t makeHeader(char *buffer, size_t size, size_t headerSize) {
+    memcpy(buffer, "HTTP/1.1 200 OK\r\n", 17);
+    size_t length = 17;
+    while (length + sizeof(headerLine) - 1 + 2 <= headerSize) {
+        memcpy(buffer + length, headerLine, sizeof(headerLine) - 1);
+        length += sizeof(headerLine) - 1;
+    }
+    memcpy(buffer + length, "\r\n", 2);
+    length += 2;
+    fillRandom(buffer + length, size - length, 1000);
+    return size;
+}
+
+static volatile size_t sink;
+
+static double timeHeaderEnd(const char *data, size_t length, long calls) {
+    double start = nowNs();
+    for (long i = 0; i < calls; i++) {
+        sink += scanHeaderEnd(data, length) != NULL;
+    }
+    return (nowNs() - start) / (double) calls;
+}
+
+static double timeFirstOf(const char *data, size_t length, long calls) {
+    double start = nowNs();
+    for (long i = 0; i < calls; i++) {
+        sink += (size_t) scanFirstOf(data, length, ':', '/');
+    }
+    return (nowNs() - start) / (double) calls;
+}
+
+int main(int argc, char *argv[]) {
+    long trials = argc > 1 ? atol(argv[1]) : 200000;
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    char *pages = mmap(NULL, 2 * pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pages == MAP_FAILED || mprotect(pages + pageSize, pageSize, PROT_NONE) == -1) {
+        perror("guard page");
+        return EXIT_FAILURE;
+    }
+
+    ScanLevel chosen = scanLevel();
+    int available[3] = {0, 0, 0};
+    for (int level = SCAN_SCALAR; level <= SCAN_AVX2; level++) {
+        if (scanUse((ScanLevel) level) != 0) {
+            printf("%-6s  not supported by this CPU\n", levelNames[level]);
+            continue;
+        }
+        available[level] = 1;
+        if (checkLevel(pages, pageSize, trials) != 0) {
+            fprintf(stderr, "%s disagrees with the scalar scanners\n", levelNames[level]);
+            return EXIT_FAILURE;
+        }
+        printf("%-6s  agrees with the scalar scanners\n", levelNames[level]);
+    }
+    printf("chosen at startup: %s\n\n", levelNames[chosen]);
+
+    static const size_t headerSizes[] = {128, 512, 2048, 8192};
+    static const size_t hostLengths[] = {12, 24, 48, 96};
+    char *read = malloc(16384);
+    printf("%-26s", "ns per call");
+    for (int level = SCAN_SCALAR; level <= SCAN_AVX2; level++) {
+        printf(" %9s", levelNames[level]);
+    }
+    printf("\n");
+    for (size_t h = 0; h <= sizeof(headerSizes) / sizeof(headerSizes[0]); h++) {
+        int none = h == sizeof(headerSizes) / sizeof(headerSizes[0]);
+        if (none) {
+            fillRandom(read, 16384, 1000);
+            printf("%-26s", "header end, 16 KB, none");
+        } else {
+            makeHeader(read, 16384, headerSizes[h]);
+            char label[64];
+            snprintf(label, sizeof(label), "header end at %zu B", headerSizes[h]);
+            printf("%-26s", label);
+        }
+        for (int level = SCAN_SCALAR; level <= SCAN_AVX2; level++) {
+            if (available[level] && scanUse((ScanLevel) level) == 0) {
+                printf(" %9.1f", timeHeaderEnd(read, 16384, none ? 100000 : 1000000));
+            } else {
+                printf(" %9s", "-");
+            }
+        }
+        printf("\n");
+    }
+    for (size_t h = 0; h < sizeof(hostLengths) / sizeof(hostLengths[0]); h++) {
+        // A hostname of that length followed by the path
+        memset(read, 'w', hostLengths[h]);
+        memcpy(read + hostLengths[h], "/static/js/app.min.js", 21);
+        char label[64];
+        snprintf(label, sizeof(label), "':' or '/' at %zu B", hostLengths[h]);
+        printf("%-26s", label);
+        for (int level = SCAN_SCALAR; level <= SCAN_AVX2; level++) {
+            if (available[level] && scanUse((ScanLevel) level) == 0) {
+                printf(" %9.1f", timeFirstOf(read, hostLengths[h] + 21, 10000000));
+            } else {
+                printf(" %9s", "-");
+            }
+        }
+        printf("\n");
+    }
+    scanUse(chosen);
+    free(read);
+    munmap(pages, 2 * pageSize);
+    return EXIT_SUCCESS;
+}
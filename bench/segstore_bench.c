@@ -0,0 +1,220 @@
+// Small-object storage: packed segment files vs one file per object.
+//
+// Writes N small objects (200 to 2000 bytes, keyed like API responses)
+// through the Cache API, reads them all back in random order, and counts
+// the inodes left on disk: once with objects packed into segments and once
+// with the pack limit at 0, i.e. a file (and inode) per object. Then
+// rewrites every other packed object and times compacting the segments
+// that became half dead. Reads hit the page cache in both modes; the
+// difference is open()/path lookup and inode overhead.
+//
+// Usage: segstore_bench [objects]
+
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "url.h"
+
+#define MIN_OBJECT 200
+#define MAX_OBJECT 2000
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static size_t objectSize(long i) {
+    return MIN_OBJECT + (size_t) ((unsigned long) i * 2654435761u % (MAX_OBJECT - MIN_OBJECT + 1));
+}
+
+static void fillBody(char *body, size_t size, long i, int version) {
+    for (size_t j = 0; j < size; j++) {
+        body[j] = (char) ('a' + (j + (size_t) i + (size_t) version) % 26);
+    }
+}
+
+static double filesFound;
+static double bytesFound;
+
+// Hard links to one body (see dedup.c) count as a single inode
+static int countFile(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void) path;
+    (void) ftw;
+    if (type == FTW_F) {
+        filesFound += 1.0 / (double) st->st_nlink;
+        bytesFound += (double) st->st_blocks * 512 / (double) st->st_nlink;
+    }
+    return 0;
+}
+
+static int removeEntry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void) st;
+    (void) type;
+    (void) ftw;
+    remove(path);
+    return 0;
+}
+
+static int storeObject(Cache *cache, long i, int version) {
+    char storage[512];
+    char url[128];
+    char body[MAX_OBJECT];
+    RequestContext ctx;
+    CacheFill fill;
+
+    requestContextInit(&ctx, storage, sizeof(storage));
+    snprintf(url, sizeof(url), "http://api.example.com/posts/%ld", i);
+    size_t size = objectSize(i);
+    fillBody(body, size, i, version);
+    const char *path = splitURL(&ctx, url) == 0 ? cachePathFor(cache, &ctx) : NULL;
+    int error = path == NULL ? -1 : cacheFillBegin(cache, &ctx, path, (long) size, &fill);
+    if (error == 0) {
+        error = cacheFillWrite(&fill, body, size);
+        error = error == 0 ? cacheFillCommit(&fill) : (cacheFillAbort(&fill), error);
+    }
+    requestContextFree(&ctx);
+    return error;
+}
+
+static int loadObject(Cache *cache, long i, int version) {
+    char storage[512];
+    char url[128];
+    char body[MAX_OBJECT];
+    char expected[MAX_OBJECT];
+    RequestContext ctx;
+    CacheObject object;
+
+    requestContextInit(&ctx, storage, sizeof(storage));
+    snprintf(url, sizeof(url), "http://api.example.com/posts/%ld", i);
+    const char *path = splitURL(&ctx, url) == 0 ? cachePathFor(cache, &ctx) : NULL;
+    int error = path == NULL || cacheOpen(cache, path, &object) == -1 ? -1 : 0;
+    requestContextFree(&ctx);
+    if (error != 0) {
+        return -1;
+    }
+    size_t size = objectSize(i);
+    ssize_t got = pread(object.fd, body, sizeof(body), object.offset);
+    close(object.fd);
+    fillBody(expected, size, i, version);
+    if (object.length != (off_t) size || got < (ssize_t) size || memcmp(body, expected, size) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct Result {
+    double writeSeconds;
+    double readSeconds;
+    double files;
+    double diskBytes;
+} Result;
+
+static int runMode(const char *root, size_t packLimit, long objects, Result *result) {
+    Cache cache;
+    if (cacheInit(&cache, root, packLimit) != 0) {
+        fprintf(stderr, "could not open the cache in %s\n", root);
+        return -1;
+    }
+    double start = nowSeconds();
+    for (long i = 0; i < objects; i++) {
+        if (storeObject(&cache, i, 0) != 0) {
+            fprintf(stderr, "storing object %ld failed\n", i);
+            return -1;
+        }
+    }
+    result->writeSeconds = nowSeconds() - start;
+
+    // Visit every object once, in an order unrelated to the write order
+    long step = 7919;
+    while (objects % step == 0) {
+        step += 2;
+    }
+    start = nowSeconds();
+    for (long n = 0, i = 0; n < objects; n++, i = (i + step) % objects) {
+        if (loadObject(&cache, i, 0) != 0) {
+            fprintf(stderr, "object %ld missing or wrong\n", i);
+            return -1;
+        }
+    }
+    result->readSeconds = nowSeconds() - start;
+
+    filesFound = 0;
+    bytesFound = 0;
+    nftw(root, countFile, 64, FTW_PHYS);
+    result->files = filesFound;
+    result->diskBytes = bytesFound;
+    cacheClose(&cache);
+    return 0;
+}
+
+static void printResult(const char *name, long objects, const Result *result) {
+    printf("%-16s write %9.0f obj/s   read %9.0f obj/s   %8.0f inodes   %7.1f MB on disk\n", name,
+           objects / result->writeSeconds, objects / result->readSeconds, result->files,
+           result->diskBytes / (1 << 20));
+}
+
+int main(int argc, char *argv[]) {
+    long objects = argc > 1 ? atol(argv[1]) : 100000;
+    char dir[] = "/tmp/cproxy-segbench-XXXXXX";
+    if (objects < 1 || mkdtemp(dir) == NULL) {
+        perror("scratch directory");
+        return EXIT_FAILURE;
+    }
+    char packedRoot[sizeof(dir) + 16];
+    char filesRoot[sizeof(dir) + 16];
+    snprintf(packedRoot, sizeof(packedRoot), "%s/packed", dir);
+    snprintf(filesRoot, sizeof(filesRoot), "%s/files", dir);
+
+    Result packed, files;
+    if (runMode(packedRoot, CACHE_PACK_LIMIT, objects, &packed) != 0 ||
+        runMode(filesRoot, 0, objects, &files) != 0) {
+        nftw(dir, removeEntry, 64, FTW_DEPTH | FTW_PHYS);
+        return EXIT_FAILURE;
+    }
+    printf("objects:         %ld of %d to %d bytes\n", objects, MIN_OBJECT, MAX_OBJECT);
+    printResult("packed segments", objects, &packed);
+    printResult("file per object", objects, &files);
+    printf("packed speedup:  write %.2fx, read %.2fx\n", files.writeSeconds / packed.writeSeconds,
+           files.readSeconds / packed.readSeconds);
+
+    // Make three quarters of the packed data dead, then compact until nothing is left to do. The rewrites
+    // go on in the segment the first run left unsealed, so only some of it dies
+    Cache cache;
+    cacheInit(&cache, packedRoot, CACHE_PACK_LIMIT);
+    for (long i = 0; i < objects; i++) {
+        if (i % 4 != 0) {
+            storeObject(&cache, i, 1);
+        }
+    }
+    filesFound = 0;
+    bytesFound = 0;
+    nftw(packedRoot, countFile, 64, FTW_PHYS);
+    double before = bytesFound;
+    double start = nowSeconds();
+    while (segStoreCompactStep(&cache.segments, CACHE_COMPACT_BUDGET)) {
+    }
+    double compactSeconds = nowSeconds() - start;
+    int intact = 1;
+    for (long i = 0; i < objects && intact; i++) {
+        intact = loadObject(&cache, i, i % 4 != 0) == 0;
+    }
+    filesFound = 0;
+    bytesFound = 0;
+    nftw(packedRoot, countFile, 64, FTW_PHYS);
+    printf("compaction:      %.1f MB -> %.1f MB in %.1f ms, objects %s\n", before / (1 << 20),
+           bytesFound / (1 << 20), compactSeconds * 1e3, intact ? "intact" : "DAMAGED");
+    cacheClose(&cache);
+
+    nftw(dir, removeEntry, 64, FTW_DEPTH | FTW_PHYS);
+    return intact ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,113 @@
+// Timer wheel benchmark: arm, re-arm, cancel and expire 50k timers.
+//
+// Usage: timerwheel_bench [timers]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "timerwheel.h"
+
+typedef struct BenchTimer {
+    Timer timer;
+    uint64_t due;
+    uint64_t firedAt;
+} BenchTimer;
+
+static TimerWheel wheel;
+static unsigned long lateFires = 0;
+
+static void onFire(Timer *timer, void *arg) {
+    BenchTimer *bt = arg;
+    (void) timer;
+    bt->firedAt = wheel.current;
+    if (bt->firedAt != bt->due) {
+        lateFires++;
+    }
+}
+
+static double nowNanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+// Deadlines spread like a proxy's: mostly seconds, some minutes
+static uint64_t randomTimeout(void) {
+    int r = rand() % 100;
+    if (r < 10) {
+        return 1 + rand() % 64;
+    }
+    if (r < 80) {
+        return 1000 + rand() % 30000;
+    }
+    return 60000 + rand() % 600000;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long count = argc > 1 ? strtoul(argv[1], NULL, 10) : 50000;
+    BenchTimer *timers = calloc(count, sizeof(BenchTimer));
+    if (timers == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    srand(42);
+    wheelInit(&wheel, 0);
+
+    // Arm every timer once
+    double start = nowNanos();
+    for (unsigned long i = 0; i < count; i++) {
+        timerInit(&timers[i].timer, onFire, &timers[i]);
+        uint64_t timeout = randomTimeout();
+        timers[i].due = wheel.current + timeout;
+        wheelArm(&wheel, &timers[i].timer, timeout);
+    }
+    double armNs = (nowNanos() - start) / (double) count;
+
+    // Re-arm every timer, as an idle deadline does on every read
+    start = nowNanos();
+    for (unsigned long i = 0; i < count; i++) {
+        uint64_t timeout = randomTimeout();
+        timers[i].due = wheel.current + timeout;
+        wheelArm(&wheel, &timers[i].timer, timeout);
+    }
+    double rearmNs = (nowNanos() - start) / (double) count;
+
+    // Cancel every other timer
+    start = nowNanos();
+    unsigned long cancelled = 0;
+    for (unsigned long i = 0; i < count; i += 2) {
+        wheelCancel(&wheel, &timers[i].timer);
+        cancelled++;
+    }
+    double cancelNs = (nowNanos() - start) / (double) cancelled;
+
+    // Run the clock forward the way the event loop would, waking at each next timeout
+    unsigned long fired = 0;
+    unsigned long wakeups = 0;
+    start = nowNanos();
+    while (wheel.count > 0) {
+        int timeout = wheelNextTimeout(&wheel);
+        fired += wheelAdvance(&wheel, wheel.current + (uint64_t) timeout);
+        wakeups++;
+    }
+    double expireNs = (nowNanos() - start) / (double) (fired ? fired : 1);
+
+    unsigned long unfired = 0;
+    for (unsigned long i = 1; i < count; i += 2) {
+        if (timers[i].firedAt == 0) {
+            unfired++;
+        }
+    }
+
+    printf("timers:        %lu\n", count);
+    printf("arm:           %.1f ns/op\n", armNs);
+    printf("re-arm:        %.1f ns/op\n", rearmNs);
+    printf("cancel:        %.1f ns/op\n", cancelNs);
+    printf("expire:        %.1f ns/timer (%lu fired, %lu wakeups)\n", expireNs, fired, wakeups);
+    printf("late fires:    %lu\n", lateFires);
+    printf("missed fires:  %lu\n", unfired);
+
+    free(timers);
+    return (lateFires == 0 && unfired == 0 && fired == count - cancelled) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,90 @@
+// What timing a request costs, and how close the histogram percentiles are.
+//
+// First the per-request cost with timing on: a timingStart(), a mark for
+// each phase a miss goes through, timingEnd(), the JSON line and the
+// summary record, against the same calls with timing off (a NULL record).
+// Then a million latencies spread over five decades are recorded, and the
+// histogram's percentiles are compared with the exact ones from sorting.
+//
+// Usage: timing_bench [requests]
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "timing.h"
+
+#define SAMPLES 1000000
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// The calls a timed miss makes; timing is NULL when timing is off
+static size_t timeRequest(RequestTiming *timing, TimingSummary *summary, char *line, size_t size) {
+    for (int phase = TIMING_PARSE; phase <= TIMING_BODY; phase++) {
+        timingMark(timing, (TimingPhase) phase);
+    }
+    uint64_t since = timingClock(timing);
+    timingSince(timing, TIMING_DISK, since);
+    timingEnd(timing);
+    if (timing == NULL) {
+        return 0;
+    }
+    timing->statusCode = 200;
+    timing->bodyBytes = 4096;
+    timingSummaryRecord(summary, timing);
+    return timingFormatJson(timing, "bench.example.com/object/12345", line, size);
+}
+
+static int compareValues(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+    long requests = argc > 1 ? atol(argv[1]) : 1000000;
+    static TimingSummary summary;
+    RequestTiming timing;
+    char line[1024];
+    size_t bytes = 0;
+
+    double start = nowSeconds();
+    for (long i = 0; i < requests; i++) {
+        bytes += timeRequest(NULL, &summary, line, sizeof(line));
+    }
+    double off = (nowSeconds() - start) / (double) requests;
+    start = nowSeconds();
+    for (long i = 0; i < requests; i++) {
+        timingStart(&timing);
+        bytes += timeRequest(&timing, &summary, line, sizeof(line));
+    }
+    double on = (nowSeconds() - start) / (double) requests;
+    printf("request: %.1f ns with timing off, %.1f ns on (%.0f bytes of JSON per request)\n", off * 1e9, on * 1e9,
+           (double) bytes / (double) requests);
+
+    // Log-uniform from 1 us to 100 ms
+    static uint64_t values[SAMPLES];
+    static TimingHistogram histogram;
+    unsigned long seed = 1;
+    for (int i = 0; i < SAMPLES; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        double exponent = 3.0 + 5.0 * (double) (seed >> 11) / (double) (1ULL << 53);
+        double value = pow(10.0, exponent);
+        values[i] = (uint64_t) value;
+        histogramRecord(&histogram, values[i]);
+    }
+    qsort(values, SAMPLES, sizeof(values[0]), compareValues);
+    static const double percentiles[] = {50, 90, 99, 99.9, 99.99};
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        size_t rank = (size_t) (percentiles[i] / 100.0 * SAMPLES + 0.999999) - 1;
+        uint64_t exact = values[rank], estimate = histogramPercentile(&histogram, percentiles[i]);
+        printf("p%-6g exact %10.1f us, histogram %10.1f us (%+.2f%%)\n", percentiles[i], (double) exact / 1e3,
+               (double) estimate / 1e3, 100.0 * ((double) estimate - (double) exact) / (double) exact);
+    }
+    printf("histogram: %zu bytes\n", sizeof(TimingHistogram));
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,235 @@
+// URL parsing throughput: per-request arena vs the global linked-list parser.
+//
+// Runs splitURL + buildPath + release over a corpus of proxy-style URLs,
+// once with the parser the proxy used before (malloc per component and per
+// path segment, globals, linked list) and once with the arena-backed
+// RequestContext from url.c. Both must produce the same cache path for
+// every URL.
+//
+// Usage: urlparse_bench [iterations]
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "url.h"
+
+static const char *corpus[] = {
+    "http://www.josephwcarrillo.com/JosephWhitfieldCarrillo.jpg",
+    "http://www.josephwcarrillo.com/music/CDadvertisement.jpg",
+    "http://jsonplaceholder.typicode.com/posts/1",
+    "http://placekitten.com/200/300",
+    "http://www.josephwcarrillo.com/news.html",
+    "http://www.josephwcarrillo.com",
+    "http://localhost:8099/big.bin",
+    "http://cdn.example.org/static/js/vendor/react/18.2.0/umd/react.production.min.js",
+    "http://images.example.net:8080/thumbs/2024/05/17/a9f3c1e2b7d84f0c/320x240.webp",
+    "http://api.example.com/v2/users/12345/repos?per_page=100&page=3",
+    "http://mirror.example.edu/debian/pool/main/o/openssl/libssl3_3.0.11-1_amd64.deb",
+    "http://example.com/",
+    "http://static.example.com/fonts/inter/Inter-Regular.woff2",
+    "http://news.example.co.uk/world/europe/2024/article-123456789.html",
+};
+
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+
+// ---- Before: the parser as it was, globals and a linked list ----
+
+typedef struct Node {
+    char *value;
+    struct Node *next;
+} Node;
+
+static size_t lenUrl;
+static Node *pathList;
+static char *hostname, *port, *filepath, *currentPath;
+static unsigned long legacyAllocations;
+
+static void *countedMalloc(size_t size) {
+    legacyAllocations++;
+    return malloc(size);
+}
+
+static void freeAll(void) {
+    free(currentPath);
+    free(hostname);
+    free(port);
+    free(filepath);
+    while (pathList != NULL) {
+        Node *temp = pathList;
+        pathList = pathList->next;
+        free(temp->value);
+        free(temp);
+    }
+}
+
+static void appendNode(char *segment) {
+    Node *newNode = countedMalloc(sizeof(Node));
+    newNode->value = segment;
+    newNode->next = NULL;
+    if (pathList == NULL) {
+        pathList = newNode;
+    } else {
+        Node *current = pathList;
+        while (current->next != NULL) {
+            current = current->next;
+        }
+        current->next = newNode;
+    }
+}
+
+static void legacySplitAndStorePath(const char *path) {
+    const char *pathStart = path;
+    const char *pathEnd = strchr(pathStart, '/');
+    while (pathEnd != NULL) {
+        size_t segmentLength = pathEnd - pathStart;
+        char *segment = countedMalloc(segmentLength + 1);
+        strncpy(segment, pathStart, segmentLength);
+        segment[segmentLength] = '\0';
+        appendNode(segment);
+        pathStart = pathEnd + 1;
+        pathEnd = strchr(pathStart, '/');
+    }
+    size_t lastSegmentLength = strlen(pathStart);
+    if (lastSegmentLength > 0) {
+        char *lastSegment = countedMalloc(lastSegmentLength + 1);
+        strcpy(lastSegment, pathStart);
+        appendNode(lastSegment);
+    }
+}
+
+// The corpus is valid, so the error paths of the original are left out
+static void legacySplitURL(const char *url) {
+    const char *hostnameStart = strstr(url, "://") + 3;
+    const char *portStart = strchr(hostnameStart, ':');
+    const char *pathStart = strchr(hostnameStart, '/');
+
+    if (portStart != NULL && (pathStart == NULL || portStart < pathStart)) {
+        hostname = countedMalloc(portStart - hostnameStart + 1);
+        strncpy(hostname, hostnameStart, portStart - hostnameStart);
+        hostname[portStart - hostnameStart] = '\0';
+        const char *portEnd = strchr(portStart, '/');
+        for (const char *digitCheck = portStart + 1; digitCheck < portEnd; ++digitCheck) {
+            if (!isdigit(*digitCheck)) {
+                abort();
+            }
+        }
+        port = countedMalloc(portEnd - portStart);
+        strncpy(port, portStart + 1, portEnd - portStart - 1);
+        port[portEnd - portStart - 1] = '\0';
+        filepath = countedMalloc(strlen(portEnd) + 1);
+        strcpy(filepath, portEnd);
+    } else if (pathStart != NULL) {
+        hostname = countedMalloc(pathStart - hostnameStart + 1);
+        strncpy(hostname, hostnameStart, pathStart - hostnameStart);
+        hostname[pathStart - hostnameStart] = '\0';
+        port = countedMalloc(3);
+        strcpy(port, "80");
+        filepath = countedMalloc(strlen(pathStart) + 1);
+        strcpy(filepath, pathStart);
+    } else {
+        hostname = countedMalloc(strlen(hostnameStart) + 1);
+        strcpy(hostname, hostnameStart);
+        port = countedMalloc(3);
+        strcpy(port, "80");
+        filepath = countedMalloc(12);
+        strcpy(filepath, "/index.html");
+        lenUrl += 12;
+    }
+    legacySplitAndStorePath(filepath);
+}
+
+static void legacyBuildPath(void) {
+    currentPath = countedMalloc(lenUrl);
+    memset(currentPath, 0, lenUrl);
+    strcat(currentPath, hostname);
+    int flag_First_in_list = 0;
+    for (Node *current = pathList; current != NULL; current = current->next) {
+        if (flag_First_in_list != 0) {
+            strcat(currentPath, "/");
+        }
+        flag_First_in_list++;
+        if (strlen(currentPath) + strlen(current->value) >= lenUrl) {
+            abort();
+        }
+        strcat(currentPath, current->value);
+    }
+}
+
+// ---- Harness ----
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Keeps the compiler from discarding the parsed paths
+static volatile size_t sink;
+
+static double runLegacy(long iterations) {
+    double start = nowSeconds();
+    for (long i = 0; i < iterations; i++) {
+        const char *url = corpus[i % CORPUS_SIZE];
+        lenUrl = strlen(url);
+        legacySplitURL(url);
+        legacyBuildPath();
+        sink += strlen(currentPath);
+        freeAll();
+    }
+    return nowSeconds() - start;
+}
+
+static double runArena(long iterations, unsigned long *overflows) {
+    char storage[512];
+    RequestContext ctx;
+    requestContextInit(&ctx, storage, sizeof(storage));
+    double start = nowSeconds();
+    for (long i = 0; i < iterations; i++) {
+        splitURL(&ctx, corpus[i % CORPUS_SIZE]);
+        buildPath(&ctx);
+        sink += strlen(ctx.currentPath);
+        if (ctx.arena.blocks != NULL) {
+            (*overflows)++;
+        }
+        requestContextFree(&ctx);
+    }
+    return nowSeconds() - start;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+
+    // Both parsers must agree on the cache path of every URL
+    char storage[512];
+    RequestContext ctx;
+    requestContextInit(&ctx, storage, sizeof(storage));
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+        lenUrl = strlen(corpus[i]);
+        legacySplitURL(corpus[i]);
+        legacyBuildPath();
+        splitURL(&ctx, corpus[i]);
+        buildPath(&ctx);
+        if (strcmp(currentPath, ctx.currentPath) != 0) {
+            fprintf(stderr, "mismatch for %s: \"%s\" vs \"%s\"\n", corpus[i], currentPath, ctx.currentPath);
+            return EXIT_FAILURE;
+        }
+        freeAll();
+        requestContextFree(&ctx);
+    }
+
+    legacyAllocations = 0;
+    double legacy = runLegacy(iterations);
+    unsigned long overflows = 0;
+    double arena = runArena(iterations, &overflows);
+
+    printf("URLs parsed:           %ld (%zu distinct)\n", iterations, CORPUS_SIZE);
+    printf("linked list + malloc:  %8.2f M URLs/s  %6.1f ns/URL  %5.1f allocations/URL\n",
+           iterations / legacy / 1e6, legacy * 1e9 / iterations, (double) legacyAllocations / iterations);
+    printf("request arena:         %8.2f M URLs/s  %6.1f ns/URL  %5.1f allocations/URL\n",
+           iterations / arena / 1e6, arena * 1e9 / iterations, (double) overflows / iterations);
+    printf("speedup:               %8.2fx\n", legacy / arena);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,195 @@
+// Multi-worker scaling benchmark over loopback.
+//
+// Starts cproxy_c in server mode with 1, 2, 4, ... workers, drives warm cache
+// hits through it from several client threads and reports requests per
+// second. Each proxy run prints its per-worker load balance on shutdown.
+//
+// Usage: worker_bench [max-workers] [seconds] [client-threads]
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef CPROXY_BINARY
+#define CPROXY_BINARY "./cproxy_c"
+#endif
+
+#define BENCH_OBJECT_SIZE 4096
+
+static const char benchRequest[] = "GET http://bench.local/obj HTTP/1.0\r\n\r\n";
+static volatile int benchRunning = 1;
+static int benchPort = 0;
+
+typedef struct ClientThread {
+    pthread_t thread;
+    unsigned long requests;
+    unsigned long errors;
+} ClientThread;
+
+static int connectLoopback(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t) port);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void *clientMain(void *arg) {
+    ClientThread *client = arg;
+    char buffer[16384];
+
+    while (benchRunning) {
+        int fd = connectLoopback(benchPort);
+        if (fd == -1) {
+            client->errors++;
+            continue;
+        }
+        size_t received = 0;
+        ssize_t n;
+        if (send(fd, benchRequest, sizeof(benchRequest) - 1, MSG_NOSIGNAL) > 0) {
+            while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+                received += (size_t) n;
+            }
+        }
+        close(fd);
+        if (received > BENCH_OBJECT_SIZE) {
+            client->requests++;
+        } else {
+            client->errors++;
+        }
+    }
+    return NULL;
+}
+
+static pid_t startProxy(int port, int workers) {
+    char portArg[16], workersArg[16];
+    snprintf(portArg, sizeof(portArg), "%d", port);
+    snprintf(workersArg, sizeof(workersArg), "%d", workers);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl(CPROXY_BINARY, "cproxy_c", "-l", portArg, "-w", workersArg, "-p", (char *) NULL);
+        perror("execl " CPROXY_BINARY);
+        _exit(127);
+    }
+    // Wait until the listeners are up
+    for (int attempt = 0; attempt < 100; attempt++) {
+        int fd = connectLoopback(port);
+        if (fd != -1) {
+            close(fd);
+            return pid;
+        }
+        usleep(20000);
+    }
+    kill(pid, SIGTERM);
+    return -1;
+}
+
+static double runLoad(int seconds, int threads) {
+    ClientThread *clients = calloc((size_t) threads, sizeof(ClientThread));
+    struct timespec start, end;
+
+    benchRunning = 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&clients[i].thread, NULL, clientMain, &clients[i]);
+    }
+    sleep((unsigned int) seconds);
+    benchRunning = 0;
+
+    unsigned long requests = 0, errors = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(clients[i].thread, NULL);
+        requests += clients[i].requests;
+        errors += clients[i].errors;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(clients);
+
+    double elapsed = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (errors > 0) {
+        fprintf(stderr, "%lu failed requests\n", errors);
+    }
+    return (double) requests / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    int maxWorkers = argc > 1 ? atoi(argv[1]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int seconds = argc > 2 ? atoi(argv[2]) : 3;
+    int threads = argc > 3 ? atoi(argv[3]) : 2 * maxWorkers;
+    if (maxWorkers < 1) {
+        maxWorkers = 1;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    // Warm cache with a single object, in a scratch directory
+    char dir[] = "/tmp/cproxy-bench-XXXXXX";
+    if (mkdtemp(dir) == NULL || chdir(dir) == -1 || mkdir("bench.local", 0777) == -1) {
+        perror("scratch directory");
+        return EXIT_FAILURE;
+    }
+    FILE *object = fopen("bench.local/obj", "wb");
+    if (object == NULL) {
+        perror("fopen");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < BENCH_OBJECT_SIZE; i++) {
+        fputc('a' + i % 26, object);
+    }
+    fclose(object);
+
+    double baseline = 0;
+    for (int workers = 1; workers <= maxWorkers; ) {
+        benchPort = 18000 + workers;
+        pid_t proxy = startProxy(benchPort, workers);
+        if (proxy == -1) {
+            fprintf(stderr, "proxy with %d workers did not start\n", workers);
+            return EXIT_FAILURE;
+        }
+        double rate = runLoad(seconds, threads);
+        if (workers == 1) {
+            baseline = rate;
+        }
+        printf("workers %3d: %10.0f req/s  (%.2fx, %.0f%% of linear)\n", workers, rate,
+               baseline > 0 ? rate / baseline : 0.0,
+               baseline > 0 ? 100.0 * rate / (baseline * workers) : 0.0);
+        fflush(stdout);
+
+        // The proxy reports its per-worker load balance on stderr when it stops
+        kill(proxy, SIGTERM);
+        waitpid(proxy, NULL, 0);
+        // Double each round, always finishing with the requested maximum
+        if (workers < maxWorkers && workers * 2 > maxWorkers) {
+            workers = maxWorkers;
+        } else {
+            workers *= 2;
+        }
+    }
+
+    unlink("bench.local/obj");
+    rmdir("bench.local");
+    if (chdir("/") == 0) {
+        rmdir(dir);
+    }
+    return EXIT_SUCCESS;
+}
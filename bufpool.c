@@ -0,0 +1,111 @@
+#include "bufpool.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+// Buffers start on a cache line so that neighbouring buffers never share one
+#define BUFFER_ALIGN 64
+
+void bufferPoolInit(BufferPool *pool) {
+    memset(pool, 0, sizeof(*pool));
+}
+
+/**
+ * @brief Returns every slab to the system; no buffer may be in use any more.
+ */
+void bufferPoolDestroy(BufferPool *pool) {
+    while (pool->slabList != NULL) {
+        void *slab = pool->slabList;
+        pool->slabList = *(void **) slab;
+        munmap(slab, BUFFER_SLAB_SIZE);
+    }
+    memset(pool, 0, sizeof(*pool));
+}
+
+size_t bufferClassSize(int sizeClass) {
+    return (size_t) 1 << (BUFFER_MIN_SHIFT + BUFFER_CLASS_SHIFT * sizeClass);
+}
+
+static int bufferClassFor(size_t size) {
+    int sizeClass = 0;
+    while (sizeClass < BUFFER_CLASSES - 1 && bufferClassSize(sizeClass) < size) {
+        sizeClass++;
+    }
+    return sizeClass;
+}
+
+// Carve a fresh slab into buffers of one class and put them on its free list
+static int bufferPoolGrow(BufferPool *pool, int sizeClass) {
+    size_t stride = (sizeof(IoBuffer) + bufferClassSize(sizeClass) + BUFFER_ALIGN - 1) & ~(size_t) (BUFFER_ALIGN - 1);
+    // Pages of the slab only become resident once a buffer in them is used
+    char *slab = mmap(NULL, BUFFER_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED) {
+        return -1;
+    }
+    pool->slabs++;
+    // The first cache line links the slab into the pool's list
+    *(void **) slab = pool->slabList;
+    pool->slabList = slab;
+
+    for (size_t offset = BUFFER_ALIGN; offset + stride <= BUFFER_SLAB_SIZE; offset += stride) {
+        IoBuffer *buffer = (IoBuffer *) (slab + offset);
+        buffer->capacity = bufferClassSize(sizeClass);
+        buffer->sizeClass = sizeClass;
+        buffer->nextFree = pool->freeList[sizeClass];
+        pool->freeList[sizeClass] = buffer;
+        pool->available[sizeClass]++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Takes a buffer of at least sizeHint bytes (capped at the largest class).
+ *
+ * @return An empty buffer, or NULL if memory is exhausted.
+ */
+IoBuffer *bufferAcquire(BufferPool *pool, size_t sizeHint) {
+    int sizeClass = bufferClassFor(sizeHint);
+    if (pool->freeList[sizeClass] == NULL && bufferPoolGrow(pool, sizeClass) == -1) {
+        return NULL;
+    }
+    IoBuffer *buffer = pool->freeList[sizeClass];
+    pool->freeList[sizeClass] = buffer->nextFree;
+    pool->available[sizeClass]--;
+    pool->inUse[sizeClass]++;
+    buffer->nextFree = NULL;
+    buffer->len = 0;
+    buffer->sent = 0;
+    return buffer;
+}
+
+void bufferRelease(BufferPool *pool, IoBuffer *buffer) {
+    if (buffer == NULL) {
+        return;
+    }
+    buffer->nextFree = pool->freeList[buffer->sizeClass];
+    pool->freeList[buffer->sizeClass] = buffer;
+    pool->inUse[buffer->sizeClass]--;
+    pool->available[buffer->sizeClass]++;
+}
+
+/**
+ * @brief Picks the size of the next read from what is left of the body.
+ *
+ * A small object is read into a small buffer; a large or unknown-length
+ * body gets bigger buffers and therefore fewer recv() calls.
+ *
+ * @param contentLength Declared body length, or a negative value if unknown.
+ * @param received Body bytes received so far.
+ */
+size_t bufferReadSize(long contentLength, long received) {
+    if (contentLength < 0) {
+        return bufferClassSize(BUFFER_CLASSES - 2);
+    }
+    long remaining = contentLength - received;
+    if (remaining <= 0) {
+        return bufferClassSize(0);
+    }
+    // One spare byte for the terminating NUL the header scanning relies on
+    size_t want = (size_t) remaining + 1;
+    return want > BUFFER_MAX_SIZE ? BUFFER_MAX_SIZE : want;
+}
@@ -0,0 +1,53 @@
+#ifndef CPROXY_BUFPOOL_H
+#define CPROXY_BUFPOOL_H
+
+#include <stddef.h>
+
+// Buffer size classes: 2 KB, 8 KB, 32 KB and 128 KB
+#define BUFFER_CLASSES 4
+#define BUFFER_MIN_SHIFT 11
+#define BUFFER_CLASS_SHIFT 2
+#define BUFFER_MAX_SIZE ((size_t) 1 << (BUFFER_MIN_SHIFT + BUFFER_CLASS_SHIFT * (BUFFER_CLASSES - 1)))
+
+// Every slab is 1 MB of address space, carved into buffers of one class
+#define BUFFER_SLAB_SIZE ((size_t) 1 << 20)
+
+/**
+ * @brief A fixed-size I/O buffer on loan from a BufferPool.
+ *
+ * A buffer is attached to a connection only while it holds bytes in flight
+ * (a partial request, a response chunk the client has not taken yet) and is
+ * returned to the pool as soon as it is drained.
+ */
+typedef struct IoBuffer {
+    struct IoBuffer *nextFree;
+    size_t capacity;
+    size_t len;             // Bytes stored
+    size_t sent;            // Bytes already consumed from the front
+    int sizeClass;
+    char data[];
+} IoBuffer;
+
+/**
+ * @brief Slab allocator for I/O buffers, one per worker (not thread-safe).
+ *
+ * Slabs are only returned to the system by bufferPoolDestroy(), so the
+ * resident cost is the peak number of buffers in flight, not the number of
+ * open connections.
+ */
+typedef struct BufferPool {
+    IoBuffer *freeList[BUFFER_CLASSES];
+    unsigned long inUse[BUFFER_CLASSES];
+    unsigned long available[BUFFER_CLASSES];
+    unsigned long slabs;
+    void *slabList;         // Every slab, linked through its first cache line
+} BufferPool;
+
+void bufferPoolInit(BufferPool *pool);
+void bufferPoolDestroy(BufferPool *pool);
+size_t bufferClassSize(int sizeClass);
+IoBuffer *bufferAcquire(BufferPool *pool, size_t sizeHint);
+void bufferRelease(BufferPool *pool, IoBuffer *buffer);
+size_t bufferReadSize(long contentLength, long received);
+
+#endif //CPROXY_BUFPOOL_H
@@ -0,0 +1,463 @@
+#include "cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cachekey.h"
+#include "cproxy.h"
+#include "crc32c.h"
+
+// Bytes of an object read at a time to check its CRC
+#define CACHE_VERIFY_CHUNK 32768
+
+/**
+ * @brief Sets up a cache under root, packing objects of up to packLimit bytes.
+ *
+ * The segment store holds per-process state (its own active segment and
+ * the lock on it), so a process that forks workers must call this in each
+ * worker rather than before forking.
+ *
+ * @return 0 on success, CPROXY_ERR_CACHE if the segment store, the blob
+ * directory or the index could not be opened; the cache then works without
+ * packing, sharing bodies or keeping metadata respectively.
+ */
+int cacheInit(Cache *cache, const char *root, size_t packLimit) {
+    cache->root = root;
+    cache->fillCounter = 0;
+    cache->packLimit = 0;
+    cache->dedup = 0;
+    cache->indexed = 0;
+    cache->verifyCounter = 0;
+    cache->verified = 0;
+    cache->corrupt = 0;
+    memset(&cache->pages, 0, sizeof(cache->pages));
+    const char *dir = root != NULL ? root : ".";
+    char path[strlen(dir) + sizeof("/.segments/")];
+    int error = 0;
+
+    snprintf(path, sizeof(path), "%s/.objects/", dir);
+    if (createParentDirectories(path) == 0 && dedupOpen(&cache->blobs, path) == 0) {
+        cache->dedup = 1;
+    } else {
+        error = CPROXY_ERR_CACHE;
+    }
+    snprintf(path, sizeof(path), "%s/.index/", dir);
+    if (createParentDirectories(path) == 0 && cacheIndexOpen(&cache->index, path, root) == 0) {
+        cache->indexed = 1;
+    } else {
+        error = CPROXY_ERR_CACHE;
+    }
+    if (packLimit > 0) {
+        snprintf(path, sizeof(path), "%s/.segments/", dir);
+        if (createParentDirectories(path) == 0 && segStoreOpen(&cache->segments, path, CACHE_SEGMENT_LIMIT) == 0) {
+            cache->packLimit = packLimit;
+        } else {
+            error = CPROXY_ERR_CACHE;
+        }
+    }
+    return error;
+}
+
+void cacheClose(Cache *cache) {
+    if (cache->packLimit > 0) {
+        segStoreClose(&cache->segments);
+        cache->packLimit = 0;
+    }
+    if (cache->dedup) {
+        dedupClose(&cache->blobs);
+        cache->dedup = 0;
+    }
+    if (cache->indexed) {
+        cacheIndexClose(&cache->index);
+        cache->indexed = 0;
+    }
+}
+
+/**
+ * @brief Background upkeep, meant to run from a periodic timer.
+ *
+ * Indexes what other workers packed since the last call, compacts a
+ * bounded amount of dead segment space, removes a batch of blobs no
+ * object refers to any more and keeps the index's snapshot and journals
+ * in shape.
+ */
+void cacheMaintain(Cache *cache) {
+    if (cache->packLimit > 0) {
+        segStoreRefresh(&cache->segments);
+        segStoreCompactStep(&cache->segments, CACHE_COMPACT_BUDGET);
+    }
+    if (cache->dedup) {
+        dedupSweepStep(&cache->blobs, CACHE_SWEEP_BATCH);
+    }
+    if (cache->indexed) {
+        cacheIndexMaintain(&cache->index);
+    }
+}
+
+// A host directory name that cannot escape the root or clash with its dot directories
+static int isPlainHost(const char *host, size_t length) {
+    if (length == 0 || host[0] == '.') {
+        return 0;
+    }
+    for (size_t i = 0; i < length; i++) {
+        char c = host[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '.' || c == ':')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Maps a parsed request to the file its object is stored in.
+ *
+ * The file is named after a 128-bit hash of the request's cache key (see
+ * canonicalizeURL(); built with the default rules if the caller has not
+ * built it), under a directory for the host and one for the first byte
+ * of the hash: host/ab/cdef.... Whatever the URL contains, the name is
+ * safe and of fixed length. The hash is keyed with the cache's secret
+ * when it has one, so no one can craft a URL that lands on another's file.
+ *
+ * The string lives in the request's arena.
+ *
+ * @return The path, or NULL if the arena could not grow.
+ */
+const char *cachePathFor(const Cache *cache, RequestContext *ctx) {
+    if (ctx->cacheKey == NULL && canonicalizeURL(ctx, &defaultKeyRules) != 0) {
+        return NULL;
+    }
+    return cachePathForKey(cache, ctx, ctx->cacheKey, strlen(ctx->cacheKey));
+}
+
+/**
+ * @brief Like cachePathFor(), for a key derived from the request's cache key.
+ *
+ * The file goes in the directory of the request's host. Derived keys
+ * contain a "#", which no canonical URL does, so they never clash with one.
+ */
+const char *cachePathForKey(const Cache *cache, RequestContext *ctx, const char *key, size_t keyLength) {
+    static const DedupStore unkeyed;
+    ContentHash hash;
+    uint64_t digest[2];
+    contentHashInit(&hash, cache->dedup ? &cache->blobs : &unkeyed);
+    contentHashUpdate(&hash, key, keyLength);
+    contentHashFinal(&hash, digest);
+
+    const char *host = ctx->cacheKey;
+    size_t hostLength = strcspn(host, "/");
+    if (!isPlainHost(host, hostLength)) {
+        host = "_";
+        hostLength = 1;
+    }
+    const char *root = cache->root != NULL ? cache->root : "";
+    const char *separator = cache->root != NULL ? "/" : "";
+    size_t size = strlen(root) + strlen(separator) + hostLength + sizeof("/ab/") + 30;
+    char *path = arenaAlloc(&ctx->arena, size);
+    if (path != NULL) {
+        snprintf(path, size, "%s%s%.*s/%02x/%014llx%016llx", root, separator, (int) hostLength, host,
+                 (unsigned int) (digest[0] >> 56), (unsigned long long) (digest[0] & 0xffffffffffffffULL),
+                 (unsigned long long) digest[1]);
+    }
+    return path;
+}
+
+// Whether an object's checksum is to be checked on this open
+static int verifyDue(Cache *cache, int verifiedBefore) {
+    return !verifiedBefore || ++cache->verifyCounter % CACHE_VERIFY_SAMPLE == 0;
+}
+
+// Whether the body still has the CRC it was stored with
+static int objectIntact(Cache *cache, const CacheObject *object, uint32_t crc) {
+    char buffer[CACHE_VERIFY_CHUNK];
+    uint32_t actual = 0;
+    off_t done = 0;
+    cache->verified++;
+    // Counted when the object is served, not here
+    PageStream pages;
+    pageStreamRead(&pages, object->fd, object->offset, object->length, NULL);
+    while (done < object->length) {
+        off_t left = object->length - done;
+        size_t wanted = left < (off_t) sizeof(buffer) ? (size_t) left : sizeof(buffer);
+        ssize_t got = pread(object->fd, buffer, wanted, object->offset + done);
+        if (got <= 0) {
+            break;      // Shorter than when it was stored
+        }
+        actual = crc32cUpdate(actual, buffer, (size_t) got);
+        done += got;
+        pageStreamReadTo(&pages, object->offset + done);
+    }
+    pageStreamEnd(&pages);
+    return done == object->length && actual == crc;
+}
+
+// Check a file-backed object against the index when due
+static int fileIntact(Cache *cache, const char *path, const CacheObject *object) {
+    IndexEntry *entry = cacheIndexLookup(&cache->index, path);
+    if (entry == NULL || entry->checked == 0 || !verifyDue(cache, entry->checked == cache->index.epoch)) {
+        return 1;
+    }
+    if (entry->size != (uint64_t) object->length || !objectIntact(cache, object, entry->crc)) {
+        // Another process may have stored a new version since this one last read the journals
+        cacheIndexRefresh(&cache->index);
+        entry = cacheIndexLookup(&cache->index, path);
+        if (entry != NULL && entry->checked != 0 &&
+            (entry->size != (uint64_t) object->length || !objectIntact(cache, object, entry->crc))) {
+            return 0;
+        }
+    }
+    if (entry != NULL && entry->checked != 0) {
+        entry->checked = cache->index.epoch;
+    }
+    return 1;
+}
+
+// Empty the damaged file still at path. Objects sharing its blob are just as damaged: emptied, the
+// blob fails them all, and since its size no longer matches, no refetched copy is linked to it
+static int emptyDamaged(const char *path, int damagedFd) {
+    struct stat damaged, linked;
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    int result = -1;
+    if (fstat(damagedFd, &damaged) == 0 && fstat(fd, &linked) == 0 && damaged.st_ino == linked.st_ino &&
+        damaged.st_dev == linked.st_dev) {
+        result = ftruncate(fd, 0);
+    }
+    close(fd);
+    return result;
+}
+
+// Drop an object that failed its check, so that it is fetched again
+static int objectCorrupt(Cache *cache, const char *path, CacheObject *object) {
+    if (!object->packed) {
+        emptyDamaged(path, object->fd);
+    }
+    close(object->fd);
+    cacheRemove(cache, path);
+    cache->corrupt++;
+    return -1;
+}
+
+/**
+ * @brief Opens a cached object for reading, packed or stored as a file.
+ *
+ * The body is checked against its CRC first if this process has not done
+ * so yet, or if this open is one of the sample. An object that fails is
+ * removed and reported as not cached.
+ *
+ * @return 0 with the object's location in *object, -1 if it is not cached.
+ */
+int cacheOpen(Cache *cache, const char *path, CacheObject *object) {
+    SegmentEntry *entry;
+    if (cache->packLimit > 0 &&
+        (entry = segStoreLookup(&cache->segments, path, &object->fd, &object->offset, &object->length)) != NULL) {
+        object->packed = 1;
+        if ((entry->flags & SEGMENT_CHECKSUM) && verifyDue(cache, entry->flags & SEGMENT_VERIFIED)) {
+            if (!objectIntact(cache, object, entry->crc)) {
+                return objectCorrupt(cache, path, object);
+            }
+            entry->flags |= SEGMENT_VERIFIED;
+        }
+        return 0;
+    }
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    object->fd = fd;
+    object->offset = 0;
+    object->length = st.st_size;
+    object->packed = 0;
+    if (cache->indexed && !fileIntact(cache, path, object)) {
+        return objectCorrupt(cache, path, object);
+    }
+    return 0;
+}
+
+static int fillOpenFile(CacheFill *fill) {
+    if (createParentDirectories(fill->path) == -1) {
+        return CPROXY_ERR_CACHE;
+    }
+    fill->file = fopen(fill->tempPath, "wb");
+    if (fill->file == NULL) {
+        return CPROXY_ERR_CACHE;
+    }
+    // Chunks arrive in pool buffers already; a second stdio buffer per fill would only copy them
+    setvbuf(fill->file, NULL, _IONBF, 0);
+    pageStreamWrite(&fill->pages, fileno(fill->file), &fill->cache->pages);
+    if (fill->cache->dedup) {
+        contentHashInit(&fill->hash, &fill->cache->blobs);
+    }
+    return 0;
+}
+
+// The body is hashed as it streams through, never read back
+static int fillWriteFile(CacheFill *fill, const char *data, size_t len) {
+    if (fwrite(data, 1, len, fill->file) != len) {
+        return CPROXY_ERR_CACHE;
+    }
+    if (fill->cache->dedup) {
+        contentHashUpdate(&fill->hash, data, len);
+    }
+    fill->fileLength += (off_t) len;
+    pageStreamWroteTo(&fill->pages, fill->fileLength);
+    return 0;
+}
+
+/**
+ * @brief Starts writing an object.
+ *
+ * An object expected to fit the pack limit (or of unknown length) is
+ * collected in memory; anything bigger goes to a temporary file next to
+ * its final path.
+ *
+ * @param expectedLength The announced body length, -1 if unknown.
+ * @return 0 on success, CPROXY_ERR_CACHE or CPROXY_ERR_NOMEM on failure.
+ */
+int cacheFillBegin(Cache *cache, RequestContext *ctx, const char *path, long expectedLength, CacheFill *fill) {
+    memset(fill, 0, sizeof(*fill));
+    fill->cache = cache;
+    fill->path = path;
+    fill->active = 1;
+    size_t size = strlen(path) + 48;
+    fill->tempPath = arenaAlloc(&ctx->arena, size);
+    if (fill->tempPath == NULL) {
+        return CPROXY_ERR_NOMEM;
+    }
+    // Unique per process and fill, so concurrent fills of one object never share a file
+    snprintf(fill->tempPath, size, "%s.tmp.%d.%u", path, (int) getpid(), cache->fillCounter++);
+
+    if (cache->packLimit > 0 && expectedLength <= (long) cache->packLimit) {
+        fill->packedCapacity = expectedLength >= 0 ? (size_t) expectedLength : cache->packLimit;
+        fill->packed = malloc(fill->packedCapacity + 1);
+        if (fill->packed == NULL) {
+            return CPROXY_ERR_NOMEM;
+        }
+        return 0;
+    }
+    return fillOpenFile(fill);
+}
+
+int cacheFillWrite(CacheFill *fill, const char *data, size_t len) {
+    fill->crc = crc32cUpdate(fill->crc, data, len);
+    if (fill->packed != NULL) {
+        if (fill->packedLength + len <= fill->packedCapacity) {
+            memcpy(fill->packed + fill->packedLength, data, len);
+            fill->packedLength += len;
+            return 0;
+        }
+        // Bigger than announced or than the pack limit: continue as a file
+        if (fillOpenFile(fill) != 0 || fillWriteFile(fill, fill->packed, fill->packedLength) != 0) {
+            return CPROXY_ERR_CACHE;
+        }
+        free(fill->packed);
+        fill->packed = NULL;
+    }
+    return fillWriteFile(fill, data, len);
+}
+
+/**
+ * @brief Publishes a complete object.
+ *
+ * Appending to a segment and rename() are both atomic for readers: other
+ * workers see either no object or the whole object. A file whose body is
+ * already stored under another path becomes a link to the same blob
+ * instead. Whichever form is written, an older copy in the other form is
+ * removed so it cannot shadow the new one.
+ */
+int cacheFillCommit(CacheFill *fill) {
+    Cache *cache = fill->cache;
+    fill->active = 0;
+    if (fill->packed != NULL) {
+        int stored = segStoreAppend(&cache->segments, fill->path, fill->packed, fill->packedLength, fill->crc);
+        free(fill->packed);
+        fill->packed = NULL;
+        if (stored == -1) {
+            return CPROXY_ERR_CACHE;
+        }
+        if (unlink(fill->path) == 0 && cache->indexed) {
+            cacheIndexForget(&cache->index, fill->path);
+        }
+        return 0;
+    }
+    pageStreamEnd(&fill->pages);
+    int closed = fclose(fill->file);
+    fill->file = NULL;
+    int published = -1;
+    if (closed == 0 && cache->dedup) {
+        uint64_t digest[2];
+        contentHashFinal(&fill->hash, digest);
+        published = dedupPublish(&cache->blobs, digest, fill->fileLength, fill->tempPath, fill->path);
+    } else if (closed == 0) {
+        published = rename(fill->tempPath, fill->path);
+    }
+    if (published == -1) {
+        unlink(fill->tempPath);
+        return CPROXY_ERR_CACHE;
+    }
+    if (cache->packLimit > 0) {
+        segStoreRemove(&cache->segments, fill->path);
+    }
+    if (cache->indexed) {
+        cacheIndexRecord(&cache->index, fill->path, (uint64_t) fill->fileLength, fill->crc);
+    }
+    return 0;
+}
+
+/**
+ * @brief Removes an object, packed or stored as a file.
+ */
+void cacheRemove(Cache *cache, const char *path) {
+    if (cache->packLimit > 0) {
+        segStoreRemove(&cache->segments, path);
+    }
+    if (unlink(path) == 0 && cache->indexed) {
+        cacheIndexForget(&cache->index, path);
+    }
+}
+
+// Drop an unfinished fill so that it can never be served
+void cacheFillAbort(CacheFill *fill) {
+    fill->active = 0;
+    free(fill->packed);
+    fill->packed = NULL;
+    if (fill->file != NULL) {
+        pageStreamEnd(&fill->pages);
+        fclose(fill->file);
+        fill->file = NULL;
+        unlink(fill->tempPath);
+    }
+}
+
+/**
+ * @brief Creates every missing directory leading up to a file path.
+ *
+ * It never changes the working directory, so it is safe to call for many
+ * requests at once. Directories created concurrently by another worker are
+ * fine.
+ *
+ * @param path Path of the file, e.g. "hostname/dir/file".
+ * @return 0 on success, -1 on failure with errno set.
+ */
+int createParentDirectories(const char *path) {
+    char pathCopy[strlen(path) + 1];
+    strcpy(pathCopy, path);
+    for (char *slash = strchr(pathCopy + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(pathCopy, 0777) == -1 && errno != EEXIST) {
+            return -1;
+        }
+        *slash = '/';
+    }
+    return 0;
+}
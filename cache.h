@@ -0,0 +1,98 @@
+#ifndef CPROXY_CACHE_H
+#define CPROXY_CACHE_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "cacheindex.h"
+#include "dedup.h"
+#include "pagecache.h"
+#include "segstore.h"
+#include "url.h"
+
+// Objects up to this size are packed into segment files by default
+#define CACHE_PACK_LIMIT (16 * 1024)
+// Size at which a segment file is sealed and a new one started
+#define CACHE_SEGMENT_LIMIT ((off_t) 64 << 20)
+// Bytes of segment data cacheMaintain() compacts per call
+#define CACHE_COMPACT_BUDGET ((off_t) 4 << 20)
+// Blobs cacheMaintain() checks for references per call
+#define CACHE_SWEEP_BATCH 1024
+// Once a process has verified an object's checksum, it checks again on one open in this many
+#define CACHE_VERIFY_SAMPLE 64
+
+/**
+ * @brief The on-disk cache under a root directory.
+ *
+ * Every object has a path, host/ab/<hash>, named after a hash of the
+ * canonical cache key (see cachePathForKey()); a host that is not a plain
+ * lower-case name goes under "_" instead. Small objects are packed into the
+ * segment files in root/.segments, keyed by that path; everything else is
+ * stored as a file at it. Those files are hard links into root/.objects,
+ * where identical bodies are stored once.
+ * Fills go to memory or to a temporary file and are published only once
+ * complete, so a reader sees either no object or the whole object.
+ *
+ * Every object is stored with the CRC32C of its body. Each process checks
+ * an object the first time it opens it, and a sample of opens after that;
+ * an object that fails is removed, so the caller fetches it again.
+ */
+typedef struct Cache {
+    const char *root;           // NULL for the working directory
+    unsigned int fillCounter;   // Makes temporary names unique within the process
+    size_t packLimit;           // 0 when every object is stored as a file
+    SegmentStore segments;      // Only open when packLimit is not 0
+    int dedup;                  // Identical bodies are shared through blobs
+    DedupStore blobs;
+    int indexed;                // Metadata of file-backed objects is kept in root/.index
+    CacheIndex index;
+    unsigned int verifyCounter; // Opens of objects verified already, for sampling
+    unsigned long verified;     // Bodies checked against their CRC
+    unsigned long corrupt;      // Of those, removed because they failed
+    PageCacheStats pages;       // Of objects read and written, see pageStreamRead()
+} Cache;
+
+/**
+ * @brief A cached body: length bytes at offset in fd, which the caller closes.
+ */
+typedef struct CacheObject {
+    int fd;
+    off_t offset;
+    off_t length;
+    int packed;             // In a segment file rather than a file of its own
+} CacheObject;
+
+/**
+ * @brief An object being written into the cache.
+ */
+typedef struct CacheFill {
+    Cache *cache;
+    int active;             // Begun and neither committed nor aborted
+    FILE *file;             // Once the object is too big to pack
+    const char *path;       // Final location of the object
+    char *tempPath;         // Where the object is written until it is complete
+    char *packed;           // The body so far, while it may still be packed
+    size_t packedLength;
+    size_t packedCapacity;
+    ContentHash hash;       // Of what went to the file, when the cache shares bodies
+    off_t fileLength;
+    uint32_t crc;           // CRC32C of the body so far
+    PageStream pages;       // Keeps a large file from filling the page cache
+} CacheFill;
+
+int cacheInit(Cache *cache, const char *root, size_t packLimit);
+void cacheClose(Cache *cache);
+void cacheMaintain(Cache *cache);
+const char *cachePathFor(const Cache *cache, RequestContext *ctx);
+const char *cachePathForKey(const Cache *cache, RequestContext *ctx, const char *key, size_t keyLength);
+int cacheOpen(Cache *cache, const char *path, CacheObject *object);
+void cacheRemove(Cache *cache, const char *path);
+
+int cacheFillBegin(Cache *cache, RequestContext *ctx, const char *path, long expectedLength, CacheFill *fill);
+int cacheFillWrite(CacheFill *fill, const char *data, size_t len);
+int cacheFillCommit(CacheFill *fill);
+void cacheFillAbort(CacheFill *fill);
+
+int createParentDirectories(const char *path);
+
+#endif //CPROXY_CACHE_H
@@ -0,0 +1,830 @@
+#include "cacheindex.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "timerwheel.h"
+
+#define INDEX_SNAPSHOT_MAGIC 0x58495043u    // "CPIX"
+#define INDEX_SNAPSHOT_VERSION 3
+#define INDEX_RECORD_MAGIC 0x49460000u
+// Journals of earlier versions had shorter records, without checksums (1) or sequences (2)
+#define INDEX_RECORD_MAGIC_V1 0x49440000u
+#define INDEX_RECORD_MAGIC_V2 0x49450000u
+#define INDEX_ADD (INDEX_RECORD_MAGIC | 1)
+#define INDEX_REMOVE (INDEX_RECORD_MAGIC | 2)
+#define INDEX_TABLE_MIN 1024
+// Size at which a process seals its journal and starts a new one
+#define INDEX_JOURNAL_LIMIT ((off_t) 4 << 20)
+// A new snapshot is written after this many records, or this long after the last one
+#define INDEX_SNAPSHOT_RECORDS 100000
+#define INDEX_SNAPSHOT_MS (5 * 60 * 1000)
+// Directory entries the background rescan visits per maintenance call
+#define INDEX_RESCAN_BATCH 20000
+
+typedef struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t tableSize;
+    uint64_t entries;
+    uint64_t bytes;
+    uint32_t journalCount;
+    uint32_t pass;
+    uint64_t sequence;      // Newest record in the table
+} SnapshotHeader;
+
+// How far the snapshot covers a journal
+typedef struct SnapshotJournal {
+    char name[48];
+    uint64_t offset;
+} SnapshotJournal;
+
+// The table follows the journal list, aligned for the entries
+static size_t tableOffset(uint32_t journalCount) {
+    size_t end = sizeof(SnapshotHeader) + journalCount * sizeof(SnapshotJournal);
+    return (end + 63) & ~(size_t) 63;
+}
+
+// FNV-1a; 0 marks an empty slot and is never returned
+static uint64_t hashPath(const char *path) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (const char *c = path; *c != '\0'; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash != 0 ? hash : 1;
+}
+
+static IndexEntry *tableFind(const CacheIndex *index, uint64_t hash) {
+    size_t mask = index->tableSize - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        IndexEntry *entry = &index->table[i];
+        if (entry->hash == 0 || entry->hash == hash) {
+            return entry;
+        }
+    }
+}
+
+static void releaseTable(CacheIndex *index) {
+    if (index->mapping != NULL) {
+        munmap(index->mapping, index->mappingLength);
+        index->mapping = NULL;
+    } else {
+        free(index->table);
+    }
+    index->table = NULL;
+}
+
+static int tableResize(CacheIndex *index, size_t size) {
+    IndexEntry *table = calloc(size, sizeof(IndexEntry));
+    if (table == NULL) {
+        return -1;
+    }
+    IndexEntry *old = index->table;
+    size_t oldSize = index->tableSize;
+    size_t mask = size - 1;
+    for (size_t i = 0; i < oldSize; i++) {
+        if (old[i].hash != 0) {
+            size_t j = old[i].hash & mask;
+            while (table[j].hash != 0) {
+                j = (j + 1) & mask;
+            }
+            table[j] = old[i];
+        }
+    }
+    releaseTable(index);
+    index->table = table;
+    index->tableSize = size;
+    return 0;
+}
+
+// Backward-shift deletion keeps every probe sequence intact without tombstones
+static void tableErase(CacheIndex *index, IndexEntry *entry) {
+    IndexEntry *table = index->table;
+    size_t mask = index->tableSize - 1;
+    size_t hole = (size_t) (entry - table);
+    for (size_t i = (hole + 1) & mask; table[i].hash != 0; i = (i + 1) & mask) {
+        size_t home = table[i].hash & mask;
+        // An entry can fill the hole unless its home lies between the hole and itself
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            table[hole] = table[i];
+            hole = i;
+        }
+    }
+    memset(&table[hole], 0, sizeof(IndexEntry));
+}
+
+static void applyRecord(CacheIndex *index, const IndexRecord *record) {
+    if (record->sequence > index->newest) {
+        index->newest = record->sequence;
+    }
+    if (record->op == INDEX_ADD) {
+        if ((index->entries + 1) * 10 > index->tableSize * 7 && tableResize(index, index->tableSize * 2) == -1) {
+            return;
+        }
+        IndexEntry *entry = tableFind(index, record->hash);
+        if (entry->hash != 0 && entry->sequence > record->sequence) {
+            return;     // A later change to the object is in already
+        }
+        if (entry->hash == 0) {
+            entry->hash = record->hash;
+            index->entries++;
+        } else {
+            index->bytes -= entry->size;
+        }
+        entry->size = record->size;
+        entry->sequence = record->sequence;
+        entry->mtime = record->mtime;
+        entry->seen = index->pass;
+        entry->crc = record->crc;
+        entry->checked = record->hasCrc ? INDEX_UNCHECKED : 0;
+        index->bytes += record->size;
+    } else if (record->op == INDEX_REMOVE) {
+        IndexEntry *entry = tableFind(index, record->hash);
+        if (entry->hash == 0 || entry->sequence > record->sequence) {
+            return;
+        }
+        index->bytes -= entry->size;
+        index->entries--;
+        tableErase(index, entry);
+    }
+    index->sinceSnapshot++;
+}
+
+static int journalFind(const CacheIndex *index, const char *name) {
+    for (uint32_t i = 0; i < index->journalCount; i++) {
+        if (strcmp(index->journals[i].name, name) == 0) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+static int journalAdd(CacheIndex *index, const char *name, off_t replayed) {
+    IndexJournal *journals = realloc(index->journals, (index->journalCount + 1) * sizeof(IndexJournal));
+    if (journals == NULL) {
+        return -1;
+    }
+    index->journals = journals;
+    IndexJournal *journal = &journals[index->journalCount];
+    memset(journal, 0, sizeof(*journal));
+    journal->fd = -1;
+    snprintf(journal->name, sizeof(journal->name), "%s", name);
+    journal->replayed = replayed;
+    return (int) index->journalCount++;
+}
+
+static void journalRemove(CacheIndex *index, int slot) {
+    int last = (int) index->journalCount - 1;
+    if (index->journals[slot].fd != -1) {
+        close(index->journals[slot].fd);
+    }
+    index->journals[slot] = index->journals[last];
+    if (index->active == last) {
+        index->active = slot;
+    }
+    index->journalCount--;
+}
+
+// Records read from the journals, to be applied in sequence order
+typedef struct RecordBatch {
+    IndexRecord *records;
+    size_t count;
+    size_t capacity;
+} RecordBatch;
+
+static int batchAdd(RecordBatch *batch, const IndexRecord *records, size_t count) {
+    if (batch->count + count > batch->capacity) {
+        size_t capacity = batch->capacity > 0 ? batch->capacity : 1024;
+        while (capacity < batch->count + count) {
+            capacity *= 2;
+        }
+        IndexRecord *grown = realloc(batch->records, capacity * sizeof(IndexRecord));
+        if (grown == NULL) {
+            return -1;
+        }
+        batch->records = grown;
+        batch->capacity = capacity;
+    }
+    memcpy(batch->records + batch->count, records, count * sizeof(IndexRecord));
+    batch->count += count;
+    return 0;
+}
+
+static int compareSequence(const void *a, const void *b) {
+    uint64_t x = ((const IndexRecord *) a)->sequence;
+    uint64_t y = ((const IndexRecord *) b)->sequence;
+    return (x > y) - (x < y);
+}
+
+// Collect the records appended to a journal since it was last read
+static void journalReplay(IndexJournal *journal, RecordBatch *batch) {
+    IndexRecord records[1024];
+    for (;;) {
+        ssize_t got = pread(journal->fd, records, sizeof(records), journal->replayed);
+        size_t count = got > 0 ? (size_t) got / sizeof(IndexRecord) : 0;
+        size_t valid = 0;
+        while (valid < count && (records[valid].op & 0xffff0000u) == INDEX_RECORD_MAGIC) {
+            valid++;
+        }
+        // Left for the next refresh when there is no memory for them
+        if (batchAdd(batch, records, valid) == -1) {
+            return;
+        }
+        journal->replayed += (off_t) (valid * sizeof(IndexRecord));
+        if (valid < count) {
+            // Nothing of an earlier version applies; counting it as replayed lets the next snapshot delete it
+            uint32_t magic = records[valid].op & 0xffff0000u;
+            struct stat st;
+            if (journal->replayed == 0 && (magic == INDEX_RECORD_MAGIC_V1 || magic == INDEX_RECORD_MAGIC_V2) &&
+                fstat(journal->fd, &st) == 0) {
+                journal->replayed = st.st_size;
+            }
+            return;     // Not a record: stop here rather than apply garbage
+        }
+        if (got < (ssize_t) sizeof(records)) {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Replaces the table with the latest snapshot.
+ *
+ * The table is the snapshot file itself, mapped copy-on-write, so loading
+ * does not depend on the number of objects.
+ *
+ * @return 0 on success, -1 if there is no valid snapshot.
+ */
+static int loadSnapshot(CacheIndex *index) {
+    SnapshotHeader header;
+    struct stat st;
+    int fd = openat(index->dirFd, "snapshot", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+        header.magic != INDEX_SNAPSHOT_MAGIC || header.version != INDEX_SNAPSHOT_VERSION ||
+        header.tableSize < INDEX_TABLE_MIN || (header.tableSize & (header.tableSize - 1)) != 0 ||
+        header.entries >= header.tableSize || header.journalCount > 65536 ||
+        (uint64_t) st.st_size != tableOffset(header.journalCount) + header.tableSize * sizeof(IndexEntry)) {
+        close(fd);
+        return -1;
+    }
+    size_t listLength = header.journalCount * sizeof(SnapshotJournal);
+    SnapshotJournal *journals = malloc(listLength + 1);
+    if (journals == NULL ||
+        pread(fd, journals, listLength, sizeof(header)) != (ssize_t) listLength) {
+        free(journals);
+        close(fd);
+        return -1;
+    }
+    void *mapping = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        free(journals);
+        return -1;
+    }
+
+    releaseTable(index);
+    index->mapping = mapping;
+    index->mappingLength = (size_t) st.st_size;
+    index->table = (IndexEntry *) ((char *) mapping + tableOffset(header.journalCount));
+    index->tableSize = header.tableSize;
+    index->entries = header.entries;
+    index->bytes = header.bytes;
+    index->pass = header.pass;
+    index->newest = header.sequence;
+    index->snapshot = st.st_ino;
+    index->rescanWanted = 0;
+    // Journals the snapshot does not mention were started after it: replay them whole
+    for (uint32_t i = 0; i < index->journalCount; i++) {
+        index->journals[i].replayed = 0;
+    }
+    for (uint32_t i = 0; i < header.journalCount; i++) {
+        journals[i].name[sizeof(journals[i].name) - 1] = '\0';
+        int slot = journalFind(index, journals[i].name);
+        if (slot == -1) {
+            slot = journalAdd(index, journals[i].name, 0);
+        }
+        if (slot != -1) {
+            index->journals[slot].replayed = (off_t) journals[i].offset;
+        }
+    }
+    free(journals);
+    index->sinceSnapshot = 0;
+    return 0;
+}
+
+// Note the journals in the directory, opening new ones
+static void scanJournals(CacheIndex *index) {
+    int fd = openat(index->dirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (dir == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < index->journalCount; i++) {
+        index->journals[i].seen = 0;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "journal.", 8) != 0 || strlen(entry->d_name) >= sizeof(index->journals[0].name)) {
+            continue;
+        }
+        int slot = journalFind(index, entry->d_name);
+        if (slot == -1 && (slot = journalAdd(index, entry->d_name, 0)) == -1) {
+            continue;
+        }
+        IndexJournal *journal = &index->journals[slot];
+        journal->seen = 1;
+        if (journal->fd == -1) {
+            journal->fd = openat(index->dirFd, journal->name, O_RDONLY | O_CLOEXEC);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * @brief Brings the table up to date with the snapshot and every journal.
+ */
+void cacheIndexRefresh(CacheIndex *index) {
+    scanJournals(index);
+    // A journal is only deleted after a snapshot covering it was renamed into place, so a
+    // missing journal always comes with a new snapshot, seen here after the directory scan
+    struct stat st;
+    if (fstatat(index->dirFd, "snapshot", &st, 0) == 0 && st.st_ino != index->snapshot && loadSnapshot(index) == 0) {
+        scanJournals(index);
+    }
+    for (int i = (int) index->journalCount - 1; i >= 0; i--) {
+        if (!index->journals[i].seen && i != index->active) {
+            journalRemove(index, i);
+        }
+    }
+    // Each journal is in order; merged, the changes of all processes are too
+    RecordBatch batch = {NULL, 0, 0};
+    for (uint32_t i = 0; i < index->journalCount; i++) {
+        if (index->journals[i].fd != -1) {
+            journalReplay(&index->journals[i], &batch);
+        }
+    }
+    if (batch.count > 0) {
+        qsort(batch.records, batch.count, sizeof(IndexRecord), compareSequence);
+    }
+    for (size_t i = 0; i < batch.count; i++) {
+        applyRecord(index, &batch.records[i]);
+    }
+    free(batch.records);
+}
+
+/**
+ * @brief Maps the counter every process numbers its records from.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int openSequence(CacheIndex *index) {
+    int fd = openat(index->dirFd, "sequence", O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    struct stat st;
+    if (fd == -1) {
+        return -1;
+    }
+    // Growing the file from nothing leaves it zero; it never shrinks, so racing openers agree
+    if (fstat(fd, &st) == -1 || (st.st_size < (off_t) sizeof(uint64_t) && ftruncate(fd, sizeof(uint64_t)) == -1)) {
+        close(fd);
+        return -1;
+    }
+    void *mapping = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return -1;
+    }
+    index->counter = mapping;
+    return 0;
+}
+
+// A counter lost or older than the table would number new records below what they replace
+static void raiseSequence(CacheIndex *index) {
+    uint64_t current = __atomic_load_n(index->counter, __ATOMIC_RELAXED);
+    while (current < index->newest &&
+           !__atomic_compare_exchange_n(index->counter, &current, index->newest, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * @brief Opens the index kept in dir for the object tree under root.
+ *
+ * Without a usable snapshot the table starts empty and is rebuilt by a
+ * background rescan once this process becomes the maintainer.
+ *
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int cacheIndexOpen(CacheIndex *index, const char *dir, const char *root) {
+    memset(index, 0, sizeof(*index));
+    index->root = root;
+    index->active = -1;
+    index->lockFd = -1;
+    if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    index->dirFd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (index->dirFd == -1) {
+        return -1;
+    }
+    if (loadSnapshot(index) == -1) {
+        index->table = calloc(INDEX_TABLE_MIN, sizeof(IndexEntry));
+        if (index->table == NULL) {
+            close(index->dirFd);
+            return -1;
+        }
+        index->tableSize = INDEX_TABLE_MIN;
+        index->rescanWanted = 1;
+    }
+    index->lastSnapshot = monotonicMillis();
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    index->epoch = ((uint32_t) getpid() * 2654435761u) ^ (uint32_t) now.tv_nsec ^ (uint32_t) now.tv_sec;
+    if (index->epoch <= INDEX_UNCHECKED) {
+        index->epoch = INDEX_UNCHECKED + 1;
+    }
+    if (openSequence(index) == -1) {
+        int error = errno;
+        releaseTable(index);
+        close(index->dirFd);
+        errno = error;
+        return -1;
+    }
+    cacheIndexRefresh(index);
+    raiseSequence(index);
+    return 0;
+}
+
+static void rescanFree(IndexRescan *rescan) {
+    while (rescan->depth > 0) {
+        closedir(rescan->dirs[--rescan->depth]);
+    }
+    free(rescan);
+}
+
+void cacheIndexClose(CacheIndex *index) {
+    if (index->rescan != NULL) {
+        rescanFree(index->rescan);
+    }
+    for (uint32_t i = 0; i < index->journalCount; i++) {
+        if (index->journals[i].fd != -1) {
+            close(index->journals[i].fd);
+        }
+    }
+    free(index->journals);
+    releaseTable(index);
+    if (index->counter != NULL) {
+        munmap(index->counter, sizeof(uint64_t));
+    }
+    if (index->lockFd != -1) {
+        close(index->lockFd);
+    }
+    close(index->dirFd);
+    memset(index, 0, sizeof(*index));
+    index->dirFd = -1;
+    index->lockFd = -1;
+}
+
+static int journalCreate(CacheIndex *index) {
+    static const int attempts = 1000;
+    char name[sizeof(index->journals[0].name)];
+
+    for (int attempt = 0; attempt < attempts; attempt++) {
+        snprintf(name, sizeof(name), "journal.%d.%u", (int) getpid(), index->sequence++);
+        int fd = openat(index->dirFd, name, O_RDWR | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0666);
+        if (fd == -1) {
+            if (errno == EEXIST) {
+                continue;   // Left behind by an earlier process with the same pid
+            }
+            return -1;
+        }
+        // Held while this process appends, so the maintainer never deletes it underneath
+        flock(fd, LOCK_EX);
+        int slot = journalAdd(index, name, 0);
+        if (slot == -1) {
+            unlinkat(index->dirFd, name, 0);
+            close(fd);
+            return -1;
+        }
+        index->journals[slot].fd = fd;
+        index->journals[slot].seen = 1;
+        index->active = slot;
+        return slot;
+    }
+    return -1;
+}
+
+static int appendRecord(CacheIndex *index, IndexRecord *record) {
+    if (index->active != -1 && index->journals[index->active].replayed >= INDEX_JOURNAL_LIMIT) {
+        // Sealed: the next snapshot covers it and the maintainer deletes it
+        flock(index->journals[index->active].fd, LOCK_UN);
+        index->active = -1;
+    }
+    if (index->active == -1 && journalCreate(index) == -1) {
+        return -1;
+    }
+    IndexJournal *journal = &index->journals[index->active];
+    record->sequence = __atomic_add_fetch(index->counter, 1, __ATOMIC_RELAXED);
+    // Records are small enough for O_APPEND writes to land whole
+    ssize_t written = write(journal->fd, record, sizeof(*record));
+    if (written != (ssize_t) sizeof(*record)) {
+        if (written > 0 && ftruncate(journal->fd, journal->replayed) == -1) {
+            flock(journal->fd, LOCK_UN);
+            index->active = -1;
+        }
+        return -1;
+    }
+    journal->replayed += (off_t) sizeof(*record);
+    applyRecord(index, record);
+    return 0;
+}
+
+/**
+ * @brief Notes that an object of the given size and CRC32C was stored at path.
+ *
+ * @return 0 on success, -1 if the journal could not be written.
+ */
+int cacheIndexRecord(CacheIndex *index, const char *path, uint64_t size, uint32_t crc) {
+    IndexRecord record = {INDEX_ADD, (uint32_t) time(NULL), hashPath(path), size, crc, 1, 0};
+    return appendRecord(index, &record);
+}
+
+/**
+ * @brief Notes that the object at path is gone.
+ *
+ * @return 0 on success, -1 if the journal could not be written.
+ */
+int cacheIndexForget(CacheIndex *index, const char *path) {
+    uint64_t hash = hashPath(path);
+    if (tableFind(index, hash)->hash == 0) {
+        return 0;
+    }
+    IndexRecord record = {INDEX_REMOVE, (uint32_t) time(NULL), hash, 0, 0, 0, 0};
+    return appendRecord(index, &record);
+}
+
+/**
+ * @brief The entry of the object at path, NULL if there is none.
+ *
+ * Only checked may be changed through it, and only until the next change
+ * to the index.
+ */
+IndexEntry *cacheIndexLookup(const CacheIndex *index, const char *path) {
+    IndexEntry *entry = tableFind(index, hashPath(path));
+    return entry->hash != 0 ? entry : NULL;
+}
+
+static int writeAll(int fd, const void *data, size_t len) {
+    const char *cursor = data;
+    while (len > 0) {
+        ssize_t written = write(fd, cursor, len);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        cursor += written;
+        len -= (size_t) written;
+    }
+    return 0;
+}
+
+/**
+ * @brief Saves the table and deletes the journals it makes redundant.
+ *
+ * Meant for the maintainer only. The snapshot is written under a private
+ * name and renamed into place, so readers see the old or the new one.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int cacheIndexSnapshot(CacheIndex *index) {
+    cacheIndexRefresh(index);
+
+    uint32_t journalCount = 0;
+    for (uint32_t i = 0; i < index->journalCount; i++) {
+        journalCount += index->journals[i].fd != -1;
+    }
+    size_t offset = tableOffset(journalCount);
+    char *head = calloc(1, offset);
+    if (head == NULL) {
+        return -1;
+    }
+    SnapshotHeader *header = (SnapshotHeader *) head;
+    header->magic = INDEX_SNAPSHOT_MAGIC;
+    header->version = INDEX_SNAPSHOT_VERSION;
+    header->tableSize = index->tableSize;
+    header->entries = index->entries;
+    header->bytes = index->bytes;
+    header->journalCount = journalCount;
+    header->pass = index->pass;
+    header->sequence = index->newest;
+    SnapshotJournal *covered = (SnapshotJournal *) (head + sizeof(SnapshotHeader));
+    for (uint32_t i = 0; i < index->journalCount; i++) {
+        if (index->journals[i].fd != -1) {
+            snprintf(covered->name, sizeof(covered->name), "%s", index->journals[i].name);
+            covered->offset = (uint64_t) index->journals[i].replayed;
+            covered++;
+        }
+    }
+
+    char temp[32];
+    snprintf(temp, sizeof(temp), "snapshot.tmp.%d", (int) getpid());
+    int fd = openat(index->dirFd, temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    int written = fd != -1 && writeAll(fd, head, offset) == 0 &&
+                  writeAll(fd, index->table, index->tableSize * sizeof(IndexEntry)) == 0 && fdatasync(fd) == 0;
+    free(head);
+    if (fd != -1) {
+        close(fd);
+    }
+    struct stat st;
+    if (!written || renameat(index->dirFd, temp, index->dirFd, "snapshot") == -1 ||
+        fstatat(index->dirFd, "snapshot", &st, 0) == -1) {
+        unlinkat(index->dirFd, temp, 0);
+        return -1;
+    }
+    index->snapshot = st.st_ino;
+    index->sinceSnapshot = 0;
+    index->lastSnapshot = monotonicMillis();
+
+    // A journal nobody appends to any more (the lock is free) and that the snapshot fully covers can go
+    for (int i = (int) index->journalCount - 1; i >= 0; i--) {
+        IndexJournal *journal = &index->journals[i];
+        if (i == index->active || journal->fd == -1 || flock(journal->fd, LOCK_EX | LOCK_NB) == -1) {
+            continue;
+        }
+        if (fstat(journal->fd, &st) == 0 && st.st_size == journal->replayed) {
+            unlinkat(index->dirFd, journal->name, 0);
+            journalRemove(index, i);
+        } else {
+            flock(journal->fd, LOCK_UN);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Starts walking the object tree to rebuild the table.
+ *
+ * Objects found are recorded if the table lacks them or has another size;
+ * once the walk is complete, entries it did not find are forgotten.
+ */
+void cacheIndexStartRescan(CacheIndex *index) {
+    if (index->rescan != NULL) {
+        return;
+    }
+    IndexRescan *rescan = calloc(1, sizeof(IndexRescan));
+    if (rescan == NULL) {
+        return;
+    }
+    size_t length = 0;
+    if (index->root != NULL) {
+        length = (size_t) snprintf(rescan->path, sizeof(rescan->path), "%s/", index->root);
+    }
+    rescan->dirs[0] = opendir(length > 0 ? rescan->path : ".");
+    if (rescan->dirs[0] == NULL || length >= sizeof(rescan->path)) {
+        if (rescan->dirs[0] != NULL) {
+            closedir(rescan->dirs[0]);
+        }
+        free(rescan);
+        return;
+    }
+    rescan->prefix[0] = length;
+    rescan->depth = 1;
+    index->pass++;
+    index->rescan = rescan;
+    index->rescanWanted = 0;
+}
+
+// Forget every entry the finished pass neither found nor saw recorded
+static void rescanSweep(CacheIndex *index) {
+    size_t count = 0;
+    uint64_t *gone = NULL;
+    for (size_t i = 0; i < index->tableSize; i++) {
+        if (index->table[i].hash != 0 && index->table[i].seen != index->pass) {
+            if ((count & (count - 1)) == 0) {
+                uint64_t *grown = realloc(gone, (count == 0 ? 1 : count * 2) * sizeof(uint64_t));
+                if (grown == NULL) {
+                    break;
+                }
+                gone = grown;
+            }
+            gone[count++] = index->table[i].hash;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        IndexRecord record = {INDEX_REMOVE, (uint32_t) time(NULL), gone[i], 0, 0, 0, 0};
+        appendRecord(index, &record);
+    }
+    free(gone);
+}
+
+/**
+ * @brief Visits up to maxEntries directory entries of a running rescan.
+ *
+ * @return 1 while the rescan goes on, 0 once it has finished or if none is running.
+ */
+int cacheIndexRescanStep(CacheIndex *index, unsigned int maxEntries) {
+    IndexRescan *rescan = index->rescan;
+    if (rescan == NULL) {
+        return 0;
+    }
+    for (unsigned int n = 0; n < maxEntries && rescan->depth > 0; n++) {
+        DIR *dir = rescan->dirs[rescan->depth - 1];
+        size_t prefix = rescan->prefix[rescan->depth - 1];
+        struct dirent *entry = readdir(dir);
+        if (entry == NULL) {
+            closedir(dir);
+            rescan->depth--;
+            continue;
+        }
+        const char *name = entry->d_name;
+        size_t nameLength = strlen(name);
+        // Skip the stores kept next to the hosts, and fills still in progress
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || (rescan->depth == 1 && name[0] == '.') ||
+            strstr(name, ".tmp.") != NULL || prefix + nameLength + 2 > sizeof(rescan->path)) {
+            continue;
+        }
+        memcpy(rescan->path + prefix, name, nameLength + 1);
+        struct stat st;
+        if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode) && rescan->depth < INDEX_MAX_DEPTH) {
+            int fd = openat(dirfd(dir), name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            DIR *child = fd == -1 ? NULL : fdopendir(fd);
+            if (child == NULL) {
+                if (fd != -1) {
+                    close(fd);
+                }
+                continue;
+            }
+            rescan->path[prefix + nameLength] = '/';
+            rescan->dirs[rescan->depth] = child;
+            rescan->prefix[rescan->depth] = prefix + nameLength + 1;
+            rescan->depth++;
+        } else if (S_ISREG(st.st_mode)) {
+            uint64_t hash = hashPath(rescan->path);
+            IndexEntry *found = tableFind(index, hash);
+            if (found->hash == 0 || found->size != (uint64_t) st.st_size) {
+                IndexRecord record = {INDEX_ADD, (uint32_t) st.st_mtime, hash, (uint64_t) st.st_size, 0, 0, 0};
+                appendRecord(index, &record);
+            } else {
+                found->seen = index->pass;
+            }
+        }
+    }
+    if (rescan->depth > 0) {
+        return 1;
+    }
+    rescanSweep(index);
+    free(rescan);
+    index->rescan = NULL;
+    return 0;
+}
+
+/**
+ * @brief Periodic upkeep: catches up with other processes and, as the maintainer,
+ * advances a rescan or writes a snapshot when one is due.
+ */
+void cacheIndexMaintain(CacheIndex *index) {
+    cacheIndexRefresh(index);
+    if (index->lockFd == -1) {
+        int fd = openat(index->dirFd, "lock", O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (fd == -1) {
+            return;
+        }
+        if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+            close(fd);
+            return;
+        }
+        index->lockFd = fd;
+    }
+    if (index->rescanWanted) {
+        cacheIndexStartRescan(index);
+    }
+    if (index->rescan != NULL) {
+        if (cacheIndexRescanStep(index, INDEX_RESCAN_BATCH) == 0) {
+            cacheIndexSnapshot(index);
+        }
+        return;
+    }
+    if (index->sinceSnapshot >= INDEX_SNAPSHOT_RECORDS ||
+        (index->sinceSnapshot > 0 && monotonicMillis() - index->lastSnapshot >= INDEX_SNAPSHOT_MS)) {
+        cacheIndexSnapshot(index);
+    }
+}
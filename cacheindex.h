@@ -0,0 +1,109 @@
+#ifndef CPROXY_CACHEINDEX_H
+#define CPROXY_CACHEINDEX_H
+
+#include <dirent.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Depth of the directory tree the rescan follows; hosts plus path segments
+#define INDEX_MAX_DEPTH 32
+// IndexEntry.checked of an object whose checksum no process has verified yet
+#define INDEX_UNCHECKED 1
+
+typedef struct IndexEntry {
+    uint64_t hash;          // Of the object's path; 0 for an empty slot
+    uint64_t size;
+    uint64_t sequence;      // Of the record the entry comes from
+    uint32_t mtime;         // Seconds, when the object was stored
+    uint32_t seen;          // Last rescan pass that found or recorded the object
+    uint32_t crc;           // CRC32C of the body
+    uint32_t checked;       // 0 without a checksum, else the epoch of the process that last verified it
+} IndexEntry;
+
+// Journal record: an object stored or found missing
+typedef struct IndexRecord {
+    uint32_t op;
+    uint32_t mtime;
+    uint64_t hash;
+    uint64_t size;
+    uint32_t crc;
+    uint32_t hasCrc;        // Objects found by a rescan have none
+    uint64_t sequence;      // Order of the change among those of every process
+} IndexRecord;
+
+typedef struct IndexJournal {
+    int fd;                 // -1 until the file has been opened
+    char name[48];
+    off_t replayed;         // Records before this offset are in the table
+    int seen;               // Found by the latest directory scan
+} IndexJournal;
+
+/**
+ * @brief Walks the object tree a bounded number of entries at a time.
+ */
+typedef struct IndexRescan {
+    DIR *dirs[INDEX_MAX_DEPTH];
+    size_t prefix[INDEX_MAX_DEPTH];     // Length of path for each open directory
+    int depth;
+    char path[PATH_MAX];
+} IndexRescan;
+
+/**
+ * @brief Metadata of every file-backed object, for accounting and eviction.
+ *
+ * The table is an open addressing hash table that is saved verbatim as a
+ * snapshot and mapped back in with mmap() at startup, so loading it costs
+ * no parsing. Changes since the snapshot are in journals of fixed-size
+ * records, one per process, held with an exclusive flock() like the
+ * active segment of a SegmentStore; startup replays only their tails.
+ * Every record takes a number from a counter the processes share, and
+ * journals are replayed merged in that order; a record older than the
+ * entry it would change is skipped, so a stale size or checksum never
+ * replaces a newer one.
+ *
+ * One process at a time, the holder of the lock file, is the maintainer:
+ * it writes new snapshots, deletes the journals they cover and, when there
+ * was no usable snapshot, rebuilds the table by walking the object tree
+ * in the background.
+ */
+typedef struct CacheIndex {
+    int dirFd;
+    const char *root;           // Object tree, NULL for the working directory
+    IndexEntry *table;
+    size_t tableSize;           // Power of two
+    size_t entries;
+    uint64_t bytes;             // Sum of the sizes of all entries
+    void *mapping;              // Snapshot the table lives in (copy on write), NULL once reallocated
+    size_t mappingLength;
+    ino_t snapshot;             // Inode of the snapshot loaded, 0 for none
+    IndexJournal *journals;
+    uint32_t journalCount;
+    int active;                 // Journal slot this process appends to, -1 when none
+    unsigned int sequence;      // Makes journal names unique within the process
+    int lockFd;                 // Open while this process is the maintainer
+    uint32_t pass;              // Current rescan pass
+    IndexRescan *rescan;        // Non-NULL while a rescan is running
+    int rescanWanted;           // No usable snapshot: rebuild once maintainer
+    unsigned long sinceSnapshot;    // Records applied since the last snapshot
+    uint64_t lastSnapshot;      // Milliseconds
+    uint32_t epoch;             // Marks the entries this process has verified; unique per open
+    uint64_t *counter;          // Shared record sequence, mapped from the "sequence" file
+    uint64_t newest;            // Highest sequence applied to the table
+} CacheIndex;
+
+int cacheIndexOpen(CacheIndex *index, const char *dir, const char *root);
+void cacheIndexClose(CacheIndex *index);
+
+int cacheIndexRecord(CacheIndex *index, const char *path, uint64_t size, uint32_t crc);
+int cacheIndexForget(CacheIndex *index, const char *path);
+IndexEntry *cacheIndexLookup(const CacheIndex *index, const char *path);
+
+void cacheIndexRefresh(CacheIndex *index);
+void cacheIndexMaintain(CacheIndex *index);
+int cacheIndexSnapshot(CacheIndex *index);
+void cacheIndexStartRescan(CacheIndex *index);
+int cacheIndexRescanStep(CacheIndex *index, unsigned int maxEntries);
+
+#endif //CPROXY_CACHEINDEX_H
@@ -0,0 +1,248 @@
+#include "cachekey.h"
+
+#include <string.h>
+#include <strings.h>
+
+#include "cproxy.h"
+
+static const char *const trackingParams[] = {
+        "utm_*", "fbclid", "gclid", "dclid", "gbraid", "wbraid", "msclkid", "yclid",
+        "mc_cid", "mc_eid", "_ga", "_gl", "igshid",
+};
+
+const CacheKeyRules defaultKeyRules = {trackingParams, sizeof(trackingParams) / sizeof(trackingParams[0]), 0, 0};
+
+// Characters besides the unreserved ones that stand for themselves (RFC 3986 pchar, query)
+static const char pathAllowed[] = "!$&'()*+,;=:@";
+static const char queryAllowed[] = "!$'()*+,;=:@/?";
+
+static const char hexDigits[] = "0123456789ABCDEF";
+
+typedef struct QueryParam {
+    size_t offset;          // In the scratch copy
+    size_t length;          // Name, then "=" and the value if there is one
+    size_t nameLength;
+} QueryParam;
+
+static int isUnreserved(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '.' ||
+           c == '_' || c == '~';
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/**
+ * @brief Copies a URL component in one canonical spelling.
+ *
+ * Escaped unreserved characters are decoded, the remaining escapes get
+ * upper case digits and anything that is neither unreserved nor allowed,
+ * including a stray "%", is escaped. Writes at most 3 * len bytes.
+ *
+ * @return The number of bytes written.
+ */
+static size_t normalizeComponent(char *out, const char *in, size_t len, const char *allowed) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char) in[i];
+        if (c == '%' && i + 2 < len && hexValue(in[i + 1]) >= 0 && hexValue(in[i + 2]) >= 0) {
+            c = (unsigned char) (hexValue(in[i + 1]) * 16 + hexValue(in[i + 2]));
+            i += 2;
+            if (isUnreserved(c)) {
+                out[n++] = (char) c;
+                continue;
+            }
+        } else if (isUnreserved(c) || (c > 0x20 && c < 0x7f && c != '%' && strchr(allowed, c) != NULL)) {
+            out[n++] = (char) c;
+            continue;
+        }
+        out[n++] = '%';
+        out[n++] = hexDigits[c >> 4];
+        out[n++] = hexDigits[c & 15];
+    }
+    return n;
+}
+
+static int isStripped(const char *name, size_t length, const CacheKeyRules *rules) {
+    for (size_t i = 0; i < rules->stripCount; i++) {
+        const char *pattern = rules->stripParams[i];
+        size_t patternLength = strlen(pattern);
+        if (patternLength > 0 && pattern[patternLength - 1] == '*') {
+            if (length >= patternLength - 1 && strncasecmp(name, pattern, patternLength - 1) == 0) {
+                return 1;
+            }
+        } else if (length == patternLength && strncasecmp(name, pattern, length) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int compareNames(const char *scratch, const QueryParam *a, const QueryParam *b) {
+    size_t common = a->nameLength < b->nameLength ? a->nameLength : b->nameLength;
+    int order = memcmp(scratch + a->offset, scratch + b->offset, common);
+    if (order != 0) {
+        return order;
+    }
+    return a->nameLength < b->nameLength ? -1 : a->nameLength > b->nameLength;
+}
+
+// Appends the canonical query to key, returning the bytes written
+static size_t appendQuery(RequestContext *ctx, char *key, const char *query, size_t queryLength,
+                          const CacheKeyRules *rules, int *error) {
+    size_t count = 1;
+    for (size_t i = 0; i < queryLength; i++) {
+        count += query[i] == '&';
+    }
+    QueryParam params[count];
+    char *scratch = arenaAlloc(&ctx->arena, 3 * queryLength + 1);
+    if (scratch == NULL) {
+        *error = CPROXY_ERR_NOMEM;
+        return 0;
+    }
+
+    size_t used = 0;
+    size_t kept = 0;
+    for (const char *raw = query, *end = query + queryLength; raw < end;) {
+        const char *ampersand = memchr(raw, '&', (size_t) (end - raw));
+        const char *rawEnd = ampersand != NULL ? ampersand : end;
+        const char *equals = memchr(raw, '=', (size_t) (rawEnd - raw));
+        if (rawEnd > raw) {
+            QueryParam *param = &params[kept];
+            param->offset = used;
+            param->nameLength = normalizeComponent(scratch + used, raw, (size_t) ((equals != NULL ? equals : rawEnd) - raw),
+                                                   queryAllowed);
+            param->length = param->nameLength;
+            if (equals != NULL) {
+                scratch[used + param->length++] = '=';
+                param->length += normalizeComponent(scratch + used + param->length, equals + 1,
+                                                    (size_t) (rawEnd - equals - 1), queryAllowed);
+            }
+            if (!isStripped(scratch + used, param->nameLength, rules)) {
+                used += param->length;
+                kept++;
+            }
+        }
+        raw = rawEnd + 1;
+    }
+
+    // Stable, so repeated parameters keep their relative order
+    for (size_t i = 1; i < kept && !rules->keepOrder; i++) {
+        QueryParam param = params[i];
+        size_t j = i;
+        for (; j > 0 && compareNames(scratch, &params[j - 1], &param) > 0; j--) {
+            params[j] = params[j - 1];
+        }
+        params[j] = param;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < kept; i++) {
+        key[n++] = i == 0 ? '?' : '&';
+        memcpy(key + n, scratch + params[i].offset, params[i].length);
+        n += params[i].length;
+    }
+    return n;
+}
+
+/**
+ * @brief Builds the cache key of a split URL into ctx->cacheKey.
+ *
+ * Spellings of one resource get one key: the hostname is lower case
+ * without a trailing dot, the default port is left out, empty, "." and
+ * ".." path segments are resolved, percent-encoding is normalized and the
+ * fragment is dropped. Query parameters are filtered and ordered by the
+ * rules. A URL without a path has the key of "/".
+ *
+ * The key is the hostname, ":port" when it is not 80, the path and the
+ * query, e.g. "example.com:8080/a/b?x=1&y=2". It is not meant to be a
+ * file name; see cachePathFor().
+ *
+ * @return 0 on success, CPROXY_ERR_NOMEM if the arena could not grow.
+ */
+int canonicalizeURL(RequestContext *ctx, const CacheKeyRules *rules) {
+    const char *path = ctx->filepath;
+    size_t pathLength = strcspn(path, "?#");
+    const char *query = path[pathLength] == '?' ? path + pathLength + 1 : NULL;
+    size_t queryLength = query != NULL ? strcspn(query, "#") : 0;
+    size_t hostLength = strlen(ctx->hostname);
+    const char *port = ctx->port;
+    while (port[0] == '0' && port[1] != '\0') {
+        port++;
+    }
+    size_t portLength = strcmp(port, "80") == 0 ? 0 : strlen(port);
+
+    char *key = arenaAlloc(&ctx->arena, hostLength + portLength + 1 + 3 * pathLength + 2 + 3 * queryLength + 2);
+    if (key == NULL) {
+        return CPROXY_ERR_NOMEM;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < hostLength; i++) {
+        char c = ctx->hostname[i];
+        key[n++] = c >= 'A' && c <= 'Z' ? (char) (c - 'A' + 'a') : c;
+    }
+    if (n > 0 && key[n - 1] == '.') {
+        n--;
+    }
+    if (portLength > 0) {
+        key[n++] = ':';
+        memcpy(key + n, port, portLength);
+        n += portLength;
+    }
+
+    // One segment at a time; starts[] remembers where each kept one begins, for ".."
+    size_t separators = 1;
+    for (size_t i = 0; i < pathLength; i++) {
+        separators += path[i] == '/';
+    }
+    size_t starts[separators];
+    size_t depth = 0;
+    int trailingSlash = 0;
+    const char *end = path + pathLength;
+    for (const char *cursor = path;;) {
+        const char *slash = memchr(cursor, '/', (size_t) (end - cursor));
+        const char *segmentEnd = slash != NULL ? slash : end;
+        size_t start = n;
+        key[n++] = '/';
+        n += normalizeComponent(key + n, cursor, (size_t) (segmentEnd - cursor), pathAllowed);
+        size_t length = n - start - 1;
+        if (length == 0 || (length == 1 && key[start + 1] == '.')) {
+            n = start;
+            trailingSlash = slash == NULL;
+        } else if (length == 2 && key[start + 1] == '.' && key[start + 2] == '.') {
+            n = depth > 0 ? starts[--depth] : start;
+            trailingSlash = slash == NULL;
+        } else {
+            starts[depth++] = start;
+            trailingSlash = 0;
+        }
+        if (slash == NULL) {
+            break;
+        }
+        cursor = slash + 1;
+    }
+    if (trailingSlash || depth == 0) {
+        key[n++] = '/';
+    }
+
+    if (query != NULL && !rules->dropQuery) {
+        int error = 0;
+        n += appendQuery(ctx, key + n, query, queryLength, rules, &error);
+        if (error != 0) {
+            return error;
+        }
+    }
+    key[n] = '\0';
+    ctx->cacheKey = key;
+    return 0;
+}
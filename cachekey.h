@@ -0,0 +1,23 @@
+#ifndef CPROXY_CACHEKEY_H
+#define CPROXY_CACHEKEY_H
+
+#include <stddef.h>
+
+#include "url.h"
+
+/**
+ * @brief How the query string enters the cache key.
+ */
+typedef struct CacheKeyRules {
+    const char *const *stripParams; // Left out of the key; a trailing '*' matches a prefix
+    size_t stripCount;
+    int keepOrder;                  // Keep parameters in request order rather than sorting them by name
+    int dropQuery;                  // Leave the whole query out of the key
+} CacheKeyRules;
+
+// Strips the usual tracking parameters (utm_*, fbclid, gclid, ...) and sorts the rest
+extern const CacheKeyRules defaultKeyRules;
+
+int canonicalizeURL(RequestContext *ctx, const CacheKeyRules *rules);
+
+#endif //CPROXY_CACHEKEY_H
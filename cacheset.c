@@ -0,0 +1,253 @@
+#include "cacheset.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cachekey.h"
+#include "cproxy.h"
+#include "timerwheel.h"
+
+// FNV-1a, then a 64-bit finalizer: FNV alone clusters similar keys on the ring
+static uint64_t ringHash(const char *key, size_t length) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static int comparePoints(const void *a, const void *b) {
+    const RingPoint *left = a;
+    const RingPoint *right = b;
+    return left->hash < right->hash ? -1 : left->hash > right->hash;
+}
+
+/**
+ * @brief Checks that a root can be written: creates it if needed and
+ * writes, syncs and removes a small file in it.
+ */
+static int probeRoot(const char *root) {
+    const char *dir = root != NULL ? root : ".";
+    char path[strlen(dir) + 32];
+    snprintf(path, sizeof(path), "%s/", dir);
+    if (createParentDirectories(path) != 0) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/.probe.%ld", dir, (long) getpid());
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    int ok = write(fd, "", 1) == 1 && fdatasync(fd) == 0;
+    close(fd);
+    unlink(path);
+    return ok ? 0 : -1;
+}
+
+// Opens the shard's cache if its disk answers; a shard that does not starts out of the ring
+static int shardStart(CacheShard *shard, size_t packLimit) {
+    shard->lastProbe = monotonicMillis();
+    if (probeRoot(shard->root) != 0) {
+        shard->up = 0;
+        return CPROXY_ERR_CACHE;
+    }
+    shard->up = 1;
+    shard->errors = 0;
+    return cacheInit(&shard->cache, shard->root, packLimit);
+}
+
+static void shardResult(CacheShard *shard, int error) {
+    if (error != CPROXY_ERR_CACHE) {
+        shard->errors = 0;
+        return;
+    }
+    shard->failures++;
+    if (++shard->errors >= CACHE_SHARD_ERRORS && shard->up) {
+        // Fills still in flight finish against the old state; the probe reopens it
+        shard->up = 0;
+        shard->lastProbe = monotonicMillis();
+    }
+}
+
+/**
+ * @brief Sets up one cache per root, NULL standing for the working directory.
+ *
+ * With no roots the set has a single cache in the working directory. Like
+ * cacheInit(), this must run in each worker process. A root that cannot be
+ * written starts out of the ring and is probed again from cacheSetMaintain().
+ *
+ * @return 0 on success, CPROXY_ERR_NOMEM, or CPROXY_ERR_CACHE if a root is
+ * down or one of its stores could not be opened; the set is usable then.
+ */
+int cacheSetInit(CacheSet *set, const char *const *roots, unsigned int count, size_t packLimit) {
+    static const char *const workingDirectory[] = {NULL};
+    if (count == 0) {
+        roots = workingDirectory;
+        count = 1;
+    }
+    if (count > CACHE_MAX_SHARDS) {
+        count = CACHE_MAX_SHARDS;
+    }
+    memset(set, 0, sizeof(*set));
+    set->packLimit = packLimit;
+    set->ring = malloc(sizeof(RingPoint) * CACHE_RING_POINTS * count);
+    if (set->ring == NULL) {
+        return CPROXY_ERR_NOMEM;
+    }
+
+    int error = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        CacheShard *shard = &set->shards[i];
+        if (roots[i] != NULL && (shard->root = strdup(roots[i])) == NULL) {
+            cacheSetClose(set);
+            return CPROXY_ERR_NOMEM;
+        }
+        set->count++;
+        shard->cache.root = shard->root;
+        int result = shardStart(shard, packLimit);
+        if (result != 0) {
+            error = result;
+        }
+
+        // Points depend only on the root's name, so adding or removing
+        // another root leaves this one's points where they were
+        const char *name = shard->root != NULL ? shard->root : ".";
+        char point[strlen(name) + 16];
+        for (unsigned int p = 0; p < CACHE_RING_POINTS; p++) {
+            int length = snprintf(point, sizeof(point), "%s#%u", name, p);
+            set->ring[set->ringSize].hash = ringHash(point, (size_t) length);
+            set->ring[set->ringSize].shard = i;
+            set->ringSize++;
+        }
+    }
+    qsort(set->ring, set->ringSize, sizeof(RingPoint), comparePoints);
+    return error;
+}
+
+void cacheSetClose(CacheSet *set) {
+    for (unsigned int i = 0; i < set->count; i++) {
+        cacheClose(&set->shards[i].cache);
+        free(set->shards[i].root);
+        set->shards[i].root = NULL;
+    }
+    set->count = 0;
+    free(set->ring);
+    set->ring = NULL;
+    set->ringSize = 0;
+}
+
+/**
+ * @brief Background upkeep of every cache that is up, and a probe of those that are down.
+ *
+ * A disk that answers again rejoins the ring once its last fills have
+ * finished, with its stores reopened.
+ */
+void cacheSetMaintain(CacheSet *set) {
+    uint64_t now = monotonicMillis();
+    for (unsigned int i = 0; i < set->count; i++) {
+        CacheShard *shard = &set->shards[i];
+        if (shard->up) {
+            cacheMaintain(&shard->cache);
+        } else if (shard->inFlight == 0 && now - shard->lastProbe >= CACHE_PROBE_MS) {
+            cacheClose(&shard->cache);
+            shardStart(shard, set->packLimit);
+        }
+    }
+}
+
+/**
+ * @brief The cache a request's object belongs in.
+ *
+ * The object's key is the request's cache key. Shards that are down
+ * are skipped, which moves only their own objects.
+ *
+ * @return The shard, or NULL if every disk is down or the arena could not grow.
+ */
+CacheShard *cacheSetPick(CacheSet *set, RequestContext *ctx) {
+    if (ctx->cacheKey == NULL && canonicalizeURL(ctx, &defaultKeyRules) != 0) {
+        return NULL;
+    }
+    uint64_t hash = ringHash(ctx->cacheKey, strlen(ctx->cacheKey));
+    size_t low = 0;
+    size_t high = set->ringSize;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (set->ring[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    for (size_t n = 0; n < set->ringSize; n++) {
+        CacheShard *shard = &set->shards[set->ring[(low + n) % set->ringSize].shard];
+        if (shard->up) {
+            return shard;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief cacheFillBegin() on the shard, if its queue has room.
+ *
+ * @return 0 on success, CPROXY_ERR_CACHE if the disk is busy or down or
+ * the fill could not start; fill is not active then.
+ */
+int cacheShardFillBegin(CacheShard *shard, RequestContext *ctx, const char *path, long expectedLength,
+                        CacheFill *fill) {
+    if (!shard->up || shard->inFlight >= CACHE_QUEUE_DEPTH) {
+        fill->active = 0;
+        shard->shed++;
+        return CPROXY_ERR_CACHE;
+    }
+    int error = cacheFillBegin(&shard->cache, ctx, path, expectedLength, fill);
+    if (error != 0) {
+        cacheFillAbort(fill);
+        shardResult(shard, error);
+        return error;
+    }
+    shard->inFlight++;
+    return 0;
+}
+
+/**
+ * @brief cacheFillCommit(), counting the outcome towards the disk's health.
+ */
+int cacheShardFillCommit(CacheFill *fill) {
+    CacheShard *shard = (CacheShard *) fill->cache;
+    int error = cacheFillCommit(fill);
+    shard->inFlight--;
+    shardResult(shard, error);
+    if (error == 0) {
+        shard->fills++;
+    }
+    return error;
+}
+
+/**
+ * @brief cacheFillAbort() for a fill begun with cacheShardFillBegin().
+ *
+ * error is CPROXY_ERR_CACHE when writing to the disk failed, which counts
+ * against its health; any other reason for giving up does not. Safe to
+ * call on a fill that is not active.
+ */
+void cacheShardFillAbort(CacheFill *fill, int error) {
+    if (!fill->active) {
+        return;
+    }
+    CacheShard *shard = (CacheShard *) fill->cache;
+    cacheFillAbort(fill);
+    shard->inFlight--;
+    if (error == CPROXY_ERR_CACHE) {
+        shardResult(shard, error);
+    }
+}
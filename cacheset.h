@@ -0,0 +1,68 @@
+#ifndef CPROXY_CACHESET_H
+#define CPROXY_CACHESET_H
+
+#include <stdint.h>
+
+#include "cache.h"
+
+#define CACHE_MAX_SHARDS 64
+// Ring points per cache root; more points spread keys more evenly
+#define CACHE_RING_POINTS 160
+// Fills that may be writing to one disk at once
+#define CACHE_QUEUE_DEPTH 64
+// Consecutive failed writes after which a disk is taken out of the ring
+#define CACHE_SHARD_ERRORS 5
+// How often a disk that is out is probed to see whether it is back
+#define CACHE_PROBE_MS 10000
+
+/**
+ * @brief One cache root, usually a disk of its own.
+ */
+typedef struct CacheShard {
+    Cache cache;                // First, so a fill's cache leads back to its shard
+    char *root;                 // NULL for the working directory
+    int up;                     // In the ring; objects of a shard that is down go to the next one
+    unsigned int errors;        // Consecutive failed writes
+    unsigned int inFlight;      // Fills writing to this disk right now
+    uint64_t lastProbe;         // Milliseconds
+    unsigned long fills;        // Objects stored
+    unsigned long shed;         // Fills skipped because the disk's queue was full
+    unsigned long failures;     // Failed writes
+} CacheShard;
+
+typedef struct RingPoint {
+    uint64_t hash;
+    uint32_t shard;
+} RingPoint;
+
+/**
+ * @brief Objects spread over several cache roots by consistent hashing.
+ *
+ * Each root owns CACHE_RING_POINTS points on a hash ring and an object
+ * belongs to the first point at or after the hash of its key. When a disk
+ * fails its points are skipped, so only its own objects move to other
+ * disks; when it comes back they move back.
+ *
+ * Disk writes happen inline on the event loop, so a disk's queue is a
+ * bound on its concurrent fills: beyond it, responses stream through
+ * without being stored instead of piling more work on a slow disk.
+ */
+typedef struct CacheSet {
+    CacheShard shards[CACHE_MAX_SHARDS];
+    unsigned int count;
+    size_t packLimit;
+    RingPoint *ring;            // Sorted by hash
+    size_t ringSize;
+} CacheSet;
+
+int cacheSetInit(CacheSet *set, const char *const *roots, unsigned int count, size_t packLimit);
+void cacheSetClose(CacheSet *set);
+void cacheSetMaintain(CacheSet *set);
+CacheShard *cacheSetPick(CacheSet *set, RequestContext *ctx);
+
+int cacheShardFillBegin(CacheShard *shard, RequestContext *ctx, const char *path, long expectedLength,
+                        CacheFill *fill);
+int cacheShardFillCommit(CacheFill *fill);
+void cacheShardFillAbort(CacheFill *fill, int error);
+
+#endif //CPROXY_CACHESET_H
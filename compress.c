@@ -0,0 +1,191 @@
+#include "compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cproxy.h"
+#include "httpheader.h"
+#include "vary.h"
+
+// Bytes read from the object and written to the variant at a time
+#define COMPRESS_CHUNK 16384
+
+void compressQueueInit(CompressQueue *queue) {
+    memset(queue, 0, sizeof(*queue));
+}
+
+static void jobFree(CompressJob *job) {
+    free(job->key);
+    free(job->contentType);
+    job->key = job->contentType = NULL;
+}
+
+// Publish the variant and retire the uncompressed object, or drop the variant
+static void compressFinish(CompressQueue *queue, int error) {
+    Cache *cache = &queue->job.shard->cache;
+    // A variant that saves less than an eighth is not worth a second lookup on every hit
+    int worthwhile = error == 0 && queue->produced < queue->source.length - queue->source.length / 8;
+    if (worthwhile) {
+        error = cacheShardFillCommit(&queue->fill);
+    } else {
+        cacheShardFillAbort(&queue->fill, error);
+    }
+    if (worthwhile && error == 0 && cacheRecordVary(cache, &queue->ctx, queue->primaryPath, "accept-encoding") == 0) {
+        // Removed even when the record was there already, from an earlier compression of the URL
+        cacheRemove(cache, queue->primaryPath);
+        queue->compressed++;
+        queue->bytesIn += (unsigned long long) queue->source.length;
+        queue->bytesOut += (unsigned long long) queue->produced;
+    } else {
+        queue->kept++;
+    }
+    gzipStreamEnd(&queue->stream);
+    close(queue->source.fd);
+    requestContextFree(&queue->ctx);
+    jobFree(&queue->job);
+    queue->running = 0;
+}
+
+// Take the next job: open the stored object and begin its variant
+static void compressStart(CompressQueue *queue) {
+    queue->job = queue->jobs[queue->head];
+    queue->head = (queue->head + 1) % COMPRESS_QUEUE_SIZE;
+    queue->count--;
+
+    CacheShard *shard = queue->job.shard;
+    RequestContext *ctx = &queue->ctx;
+    requestContextInit(ctx, queue->storage, sizeof(queue->storage));
+    ctx->cacheKey = queue->job.key;
+    queue->primaryPath = cachePathFor(&shard->cache, ctx);
+    const char *variantPath = cacheVariantPathFor(&shard->cache, ctx, "accept-encoding", HTTP_ACCEPT_GZIP);
+    if (!shard->up || queue->primaryPath == NULL || variantPath == NULL ||
+        cacheOpen(&shard->cache, queue->primaryPath, &queue->source) == -1) {
+        requestContextFree(ctx);
+        jobFree(&queue->job);
+        queue->kept++;
+        return;
+    }
+
+    // The variant carries its representation headers like any other
+    const char *type = queue->job.contentType;
+    char block[(type != NULL ? strlen(type) : 0) + 96];
+    int blockLength = snprintf(block, sizeof(block), "%s%s%sContent-Encoding: gzip\r\nVary: Accept-Encoding\r\n",
+                               type != NULL ? "Content-Type: " : "", type != NULL ? type : "",
+                               type != NULL ? "\r\n" : "");
+    char prefix[VARY_HEADERS_MAX];
+    size_t prefixLength = varyRepresentationHeaders(prefix, sizeof(prefix), block, (size_t) blockLength);
+    queue->consumed = 0;
+    queue->produced = (off_t) prefixLength;
+    queue->running = 1;
+    int error = gzipStreamBegin(&queue->stream, 1) == 0 ? 0 : CPROXY_ERR_NOMEM;
+    if (error == 0) {
+        error = cacheShardFillBegin(shard, ctx, variantPath, -1, &queue->fill);
+    }
+    if (error == 0) {
+        error = cacheFillWrite(&queue->fill, prefix, prefixLength);
+    }
+    if (error != 0) {
+        compressFinish(queue, error);
+    }
+}
+
+/**
+ * @brief Releases the queue, dropping the job under way and those waiting.
+ */
+void compressQueueClose(CompressQueue *queue) {
+    if (queue->running) {
+        compressFinish(queue, CPROXY_ERR_IO);
+    }
+    for (; queue->count > 0; queue->count--) {
+        jobFree(&queue->jobs[queue->head]);
+        queue->head = (queue->head + 1) % COMPRESS_QUEUE_SIZE;
+    }
+}
+
+/**
+ * @brief Queues a freshly stored object to be compressed if it is text of
+ * a worthwhile size.
+ *
+ * The object must have been stored under the request's own key, not as a
+ * variant. length is the body's, -1 if unknown.
+ *
+ * @return 1 if the object was queued, 0 otherwise.
+ */
+int compressQueueAdd(CompressQueue *queue, CacheShard *shard, const RequestContext *ctx, const char *contentType,
+                     size_t typeLength, long length) {
+    if (contentType == NULL || !gzipCompressible(contentType, typeLength) ||
+        (length >= 0 && (length < COMPRESS_MIN_LENGTH || length > COMPRESS_MAX_LENGTH))) {
+        return 0;
+    }
+    if (queue->count == COMPRESS_QUEUE_SIZE) {
+        queue->dropped++;
+        return 0;
+    }
+    CompressJob *job = &queue->jobs[(queue->head + queue->count) % COMPRESS_QUEUE_SIZE];
+    job->shard = shard;
+    job->key = strdup(ctx->cacheKey);
+    job->contentType = strndup(contentType, typeLength);
+    if (job->key == NULL || job->contentType == NULL) {
+        jobFree(job);
+        return 0;
+    }
+    queue->count++;
+    return 1;
+}
+
+/**
+ * @brief Compresses up to budget bytes of waiting objects.
+ *
+ * @return 1 while there is work left, 0 once the queue is empty.
+ */
+int compressQueueStep(CompressQueue *queue, size_t budget) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    size_t spent = 0;
+    while (spent < budget && (queue->running || queue->count > 0)) {
+        if (!queue->running) {
+            compressStart(queue);
+            continue;
+        }
+        if (queue->source.length > COMPRESS_MAX_LENGTH) {
+            compressFinish(queue, CPROXY_ERR_IO);
+            continue;
+        }
+        char in[COMPRESS_CHUNK];
+        char out[COMPRESS_CHUNK];
+        off_t left = queue->source.length - queue->consumed;
+        size_t wanted = left < (off_t) sizeof(in) ? (size_t) left : sizeof(in);
+        ssize_t got = pread(queue->source.fd, in, wanted, queue->source.offset + queue->consumed);
+        if (got < 0 || (size_t) got != wanted) {
+            compressFinish(queue, CPROXY_ERR_IO);
+            continue;
+        }
+        queue->consumed += got;
+        spent += (size_t) got + 1;
+        int finish = queue->consumed == queue->source.length;
+        int result;
+        int error = 0;
+        size_t offset = 0;
+        do {
+            size_t used, made;
+            result = gzipStreamStep(&queue->stream, in + offset, (size_t) got - offset, &used, out, sizeof(out), &made,
+                                    finish);
+            offset += used;
+            if (result == -1) {
+                error = CPROXY_ERR_IO;
+            } else if (made > 0) {
+                error = cacheFillWrite(&queue->fill, out, made);
+                queue->produced += (off_t) made;
+            }
+        } while (error == 0 && (offset < (size_t) got || (finish && result == 0)));
+        if (error != 0 || result == 1) {
+            compressFinish(queue, error);
+        }
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    queue->cpuNs += (unsigned long long) ((end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec));
+    return queue->running || queue->count > 0;
+}
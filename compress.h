@@ -0,0 +1,66 @@
+#ifndef CPROXY_COMPRESS_H
+#define CPROXY_COMPRESS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "cacheset.h"
+#include "gzip.h"
+#include "url.h"
+
+// Objects waiting to be compressed; beyond that new ones are left as they are
+#define COMPRESS_QUEUE_SIZE 256
+// Smaller bodies gain too little to be worth a second object
+#define COMPRESS_MIN_LENGTH 512
+// Bigger bodies would keep a worker's step busy for too long in total
+#define COMPRESS_MAX_LENGTH ((off_t) 16 << 20)
+// Bytes of body compressed per compressQueueStep() in the server; about 2 ms of CPU at GZIP_LEVEL
+#define COMPRESS_STEP_BUDGET (64 * 1024)
+// How often the server takes a step while objects are waiting
+#define COMPRESS_STEP_MS 10
+
+typedef struct CompressJob {
+    CacheShard *shard;
+    char *key;              // Cache key of the object
+    char *contentType;      // Stored with the compressed variant; NULL when the response had none
+} CompressJob;
+
+/**
+ * @brief Text objects stored uncompressed, replaced by a gzip variant in
+ * the background.
+ *
+ * Work is done in bounded steps from a timer, so compressing never holds
+ * up the event loop for longer than one step's budget. One per event loop,
+ * not thread-safe.
+ */
+typedef struct CompressQueue {
+    CompressJob jobs[COMPRESS_QUEUE_SIZE];
+    unsigned int head;
+    unsigned int count;
+    // The job under way
+    int running;
+    CompressJob job;
+    RequestContext ctx;
+    char storage[512];
+    const char *primaryPath;
+    CacheObject source;
+    off_t consumed;
+    off_t produced;
+    GzipStream stream;
+    CacheFill fill;
+    // Totals
+    unsigned long compressed;       // Objects replaced by their gzip variant
+    unsigned long kept;             // Left as they were: too little gain, gone, or the disk failed
+    unsigned long dropped;          // Not queued because the queue was full
+    unsigned long long bytesIn;     // Of compressed objects, before and after
+    unsigned long long bytesOut;
+    unsigned long long cpuNs;       // Spent in compressQueueStep()
+} CompressQueue;
+
+void compressQueueInit(CompressQueue *queue);
+void compressQueueClose(CompressQueue *queue);
+int compressQueueAdd(CompressQueue *queue, CacheShard *shard, const RequestContext *ctx, const char *contentType,
+                     size_t typeLength, long length);
+int compressQueueStep(CompressQueue *queue, size_t budget);
+
+#endif //CPROXY_COMPRESS_H
@@ -0,0 +1,570 @@
+#define _GNU_SOURCE
+
+#include "cproxy.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "cachekey.h"
+#include "cacheset.h"
+#include "compress.h"
+#include "vary.h"
+#include "fetch.h"
+#include "gzip.h"
+#include "httpheader.h"
+#include "probes.h"
+#include "timing.h"
+#include "url.h"
+
+/**
+ * @brief One submitted request, from cproxySubmit() until its callback returns.
+ */
+typedef struct CproxyRequest {
+    CproxyClient *client;
+    CproxyCallback callback;
+    void *arg;
+    CproxyResult result;
+    RequestContext ctx;
+    CacheShard *shard;              // Disk the object belongs on
+    const char *cachePath;
+    Fetch fetch;
+    CacheFill fill;
+    int fillError;
+    int passThrough;                // A 200 not stored: the body goes to the unlinked file in result.fd
+    RequestTiming timing;           // Only filled in when the client times requests
+    char contentType[128];          // Of a body stored as is under the URL's own key; empty otherwise
+    struct CproxyRequest *next;     // In-flight list, then completion queue
+    struct CproxyRequest *prev;
+    char storage[1024];             // First block of the request's arena
+} CproxyRequest;
+
+#define MAINTENANCE_INTERVAL_MS 1000
+
+struct CproxyClient {
+    EventLoop loop;
+    BufferPool pool;
+    CacheSet cache;
+    FetchTimeouts timeouts;
+    CacheKeyRules keyRules;
+    Timer maintenance;              // Periodic cacheSetMaintain()
+    CompressQueue compress;         // Text objects stored uncompressed, to be gzipped
+    Timer compressStep;
+    CproxyRequest *inFlight;
+    CproxyRequest *completedHead;
+    CproxyRequest *completedTail;
+    unsigned long pending;          // Submitted and not yet delivered
+    int timing;                     // Record the phases of every request
+    Admission admission;            // Only set up when the client was asked to filter fills
+};
+
+const char *cproxyStrerror(int error) {
+    switch (error) {
+        case CPROXY_OK:
+            return "success";
+        case CPROXY_ERR_URL:
+            return "invalid URL format";
+        case CPROXY_ERR_NOMEM:
+            return "out of memory";
+        case CPROXY_ERR_RESOLVE:
+            return "host name could not be resolved";
+        case CPROXY_ERR_CONNECT:
+            return "connection to server failed";
+        case CPROXY_ERR_IO:
+            return "transfer from server failed";
+        case CPROXY_ERR_TIMEOUT:
+            return "timed out";
+        case CPROXY_ERR_CACHE:
+            return "could not write to the cache";
+        case CPROXY_ERR_SYSTEM:
+            return "event loop failure";
+        default:
+            return "unknown error";
+    }
+}
+
+static void onMaintenance(Timer *timer, void *arg) {
+    CproxyClient *client = arg;
+    cacheSetMaintain(&client->cache);
+    loopArmTimer(&client->loop, timer, MAINTENANCE_INTERVAL_MS);
+}
+
+static void onCompressStep(Timer *timer, void *arg) {
+    CproxyClient *client = arg;
+    if (compressQueueStep(&client->compress, COMPRESS_STEP_BUDGET)) {
+        loopArmTimer(&client->loop, timer, COMPRESS_STEP_MS);
+    }
+}
+
+/**
+ * @brief Creates a client; options may be NULL for the defaults.
+ *
+ * @return The client, or NULL with errno set if memory or the event loop could not be set up.
+ */
+CproxyClient *cproxyCreate(const CproxyOptions *options) {
+    CproxyClient *client = calloc(1, sizeof(CproxyClient));
+    if (client == NULL) {
+        return NULL;
+    }
+    if (loopInit(&client->loop) == -1) {
+        free(client);
+        return NULL;
+    }
+    bufferPoolInit(&client->pool);
+    client->timeouts = defaultFetchTimeouts;
+    client->keyRules = defaultKeyRules;
+    long packLimit = CACHE_PACK_LIMIT;
+    const char *const *roots = NULL;
+    unsigned int rootCount = 0;
+    if (options != NULL) {
+        if (options->cacheRootCount > 0) {
+            roots = options->cacheRoots;
+            rootCount = options->cacheRootCount;
+        } else if (options->cacheRoot != NULL) {
+            roots = &options->cacheRoot;
+            rootCount = 1;
+        }
+        if (options->connectTimeoutMs > 0) {
+            client->timeouts.connectMs = options->connectTimeoutMs;
+        }
+        if (options->headerTimeoutMs > 0) {
+            client->timeouts.headerMs = options->headerTimeoutMs;
+        }
+        if (options->idleTimeoutMs > 0) {
+            client->timeouts.idleMs = options->idleTimeoutMs;
+        }
+        if (options->totalTimeoutMs > 0) {
+            client->timeouts.totalMs = options->totalTimeoutMs;
+        }
+        if (options->keyRules != NULL) {
+            client->keyRules = *options->keyRules;
+        }
+        if (options->packLimit != 0) {
+            packLimit = options->packLimit > 0 ? options->packLimit : 0;
+        }
+        client->timing = options->timing;
+        if (options->admitAfter > 0 &&
+            admissionInit(&client->admission, ADMISSION_ENTRIES, options->admitAfter) != 0) {
+            loopClose(&client->loop);
+            free(client);
+            return NULL;
+        }
+    }
+    // Without a segment store the cache still works, one file per object,
+    // and a disk that is down is left out until it answers again
+    if (cacheSetInit(&client->cache, roots, rootCount, (size_t) packLimit) == CPROXY_ERR_NOMEM) {
+        admissionFree(&client->admission);
+        loopClose(&client->loop);
+        free(client);
+        return NULL;
+    }
+    timerInit(&client->maintenance, onMaintenance, client);
+    loopArmTimer(&client->loop, &client->maintenance, MAINTENANCE_INTERVAL_MS);
+    compressQueueInit(&client->compress);
+    timerInit(&client->compressStep, onCompressStep, client);
+    return client;
+}
+
+static void requestFree(CproxyRequest *request) {
+    if (request->result.fd >= 0) {
+        close(request->result.fd);
+    }
+    requestContextFree(&request->ctx);
+    free(request);
+}
+
+/**
+ * @brief Destroys a client. Requests still in flight are dropped without their callbacks.
+ */
+void cproxyDestroy(CproxyClient *client) {
+    while (client->inFlight != NULL) {
+        CproxyRequest *request = client->inFlight;
+        client->inFlight = request->next;
+        fetchClose(&request->fetch);
+        cacheShardFillAbort(&request->fill, CPROXY_OK);
+        requestFree(request);
+    }
+    while (client->completedHead != NULL) {
+        CproxyRequest *request = client->completedHead;
+        client->completedHead = request->next;
+        requestFree(request);
+    }
+    loopCancelTimer(&client->loop, &client->maintenance);
+    loopCancelTimer(&client->loop, &client->compressStep);
+    compressQueueClose(&client->compress);
+    loopClose(&client->loop);
+    bufferPoolDestroy(&client->pool);
+    cacheSetClose(&client->cache);
+    admissionFree(&client->admission);
+    free(client);
+}
+
+// Move a request from the in-flight list to the completion queue
+static void requestComplete(CproxyRequest *request, int error) {
+    CproxyClient *client = request->client;
+    if (request->prev != NULL) {
+        request->prev->next = request->next;
+    } else {
+        client->inFlight = request->next;
+    }
+    if (request->next != NULL) {
+        request->next->prev = request->prev;
+    }
+    request->result.error = error;
+    RequestTiming *timing = request->fetch.timing;
+    if (timing != NULL) {
+        timingEnd(timing);
+        timing->statusCode = request->result.statusCode;
+        timing->cached = request->result.fromCache;
+        timing->bodyBytes = request->result.bodyBytes;
+        timing->error = error;
+        request->result.timing = timing;
+    }
+    CPROXY_PROBE4(serve_done, request->ctx.cacheKey, request->result.statusCode, request->result.bodyBytes,
+                  request->result.fromCache);
+    request->next = NULL;
+    if (client->completedTail != NULL) {
+        client->completedTail->next = request;
+    } else {
+        client->completedHead = request;
+    }
+    client->completedTail = request;
+}
+
+// Point the result at the stored body
+static int cacheResult(CproxyRequest *request) {
+    CacheObject object;
+    const char *path = request->cachePath;
+    const char *headers;
+    // The only request header is the Accept-Encoding every fetch sends
+    if (cacheLookup(&request->shard->cache, &request->ctx, HTTP_ACCEPT_GZIP, &path, &object, &headers) == -1) {
+        return -1;
+    }
+    request->result.fd = object.fd;
+    request->result.offset = (long) object.offset;
+    request->result.bodyBytes = (long) object.length;
+    size_t encodingLength;
+    const char *encoding = headers != NULL ? httpHeaderFind(headers, strlen(headers), "Content-Encoding",
+                                                            &encodingLength) : NULL;
+    request->result.gzip = encoding != NULL && gzipIsEncoding(encoding, encodingLength);
+    // Only objects stored as a file of their own, holding nothing but the body, have a path to show
+    if (!object.packed && headers == NULL) {
+        request->result.path = path;
+    }
+    return 0;
+}
+
+/**
+ * @brief Opens the file the body of a response the cache does not take goes to.
+ *
+ * It is created unlinked, on the disk the object would have gone to, so a
+ * large body does not sit in memory and nothing is left behind.
+ *
+ * @return 0, or CPROXY_ERR_CACHE if no such file can be created.
+ */
+static int passThroughBegin(CproxyRequest *request) {
+    const char *root = request->shard->cache.root != NULL ? request->shard->cache.root : ".";
+    int fd = open(root, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return CPROXY_ERR_CACHE;
+    }
+    size_t encodingLength;
+    const char *encoding = fetchResponseHeader(&request->fetch, "Content-Encoding", &encodingLength);
+    request->result.fd = fd;
+    request->result.offset = 0;
+    request->result.gzip = encoding != NULL && gzipIsEncoding(encoding, encodingLength);
+    request->result.transient = 1;
+    request->passThrough = 1;
+    return 0;
+}
+
+static int passThroughWrite(CproxyRequest *request, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(request->result.fd, data, length);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return CPROXY_ERR_CACHE;
+        }
+        data += written;
+        length -= (size_t) written;
+    }
+    return 0;
+}
+
+// Take back a body that will not be handed over
+static void passThroughEnd(CproxyRequest *request) {
+    if (request->passThrough) {
+        close(request->result.fd);
+        request->result.fd = -1;
+        request->result.transient = 0;
+        request->passThrough = 0;
+    }
+}
+
+static void libraryHeader(Fetch *fetch) {
+    CproxyRequest *request = fetch->owner;
+    // Only complete 200 responses are cached, and with admitAfter only those of URLs asked for that often
+    if (fetch->statusCode == 200 &&
+        (request->client->admission.words == NULL ||
+         admissionAdmit(&request->client->admission, request->ctx.cacheKey))) {
+        request->fillError = cacheShardFillResponse(request->shard, &request->ctx, request->cachePath,
+                                                    HTTP_ACCEPT_GZIP, fetch->in->data, fetch->headerLength,
+                                                    fetch->contentLength, &request->fill);
+    }
+    // Not stored, for admission or a busy disk: the caller still gets the body, in a file only it can see
+    if (fetch->statusCode == 200 && request->fillError == 0 && !request->fill.active) {
+        request->fillError = passThroughBegin(request);
+    }
+    // Stored as is under the URL's own key: a text body is compressed in the background once complete
+    size_t typeLength, encodingLength;
+    const char *type = fetchResponseHeader(fetch, "Content-Type", &typeLength);
+    if (request->fill.active && request->fill.path == request->cachePath && type != NULL &&
+        typeLength < sizeof(request->contentType) &&
+        fetchResponseHeader(fetch, "Content-Encoding", &encodingLength) == NULL) {
+        memcpy(request->contentType, type, typeLength);
+        request->contentType[typeLength] = '\0';
+    }
+}
+
+static int libraryChunk(Fetch *fetch, size_t bodyOffset) {
+    CproxyRequest *request = fetch->owner;
+    if (request->fillError == 0 && request->fill.active) {
+        uint64_t writeStart = timingClock(fetch->timing);
+        request->fillError = cacheFillWrite(&request->fill, fetch->in->data + bodyOffset, fetch->in->len - bodyOffset);
+        timingSince(fetch->timing, TIMING_DISK, writeStart);
+    } else if (request->fillError == 0 && request->passThrough) {
+        uint64_t writeStart = timingClock(fetch->timing);
+        request->fillError = passThroughWrite(request, fetch->in->data + bodyOffset, fetch->in->len - bodyOffset);
+        timingSince(fetch->timing, TIMING_DISK, writeStart);
+    }
+    if (request->fillError != 0) {
+        fetchClose(fetch);
+        cacheShardFillAbort(&request->fill, request->fillError);
+        passThroughEnd(request);
+        request->result.statusCode = fetch->statusCode;
+        requestComplete(request, request->fillError);
+        return -1;
+    }
+    return 0;
+}
+
+static void libraryFinish(Fetch *fetch) {
+    CproxyRequest *request = fetch->owner;
+    int error = CPROXY_OK;
+
+    request->result.statusCode = fetch->statusCode;
+    request->result.bodyBytes = fetch->bodyBytes;
+    if (!fetch->headerRead) {
+        error = CPROXY_ERR_IO;
+    } else if (request->fill.active) {
+        if (fetch->contentLength >= 0 && fetch->bodyBytes != fetch->contentLength) {
+            // Never leave a truncated body behind to be served as a cache hit
+            cacheShardFillAbort(&request->fill, CPROXY_ERR_IO);
+            error = CPROXY_ERR_IO;
+        } else {
+            uint64_t commitStart = timingClock(fetch->timing);
+            error = cacheShardFillCommit(&request->fill);
+            timingSince(fetch->timing, TIMING_COMMIT, commitStart);
+            if (error == CPROXY_OK) {
+                cacheResult(request);
+            }
+            CproxyClient *client = request->client;
+            if (error == CPROXY_OK && request->contentType[0] != '\0' &&
+                compressQueueAdd(&client->compress, request->shard, &request->ctx, request->contentType,
+                                 strlen(request->contentType), fetch->bodyBytes) &&
+                !timerArmed(&client->compressStep)) {
+                loopArmTimer(&client->loop, &client->compressStep, COMPRESS_STEP_MS);
+            }
+        }
+        CPROXY_PROBE3(fill_done, request->ctx.cacheKey, fetch->bodyBytes, error == CPROXY_OK);
+    } else if (request->passThrough && fetch->contentLength >= 0 && fetch->bodyBytes != fetch->contentLength) {
+        passThroughEnd(request);
+        error = CPROXY_ERR_IO;
+    }
+    requestComplete(request, error);
+}
+
+static void libraryFail(Fetch *fetch) {
+    CproxyRequest *request = fetch->owner;
+    cacheShardFillAbort(&request->fill, fetch->error);
+    passThroughEnd(request);
+    request->result.statusCode = fetch->statusCode;
+    requestComplete(request, fetch->error);
+}
+
+static const FetchHandler libraryHandler = {libraryHeader, libraryChunk, libraryFinish, libraryFail};
+
+/**
+ * @brief Answers the request from the cache if the object is there.
+ *
+ * @return 1 on a hit, 0 on a miss.
+ */
+static int checkDirectoryExistence(CproxyRequest *request) {
+    if (cacheResult(request) == -1) {
+        return 0;
+    }
+    request->result.statusCode = 200;
+    request->result.fromCache = 1;
+    return 1;
+}
+
+/**
+ * @brief Starts the origin fetch for a cache miss.
+ *
+ * @return 0 on success, a CproxyError if the fetch could not start.
+ */
+static int sendHTTPRequestAndReceiveResponse(CproxyRequest *request) {
+    CproxyClient *client = request->client;
+    Fetch *fetch = &request->fetch;
+    fetch->handler = &libraryHandler;
+    fetch->owner = request;
+    fetch->hostname = request->ctx.hostname;
+    fetch->filepath = request->ctx.filepath;
+    fetch->cacheKey = request->ctx.cacheKey;
+    fetch->requestHeaders = HTTP_ACCEPT_GZIP;
+    return fetchStart(fetch, &client->loop, &client->pool, &client->timeouts, request->ctx.port);
+}
+
+/**
+ * @brief Submits a request; the callback runs later from cproxyProcess().
+ *
+ * @return 0 if the request was accepted, a CproxyError otherwise (the
+ * callback is then never called).
+ */
+int cproxySubmit(CproxyClient *client, const char *url, CproxyCallback callback, void *arg) {
+    CproxyRequest *request = calloc(1, sizeof(CproxyRequest));
+    if (request == NULL) {
+        return CPROXY_ERR_NOMEM;
+    }
+    request->client = client;
+    request->callback = callback;
+    request->arg = arg;
+    request->result.fd = -1;
+    if (client->timing) {
+        timingStart(&request->timing);
+        request->fetch.timing = &request->timing;
+    }
+    requestContextInit(&request->ctx, request->storage, sizeof(request->storage));
+
+    int error = splitURL(&request->ctx, url);
+    if (error == CPROXY_OK) {
+        error = canonicalizeURL(&request->ctx, &client->keyRules);
+    }
+    if (error == CPROXY_OK) {
+        request->result.url = arenaStrndup(&request->ctx.arena, url, strlen(url));
+        request->shard = cacheSetPick(&client->cache, &request->ctx);
+        request->cachePath = request->shard != NULL ? cachePathFor(&request->shard->cache, &request->ctx) : NULL;
+        if (request->result.url == NULL) {
+            error = CPROXY_ERR_NOMEM;
+        } else if (request->shard == NULL) {
+            // Every disk is down
+            error = CPROXY_ERR_CACHE;
+        } else if (request->cachePath == NULL) {
+            error = CPROXY_ERR_NOMEM;
+        }
+    }
+    timingMark(request->fetch.timing, TIMING_PARSE);
+    if (error == CPROXY_OK) {
+        CPROXY_PROBE2(request_start, request->ctx.cacheKey, strlen(url));
+        int hit = checkDirectoryExistence(request);
+        timingMark(request->fetch.timing, TIMING_LOOKUP);
+        CPROXY_PROBE3(cache_lookup, request->ctx.cacheKey, hit, hit ? request->result.bodyBytes : 0);
+        if (!hit) {
+            error = sendHTTPRequestAndReceiveResponse(request);
+        }
+    }
+    if (error != CPROXY_OK) {
+        // errno goes with CPROXY_ERR_SYSTEM
+        int savedErrno = errno;
+        requestFree(request);
+        errno = savedErrno;
+        return error;
+    }
+
+    request->next = client->inFlight;
+    if (client->inFlight != NULL) {
+        client->inFlight->prev = request;
+    }
+    client->inFlight = request;
+    client->pending++;
+    if (request->result.fromCache) {
+        requestComplete(request, CPROXY_OK);
+    }
+    return 0;
+}
+
+unsigned long cproxyPending(const CproxyClient *client) {
+    return client->pending;
+}
+
+/**
+ * @brief Descriptor that becomes readable when the client has I/O to process.
+ */
+int cproxyFd(const CproxyClient *client) {
+    return client->loop.epfd;
+}
+
+/**
+ * @brief Longest the caller may wait on cproxyFd() before calling cproxyProcess().
+ *
+ * @return Milliseconds, 0 when completions are already queued, -1 when only
+ * I/O can make progress.
+ */
+int cproxyTimeout(const CproxyClient *client) {
+    if (client->completedHead != NULL) {
+        return 0;
+    }
+    return loopNextTimeout(&client->loop);
+}
+
+/**
+ * @brief Handles ready I/O and expired deadlines without blocking, then runs callbacks.
+ *
+ * @return Number of callbacks run, or CPROXY_ERR_SYSTEM with errno set if the loop failed.
+ */
+int cproxyProcess(CproxyClient *client) {
+    if (loopRunOnce(&client->loop, 0) == -1) {
+        return CPROXY_ERR_SYSTEM;
+    }
+    // Detach the queue first: requests submitted from a callback complete on the next call
+    CproxyRequest *request = client->completedHead;
+    client->completedHead = client->completedTail = NULL;
+    int delivered = 0;
+    while (request != NULL) {
+        CproxyRequest *next = request->next;
+        client->pending--;
+        if (request->callback != NULL) {
+            request->callback(&request->result, request->arg);
+        }
+        requestFree(request);
+        delivered++;
+        request = next;
+    }
+    return delivered;
+}
+
+/**
+ * @brief Blocks until every submitted request has completed.
+ *
+ * @return 0, or CPROXY_ERR_SYSTEM with errno set if waiting failed.
+ */
+int cproxyRun(CproxyClient *client) {
+    struct pollfd pfd;
+    pfd.fd = cproxyFd(client);
+    pfd.events = POLLIN;
+    while (client->pending > 0) {
+        if (poll(&pfd, 1, cproxyTimeout(client)) == -1 && errno != EINTR) {
+            return CPROXY_ERR_SYSTEM;
+        }
+        if (cproxyProcess(client) < 0) {
+            return CPROXY_ERR_SYSTEM;
+        }
+    }
+    return 0;
+}
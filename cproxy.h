@@ -0,0 +1,91 @@
+#ifndef CPROXY_CPROXY_H
+#define CPROXY_CPROXY_H
+
+/**
+ * @file cproxy.h
+ * @brief libcproxy: cache-backed HTTP fetches inside the calling process.
+ *
+ * A CproxyClient owns an event loop, an I/O buffer pool and a cache root;
+ * it has no hidden global state, so independent clients can live in the
+ * same process (one per thread). Nothing in the library calls exit() or
+ * prints: every failure is reported as a CproxyError.
+ *
+ * Requests are submitted with cproxySubmit() and complete through their
+ * callback, always from inside cproxyProcess(), never from cproxySubmit()
+ * itself. To drive a client from an existing event loop, poll cproxyFd()
+ * for readability with a timeout of at most cproxyTimeout() and call
+ * cproxyProcess() whenever either fires. cproxyRun() does exactly that
+ * until every request has completed.
+ *
+ * Host names are looked up on a short-lived thread per request, so a slow
+ * DNS server holds up only that request; a failed lookup completes it with
+ * CPROXY_ERR_RESOLVE.
+ */
+
+typedef enum CproxyError {
+    CPROXY_OK = 0,
+    CPROXY_ERR_URL = -1,        // URL not in a supported format
+    CPROXY_ERR_NOMEM = -2,      // Out of memory or out of I/O buffers
+    CPROXY_ERR_RESOLVE = -3,    // Host name could not be resolved
+    CPROXY_ERR_CONNECT = -4,    // Connection to the origin failed
+    CPROXY_ERR_IO = -5,         // Sending to or receiving from the origin failed
+    CPROXY_ERR_TIMEOUT = -6,    // A connect, header, idle or total deadline expired
+    CPROXY_ERR_CACHE = -7,      // The response could not be stored in the cache
+    CPROXY_ERR_SYSTEM = -8      // The event loop could not be created or used; errno says why
+} CproxyError;
+
+typedef struct CproxyClient CproxyClient;
+
+/**
+ * @brief Outcome of one request, valid only for the duration of the callback.
+ */
+typedef struct CproxyResult {
+    const char *url;
+    int error;              // CPROXY_OK or a CproxyError
+    int statusCode;         // Origin status; 200 for a cache hit, 0 if no response arrived
+    int fromCache;          // Answered from the cache without contacting the origin
+    const char *path;       // Cache file holding the body, NULL unless it is stored as a file of its own
+    int fd;                 // Body readable at offset, -1 when there is none to read
+    long offset;
+    long bodyBytes;         // Size of the body
+    int gzip;               // The stored body is gzip-encoded and has to be decoded to be shown
+    int transient;          // A 200 the cache did not take: fd is an unlinked file, gone once the callback returns
+    const struct RequestTiming *timing;     // Phase timestamps when the client times requests, else NULL
+} CproxyResult;
+
+typedef void (*CproxyCallback)(const CproxyResult *result, void *arg);
+
+/**
+ * @brief Client settings; zero fields take the defaults.
+ */
+typedef struct CproxyOptions {
+    const char *cacheRoot;          // Directory the cache lives in (default: the working directory)
+    const char *const *cacheRoots;  // Several directories, usually one per disk, to spread objects over
+    unsigned int cacheRootCount;    // Entries in cacheRoots; when not 0 they replace cacheRoot
+    unsigned int connectTimeoutMs;  // Host name lookup and TCP handshake (default 5 s)
+    unsigned int headerTimeoutMs;   // From request sent until the end of the response header (default 10 s)
+    unsigned int idleTimeoutMs;     // Maximum gap between two reads of the body (default 15 s)
+    unsigned int totalTimeoutMs;    // Whole transfer (default 5 min)
+    long packLimit;                 // Largest object packed into segment files (default 16 KB, -1: none)
+    const struct CacheKeyRules *keyRules;   // Query handling in cache keys (default: strip tracking parameters
+                                            // and sort the rest); its strip list must outlive the client
+    int timing;                     // Record the phases of every request, see timing.h (default: off)
+    unsigned int admitAfter;        // Store a response only once its URL was asked for this many times
+                                    // lately, at most 15 (default 0: store every 200 response); the body
+                                    // of one not stored is still handed over, see CproxyResult.transient
+} CproxyOptions;
+
+CproxyClient *cproxyCreate(const CproxyOptions *options);
+void cproxyDestroy(CproxyClient *client);
+
+int cproxySubmit(CproxyClient *client, const char *url, CproxyCallback callback, void *arg);
+unsigned long cproxyPending(const CproxyClient *client);
+
+int cproxyFd(const CproxyClient *client);
+int cproxyTimeout(const CproxyClient *client);
+int cproxyProcess(CproxyClient *client);
+int cproxyRun(CproxyClient *client);
+
+const char *cproxyStrerror(int error);
+
+#endif //CPROXY_CPROXY_H
@@ -0,0 +1,217 @@
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+// Castagnoli polynomial, reflected
+#define CRC32C_POLY 0x82f63b78u
+
+// The hardware path runs three independent CRCs over blocks of these sizes and combines them
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+// Slicing-by-8: table[k][b] is the CRC of byte b followed by k zero bytes
+static uint32_t table[8][256];
+static uint32_t (*update)(uint32_t crc, const unsigned char *data, size_t length);
+
+static uint32_t updatePortable(uint32_t crc, const unsigned char *data, size_t length) {
+    for (; length > 0 && ((uintptr_t) data & 7) != 0; length--) {
+        crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    for (; length >= 8; length -= 8, data += 8) {
+        uint32_t low, high;
+        memcpy(&low, data, 4);
+        memcpy(&high, data + 4, 4);
+        // The tables are laid out for little-endian words
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        low = __builtin_bswap32(low);
+        high = __builtin_bswap32(high);
+#endif
+        low ^= crc;
+        crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^ table[5][(low >> 16) & 0xff] ^
+              table[4][low >> 24] ^ table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^
+              table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+    }
+    for (; length > 0; length--) {
+        crc = table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CRC32C_X86
+// Shift tables: what appending CRC32C_LONG or CRC32C_SHORT zero bytes does to a CRC register
+static uint32_t zerosLong[4][256];
+static uint32_t zerosShort[4][256];
+
+static uint32_t gf2Times(const uint32_t *matrix, uint32_t vector) {
+    uint32_t sum = 0;
+    for (; vector != 0; vector >>= 1, matrix++) {
+        if (vector & 1) {
+            sum ^= *matrix;
+        }
+    }
+    return sum;
+}
+
+static void gf2Square(uint32_t *square, const uint32_t *matrix) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2Times(matrix, matrix[n]);
+    }
+}
+
+// Fill zeros with the operator for length zero bytes, length a power of two
+static void zerosTable(uint32_t zeros[4][256], size_t length) {
+    uint32_t even[32], odd[32];
+    // One zero bit, squared into two, four, then eight and onwards
+    odd[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = 1u << (n - 1);
+    }
+    gf2Square(even, odd);
+    gf2Square(odd, even);
+    uint32_t *op = even;
+    for (;;) {
+        gf2Square(even, odd);
+        op = even;
+        if ((length >>= 1) == 0) {
+            break;
+        }
+        gf2Square(odd, even);
+        op = odd;
+        if ((length >>= 1) == 0) {
+            break;
+        }
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = gf2Times(op, n);
+        zeros[1][n] = gf2Times(op, n << 8);
+        zeros[2][n] = gf2Times(op, n << 16);
+        zeros[3][n] = gf2Times(op, n << 24);
+    }
+}
+
+static uint32_t shift(uint32_t zeros[4][256], uint32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+/*
+ * The SSE4.2 crc32 instruction computes exactly this CRC, 8 bytes at a
+ * time, but each one waits for the previous result. Three streams over
+ * adjacent blocks keep the unit busy; the CRCs of the later blocks are
+ * then folded into the first by shifting it over their length.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t updateHardware(uint32_t crc, const unsigned char *data, size_t length) {
+    for (; length > 0 && ((uintptr_t) data & 7) != 0; length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+#ifdef __x86_64__
+    uint64_t crc0 = crc;
+    while (length >= CRC32C_LONG * 3) {
+        uint64_t crc1 = 0, crc2 = 0;
+        for (const unsigned char *end = data + CRC32C_LONG; data < end; data += 8) {
+            uint64_t a, b, c;
+            memcpy(&a, data, 8);
+            memcpy(&b, data + CRC32C_LONG, 8);
+            memcpy(&c, data + CRC32C_LONG * 2, 8);
+            crc0 = _mm_crc32_u64(crc0, a);
+            crc1 = _mm_crc32_u64(crc1, b);
+            crc2 = _mm_crc32_u64(crc2, c);
+        }
+        crc0 = shift(zerosLong, (uint32_t) crc0) ^ crc1;
+        crc0 = shift(zerosLong, (uint32_t) crc0) ^ crc2;
+        data += CRC32C_LONG * 2;
+        length -= CRC32C_LONG * 3;
+    }
+    while (length >= CRC32C_SHORT * 3) {
+        uint64_t crc1 = 0, crc2 = 0;
+        for (const unsigned char *end = data + CRC32C_SHORT; data < end; data += 8) {
+            uint64_t a, b, c;
+            memcpy(&a, data, 8);
+            memcpy(&b, data + CRC32C_SHORT, 8);
+            memcpy(&c, data + CRC32C_SHORT * 2, 8);
+            crc0 = _mm_crc32_u64(crc0, a);
+            crc1 = _mm_crc32_u64(crc1, b);
+            crc2 = _mm_crc32_u64(crc2, c);
+        }
+        crc0 = shift(zerosShort, (uint32_t) crc0) ^ crc1;
+        crc0 = shift(zerosShort, (uint32_t) crc0) ^ crc2;
+        data += CRC32C_SHORT * 2;
+        length -= CRC32C_SHORT * 3;
+    }
+    for (; length >= 8; length -= 8, data += 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc0 = _mm_crc32_u64(crc0, word);
+    }
+    crc = (uint32_t) crc0;
+#endif
+    for (; length >= 4; length -= 4, data += 4) {
+        uint32_t word;
+        memcpy(&word, data, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+    for (; length > 0; length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+// Runs before main(), so the tables and the choice of implementation never race
+__attribute__((constructor))
+static void crc32cInit(void) {
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+        }
+        table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            table[k][b] = table[0][table[k - 1][b] & 0xff] ^ (table[k - 1][b] >> 8);
+        }
+    }
+    update = updatePortable;
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        zerosTable(zerosLong, CRC32C_LONG);
+        zerosTable(zerosShort, CRC32C_SHORT);
+        update = updateHardware;
+    }
+#endif
+}
+
+/**
+ * @brief Extends a CRC32C (Castagnoli) over more data.
+ *
+ * Start from 0; feeding a buffer in pieces gives the same result as
+ * feeding it whole. Uses the SSE4.2 instruction when the CPU has it.
+ */
+uint32_t crc32cUpdate(uint32_t crc, const void *data, size_t length) {
+    return ~update(~crc, data, length);
+}
+
+/**
+ * @brief crc32cUpdate() without the hardware instruction, for comparison.
+ */
+uint32_t crc32cPortable(uint32_t crc, const void *data, size_t length) {
+    return ~updatePortable(~crc, data, length);
+}
+
+/**
+ * @brief Whether crc32cUpdate() runs on the CPU's CRC instruction.
+ */
+int crc32cHardware(void) {
+#ifdef CRC32C_X86
+    return update == updateHardware;
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,11 @@
+#ifndef CPROXY_CRC32C_H
+#define CPROXY_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32cUpdate(uint32_t crc, const void *data, size_t length);
+uint32_t crc32cPortable(uint32_t crc, const void *data, size_t length);
+int crc32cHardware(void);
+
+#endif //CPROXY_CRC32C_H
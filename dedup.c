@@ -0,0 +1,248 @@
+#include "dedup.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v)                                                             \
+    do {                                                                        \
+        v[0] += v[1]; v[1] = ROTL(v[1], 13); v[1] ^= v[0]; v[0] = ROTL(v[0], 32); \
+        v[2] += v[3]; v[3] = ROTL(v[3], 16); v[3] ^= v[2];                        \
+        v[0] += v[3]; v[3] = ROTL(v[3], 21); v[3] ^= v[0];                        \
+        v[2] += v[1]; v[1] = ROTL(v[1], 17); v[1] ^= v[2]; v[2] = ROTL(v[2], 32); \
+    } while (0)
+
+void contentHashInit(ContentHash *hash, const DedupStore *store) {
+    hash->v[0] = 0x736f6d6570736575ULL ^ store->key[0];
+    hash->v[1] = 0x646f72616e646f6dULL ^ store->key[1] ^ 0xee;
+    hash->v[2] = 0x6c7967656e657261ULL ^ store->key[0];
+    hash->v[3] = 0x7465646279746573ULL ^ store->key[1];
+    hash->tail = 0;
+    hash->length = 0;
+}
+
+static inline void compress(uint64_t v[4], uint64_t word) {
+    v[3] ^= word;
+    SIPROUND(v);
+    SIPROUND(v);
+    v[0] ^= word;
+}
+
+/**
+ * @brief Feeds the next chunk of a body; chunks may have any length.
+ */
+void contentHashUpdate(ContentHash *hash, const char *data, size_t len) {
+    const unsigned char *in = (const unsigned char *) data;
+    unsigned int filled = (unsigned int) (hash->length & 7);
+    hash->length += len;
+
+    // Complete the word left over from the previous chunk
+    while (filled != 0 && len > 0) {
+        hash->tail |= (uint64_t) *in++ << (8 * filled);
+        len--;
+        filled = (filled + 1) & 7;
+        if (filled == 0) {
+            compress(hash->v, hash->tail);
+            hash->tail = 0;
+        }
+    }
+    for (; len >= 8; in += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, in, 8);   // Little endian hosts only, like the on-disk formats
+        compress(hash->v, word);
+    }
+    for (unsigned int i = 0; i < len; i++) {
+        hash->tail |= (uint64_t) in[i] << (8 * i);
+    }
+}
+
+void contentHashFinal(ContentHash *hash, uint64_t out[2]) {
+    uint64_t *v = hash->v;
+    compress(v, hash->tail | hash->length << 56);
+    v[2] ^= 0xee;
+    SIPROUND(v);
+    SIPROUND(v);
+    SIPROUND(v);
+    SIPROUND(v);
+    out[0] = v[0] ^ v[1] ^ v[2] ^ v[3];
+    v[1] ^= 0xdd;
+    SIPROUND(v);
+    SIPROUND(v);
+    SIPROUND(v);
+    SIPROUND(v);
+    out[1] = v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+// Read the store's hash key, creating it on first use
+static int loadKey(DedupStore *store) {
+    int fd = openat(store->dirFd, ".key", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            return -1;
+        }
+        // Written under a private name and linked into place: whichever worker links first wins
+        unsigned char key[sizeof(store->key)];
+        char temp[32];
+        snprintf(temp, sizeof(temp), ".key.%d", (int) getpid());
+        if (getrandom(key, sizeof(key), 0) != (ssize_t) sizeof(key)) {
+            return -1;
+        }
+        int tempFd = openat(store->dirFd, temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (tempFd == -1) {
+            return -1;
+        }
+        int written = write(tempFd, key, sizeof(key)) == (ssize_t) sizeof(key);
+        close(tempFd);
+        int linked = written ? linkat(store->dirFd, temp, store->dirFd, ".key", 0) : -1;
+        int linkError = errno;
+        unlinkat(store->dirFd, temp, 0);
+        if (!written || (linked == -1 && linkError != EEXIST)) {
+            return -1;
+        }
+        fd = openat(store->dirFd, ".key", O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return -1;
+        }
+    }
+    ssize_t got = read(fd, store->key, sizeof(store->key));
+    close(fd);
+    return got == (ssize_t) sizeof(store->key) ? 0 : -1;
+}
+
+/**
+ * @brief Opens the blob directory dir, creating it and its key if missing.
+ *
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int dedupOpen(DedupStore *store, const char *dir) {
+    memset(store, 0, sizeof(*store));
+    if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    store->dirFd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (store->dirFd == -1) {
+        return -1;
+    }
+    if (loadKey(store) == -1) {
+        close(store->dirFd);
+        store->dirFd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void dedupClose(DedupStore *store) {
+    if (store->sweep != NULL) {
+        closedir(store->sweep);
+        store->sweep = NULL;
+    }
+    close(store->dirFd);
+    store->dirFd = -1;
+}
+
+/**
+ * @brief Moves a complete body from tempPath to path, sharing an identical blob if there is one.
+ *
+ * Like the rename() it replaces, path changes atomically from the old
+ * object to the new one. If the blob cannot be linked for any reason the
+ * body is simply kept as a copy of its own.
+ *
+ * @return 0 on success, -1 if the object could not be published at all.
+ */
+int dedupPublish(DedupStore *store, const uint64_t digest[2], off_t size, const char *tempPath, const char *path) {
+    char name[33];
+    snprintf(name, sizeof(name), "%016llx%016llx", (unsigned long long) digest[0], (unsigned long long) digest[1]);
+    store->published++;
+    if (linkat(AT_FDCWD, tempPath, store->dirFd, name, 0) == 0 || errno != EEXIST) {
+        // First copy of this body: it becomes the blob
+        return rename(tempPath, path);
+    }
+
+    // The body is stored already: publish another link to it and drop the new copy
+    struct stat blob;
+    size_t sharedSize = strlen(tempPath) + sizeof(".shared");
+    char sharedPath[sharedSize];
+    snprintf(sharedPath, sharedSize, "%s.shared", tempPath);
+    if (fstatat(store->dirFd, name, &blob, 0) == 0 && blob.st_size == size &&
+        linkat(store->dirFd, name, AT_FDCWD, sharedPath, 0) == 0) {
+        if (rename(sharedPath, path) == 0) {
+            // rename() leaves both names in place when path already is this blob
+            unlink(sharedPath);
+            unlink(tempPath);
+            store->shared++;
+            store->bytesSaved += (uint64_t) size;
+            return 0;
+        }
+        unlink(sharedPath);
+    }
+    return rename(tempPath, path);
+}
+
+// A descriptor of its own, so that walking the directory never moves another walk's position
+static DIR *openBlobs(const DedupStore *store) {
+    int fd = openat(store->dirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (dir == NULL && fd != -1) {
+        close(fd);
+    }
+    return dir;
+}
+
+/**
+ * @brief Looks at up to maxEntries blobs and removes those no object refers to any more.
+ *
+ * Successive calls walk the whole directory and then start over.
+ */
+void dedupSweepStep(DedupStore *store, unsigned int maxEntries) {
+    if (store->sweep == NULL && (store->sweep = openBlobs(store)) == NULL) {
+        return;
+    }
+    for (unsigned int i = 0; i < maxEntries; i++) {
+        struct dirent *entry = readdir(store->sweep);
+        if (entry == NULL) {
+            closedir(store->sweep);
+            store->sweep = NULL;
+            return;
+        }
+        struct stat st;
+        // A link made right after the check survives the unlink: only sharing with later copies is lost
+        if (entry->d_name[0] != '.' && fstatat(store->dirFd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+            S_ISREG(st.st_mode) && st.st_nlink == 1) {
+            unlinkat(store->dirFd, entry->d_name, 0);
+        }
+    }
+}
+
+/**
+ * @brief Adds up what the blobs save across every process sharing the cache.
+ *
+ * @return 0 on success, -1 if the directory could not be read.
+ */
+int dedupReport(const DedupStore *store, DedupReport *report) {
+    memset(report, 0, sizeof(*report));
+    DIR *dir = openBlobs(store);
+    if (dir == NULL) {
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        if (entry->d_name[0] == '.' || fstatat(store->dirFd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+            !S_ISREG(st.st_mode) || st.st_nlink < 2) {
+            continue;
+        }
+        unsigned long references = (unsigned long) st.st_nlink - 1;
+        report->blobs++;
+        report->references += references;
+        report->logicalBytes += (uint64_t) st.st_size * references;
+        report->physicalBytes += (uint64_t) st.st_size;
+    }
+    closedir(dir);
+    return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef CPROXY_DEDUP_H
+#define CPROXY_DEDUP_H
+
+#include <dirent.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * @brief Streaming SipHash-2-4 with a 128-bit result.
+ *
+ * Keyed with a secret of the cache, so an origin cannot craft a body that
+ * collides with another one and get it served in its place.
+ */
+typedef struct ContentHash {
+    uint64_t v[4];
+    uint64_t tail;          // Bytes not yet forming a full word, little endian
+    uint64_t length;
+} ContentHash;
+
+/**
+ * @brief Content-addressed store of the bodies of file-backed objects.
+ *
+ * Each distinct body exists once, as a blob named after its hash; every
+ * object with that body is a hard link to the blob. The link count is the
+ * reference count: once every object referring to a blob is gone, the
+ * blob is left with a count of 1 and is swept.
+ */
+typedef struct DedupStore {
+    int dirFd;
+    uint64_t key[2];
+    DIR *sweep;             // Position of the incremental sweep, NULL between passes
+    unsigned long published;    // Bodies published by this process
+    unsigned long shared;       // ... of which an identical blob already existed
+    uint64_t bytesSaved;        // Size of the shared bodies
+} DedupStore;
+
+/**
+ * @brief Space used by a store, see dedupReport().
+ */
+typedef struct DedupReport {
+    unsigned long blobs;        // Distinct bodies still referenced
+    unsigned long references;   // Objects referring to them
+    uint64_t logicalBytes;      // What the objects would take without sharing
+    uint64_t physicalBytes;     // What the blobs take
+} DedupReport;
+
+int dedupOpen(DedupStore *store, const char *dir);
+void dedupClose(DedupStore *store);
+
+void contentHashInit(ContentHash *hash, const DedupStore *store);
+void contentHashUpdate(ContentHash *hash, const char *data, size_t len);
+void contentHashFinal(ContentHash *hash, uint64_t out[2]);
+
+int dedupPublish(DedupStore *store, const uint64_t digest[2], off_t size, const char *tempPath, const char *path);
+void dedupSweepStep(DedupStore *store, unsigned int maxEntries);
+int dedupReport(const DedupStore *store, DedupReport *report);
+
+#endif //CPROXY_DEDUP_H
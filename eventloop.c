@@ -0,0 +1,182 @@
+#include "eventloop.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOOP_MAX_EVENTS 256
+
+/**
+ * @brief Sets up an empty loop.
+ *
+ * @return 0 on success, -1 with errno set if the epoll instance could not be created.
+ */
+int loopInit(EventLoop *loop) {
+    memset(loop, 0, sizeof(*loop));
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd == -1) {
+        return -1;
+    }
+    wheelInit(&loop->wheel, monotonicMillis());
+    return 0;
+}
+
+void loopClose(EventLoop *loop) {
+    if (loop->epfd != -1) {
+        close(loop->epfd);
+        loop->epfd = -1;
+    }
+}
+
+void watcherInit(IoWatcher *watcher, int fd, IoCallback callback, void *arg) {
+    watcher->fd = fd;
+    watcher->events = 0;
+    watcher->registered = 0;
+    watcher->callback = callback;
+    watcher->arg = arg;
+}
+
+int loopAddFd(EventLoop *loop, IoWatcher *watcher, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = watcher;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, watcher->fd, &ev) == -1) {
+        return -1;
+    }
+    watcher->events = events;
+    watcher->registered = 1;
+    loop->watchers++;
+    return 0;
+}
+
+int loopModFd(EventLoop *loop, IoWatcher *watcher, uint32_t events) {
+    if (watcher->events == events) {
+        return 0;  // Nothing changed, save the system call
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = watcher;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, watcher->fd, &ev) == -1) {
+        return -1;
+    }
+    watcher->events = events;
+    return 0;
+}
+
+/**
+ * @brief Removes a watcher from the loop.
+ *
+ * Must be called before closing the descriptor. The watcher is detached even
+ * if it is still in the ready list of the current iteration.
+ */
+void loopDelFd(EventLoop *loop, IoWatcher *watcher) {
+    if (!watcher->registered) {
+        return;
+    }
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, watcher->fd, NULL);
+    watcher->events = 0;
+    watcher->registered = 0;
+    loop->watchers--;
+}
+
+void deferredInit(Deferred *deferred, DeferredCallback callback, void *arg) {
+    deferred->next = NULL;
+    deferred->callback = callback;
+    deferred->arg = arg;
+}
+
+/**
+ * @brief Runs the callback once the I/O events of the current batch have all
+ * been dispatched, or right away outside of a batch.
+ */
+void loopDefer(EventLoop *loop, Deferred *deferred) {
+    if (!loop->dispatching) {
+        deferred->callback(deferred->arg);
+        return;
+    }
+    deferred->next = loop->deferred;
+    loop->deferred = deferred;
+}
+
+void loopArmTimer(EventLoop *loop, Timer *timer, uint64_t timeoutMs) {
+    wheelArm(&loop->wheel, timer, timeoutMs);
+}
+
+void loopCancelTimer(EventLoop *loop, Timer *timer) {
+    wheelCancel(&loop->wheel, timer);
+}
+
+void loopStop(EventLoop *loop) {
+    loop->stopped = 1;
+}
+
+/**
+ * @brief Milliseconds until the next timer is due, -1 when none is armed.
+ */
+int loopNextTimeout(const EventLoop *loop) {
+    return wheelNextTimeout(&loop->wheel);
+}
+
+/**
+ * @brief Waits at most maxWaitMs (-1 for no limit) and dispatches one batch.
+ *
+ * The wait is shortened to the next timer. I/O events are dispatched before
+ * timers. A watcher removed by an earlier callback of the batch gets no
+ * event, and owners free themselves through loopDefer(), so the watcher is
+ * still there to look at. Owners cancel their timers when they close, so a
+ * timer can never fire for a connection closed in the same iteration.
+ *
+ * @return Number of ready descriptors, or -1 with errno set if epoll_wait() failed.
+ */
+int loopRunOnce(EventLoop *loop, int maxWaitMs) {
+    struct epoll_event events[LOOP_MAX_EVENTS];
+
+    int timeout = wheelNextTimeout(&loop->wheel);
+    if (maxWaitMs >= 0 && (timeout == -1 || timeout > maxWaitMs)) {
+        timeout = maxWaitMs;
+    }
+    int ready = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS, timeout);
+    if (ready == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    uint64_t now = monotonicMillis();
+    if (loop->wheel.count == 0) {
+        // Nothing can fire, but timers armed below must count from now and not from before the wait
+        wheelAdvance(&loop->wheel, now);
+    }
+
+    loop->dispatching = 1;
+    for (int i = 0; i < ready; i++) {
+        IoWatcher *watcher = events[i].data.ptr;
+        if (watcher->registered) {
+            watcher->callback(watcher, events[i].events);
+        }
+    }
+    loop->dispatching = 0;
+    while (loop->deferred != NULL) {
+        Deferred *deferred = loop->deferred;
+        loop->deferred = deferred->next;
+        deferred->callback(deferred->arg);
+    }
+
+    wheelAdvance(&loop->wheel, now);
+    return ready;
+}
+
+/**
+ * @brief Runs the loop until it is stopped or has nothing left to wait for.
+ *
+ * @return 0, or -1 with errno set if waiting failed.
+ */
+int loopRun(EventLoop *loop) {
+    loop->stopped = 0;
+    while (!loop->stopped && (loop->watchers > 0 || loop->wheel.count > 0)) {
+        if (loopRunOnce(loop, -1) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
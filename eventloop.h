@@ -0,0 +1,73 @@
+#ifndef CPROXY_EVENTLOOP_H
+#define CPROXY_EVENTLOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#include "timerwheel.h"
+
+struct IoWatcher;
+typedef void (*IoCallback)(struct IoWatcher *watcher, uint32_t events);
+
+/**
+ * @brief A file descriptor registered with the event loop.
+ *
+ * Like timers, watchers are embedded in the connection that owns them.
+ */
+typedef struct IoWatcher {
+    int fd;
+    uint32_t events;        // EPOLLIN / EPOLLOUT mask currently registered, 0 while paused
+    int registered;
+    IoCallback callback;
+    void *arg;
+} IoWatcher;
+
+typedef void (*DeferredCallback)(void *arg);
+
+/**
+ * @brief Work put off until the current batch of I/O events has been dispatched.
+ *
+ * Owners free themselves through it, since a watcher they embed may still
+ * be further down the ready list. Embedded like timers and watchers.
+ */
+typedef struct Deferred {
+    struct Deferred *next;
+    DeferredCallback callback;
+    void *arg;
+} Deferred;
+
+/**
+ * @brief epoll based event loop with an embedded timer wheel.
+ *
+ * The epoll_wait() timeout is taken from the wheel, so timers never need a
+ * timerfd or a per-connection system call.
+ */
+typedef struct EventLoop {
+    int epfd;
+    int stopped;
+    unsigned long watchers;     // Number of registered file descriptors
+    int dispatching;            // Inside the I/O callbacks of a batch
+    Deferred *deferred;         // Run once the batch is over, see loopDefer()
+    TimerWheel wheel;
+} EventLoop;
+
+int loopInit(EventLoop *loop);
+void loopClose(EventLoop *loop);
+
+void watcherInit(IoWatcher *watcher, int fd, IoCallback callback, void *arg);
+int loopAddFd(EventLoop *loop, IoWatcher *watcher, uint32_t events);
+int loopModFd(EventLoop *loop, IoWatcher *watcher, uint32_t events);
+void loopDelFd(EventLoop *loop, IoWatcher *watcher);
+
+void deferredInit(Deferred *deferred, DeferredCallback callback, void *arg);
+void loopDefer(EventLoop *loop, Deferred *deferred);
+
+void loopArmTimer(EventLoop *loop, Timer *timer, uint64_t timeoutMs);
+void loopCancelTimer(EventLoop *loop, Timer *timer);
+
+int loopNextTimeout(const EventLoop *loop);
+int loopRunOnce(EventLoop *loop, int maxWaitMs);
+int loopRun(EventLoop *loop);
+void loopStop(EventLoop *loop);
+
+#endif //CPROXY_EVENTLOOP_H
@@ -0,0 +1,452 @@
+#include "fetch.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cproxy.h"
+#include "httpheader.h"
+#include "probes.h"
+
+const FetchTimeouts defaultFetchTimeouts = {5000, 10000, 15000, 300000};
+
+/**
+ * @brief A getaddrinfo() call running on a thread of its own.
+ *
+ * Shared by the fetch and the thread, so that either can let go first: a
+ * fetch that times out or is closed meanwhile just drops its reference.
+ * The thread signals the eventfd once the result is in.
+ */
+typedef struct FetchResolve {
+    int refs;
+    int fd;
+    int status;                 // Of getaddrinfo()
+    struct addrinfo *addresses;
+    const char *hostname;       // Copies, stored after the structure
+    const char *port;
+} FetchResolve;
+
+static void resolveRelease(FetchResolve *resolve) {
+    if (__atomic_sub_fetch(&resolve->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    close(resolve->fd);
+    if (resolve->addresses != NULL) {
+        freeaddrinfo(resolve->addresses);
+    }
+    free(resolve);
+}
+
+static void *resolveThread(void *arg) {
+    FetchResolve *resolve = arg;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    resolve->status = getaddrinfo(resolve->hostname, resolve->port, &hints, &resolve->addresses);
+    eventfd_write(resolve->fd, 1);
+    resolveRelease(resolve);
+    return NULL;
+}
+
+void fetchClose(Fetch *fetch) {
+    loopCancelTimer(fetch->loop, &fetch->phaseTimer);
+    loopCancelTimer(fetch->loop, &fetch->totalTimer);
+    loopDelFd(fetch->loop, &fetch->io);
+    if (fetch->resolve != NULL) {
+        // The descriptor is the lookup's eventfd, closed by whoever lets go of the lookup last
+        resolveRelease(fetch->resolve);
+        fetch->resolve = NULL;
+    } else if (fetch->io.fd >= 0) {
+        close(fetch->io.fd);
+    }
+    fetch->io.fd = -1;
+    bufferRelease(fetch->pool, fetch->in);
+    bufferRelease(fetch->pool, fetch->out);
+    fetch->in = fetch->out = NULL;
+}
+
+static void fetchFail(Fetch *fetch, int error) {
+    fetchClose(fetch);
+    fetch->error = error;
+    fetch->handler->fail(fetch);
+}
+
+static void fetchOnTimeout(Timer *timer, void *arg) {
+    (void) timer;
+    fetchFail(arg, CPROXY_ERR_TIMEOUT);
+}
+
+/**
+ * @brief Reads the code off a status line such as "HTTP/1.1 200 OK".
+ *
+ * @return The status code, or 0 when the line is not an HTTP/1.x status line.
+ */
+static int fetchStatusCode(const char *line, size_t length) {
+    if (length < 12 || memcmp(line, "HTTP/1.", 7) != 0 || !isdigit((unsigned char) line[7]) || line[8] != ' ') {
+        return 0;
+    }
+    int code = 0;
+    for (size_t i = 9; i < 12; i++) {
+        if (!isdigit((unsigned char) line[i])) {
+            return 0;
+        }
+        code = code * 10 + (line[i] - '0');
+    }
+    // The reason phrase may be left out, the space before it too
+    if (length > 12 && line[12] != ' ' && line[12] != '\r') {
+        return 0;
+    }
+    return code;
+}
+
+/**
+ * @brief Looks for the end of the response header in fetch->in, which holds
+ * the header as received so far.
+ *
+ * Only the bytes from scanFrom on are new; the end can straddle the old
+ * and the new bytes, so the caller backs up three bytes. Once the end is
+ * there, the whole block is parsed.
+ *
+ * @return Offset of the first body byte, or the whole length while the
+ * header is not complete.
+ */
+static size_t fetchParseHeader(Fetch *fetch, size_t scanFrom) {
+    const char *response = fetch->in->data;
+    const char *headerEnd = httpHeaderEnd(response + scanFrom, fetch->in->len - scanFrom);
+    if (headerEnd == NULL) {
+        return fetch->in->len;
+    }
+    fetch->headerRead = 1;
+    fetch->headerLength = (size_t) (headerEnd + 2 - response);
+    fetch->state = FETCH_BODY;
+    fetch->statusCode = fetchStatusCode(response, fetch->headerLength);     // 0 fails the fetch
+    // The header lines start after the status line, whose reason phrase may hold a colon
+    const char *lines = memchr(response, '\n', fetch->headerLength);
+    lines = lines != NULL ? lines + 1 : response + fetch->headerLength;
+    httpHeadersParse(&fetch->headers, lines, fetch->headerLength - (size_t) (lines - response));
+    fetch->contentLength = httpHeadersContentLength(&fetch->headers);
+    return (size_t) (headerEnd + 4 - response);
+}
+
+/**
+ * @brief Makes room in fetch->in for more of a response header that has filled it.
+ *
+ * The header moves to a buffer of the next size class; one that does not
+ * fit in the largest is refused.
+ *
+ * @return 0, or the CproxyError to fail the fetch with.
+ */
+static int fetchGrowHeader(Fetch *fetch) {
+    IoBuffer *in = fetch->in;
+    if (in->capacity >= BUFFER_MAX_SIZE) {
+        return CPROXY_ERR_IO;
+    }
+    IoBuffer *larger = bufferAcquire(fetch->pool, in->capacity + 1);
+    if (larger == NULL) {
+        return CPROXY_ERR_NOMEM;
+    }
+    memcpy(larger->data, in->data, in->len);
+    larger->len = in->len;
+    bufferRelease(fetch->pool, in);
+    fetch->in = larger;
+    return 0;
+}
+
+/**
+ * @brief Looks up a response header; only valid inside the header handler.
+ *
+ * @return The value, pointing into the receive buffer, or NULL if the
+ * response has no such header.
+ */
+const char *fetchResponseHeader(const Fetch *fetch, const char *name, size_t *length) {
+    return httpHeadersGet(&fetch->headers, name, length);
+}
+
+static void fetchOnIo(IoWatcher *watcher, uint32_t events) {
+    Fetch *fetch = watcher->arg;
+
+    if (fetch->state == FETCH_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(watcher->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            fetchFail(fetch, CPROXY_ERR_CONNECT);
+            return;
+        }
+        timingMark(fetch->timing, TIMING_CONNECT);
+        CPROXY_PROBE2(connect_done, fetch->cacheKey, fetch->hostname);
+        fetch->state = FETCH_SENDING;
+        loopArmTimer(fetch->loop, &fetch->phaseTimer, fetch->timeouts->headerMs);
+    }
+
+    if (fetch->state == FETCH_SENDING) {
+        // Send the HTTP request to the server
+        IoBuffer *out = fetch->out;
+        ssize_t sent = send(watcher->fd, out->data + out->sent, out->len - out->sent, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            fetchFail(fetch, CPROXY_ERR_IO);
+            return;
+        }
+        out->sent += (size_t) sent;
+        if (out->sent == out->len) {
+            bufferRelease(fetch->pool, out);
+            fetch->out = NULL;
+            timingMark(fetch->timing, TIMING_SEND);
+            fetch->state = FETCH_HEADER;
+            loopModFd(fetch->loop, watcher, EPOLLIN);
+        }
+        return;
+    }
+
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+    // Until its end has been seen, the header stays in fetch->in and each read appends to it
+    if (fetch->in == NULL) {
+        // Size the read to what is left of the body: small objects never touch a large buffer
+        size_t readSize = fetch->headerRead ? bufferReadSize(fetch->contentLength, fetch->bodyBytes)
+                                            : bufferClassSize(1);
+        fetch->in = bufferAcquire(fetch->pool, readSize);
+        if (fetch->in == NULL) {
+            fetchFail(fetch, CPROXY_ERR_NOMEM);
+            return;
+        }
+    } else if (fetch->in->len + 1 == fetch->in->capacity) {
+        int error = fetchGrowHeader(fetch);
+        if (error != 0) {
+            fetchFail(fetch, error);
+            return;
+        }
+    }
+    IoBuffer *in = fetch->in;
+    ssize_t bytesRead = recv(watcher->fd, in->data + in->len, in->capacity - 1 - in->len, 0);
+    if (bytesRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (in->len == 0) {
+            bufferRelease(fetch->pool, in);
+            fetch->in = NULL;
+        }
+        return;
+    }
+    if (bytesRead == -1) {
+        fetchFail(fetch, CPROXY_ERR_IO);
+        return;
+    }
+    if (bytesRead == 0) {
+        if (!fetch->headerRead) {
+            // The connection closed in the middle of the header
+            fetchFail(fetch, CPROXY_ERR_IO);
+            return;
+        }
+        fetchClose(fetch);
+        timingMark(fetch->timing, TIMING_BODY);
+        fetch->handler->finish(fetch);
+        return;
+    }
+    if (fetch->totalBytesRead == 0) {
+        timingMark(fetch->timing, TIMING_FIRST_BYTE);
+        CPROXY_PROBE2(first_byte, fetch->cacheKey, bytesRead);
+    }
+    if (fetch->state == FETCH_BODY) {
+        // Every read pushes the idle deadline forward; re-arming is O(1)
+        loopArmTimer(fetch->loop, &fetch->phaseTimer, fetch->timeouts->idleMs);
+    }
+    size_t previous = in->len;
+    in->len += (size_t) bytesRead;
+    in->data[in->len] = '\0';
+    fetch->totalBytesRead += bytesRead;
+
+    size_t bodyOffset = 0;
+    if (!fetch->headerRead) {
+        bodyOffset = fetchParseHeader(fetch, previous > 3 ? previous - 3 : 0);
+        if (!fetch->headerRead) {
+            return;
+        }
+        if (fetch->statusCode == 0) {
+            fetchFail(fetch, CPROXY_ERR_IO);
+            return;
+        }
+        timingMark(fetch->timing, TIMING_HEADER);
+        fetch->handler->header(fetch);
+    }
+    fetch->bodyBytes += (long) (in->len - bodyOffset);
+
+    if (fetch->handler->chunk(fetch, bodyOffset) == -1) {
+        return;
+    }
+    // The handler keeps the buffer by clearing fetch->in; otherwise it goes straight back
+    bufferRelease(fetch->pool, fetch->in);
+    fetch->in = NULL;
+    // If the content length is known and reached, stop reading
+    if (fetch->contentLength >= 0 && fetch->bodyBytes >= fetch->contentLength) {
+        fetchClose(fetch);
+        timingMark(fetch->timing, TIMING_BODY);
+        fetch->handler->finish(fetch);
+    }
+}
+
+/**
+ * @brief Starts a non-blocking connect to the first address and registers the fetch.
+ *
+ * @return 0 on success, a CproxyError on failure.
+ */
+static int fetchConnect(Fetch *fetch, struct addrinfo *addresses) {
+    timingMark(fetch->timing, TIMING_DNS);
+    CPROXY_PROBE2(dns_done, fetch->cacheKey, fetch->hostname);
+
+    // Connect to the server using the first address
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd == -1) {
+        freeaddrinfo(addresses);
+        return CPROXY_ERR_SYSTEM;
+    }
+    // Start connecting; completion is reported as writability
+    int connected = connect(sockfd, addresses->ai_addr, addresses->ai_addrlen);
+    freeaddrinfo(addresses);
+    if (connected == -1 && errno != EINPROGRESS) {
+        close(sockfd);
+        return CPROXY_ERR_CONNECT;
+    }
+
+    // Construct HTTP request
+    const char *headers = fetch->requestHeaders != NULL ? fetch->requestHeaders : "";
+    fetch->out = bufferAcquire(fetch->pool, strlen(fetch->filepath) + strlen(fetch->hostname) + strlen(headers) + 32);
+    if (fetch->out == NULL) {
+        close(sockfd);
+        return CPROXY_ERR_NOMEM;
+    }
+    // Buffers stop at BUFFER_MAX_SIZE, so a long enough URL does not fit
+    int length = snprintf(fetch->out->data, fetch->out->capacity, "GET %s HTTP/1.0\r\nHost: %s\r\n%s\r\n",
+                          fetch->filepath, fetch->hostname, headers);
+    if (length < 0 || (size_t) length >= fetch->out->capacity) {
+        close(sockfd);
+        bufferRelease(fetch->pool, fetch->out);
+        fetch->out = NULL;
+        return CPROXY_ERR_URL;
+    }
+    fetch->out->len = (size_t) length;
+
+    watcherInit(&fetch->io, sockfd, fetchOnIo, fetch);
+    fetch->state = FETCH_CONNECTING;
+    if (loopAddFd(fetch->loop, &fetch->io, EPOLLOUT) == -1) {
+        int error = errno;
+        close(sockfd);
+        bufferRelease(fetch->pool, fetch->out);
+        fetch->out = NULL;
+        fetch->io.fd = -1;
+        errno = error;
+        return CPROXY_ERR_SYSTEM;
+    }
+    return 0;
+}
+
+static void fetchOnResolved(IoWatcher *watcher, uint32_t events) {
+    Fetch *fetch = watcher->arg;
+    FetchResolve *resolve = fetch->resolve;
+    (void) events;
+
+    loopDelFd(fetch->loop, &fetch->io);
+    fetch->io.fd = -1;
+    fetch->resolve = NULL;
+    int status = resolve->status;
+    struct addrinfo *addresses = resolve->addresses;
+    resolve->addresses = NULL;
+    resolveRelease(resolve);
+    int error = status != 0 ? CPROXY_ERR_RESOLVE : fetchConnect(fetch, addresses);
+    if (error != 0) {
+        fetchFail(fetch, error);
+    }
+}
+
+// Hands the lookup of a host name to a thread, so the loop never waits for DNS
+static int fetchResolve(Fetch *fetch, const char *port) {
+    size_t hostnameSize = strlen(fetch->hostname) + 1;
+    size_t portSize = strlen(port) + 1;
+    FetchResolve *resolve = malloc(sizeof(FetchResolve) + hostnameSize + portSize);
+    if (resolve == NULL) {
+        return CPROXY_ERR_NOMEM;
+    }
+    char *names = (char *) (resolve + 1);
+    memcpy(names, fetch->hostname, hostnameSize);
+    memcpy(names + hostnameSize, port, portSize);
+    resolve->hostname = names;
+    resolve->port = names + hostnameSize;
+    resolve->addresses = NULL;
+    resolve->status = 0;
+    resolve->refs = 2;
+    resolve->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (resolve->fd == -1) {
+        free(resolve);
+        return CPROXY_ERR_SYSTEM;
+    }
+    watcherInit(&fetch->io, resolve->fd, fetchOnResolved, fetch);
+    if (loopAddFd(fetch->loop, &fetch->io, EPOLLIN) == -1) {
+        int error = errno;
+        close(resolve->fd);
+        free(resolve);
+        errno = error;
+        return CPROXY_ERR_SYSTEM;
+    }
+
+    pthread_attr_t attributes;
+    pthread_t thread;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    int started = pthread_create(&thread, &attributes, resolveThread, resolve);
+    pthread_attr_destroy(&attributes);
+    if (started != 0) {
+        loopDelFd(fetch->loop, &fetch->io);
+        close(resolve->fd);
+        free(resolve);
+        errno = started;
+        return CPROXY_ERR_SYSTEM;
+    }
+    fetch->resolve = resolve;
+    fetch->state = FETCH_RESOLVING;
+    return 0;
+}
+
+/**
+ * @brief Resolves the origin, starts a non-blocking connect and registers the fetch.
+ *
+ * The caller fills in handler, owner, hostname and filepath first. A
+ * numeric address is used right away; a host name is looked up on a
+ * thread of its own and the connect starts once the loop hears back, so a
+ * failed lookup is reported through the fail handler.
+ *
+ * @return 0 on success, a CproxyError on failure (the fail handler is not called).
+ */
+int fetchStart(Fetch *fetch, EventLoop *loop, BufferPool *pool, const FetchTimeouts *timeouts, const char *port) {
+    fetch->loop = loop;
+    fetch->pool = pool;
+    fetch->timeouts = timeouts;
+    timerInit(&fetch->phaseTimer, fetchOnTimeout, fetch);
+    timerInit(&fetch->totalTimer, fetchOnTimeout, fetch);
+    fetch->contentLength = -1;
+
+    // getaddrinfo() keeps no static state, unlike gethostbyname(); with AI_NUMERICHOST it never blocks
+    struct addrinfo hints, *addresses;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+    int error = getaddrinfo(fetch->hostname, port, &hints, &addresses) == 0 ? fetchConnect(fetch, addresses)
+                                                                            : fetchResolve(fetch, port);
+    if (error != 0) {
+        return error;
+    }
+    // The connect deadline covers the lookup too
+    loopArmTimer(loop, &fetch->phaseTimer, timeouts->connectMs);
+    loopArmTimer(loop, &fetch->totalTimer, timeouts->totalMs);
+    return 0;
+}
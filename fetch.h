@@ -0,0 +1,88 @@
+#ifndef CPROXY_FETCH_H
+#define CPROXY_FETCH_H
+
+#include <stddef.h>
+
+#include "bufpool.h"
+#include "eventloop.h"
+#include "httpheader.h"
+#include "timing.h"
+
+/**
+ * @brief Deadlines applied to every origin fetch, in milliseconds.
+ */
+typedef struct FetchTimeouts {
+    unsigned int connectMs;     // Host name lookup and TCP handshake
+    unsigned int headerMs;      // From request sent until the end of the response header
+    unsigned int idleMs;        // Maximum gap between two reads of the body
+    unsigned int totalMs;       // Whole transfer
+} FetchTimeouts;
+
+extern const FetchTimeouts defaultFetchTimeouts;
+
+typedef enum {
+    FETCH_RESOLVING,
+    FETCH_CONNECTING,
+    FETCH_SENDING,
+    FETCH_HEADER,
+    FETCH_BODY
+} FetchState;
+
+struct Fetch;
+struct FetchResolve;
+
+/**
+ * @brief What to do with the bytes of a fetch.
+ *
+ * The library stores the body in the cache; the proxy server relays it to a
+ * client while filling the cache. The fetch itself parses the status line
+ * and Content-Length and decides when the body is complete.
+ */
+typedef struct FetchHandler {
+    void (*header)(struct Fetch *fetch);                    // Status, Content-Length and fetch->headers available
+    int (*chunk)(struct Fetch *fetch, size_t bodyOffset);   // fetch->in holds the bytes; -1 when the fetch was aborted
+    void (*finish)(struct Fetch *fetch);
+    void (*fail)(struct Fetch *fetch);                      // fetch->error says why
+} FetchHandler;
+
+/**
+ * @brief State of one origin fetch driven by the event loop.
+ *
+ * The socket is non-blocking; every wait goes through epoll and every
+ * deadline through the loop's timer wheel. Buffers come from the pool of
+ * whoever started the fetch, so fetches of different clients share nothing.
+ */
+typedef struct Fetch {
+    EventLoop *loop;
+    BufferPool *pool;
+    const FetchTimeouts *timeouts;
+    IoWatcher io;
+    Timer phaseTimer;       // Connect, then header, then idle deadline
+    Timer totalTimer;       // Total-transfer deadline
+    FetchState state;
+    struct FetchResolve *resolve;   // Host name lookup running on its own thread, NULL once done
+    const FetchHandler *handler;
+    void *owner;            // Client connection or library request being served
+    const char *hostname;
+    const char *filepath;
+    const char *cacheKey;   // Of the request being served, passed to the trace probes
+    const char *requestHeaders; // Client header lines passed on to the origin, each ending in CRLF; NULL for none
+    IoBuffer *out;          // The HTTP request until it has been sent
+    IoBuffer *in;           // Receive buffer: the header as far as it has come, then each chunk while it is handled
+    int headerRead;         // Flag to indicate whether the header has been fully read
+    int statusCode;
+    size_t headerLength;    // Of the response header at the start of fetch->in, during the header handler
+    HttpHeaders headers;    // Its lines, indexed; the slices point into fetch->in, so only the header handler reads them
+    long totalBytesRead;
+    long contentLength;     // -1 until a Content-Length header has been seen
+    long bodyBytes;         // Body bytes received, drives the size of the next read
+    int error;              // CproxyError passed to the fail handler
+    RequestTiming *timing;  // Phases of the request this fetch serves, NULL when not timed
+    Deferred release;       // For an owner that frees the fetch from one of its handlers
+} Fetch;
+
+int fetchStart(Fetch *fetch, EventLoop *loop, BufferPool *pool, const FetchTimeouts *timeouts, const char *port);
+void fetchClose(Fetch *fetch);
+const char *fetchResponseHeader(const Fetch *fetch, const char *name, size_t *length);
+
+#endif //CPROXY_FETCH_H
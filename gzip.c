@@ -0,0 +1,149 @@
+#include "gzip.h"
+
+#include <string.h>
+#include <strings.h>
+
+#include "httpheader.h"
+
+// Besides text/*, media types whose bodies are text and shrink well; the rest are usually compressed already
+static const char *const compressibleTypes[] = {"json", "javascript", "ecmascript", "xml"};
+
+/**
+ * @brief Starts a stream that writes or reads the gzip format.
+ *
+ * @return 0 on success, -1 if zlib could not allocate its state.
+ */
+int gzipStreamBegin(GzipStream *stream, int compress) {
+    memset(&stream->z, 0, sizeof(stream->z));
+    stream->compress = compress;
+    stream->pending = 0;
+    // 16 added to the window bits selects the gzip wrapper instead of zlib's
+    int result = compress ? deflateInit2(&stream->z, GZIP_LEVEL, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY)
+                          : inflateInit2(&stream->z, 16 + MAX_WBITS);
+    stream->active = result == Z_OK;
+    return stream->active ? 0 : -1;
+}
+
+/**
+ * @brief Runs as much of in through the stream as fits in out.
+ *
+ * finish says that in holds the last bytes of the input, which makes a
+ * compressor write the gzip trailer. A decompressor carries on into the
+ * next member of a body made of several gzip members, as gzip -d does.
+ *
+ * @return 1 when the stream has ended, 0 when it needs more input or more
+ * room in out, -1 if the input is not valid gzip.
+ */
+int gzipStreamStep(GzipStream *stream, const char *in, size_t inLength, size_t *consumed, char *out, size_t outSize,
+                   size_t *produced, int finish) {
+    z_stream *z = &stream->z;
+    z->next_in = (Bytef *) in;
+    z->avail_in = (uInt) inLength;
+    z->next_out = (Bytef *) out;
+    z->avail_out = (uInt) outSize;
+    int result = stream->compress ? deflate(z, finish ? Z_FINISH : Z_NO_FLUSH) : inflate(z, Z_NO_FLUSH);
+    *consumed = inLength - z->avail_in;
+    *produced = outSize - z->avail_out;
+    stream->pending = z->avail_out == 0 && result != Z_STREAM_END;
+    if (result == Z_STREAM_END && !stream->compress && z->avail_in > 0) {
+        return inflateReset(z) == Z_OK ? 0 : -1;
+    }
+    if (result == Z_STREAM_END) {
+        return 1;
+    }
+    // Z_BUF_ERROR only means that no progress was possible with what was given
+    return result == Z_OK || result == Z_BUF_ERROR ? 0 : -1;
+}
+
+void gzipStreamEnd(GzipStream *stream) {
+    if (!stream->active) {
+        return;
+    }
+    if (stream->compress) {
+        deflateEnd(&stream->z);
+    } else {
+        inflateEnd(&stream->z);
+    }
+    stream->active = 0;
+}
+
+/**
+ * @brief Tells whether a Content-Encoding value is gzip.
+ */
+int gzipIsEncoding(const char *value, size_t length) {
+    return (length == 4 && strncasecmp(value, "gzip", 4) == 0) ||
+           (length == 6 && strncasecmp(value, "x-gzip", 6) == 0);
+}
+
+// A qvalue of zero ("0", "0.0", "0.000") means "not acceptable"
+static int qualityIsZero(const char *params, const char *end) {
+    for (const char *p = params; p < end; p++) {
+        if ((*p == 'q' || *p == 'Q') && p + 1 < end && p[1] == '=') {
+            for (p += 2; p < end && (*p == '0' || *p == '.'); p++) {
+            }
+            return p == end || *p < '1' || *p > '9';
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Tells whether the client that sent a block of request header
+ * lines takes gzip-encoded responses.
+ *
+ * Honors "gzip", "x-gzip" and "*" and their qvalues. A request without
+ * Accept-Encoding is taken not to: clients that do not send it rarely
+ * decode anything.
+ */
+int gzipAccepted(const char *block, size_t length) {
+    size_t valueLength;
+    const char *value = httpHeaderFind(block, length, "Accept-Encoding", &valueLength);
+    if (value == NULL) {
+        return 0;
+    }
+    int gzip = -1;
+    int any = -1;
+    for (const char *cursor = value, *end = value + valueLength; cursor < end;) {
+        const char *comma = memchr(cursor, ',', (size_t) (end - cursor));
+        const char *itemEnd = comma != NULL ? comma : end;
+        const char *semicolon = memchr(cursor, ';', (size_t) (itemEnd - cursor));
+        const char *tokenEnd = semicolon != NULL ? semicolon : itemEnd;
+        while (cursor < tokenEnd && (*cursor == ' ' || *cursor == '\t')) {
+            cursor++;
+        }
+        while (tokenEnd > cursor && (tokenEnd[-1] == ' ' || tokenEnd[-1] == '\t')) {
+            tokenEnd--;
+        }
+        int accepted = semicolon == NULL || !qualityIsZero(semicolon, itemEnd);
+        if (gzipIsEncoding(cursor, (size_t) (tokenEnd - cursor))) {
+            gzip = accepted;
+        } else if (tokenEnd - cursor == 1 && *cursor == '*') {
+            any = accepted;
+        }
+        cursor = itemEnd + 1;
+    }
+    return gzip >= 0 ? gzip : any == 1;
+}
+
+/**
+ * @brief Tells whether a body of the given Content-Type is worth compressing.
+ */
+int gzipCompressible(const char *contentType, size_t length) {
+    const char *semicolon = memchr(contentType, ';', length);
+    size_t typeLength = semicolon != NULL ? (size_t) (semicolon - contentType) : length;
+    char type[typeLength + 1];
+    for (size_t i = 0; i < typeLength; i++) {
+        char c = contentType[i];
+        type[i] = c >= 'A' && c <= 'Z' ? (char) (c - 'A' + 'a') : c;
+    }
+    type[typeLength] = '\0';
+    if (strncmp(type, "text/", 5) == 0) {
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(compressibleTypes) / sizeof(compressibleTypes[0]); i++) {
+        if (strstr(type, compressibleTypes[i]) != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
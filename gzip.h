@@ -0,0 +1,32 @@
+#ifndef CPROXY_GZIP_H
+#define CPROXY_GZIP_H
+
+#include <stddef.h>
+#include <zlib.h>
+
+// Level of bodies the cache compresses itself; zlib's default trade-off between size and CPU
+#define GZIP_LEVEL 6
+
+/**
+ * @brief A gzip compressor or decompressor fed in pieces.
+ *
+ * zlib allocates its window only in gzipStreamBegin(), so an idle stream
+ * embedded in a connection costs just this structure.
+ */
+typedef struct GzipStream {
+    z_stream z;
+    int active;             // Begun and not ended
+    int compress;           // Deflating rather than inflating
+    int pending;            // The last step filled out: more output may come without more input
+} GzipStream;
+
+int gzipStreamBegin(GzipStream *stream, int compress);
+int gzipStreamStep(GzipStream *stream, const char *in, size_t inLength, size_t *consumed, char *out, size_t outSize,
+                   size_t *produced, int finish);
+void gzipStreamEnd(GzipStream *stream);
+
+int gzipIsEncoding(const char *value, size_t length);
+int gzipAccepted(const char *block, size_t length);
+int gzipCompressible(const char *contentType, size_t length);
+
+#endif //CPROXY_GZIP_H
@@ -0,0 +1,263 @@
+#include "httpheader.h"
+
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+
+#include "scan.h"
+
+// Hop-by-hop headers, the proxy's own, and those that would turn a cacheable 200 into something else;
+// Accept-Encoding is replaced by HTTP_ACCEPT_GZIP
+static const char *const unforwarded[] = {
+        "host", "connection", "keep-alive", "proxy-connection", "proxy-authorization", "proxy-authenticate",
+        "te", "trailer", "transfer-encoding", "upgrade", "content-length", "accept-encoding",
+        "if-modified-since", "if-none-match", "if-match", "if-unmodified-since", "if-range", "range",
+};
+
+// Slots of the known headers, hashed by httpKnownHeader(): no two of them share one,
+// so a lookup is one hash and one comparison. Adding a header means finding a new
+// multiplier, or a wider table, under which they still don't.
+#define KNOWN_SLOTS 16
+
+static const struct {
+    const char *name;
+    size_t length;
+    HttpKnownHeader header;
+} knownSlots[KNOWN_SLOTS] = {
+        [0] = {"content-type", 12, HTTP_CONTENT_TYPE},
+        [1] = {NULL, 0, HTTP_UNKNOWN},
+        [2] = {"location", 8, HTTP_LOCATION},
+        [3] = {NULL, 0, HTTP_UNKNOWN},
+        [4] = {"etag", 4, HTTP_ETAG},
+        [5] = {"content-length", 14, HTTP_CONTENT_LENGTH},
+        [6] = {"content-encoding", 16, HTTP_CONTENT_ENCODING},
+        [7] = {"connection", 10, HTTP_CONNECTION},
+        [8] = {"cache-control", 13, HTTP_CACHE_CONTROL},
+        [9] = {NULL, 0, HTTP_UNKNOWN},
+        [10] = {NULL, 0, HTTP_UNKNOWN},
+        [11] = {"vary", 4, HTTP_VARY},
+        [12] = {"transfer-encoding", 17, HTTP_TRANSFER_ENCODING},
+        [13] = {"last-modified", 13, HTTP_LAST_MODIFIED},
+        [14] = {NULL, 0, HTTP_UNKNOWN},
+        [15] = {NULL, 0, HTTP_UNKNOWN},
+};
+
+/**
+ * @brief Finds the blank line that ends a header, in the bytes received so far.
+ *
+ * @return The CRLF CRLF sequence, or NULL while the header is incomplete.
+ */
+const char *httpHeaderEnd(const char *data, size_t length) {
+    return scanHeaderEnd(data, length);
+}
+
+// Decimal digits only, so the value need not be terminated; -1 for anything else
+static long parseLength(const char *value, size_t length) {
+    if (value == NULL || length == 0) {
+        return -1;
+    }
+    long n = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (value[i] < '0' || value[i] > '9' || n > (LONG_MAX - 9) / 10) {
+            return -1;
+        }
+        n = n * 10 + (value[i] - '0');
+    }
+    return n;
+}
+
+/**
+ * @brief The Content-Length of a response, from its header up to the blank line.
+ *
+ * @return The length, or -1 if the header does not give a valid one.
+ */
+long httpContentLength(const char *header, size_t length) {
+    // The status line never looks like a header line, so the whole header can be searched
+    size_t valueLength;
+    const char *value = httpHeaderFind(header, length, "Content-Length", &valueLength);
+    return parseLength(value, valueLength);
+}
+
+/**
+ * @brief Which of the known headers a name is, without regard to case.
+ */
+HttpKnownHeader httpKnownHeader(const char *name, size_t length) {
+    if (length == 0) {
+        return HTTP_UNKNOWN;
+    }
+    // Setting bit 5 lower-cases letters; whatever it does to other bytes, the comparison below settles
+    unsigned int slot = ((unsigned int) length + 5 * ((unsigned char) name[0] | 0x20) +
+                         ((unsigned char) name[length - 1] | 0x20)) % KNOWN_SLOTS;
+    if (knownSlots[slot].length != length || strncasecmp(name, knownSlots[slot].name, length) != 0) {
+        return HTTP_UNKNOWN;
+    }
+    return knownSlots[slot].header;
+}
+
+/**
+ * @brief Indexes a header block in one pass.
+ *
+ * Lines without a name, such as a status line, are skipped, so a whole
+ * response header can be passed. Values are trimmed as by httpHeaderFind().
+ */
+void httpHeadersParse(HttpHeaders *headers, const char *block, size_t length) {
+    memset(headers->known, 0, sizeof(headers->known));
+    headers->fieldCount = 0;
+    headers->block = block;
+    headers->length = length;
+    headers->overflow = 0;
+    const char *end = block + length;
+    for (const char *line = block; line < end;) {
+        const char *lineEnd = memchr(line, '\n', (size_t) (end - line));
+        const char *next = lineEnd != NULL ? lineEnd + 1 : end;
+        if (lineEnd == NULL) {
+            lineEnd = end;
+        }
+        const char *colon = memchr(line, ':', (size_t) (lineEnd - line));
+        if (colon == NULL || colon == line) {
+            line = next;
+            continue;
+        }
+        const char *value = colon + 1;
+        while (value < lineEnd && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        const char *valueEnd = lineEnd;
+        while (valueEnd > value && (valueEnd[-1] == '\r' || valueEnd[-1] == ' ' || valueEnd[-1] == '\t')) {
+            valueEnd--;
+        }
+        HttpSlice slice = {value, (size_t) (valueEnd - value)};
+        HttpKnownHeader known = httpKnownHeader(line, (size_t) (colon - line));
+        if (known != HTTP_UNKNOWN) {
+            if (headers->known[known].data == NULL) {
+                headers->known[known] = slice;
+            }
+        } else if (headers->fieldCount < HTTP_MAX_FIELDS) {
+            HttpField *field = &headers->fields[headers->fieldCount++];
+            field->name = (HttpSlice) {line, (size_t) (colon - line)};
+            field->value = slice;
+        } else {
+            headers->overflow = 1;
+        }
+        line = next;
+    }
+}
+
+/**
+ * @brief Looks up a header in an index, known or not.
+ *
+ * @return The value, pointing into the parsed block, or NULL if there is
+ * no such header.
+ */
+const char *httpHeadersGet(const HttpHeaders *headers, const char *name, size_t *valueLength) {
+    size_t nameLength = strlen(name);
+    HttpKnownHeader known = httpKnownHeader(name, nameLength);
+    if (known != HTTP_UNKNOWN) {
+        *valueLength = headers->known[known].length;
+        return headers->known[known].data;
+    }
+    for (size_t i = 0; i < headers->fieldCount; i++) {
+        const HttpField *field = &headers->fields[i];
+        if (field->name.length == nameLength && strncasecmp(field->name.data, name, nameLength) == 0) {
+            *valueLength = field->value.length;
+            return field->value.data;
+        }
+    }
+    return headers->overflow ? httpHeaderFind(headers->block, headers->length, name, valueLength) : NULL;
+}
+
+/**
+ * @brief The Content-Length of an indexed response header.
+ *
+ * @return The length, or -1 if the header does not give a valid one.
+ */
+long httpHeadersContentLength(const HttpHeaders *headers) {
+    return parseLength(headers->known[HTTP_CONTENT_LENGTH].data, headers->known[HTTP_CONTENT_LENGTH].length);
+}
+
+/**
+ * @brief Finds a header in a block of CRLF-terminated header lines.
+ *
+ * The name is matched without regard to case; the value comes back without
+ * surrounding whitespace and points into the block.
+ *
+ * @return The value of the first matching line, or NULL if there is none.
+ */
+const char *httpHeaderFind(const char *block, size_t length, const char *name, size_t *valueLength) {
+    size_t nameLength = strlen(name);
+    const char *end = block + length;
+    for (const char *line = block; line < end;) {
+        const char *lineEnd = memchr(line, '\n', (size_t) (end - line));
+        const char *next = lineEnd != NULL ? lineEnd + 1 : end;
+        if (lineEnd == NULL) {
+            lineEnd = end;
+        }
+        if ((size_t) (lineEnd - line) > nameLength && line[nameLength] == ':' &&
+            strncasecmp(line, name, nameLength) == 0) {
+            const char *value = line + nameLength + 1;
+            while (value < lineEnd && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            const char *valueEnd = lineEnd;
+            while (valueEnd > value && (valueEnd[-1] == '\r' || valueEnd[-1] == ' ' || valueEnd[-1] == '\t')) {
+                valueEnd--;
+            }
+            *valueLength = (size_t) (valueEnd - value);
+            return value;
+        }
+        line = next;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Copies header lines except those named in names (lower case).
+ *
+ * Every line copied ends in CRLF, so out needs room for 2 * length bytes
+ * when lines may end in a bare LF. Lines without a name are dropped.
+ *
+ * @return The number of bytes written.
+ */
+size_t httpWithoutHeaders(char *out, const char *block, size_t length, const char *const *names, size_t count) {
+    size_t n = 0;
+    const char *end = block + length;
+    for (const char *line = block; line < end;) {
+        const char *lineEnd = memchr(line, '\n', (size_t) (end - line));
+        const char *next = lineEnd != NULL ? lineEnd + 1 : end;
+        const char *colon = memchr(line, ':', (size_t) (next - line));
+        int keep = colon != NULL && colon > line;
+        for (size_t i = 0; keep && i < count; i++) {
+            size_t nameLength = strlen(names[i]);
+            if ((size_t) (colon - line) == nameLength && strncasecmp(line, names[i], nameLength) == 0) {
+                keep = 0;
+            }
+        }
+        if (keep) {
+            size_t lineLength = (size_t) ((lineEnd != NULL ? lineEnd : end) - line);
+            if (lineLength > 0 && line[lineLength - 1] == '\r') {
+                lineLength--;
+            }
+            memcpy(out + n, line, lineLength);
+            n += lineLength;
+            out[n++] = '\r';
+            out[n++] = '\n';
+        }
+        line = next;
+    }
+    return n;
+}
+
+/**
+ * @brief Copies the header lines a proxy passes on to the origin.
+ *
+ * Whatever the client accepts, the origin is asked for gzip: that is what
+ * the cache stores, decoding it for clients that cannot take it. out needs
+ * room for 2 * length + sizeof(HTTP_ACCEPT_GZIP) bytes.
+ *
+ * @return The number of bytes written.
+ */
+size_t httpForwardHeaders(char *out, const char *block, size_t length) {
+    size_t n = httpWithoutHeaders(out, block, length, unforwarded, sizeof(unforwarded) / sizeof(unforwarded[0]));
+    memcpy(out + n, HTTP_ACCEPT_GZIP, sizeof(HTTP_ACCEPT_GZIP) - 1);
+    return n + sizeof(HTTP_ACCEPT_GZIP) - 1;
+}
@@ -0,0 +1,68 @@
+#ifndef CPROXY_HTTPHEADER_H
+#define CPROXY_HTTPHEADER_H
+
+#include <stddef.h>
+
+// What the proxy asks every origin for, in place of the client's Accept-Encoding
+#define HTTP_ACCEPT_GZIP "Accept-Encoding: gzip\r\n"
+
+// Unknown header lines an HttpHeaders indexes; a header with more still parses
+#define HTTP_MAX_FIELDS 32
+
+/**
+ * @brief Headers the proxy itself reads, each with a slot of its own in HttpHeaders.
+ */
+typedef enum {
+    HTTP_CACHE_CONTROL,
+    HTTP_CONNECTION,
+    HTTP_CONTENT_ENCODING,
+    HTTP_CONTENT_LENGTH,
+    HTTP_CONTENT_TYPE,
+    HTTP_ETAG,
+    HTTP_LAST_MODIFIED,
+    HTTP_LOCATION,
+    HTTP_TRANSFER_ENCODING,
+    HTTP_VARY,
+    HTTP_KNOWN_COUNT,
+    HTTP_UNKNOWN = HTTP_KNOWN_COUNT
+} HttpKnownHeader;
+
+/**
+ * @brief Bytes of a header block, not NUL-terminated.
+ */
+typedef struct HttpSlice {
+    const char *data;       // NULL when the header is absent
+    size_t length;
+} HttpSlice;
+
+typedef struct HttpField {
+    HttpSlice name;
+    HttpSlice value;
+} HttpField;
+
+/**
+ * @brief Index of a header block, built in one pass by httpHeadersParse().
+ *
+ * Every slice points into the parsed block, which must outlive the index.
+ * A known header repeated keeps its first value, as httpHeaderFind() does.
+ */
+typedef struct HttpHeaders {
+    HttpSlice known[HTTP_KNOWN_COUNT];
+    HttpField fields[HTTP_MAX_FIELDS];      // Other header lines, in order
+    size_t fieldCount;
+    const char *block;                      // Searched again for unknown names past HTTP_MAX_FIELDS
+    size_t length;
+    int overflow;
+} HttpHeaders;
+
+const char *httpHeaderEnd(const char *data, size_t length);
+long httpContentLength(const char *header, size_t length);
+HttpKnownHeader httpKnownHeader(const char *name, size_t length);
+void httpHeadersParse(HttpHeaders *headers, const char *block, size_t length);
+const char *httpHeadersGet(const HttpHeaders *headers, const char *name, size_t *valueLength);
+long httpHeadersContentLength(const HttpHeaders *headers);
+const char *httpHeaderFind(const char *block, size_t length, const char *name, size_t *valueLength);
+size_t httpWithoutHeaders(char *out, const char *block, size_t length, const char *const *names, size_t count);
+size_t httpForwardHeaders(char *out, const char *block, size_t length);
+
+#endif //CPROXY_HTTPHEADER_H
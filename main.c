@@ -11,65 +11,56 @@
 #include <netdb.h>
 #include <errno.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <time.h>
+
+#include "accesslog.h"
+#include "admission.h"
+#include "bufpool.h"
+#include "cachekey.h"
+#include "cacheset.h"
+#include "compress.h"
+#include "httpheader.h"
+#include "cproxy.h"
+#include "eventloop.h"
+#include "fetch.h"
+#include "gzip.h"
+#include "metrics.h"
+#include "mirror.h"
+#include "probes.h"
+#include "timing.h"
+#include "url.h"
+#include "vary.h"
+#include "worker.h"
 
-// Define a structure for a node in the linked list
-typedef struct Node {
-    char *value;
-    struct Node *next;
-} Node;
-
-typedef uint16_t in_port_t;
-struct hostent *server_info = NULL;
-int lenUrl=0;
 int saveLocally = 1;
+int debugOutput = 0;        // -D: print the URL components, the path list and the whole response
 
-// Declare global variable for the linked list
-Node *pathList;
-
-// Declare global variables for storing URL components
-char *protocol, *hostname, *port, *filepath, *currentPath;
-void freePathList() {
-    Node *current = pathList;
-    while (current != NULL) {
-        Node *temp = current;
-        current = current->next;
-        free(temp->value);
-        free(temp);
-    }
-    pathList = NULL;
-}
-
-void freeAll() {
-    // Free allocated memory
-    free(currentPath);
-    free(hostname);
-    free(port);
-    free(filepath);
-    // Free memory allocated for the linked list
-    freePathList();
-}
-
-
-char *build_full_path(const char *relative_path) {
+char *build_full_path(RequestContext *ctx, const char *relative_path) {
     // Get the current working directory
     char current_path[PATH_MAX];
     if (getcwd(current_path, sizeof(current_path)) == NULL) {
         perror("getcwd");
         exit(EXIT_FAILURE);
     }
+    // Cache directories given with -d may be absolute already
+    const char *base = relative_path[0] == '/' ? "" : current_path;
     // Determine the required size for the combined string
-    size_t required_size = snprintf(NULL, 0, "%s/%s", current_path, relative_path) + 1;
+    size_t required_size = snprintf(NULL, 0, "%s/%s", base, relative_path) + 1;
 
 // Allocate memory dynamically
     char *full_path = malloc(required_size);
     if (full_path == NULL) {
         perror("malloc");
-        freeAll();
+        requestContextFree(ctx);
         exit(EXIT_FAILURE);
     }
 
 // Use snprintf to concatenate the strings
-    snprintf(full_path, required_size, "%s/%s", current_path, relative_path);
+    snprintf(full_path, required_size, "%s/%s", base, relative_path);
 
     // Resolve any relative path components
     char *resolved_full_path = realpath(full_path, NULL);
@@ -77,595 +68,1159 @@ char *build_full_path(const char *relative_path) {
     if (resolved_full_path == NULL) {
         perror("realpath");
         free(full_path);
-        freeAll();
+        requestContextFree(ctx);
         exit(EXIT_FAILURE);
     }
     free(full_path);
     return resolved_full_path;
 }
 
-// Function to find the last value in the linked list
-char *get_last_value(const struct Node *pathList) {
-    if (pathList == NULL) {
-        return NULL;  // List is empty or has only one node
-    }
-
-    const Node *current = pathList;
-
+/**
+ * @brief Opens the URL in the default web browser.
+ *
+ * @param url The URL to be opened in the browser.
+ */
+void openInBrowser(RequestContext *ctx, const char *url) {
+    // Use a system command to open the default web browser
+    char command[256];
+    snprintf(command, sizeof(command), "xdg-open %s", url);
 
-    // Handle the case where there is only one node
-    if (current->next == NULL) {
-        return hostname;
+    if (system(command) == -1) {
+        perror("Error opening in the browser");
+        // Free allocated memory
+        requestContextFree(ctx);
+        exit(EXIT_FAILURE);
     }
+}
+
 
-    // Iterate through the list until the second-to-last node is reached
-    while (current->next->next != NULL) {
-        current = current->next;
+/**
+ * @brief Generates an HTTP response for a cached object.
+ *
+ * Given the cached object, this function generates an HTTP response
+ * with the following format:
+ * HTTP/1.0 200 OK\r\n
+ * Content-Length: N\r\n\r\n
+ * Where N is the object size in bytes. A body the cache stores
+ * gzip-encoded is printed decoded. Only with -D: a binary body is of no
+ * use on a terminal.
+ *
+ * @param ctx The request being answered.
+ * @param result Where the library found or stored the object.
+ */
+void generateHTTPResponse(RequestContext *ctx, const CproxyResult *result) {
+    long storedSize = result->bodyBytes;
+    long fileSize = storedSize;
+    GzipStream decoder;
+
+    // A compressed body is shown decoded; the gzip trailer ends with its decoded length (modulo 4 GB)
+    if (result->gzip) {
+        unsigned char trailer[4];
+        if (storedSize < 18 || pread(result->fd, trailer, 4, (off_t) (result->offset + storedSize - 4)) != 4 ||
+            gzipStreamBegin(&decoder, 0) == -1) {
+            fprintf(stderr, "Cached body is not valid gzip\n");
+            requestContextFree(ctx);
+            exit(EXIT_FAILURE);
+        }
+        fileSize = (long) ((unsigned long) trailer[0] | (unsigned long) trailer[1] << 8 |
+                           (unsigned long) trailer[2] << 16 | (unsigned long) trailer[3] << 24);
     }
 
-    return current->next->value;
-}
+    // Generate HTTP response
+    printf("HTTP/1.0 200 OK\r\n");
+    printf("Content-Length: %ld\r\n\r\n", fileSize);
 
-void createDirectories(const char *path) {
-    char *last_node = get_last_value(pathList);
-    char pathCopy[strlen(path) + 1];
-    memset(pathCopy, 0, strlen(path)+1);
-    strcpy(pathCopy, path);
-    pathCopy[strlen(path)] = '\0';
-    char *token = strtok(pathCopy, "/");
-    if (token == NULL) {
-        if (access(path, F_OK) == -1) {
-            if (mkdir(path, 0777) == -1) {
-                perror("Error creating directory");
+    // Print the content to stdout; small objects share a segment file, so read only their range
+    char buffer[65536];
+    char decoded[65536];
+    PageStream pages;
+    pageStreamRead(&pages, result->fd, (off_t) result->offset, (off_t) storedSize, NULL);
+    size_t totalBytes = 0;  // Variable to track total response bytes
+    long readBytes = 0;
+
+    while (readBytes < storedSize) {
+        size_t wanted = (size_t) (storedSize - readBytes) < sizeof(buffer) ? (size_t) (storedSize - readBytes)
+                                                                           : sizeof(buffer);
+        ssize_t bytesRead = pread(result->fd, buffer, wanted, (off_t) (result->offset + readBytes));
+        if (bytesRead <= 0) {
+            perror("Error reading file");
+            requestContextFree(ctx);
+            exit(EXIT_FAILURE);
+        }
+        readBytes += bytesRead;
+        pageStreamReadTo(&pages, (off_t) (result->offset + readBytes));
+        if (!result->gzip) {
+            fwrite(buffer, 1, (size_t) bytesRead, stdout);
+            totalBytes += (size_t) bytesRead;  // Update total response bytes
+            continue;
+        }
+        size_t used = 0;
+        int ended = 0;
+        while (!ended && (used < (size_t) bytesRead || decoder.pending)) {
+            size_t consumed, made;
+            ended = gzipStreamStep(&decoder, buffer + used, (size_t) bytesRead - used, &consumed, decoded,
+                                   sizeof(decoded), &made, 0);
+            if (ended == -1) {
+                fprintf(stderr, "Cached body is not valid gzip\n");
+                gzipStreamEnd(&decoder);
+                requestContextFree(ctx);
                 exit(EXIT_FAILURE);
             }
+            used += consumed;
+            fwrite(decoded, 1, made, stdout);
+            totalBytes += made;
         }
-        chdir((path));
+    }
+    pageStreamEnd(&pages);
+    if (result->gzip) {
+        gzipStreamEnd(&decoder);
     }
 
-    if (strcmp(token, last_node) == 0) {
-        // Check if the directory exists, create if not
-        if (access(token, F_OK) == -1) {
-            if (mkdir(token, 0777) == -1) {
-                perror("Error creating directory");
-                exit(EXIT_FAILURE);
-            }
+    char responseHeader[1024];  // Adjust the size as needed
+    sprintf(responseHeader, "HTTP/1.0 200 OK\r\nContent-Length: %ld\r\n\r\n", fileSize);
+
+    // Print total response bytes
+    printf("\nTotal response bytes: %zu\n", totalBytes + strlen(responseHeader));
+}
+
+// Request timing: -t writes one JSON line per request, -T prints latency histograms at exit
+static int timingLogFd = -1;
+static TimingSummary *timingSummary = NULL;     // This process's, NULL without -T
+static TimingSummary *timingSummaries = NULL;   // Proxy server: one per worker, shared with the master
+
+static int timingEnabled(void) {
+    return timingLogFd != -1 || timingSummary != NULL || timingSummaries != NULL;
+}
+
+static void reportTiming(const RequestTiming *timing, const char *url) {
+    if (timingLogFd != -1) {
+        char line[1024];
+        size_t length = timingFormatJson(timing, url, line, sizeof(line));
+        // One write per line: with O_APPEND, lines of different workers never interleave
+        if (length > 0 && write(timingLogFd, line, length) == -1) {
+            timingLogFd = -1;
         }
-        chdir((token));
     }
-    while (strcmp(token, last_node) != 0) {
-        // Check if the directory exists, create if not
-        if (access(token, F_OK) == -1) {
-            if (mkdir(token, 0777) == -1) {
-                perror("Error creating directory");
-                exit(EXIT_FAILURE);
-            }
-        }
-        chdir((token));
-        token = strtok(NULL, "/");
+    if (timingSummary != NULL) {
+        timingSummaryRecord(timingSummary, timing);
     }
-
 }
 
-/**
- * @brief Frees the memory allocated for the linked list.
- */
+static void printTimingRow(const char *name, const TimingHistogram *histogram) {
+    fprintf(stderr, "%-12s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+            (unsigned long long) histogram->count, (double) histogram->sum / (double) histogram->count / 1e3,
+            (double) histogramPercentile(histogram, 50) / 1e3, (double) histogramPercentile(histogram, 90) / 1e3,
+            (double) histogramPercentile(histogram, 99) / 1e3, (double) histogramPercentile(histogram, 99.9) / 1e3,
+            (double) histogram->max / 1e3);
+}
 
-// Function to build a path from a hostname and linked list of path segments
-void buildPath(const char *hostname, Node *pathList) {
-    currentPath = malloc(lenUrl);
-    if (currentPath == NULL) {
-        // Free allocated memory
-        freeAll();
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
+static void printTimingSummary(const TimingSummary *summary) {
+    if (summary->requests == 0) {
+        return;
     }
+    fprintf(stderr, "Request timing:\n%-12s %8s %10s %10s %10s %10s %10s %10s\n", "phase (us)", "count", "mean", "p50",
+            "p90", "p99", "p99.9", "max");
+    printTimingRow("total", &summary->total);
+    for (int phase = 0; phase < TIMING_PHASES; phase++) {
+        if (summary->phases[phase].count > 0) {
+            printTimingRow(timingPhaseNames[phase], &summary->phases[phase]);
+        }
+    }
+}
 
-    memset(currentPath, 0, lenUrl);
-    strcat(currentPath, hostname);
+/**
+ * @brief Where the one-shot fetch reports to.
+ */
+typedef struct OneShot {
+    RequestContext *ctx;
+    int status;             // Exit status of the program
+} OneShot;
 
-    int flag_First_in_list = 0;
+/**
+ * @brief Reports the outcome of the one-shot fetch and shows the object.
+ *
+ * The library looked the object up in the cache and fetched and stored it
+ * if it was not there; all that is left is to print it.
+ */
+static void oneShotDone(const CproxyResult *result, void *arg) {
+    OneShot *oneShot = arg;
 
-    // Iterate through the linked list and check subdirectories
-    Node *current = pathList;
-    while (current != NULL) {
-        if (flag_First_in_list != 0) {
-            // Use platform-independent path separator
-            strcat(currentPath, "/");
+    if (result->timing != NULL) {
+        reportTiming(result->timing, result->url);
+    }
+    if (result->error != CPROXY_OK) {
+        fprintf(stderr, "%s: %s\n", result->url, cproxyStrerror(result->error));
+        oneShot->status = EXIT_FAILURE;
+        return;
+    }
+    if (result->statusCode == 404) {
+        printf("File does not exist (HTTP 404 Not Found)\n");
+        oneShot->status = EXIT_FAILURE;
+        return;
+    }
+    if (result->statusCode != 200) {
+        fprintf(stderr,"Status not 200");
+        oneShot->status = EXIT_FAILURE;
+        return;
+    }
+    if (result->fd < 0) {
+        fprintf(stderr, "%s: %s\n", result->url, cproxyStrerror(CPROXY_ERR_CACHE));
+        oneShot->status = EXIT_FAILURE;
+        return;
+    }
+    if (result->transient) {
+        printf("File fetched without being stored in the cache, %ld bytes\n", result->bodyBytes);
+        if (debugOutput) {
+            generateHTTPResponse(oneShot->ctx, result);
         }
-        flag_First_in_list++;
-
-        // Check the combined length before concatenating
-        if (strlen(currentPath) + strlen(current->value) < lenUrl) {
-            strcat(currentPath, current->value);
-        } else {
-            // Free allocated memory
-            freeAll();
-            fprintf(stderr, "\nUsage: cproxy <URL> [-s]\n");
-            exit(EXIT_FAILURE);
+        return;
+    }
+    // Small objects are packed into a segment file and have no path of their own
+    const char *location = result->path != NULL ? result->path : "(packed segment)";
+    if (result->fromCache) {
+        if (debugOutput) {
+            generateHTTPResponse(oneShot->ctx, result);
         }
-
-        current = current->next;
+        printf("Directory structure and file exist locally: %s\n", location);
+        printf("File is given from the local filesystem\n");
+    } else {
+        printf("File does not exist locally, fetched %ld bytes\n", result->bodyBytes);
+        printf("File saved locally: %s\n", location);
+        if (debugOutput) {
+            generateHTTPResponse(oneShot->ctx, result);
+        }
+    }
+    if (saveLocally == 1 && result->path != NULL) {
+        char *full = build_full_path(oneShot->ctx, result->path);
+        openInBrowser(oneShot->ctx, full);
+        free(full);
     }
+}
 
-    // The last segment in the path list is assumed to be a file
-    // Append the last segment to the current path
-    if (current != NULL) {
-        // Check the combined length before concatenating
-        if (strlen(currentPath) + strlen(current->value) < lenUrl) {
-            strcat(currentPath, current->value);
-        } else {
-            fprintf(stderr, "\nUsage: cproxy <URL> [-s]\n");
-            // Free allocated memory
-            freeAll();
-            exit(EXIT_FAILURE);
-        }
+static int mirrorDepth = -1;                    // -R; -1 fetches the one URL
+static MirrorOptions mirrorOptions;
+static const char *mirrorHosts[64];             // -H
+
+/**
+ * @brief Prints one line per URL of a mirror run: depth, status, body size and where it came from.
+ */
+static void mirrorPageDone(const CproxyResult *result, unsigned int depth, void *arg) {
+    (void) arg;
+    if (result->timing != NULL) {
+        reportTiming(result->timing, result->url);
     }
+    if (result->error != CPROXY_OK) {
+        printf("%u  ---  %s: %s\n", depth, result->url, cproxyStrerror(result->error));
+        return;
+    }
+    printf("%u  %d  %10ld  %-6s  %s\n", depth, result->statusCode, result->bodyBytes,
+           result->fromCache ? "cache" : "origin", result->url);
 }
 
 /**
- * @brief Opens the URL in the default web browser.
+ * @brief Mirrors a site into the cache: the page at url and what it links to, -R links deep.
  *
- * @param url The URL to be opened in the browser.
+ * @return The exit status of the program.
  */
-void openInBrowser(const char *url) {
-    // Use a system command to open the default web browser
-    char command[256];
-    snprintf(command, sizeof(command), "xdg-open %s", url);
+static int runMirror(CproxyClient *client, const char *url, const CacheKeyRules *keyRules) {
+    mirrorOptions.maxDepth = (unsigned int) mirrorDepth;
+    mirrorOptions.hosts = mirrorHosts;
+    mirrorOptions.keyRules = keyRules;
+    mirrorOptions.onPage = mirrorPageDone;
+    MirrorStats stats;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int error = mirrorRun(client, url, &mirrorOptions, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (error != CPROXY_OK) {
+        fprintf(stderr, "%s: %s\n", url, cproxyStrerror(error));
+        return EXIT_FAILURE;
+    }
+    double seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%lu pages (%lu from the cache, %lu failed), %llu bytes in %.2f s\n", stats.pages, stats.fromCache,
+           stats.failed, stats.bytes, seconds);
+    printf("%lu pages scanned: %lu links, %lu queued, %lu off-site\n", stats.scanned, stats.links, stats.queued,
+           stats.offsite);
+    return stats.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-    if (system(command) == -1) {
-        perror("Error opening in the browser");
-        // Free allocated memory
-        freeAll();
-        exit(EXIT_FAILURE);
+/**
+ * @brief Checks a URL against the formats the proxy server accepts.
+ *
+ * Stricter than splitURL(): only http:// URLs with a hostname are relayed.
+ *
+ * @return 1 if the URL can be split, 0 otherwise.
+ */
+static int isValidProxyURL(const char *url) {
+    if (strncmp(url, "http://", 7) != 0 || url[7] == '\0') {
+        return 0;
+    }
+    const char *hostnameStart = url + 7;
+    const char *pathStart = strchr(hostnameStart, '/');
+    const char *portStart = strchr(hostnameStart, ':');
+    if (portStart == NULL || (pathStart != NULL && portStart > pathStart)) {
+        return 1;
+    }
+    // A port must be all digits and followed by a path
+    if (pathStart == NULL || pathStart == portStart + 1) {
+        return 0;
+    }
+    for (const char *digit = portStart + 1; digit < pathStart; ++digit) {
+        if (!isdigit((unsigned char) *digit)) {
+            return 0;
+        }
     }
+    return 1;
 }
 
+// Upper bound on open client connections per worker
+unsigned int maxClientConnections = 10000;
+
+// State of the proxy server; each worker has its own copy after fork()
+BufferPool ioBuffers;
+static CacheSet serverCache;
+static const char *serverCacheRoots[CACHE_MAX_SHARDS];     // -d, one per disk; none for the working directory
+static unsigned int serverCacheRootCount = 0;
+static int serverRootWasUp[CACHE_MAX_SHARDS];
+static size_t serverPackLimit = CACHE_PACK_LIMIT;
+static const char *serverStripParams[64];                  // The default tracking parameters, then -s
+static CacheKeyRules serverKeyRules;
+static Timer cacheMaintenance;
+static CompressQueue serverCompress;                        // Text objects stored uncompressed, to be gzipped
+static Timer compressStep;
+static const FetchTimeouts *serverTimeouts = &defaultFetchTimeouts;
+static WorkerStats *workerStats = NULL;                     // This worker's entry, once it has a client
+static const char *accessLogPath = NULL;                    // -a
+static Admission serverAdmission;                           // Shared by the workers: mapped before they fork
+static unsigned int serverAdmitAfter = 0;                   // -A; 0 stores every 200 response
+static AccessLog accessLog;                                 // Per worker, with its writer thread
+static int accessLogging = 0;
+
+#define CACHE_MAINTENANCE_MS 1000
+
+typedef enum {
+    CLIENT_READING,         // Waiting for the request header
+    CLIENT_SENDING_FILE,    // Serving a cache hit
+    CLIENT_RELAYING,        // Relaying an origin fetch while filling the cache
+    CLIENT_FLUSHING         // Sending a final error response
+} ClientState;
 
 /**
- * @brief Sends an HTTP request to the server and receives the response.
+ * @brief A client connection in proxy server mode.
  *
- * @param hostname The hostname of the server.
- * @param port The port number for the server.
- * @param filepath The filepath of the requested resource.
+ * Connections are recycled through a per-worker free list instead of being
+ * returned to malloc. They own no I/O memory of their own: buffers are
+ * borrowed from the pool while bytes are in flight, so an idle connection
+ * costs only this structure.
  */
-void sendHTTPRequestAndReceiveResponse(const char *hostname, const char *port, const char *filepath) {
-    // Construct HTTP request
-    char request[1024];  // Adjust the size as needed
-    sprintf(request, "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", filepath, hostname);
+typedef struct ClientConn {
+    EventLoop *loop;
+    IoWatcher io;
+    Timer timer;            // Request header deadline, then idle deadline while sending
+    WorkerStats *stats;
+    ClientState state;
+    // Cache hit
+    int fileFd;
+    off_t fileOffset;
+    off_t fileEnd;          // Packed objects end before their segment file does
+    PageStream pages;       // Page cache policy for the file
+    // Cache miss
+    Fetch *fetch;
+    RequestContext request; // Parsed URL; every per-request string below lives in its arena
+    IoBuffer *requestStorage;   // First block of that arena, on loan while the request is served
+    const char *requestHeaders; // Client header lines passed on to the origin, also selecting a variant
+    int noStore;            // The request carries credentials, so its response is not shared
+    int acceptsGzip;        // The client decodes gzip; otherwise gzip bodies are decoded for it
+    const char *contentType;    // Of a text response stored uncompressed, to be compressed once complete
+    CacheShard *shard;      // Disk the object belongs on, NULL when every disk is down
+    const char *cacheFile;  // Final location of the object in the cache
+    CacheFill fill;         // The object being written, only for 200 responses
+    int originDone;
+    GzipStream inflater;    // Decoding a gzip body for the client, when active
+    IoBuffer *inflateIn;    // Encoded bytes not decoded yet
+    IoBuffer *in;           // Partial request header
+    IoBuffer *out;          // Bytes the client could not take yet
+    RequestTiming *timing;  // Points at timingData while requests are timed
+    RequestTiming timingData;
+    int metrics;            // Came in on the metrics port: answered with the counters
+    uint64_t started;       // When the request header was complete, for the latency histograms
+    int fillCounted;        // The fill is counted in stats->fills
+    uint32_t peer;          // Client IPv4 address, for the access log
+    int statusCode;         // Of the response, once known
+    long bodyBytes;         // Of the response body, stored size for a hit
+    Deferred release;       // Back to the free list once the loop's batch is over
+    struct ClientConn *nextFree;
+} ClientConn;
+
+static ClientConn *clientFreeList = NULL;
+static unsigned int clientsInUse = 0;
+
+static ClientConn *clientAlloc(void) {
+    if (clientsInUse >= maxClientConnections) {
+        return NULL;
+    }
+    ClientConn *conn = clientFreeList;
+    if (conn != NULL) {
+        clientFreeList = conn->nextFree;
+    } else {
+        conn = malloc(sizeof(ClientConn));
+        if (conn == NULL) {
+            return NULL;
+        }
+    }
+    memset(conn, 0, sizeof(ClientConn));
+    clientsInUse++;
+    return conn;
+}
 
-    in_port_t port1 = atoi(port);
+static void clientRelease(void *arg) {
+    ClientConn *conn = arg;
+    conn->nextFree = clientFreeList;
+    clientFreeList = conn;
+    clientsInUse--;
+}
 
-    // Print the HTTP request
-    printf("HTTP request =\n%s\nLEN = %zu\n", request, strlen(request));
+// The fetch's watcher may be further down the loop's ready list, so it is freed once the batch is over
+static void relayRelease(Fetch *fetch) {
+    loopDefer(fetch->loop, &fetch->release);
+}
 
-    // Connect to the server
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd == -1) {
-        perror("Socket creation failed");
-        freeAll();
-        exit(EXIT_FAILURE);
+// The URL of the request being served, empty before it has been parsed
+static size_t clientRequestUrl(const ClientConn *conn, char *url, size_t size) {
+    const RequestContext *ctx = &conn->request;
+    int length = 0;
+    if (conn->requestStorage != NULL && ctx->hostname != NULL) {
+        int defaultPort = ctx->port == NULL || strcmp(ctx->port, "80") == 0;
+        length = snprintf(url, size, "http://%s%s%s%s", ctx->hostname, defaultPort ? "" : ":",
+                          defaultPort ? "" : ctx->port, ctx->filepath);
     }
-
-    server_info = gethostbyname(hostname);
-    if (!server_info) {
-        fprintf(stderr, "gethostbyname failed: %s\n", hstrerror(h_errno));
-        close(sockfd);
-        freeAll();
-        exit(EXIT_FAILURE);
+    if (length <= 0) {
+        url[0] = '\0';
+        return 0;
     }
+    return (size_t) length < size ? (size_t) length : size - 1;
+}
 
-    struct sockaddr_in serverAddr;
-    memset(&serverAddr, 0, sizeof(struct sockaddr_in));
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(port1);
-    // Set the server address using the first IP address from the hostent structure
-    serverAddr.sin_addr.s_addr = ((struct in_addr *) server_info->h_addr)->s_addr;
+// Finish the request's timing record and hand it on
+static void clientReportTiming(ClientConn *conn) {
+    RequestTiming *timing = conn->timing;
+    timing->cached = conn->state == CLIENT_SENDING_FILE;
+    timing->statusCode = conn->statusCode;
+    timing->bodyBytes = conn->bodyBytes;
+    if (timing->cached) {
+        timingMark(timing, TIMING_BODY);
+    }
+    timingEnd(timing);
+    char url[512];
+    clientRequestUrl(conn, url, sizeof(url));
+    reportTiming(timing, url);
+}
 
-    // Connect to the server
-    if (connect(sockfd, (struct sockaddr *) &serverAddr, sizeof(serverAddr)) == -1) {
-        perror("Connection to server failed");
-        fprintf(stderr, "Error code: %d\n", errno);  // Add this line to print the error code
-        close(sockfd);
-        freeAll();
-        exit(EXIT_FAILURE);
+// Queue the access log entry; a full ring drops it rather than wait for the disk
+static void clientLogAccess(ClientConn *conn, uint64_t durationNs) {
+    AccessEntry *entry = accessLogReserve(&accessLog);
+    if (entry == NULL) {
+        conn->stats->logDropped++;
+        return;
     }
+    entry->time = (int64_t) time(NULL);
+    entry->client = conn->peer;
+    entry->statusCode = (uint16_t) conn->statusCode;
+    entry->cached = conn->state == CLIENT_SENDING_FILE;
+    entry->bodyBytes = conn->bodyBytes;
+    entry->durationUs = durationNs / 1000 > UINT32_MAX ? UINT32_MAX : (uint32_t) (durationNs / 1000);
+    char url[ACCESS_LOG_URL + 1];
+    entry->urlLength = (uint8_t) clientRequestUrl(conn, url, sizeof(url));
+    memcpy(entry->url, url, entry->urlLength);
+    accessLogPublish(&accessLog);
+}
 
-    // Send the HTTP request to the server
-    if (send(sockfd, request, strlen(request), 0) == -1) {
-        perror("Failed to send HTTP request");
-        close(sockfd);
-        freeAll();
-        exit(EXIT_FAILURE);
+// Keep the fill gauge in step once the fill has been committed or abandoned
+static void clientFillEnded(ClientConn *conn) {
+    if (conn->fillCounted && !conn->fill.active) {
+        conn->stats->fills--;
+        conn->fillCounted = 0;
     }
+}
 
-    int headerRead = 0;  // Flag to indicate whether the header has been fully read
-    int bytesRead = 0;
-    int flag_first_write = 0;
-    int totalBytesRead = 0;
-    unsigned char response[8192];
-    int contentLength = 0;
-    char *headerEnd;
-    // Open the file
-    FILE *file = NULL;
-    int skip=0;
-    // Loop to receive the response
-    while ((bytesRead = recv(sockfd, response, sizeof(response) - 1, 0)) > 0) {
-        response[bytesRead] = '\0';
-
-        // If the header has not been fully read, check for the end of the header
-        if (!headerRead) {
-            headerEnd = strstr((char*)response, "\r\n\r\n");
-            if (headerEnd != NULL) {
-                // The header is fully read
-                headerRead = 1;
-
-                // Extract the status and content length from the header
-                unsigned char *statusStart = response + 9;  // Assuming "HTTP/1.x " is at the beginning
-                int statusCode = atoi((char*)statusStart);
-                if (statusCode == 404) {
-                    printf("File does not exist (HTTP 404 Not Found)\n");
-                    close(sockfd);
-                    // Free allocated memory
-                    freeAll();
-                    exit(EXIT_FAILURE);
-                } else if (statusCode == 200) {
-                    char* contentLengthStart = strstr((char*)response, "Content-Length: ");
-                    if (contentLengthStart != NULL) {
-                        contentLengthStart += 16;  // Move to the beginning of the content length value
-                        contentLength = atoi(contentLengthStart);
-                        printf("\nContent Length: %u\n", contentLength);
-                        createDirectories(currentPath);
-                        // Open the file
-                        file = NULL;
-                        if (strcmp(filepath, "/") == 0 || strcmp(hostname, currentPath) == 0) {
-                            buildPath(hostname, pathList);
-                            file = fopen("index.html", "wb");
-                            printf("File saved locally: index.html\n");
-
-                        } else {
-                            char *last_node = get_last_value(pathList);
-                            file = fopen(last_node, "wb");
-                            printf("File saved locally: %s\n", last_node);
-                        }
-
-                        if (file == NULL) {
-                            perror("Error opening file for writing");
-                            close(sockfd);
-                            freeAll();
-                            exit(EXIT_FAILURE);
-                        }
-                    }
-                }
-                else{
-                    skip=1;
-                    char* contentLengthStart = strstr((char*)response, "Content-Length: ");
-                    if (contentLengthStart != NULL) {
-                        contentLengthStart += 16;  // Move to the beginning of the content length value
-                        contentLength = atoi(contentLengthStart);
-                        printf("\nContent Length: %u\n", contentLength);
-                        createDirectories(currentPath);
-                    }
-                }
-            }
+static void clientClose(ClientConn *conn) {
+    CPROXY_PROBE4(serve_done, conn->requestStorage != NULL ? conn->request.cacheKey : NULL, conn->statusCode,
+                  conn->bodyBytes, conn->state == CLIENT_SENDING_FILE);
+    if (conn->timing != NULL) {
+        clientReportTiming(conn);
+    }
+    if (conn->started != 0) {
+        uint64_t duration = timingNow() - conn->started;
+        if (conn->state == CLIENT_SENDING_FILE || conn->state == CLIENT_RELAYING) {
+            latencyRecord(conn->state == CLIENT_SENDING_FILE ? &conn->stats->hitLatency : &conn->stats->missLatency,
+                          duration);
         }
-        if(skip==0){
-            if (flag_first_write == 0) {
-                fwrite((const void *) (headerEnd + 4), 1, (size_t) (bytesRead - ((unsigned char *)headerEnd - response) - 4), file);
-                flag_first_write = 1;
-            } else {
-                // Write everything received to the file
-                fwrite(response, 1, bytesRead, file);
-            }
-            // If the content length is known and reached, break the loop
-            if (contentLength > 0 && totalBytesRead >= contentLength) {
-                break;
-            }
+        if (accessLogging) {
+            clientLogAccess(conn, duration);
         }
-        // Update total response bytes
-        totalBytesRead += bytesRead;
-        // Print everything received to the screen
-        printf("%s", response);
-
     }
-
-    printf("\nTotal response bytes: %u\n", totalBytesRead);
-
-    // Print total response bytes
-    //printf("\nTotal response bytes: %zu\n", contentLength);
-    if(skip==0){
-        printf("File saved locally: %s\n", currentPath);
-        if (saveLocally == 1) {
-            char* last_node= get_last_value(pathList);
-            char *full = build_full_path(last_node);
-            openInBrowser(full);
-            free(full);
-        }
-        fclose(file);
-    }
-    close(sockfd);
-    if (strcmp(filepath, "/") == 0) {
-        //free(currentPath);
-        return;
+    if (conn->fetch != NULL) {
+        fetchClose(conn->fetch);
+        cacheShardFillAbort(&conn->fill, CPROXY_OK);
+        relayRelease(conn->fetch);
+        conn->fetch = NULL;
     }
-    if(skip==1){
-        freeAll();
-        fprintf(stderr,"Status not 200");
-        exit(-1);
+    clientFillEnded(conn);
+    loopCancelTimer(conn->loop, &conn->timer);
+    loopDelFd(conn->loop, &conn->io);
+    close(conn->io.fd);
+    if (conn->fileFd >= 0) {
+        pageStreamEnd(&conn->pages);
+        close(conn->fileFd);
     }
-    //free(currentPath);
+    gzipStreamEnd(&conn->inflater);
+    bufferRelease(&ioBuffers, conn->inflateIn);
+    bufferRelease(&ioBuffers, conn->in);
+    bufferRelease(&ioBuffers, conn->out);
+    if (conn->requestStorage != NULL) {
+        requestContextFree(&conn->request);
+        bufferRelease(&ioBuffers, conn->requestStorage);
+    }
+    conn->stats->active--;
+    // Like the watchers, the connection may still be in the ready list
+    loopDefer(conn->loop, &conn->release);
 }
 
 /**
- * @brief Splits a path and stores each segment in a linked list.
- *
- * Given a path, this function splits it at each "/" and stores each segment
- * in a linked list.
+ * @brief Sends whatever is pending for the client.
  *
- * @param path The input path to be split and stored.
+ * @return 0 when everything was sent, 1 when the socket is full, -1 on error.
  */
-void splitAndStorePath(const char *path) {
-    // Find the position of the first "/"
-    const char *pathStart = path;
-    const char *pathEnd = strchr(pathStart, '/');
-
-    // Iterate through the path and split at each "/"
-    while (pathEnd != NULL) {
-        // Extract the segment between pathStart and pathEnd
-        size_t segmentLength = pathEnd - pathStart;
-        char *segment = malloc(segmentLength + 1);
-        strncpy(segment, pathStart, segmentLength);
-        segment[segmentLength] = '\0';
-
-        // Create a new node for the linked list
-        Node *newNode = malloc(sizeof(Node));
-        newNode->value = segment;
-        newNode->next = NULL;
-
-        // Add the new node to the linked list
-        if (pathList == NULL) {
-            // If the list is empty, set the new node as the head
-            pathList = newNode;
-        } else {
-            // Otherwise, find the end of the list and append the new node
-            Node *current = pathList;
-            while (current->next != NULL) {
-                current = current->next;
-            }
-            current->next = newNode;
+static int clientFlush(ClientConn *conn) {
+    IoBuffer *out = conn->out;
+    if (out == NULL) {
+        return 0;
+    }
+    while (out->sent < out->len) {
+        ssize_t sent = send(conn->io.fd, out->data + out->sent, out->len - out->sent, MSG_NOSIGNAL);
+        if (sent == -1) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
         }
+        out->sent += (size_t) sent;
+    }
+    // Drained: the buffer goes back to the pool right away
+    bufferRelease(&ioBuffers, out);
+    conn->out = NULL;
+    return 0;
+}
+
+/**
+ * @brief Hands a filled buffer to the client, keeping what does not fit for later.
+ *
+ * Only called with nothing pending; at most one receive buffer is ever
+ * queued because the origin is paused until the client catches up.
+ */
+static int clientQueue(ClientConn *conn, IoBuffer *buffer) {
+    conn->out = buffer;
+    return clientFlush(conn);
+}
 
-        // Move to the next segment
-        pathStart = pathEnd + 1;
-        pathEnd = strchr(pathStart, '/');
+// Send the response in conn->out, then close
+static void clientFinish(ClientConn *conn) {
+    conn->state = CLIENT_FLUSHING;
+    if (clientFlush(conn) != 1) {
+        clientClose(conn);
+        return;
     }
+    loopModFd(conn->loop, &conn->io, EPOLLOUT);
+    loopArmTimer(conn->loop, &conn->timer, serverTimeouts->idleMs);
+}
 
-    // Handle the last segment after the last "/"
-    size_t lastSegmentLength = strlen(pathStart);
-    if (lastSegmentLength > 0) {
-        char *lastSegment = malloc(lastSegmentLength + 1);
-        strcpy(lastSegment, pathStart);
+static void clientRespondError(ClientConn *conn, const char *status) {
+    bufferRelease(&ioBuffers, conn->out);
+    conn->out = bufferAcquire(&ioBuffers, 128);
+    conn->state = CLIENT_FLUSHING;
+    if (conn->out == NULL) {
+        clientClose(conn);
+        return;
+    }
+    conn->out->len = (size_t) snprintf(conn->out->data, conn->out->capacity,
+                                       "HTTP/1.0 %s\r\nContent-Length: 0\r\n\r\n", status);
+    if (!conn->metrics) {
+        conn->stats->requests++;
+    }
+    conn->statusCode = atoi(status);
+    clientFinish(conn);
+}
 
-        Node *newNode = malloc(sizeof(Node));
-        newNode->value = lastSegment;
-        newNode->next = NULL;
+// What this worker's buffer pool holds, for the scrapes
+static void publishBufferPool(WorkerStats *stats) {
+    for (int i = 0; i < BUFFER_CLASSES; i++) {
+        stats->buffersInUse[i] = ioBuffers.inUse[i];
+    }
+    stats->bufferSlabs = ioBuffers.slabs;
+}
 
-        if (pathList == NULL) {
-            pathList = newNode;
-        } else {
-            Node *current = pathList;
-            while (current->next != NULL) {
-                current = current->next;
-            }
-            current->next = newNode;
-        }
+/**
+ * @brief Answers a scrape on the metrics port with the counters of every worker.
+ */
+static void clientServeMetrics(ClientConn *conn) {
+    const char *request = conn->in->data;
+    if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET /metrics?", 13) != 0) {
+        bufferRelease(&ioBuffers, conn->in);
+        conn->in = NULL;
+        clientRespondError(conn, "404 Not Found");
+        return;
+    }
+    bufferRelease(&ioBuffers, conn->in);
+    conn->in = NULL;
+    publishBufferPool(conn->stats);
+    int workers;
+    const WorkerStats *stats = workerStatsAll(&workers);
+    char body[16384];
+    size_t length = metricsFormat(body, sizeof(body), stats, workers, (unsigned long) workers * maxClientConnections);
+    conn->out = bufferAcquire(&ioBuffers, length + 128);
+    if (length == 0 || conn->out == NULL) {
+        clientRespondError(conn, "500 Internal Server Error");
+        return;
     }
+    conn->out->len = (size_t) snprintf(conn->out->data, conn->out->capacity,
+                                       "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                       "Content-Length: %zu\r\n\r\n", length);
+    memcpy(conn->out->data + conn->out->len, body, length);
+    conn->out->len += length;
+    clientFinish(conn);
 }
 
 /**
- * @brief Splits a URL into its components.
+ * @brief Sends a gzip body decoded, for a client that cannot take gzip.
  *
- * Given a URL, this function extracts the protocol, hostname, port, and filepath.
- * The components are stored in global variables. It also calls splitAndStorePath
- * to store the path segments in a linked list.
+ * The encoded bytes come from conn->inflateIn, which a cache hit refills
+ * from its file. Each decoded piece goes out before the next one is made,
+ * so a slow client holds one buffer of each and the origin or the file is
+ * read no faster than the client takes the body.
  *
- * @param url The input URL to be split.
+ * @return 0 when everything available has been sent, 1 when the socket is
+ * full, -1 on error or when the body is not valid gzip.
  */
-void splitURL(const char *url) {
-    // Find the position of "://"
-    const char *protocolEnd = strstr(url, "://");
-    const char *protocol = "http://";
-    if (strcmp(protocol, "http://") != 0) {
-        fprintf(stderr, "Invalid URL format: %s\n", url);
-        exit(EXIT_FAILURE);
+static int clientPumpInflate(ClientConn *conn) {
+    for (;;) {
+        int flushed = clientFlush(conn);
+        if (flushed != 0) {
+            return flushed;
+        }
+        IoBuffer *in = conn->inflateIn;
+        if (in != NULL && in->sent == in->len && !conn->inflater.pending) {
+            bufferRelease(&ioBuffers, in);
+            conn->inflateIn = in = NULL;
+        }
+        if (in == NULL && conn->state == CLIENT_SENDING_FILE && conn->fileOffset < conn->fileEnd) {
+            in = conn->inflateIn = bufferAcquire(&ioBuffers, bufferClassSize(2));
+            if (in == NULL) {
+                return -1;
+            }
+            off_t left = conn->fileEnd - conn->fileOffset;
+            ssize_t got = pread(conn->fileFd, in->data, left < (off_t) in->capacity ? (size_t) left : in->capacity,
+                                conn->fileOffset);
+            if (got <= 0) {
+                return -1;
+            }
+            in->len = (size_t) got;
+            conn->fileOffset += got;
+            conn->stats->cacheBytes += (unsigned long long) got;
+            pageStreamReadTo(&conn->pages, conn->fileOffset);
+        }
+        if (in == NULL) {
+            return 0;
+        }
+        conn->out = bufferAcquire(&ioBuffers, bufferClassSize(2));
+        if (conn->out == NULL) {
+            return -1;
+        }
+        size_t used, made;
+        int result = gzipStreamStep(&conn->inflater, in->data + in->sent, in->len - in->sent, &used, conn->out->data,
+                                    conn->out->capacity, &made, 0);
+        in->sent += used;
+        conn->out->len = made;
+        if (result == -1) {
+            return -1;
+        }
+        if (result == 1) {
+            // Whatever follows the gzip trailer is not part of the body
+            in->sent = in->len;
+            conn->fileOffset = conn->fileEnd;
+        }
     }
-    if (protocolEnd == NULL) {
-        fprintf(stderr, "Invalid URL format: %s\n", url);
-        exit(EXIT_FAILURE);
+}
+
+// Serve a cache hit: the header from the out buffer, then the body with sendfile()
+static void clientContinueFile(ClientConn *conn) {
+    int flushed;
+    if (conn->inflater.active) {
+        // Decoded on the way out instead
+        flushed = clientPumpInflate(conn);
+    } else {
+        flushed = clientFlush(conn);
     }
+    while (!conn->inflater.active && flushed == 0 && conn->fileOffset < conn->fileEnd) {
+        ssize_t sent = sendfile(conn->io.fd, conn->fileFd, &conn->fileOffset,
+                                (size_t) (conn->fileEnd - conn->fileOffset));
+        if (sent == -1) {
+            flushed = (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+        } else if (sent == 0) {
+            break;  // File shrank underneath us
+        } else {
+            conn->stats->cacheBytes += (unsigned long long) sent;
+        }
+    }
+    pageStreamReadTo(&conn->pages, conn->fileOffset);
+    if (flushed == 1) {
+        loopModFd(conn->loop, &conn->io, EPOLLOUT);
+        loopArmTimer(conn->loop, &conn->timer, serverTimeouts->idleMs);
+        return;
+    }
+    clientClose(conn);
+}
 
-    // Move to the hostname part
-    const char *hostnameStart = protocolEnd + 3;
+static void onCompressStep(Timer *timer, void *arg) {
+    if (compressQueueStep(&serverCompress, COMPRESS_STEP_BUDGET)) {
+        loopArmTimer(arg, timer, COMPRESS_STEP_MS);
+    }
+}
 
-    // Find the position of ":"
-    const char *portStart = strchr(hostnameStart, ':');
-    const char *pathStart = strchr(hostnameStart, '/');
+// Whether the frequency sketch lets the response in; a key seen once is only relayed
+static int relayAdmitted(ClientConn *conn) {
+    if (serverAdmitAfter == 0) {
+        return 1;
+    }
+    if (admissionAdmit(&serverAdmission, conn->request.cacheKey)) {
+        conn->stats->admitted++;
+        return 1;
+    }
+    conn->stats->rejected++;
+    return 0;
+}
 
-    if (portStart != NULL && (pathStart == NULL || portStart < pathStart)) {
-        // Extract hostname up to the port
-        hostname = malloc(portStart - hostnameStart + 1);
-        strncpy(hostname, hostnameStart, portStart - hostnameStart);
-        hostname[portStart - hostnameStart] = '\0';
-
-        // Move to the port part
-        const char *portEnd = strchr(portStart, '/');
-
-        // Check if the port contains only digits
-        if (portEnd != NULL && portEnd > portStart + 1) {
-            int isDigit = 1;
-            for (const char *digitCheck = portStart + 1; digitCheck < portEnd; ++digitCheck) {
-                if (!isdigit(*digitCheck)) {
-                    isDigit = 0;
-                    break;
-                }
-            }
+static void relayHeader(Fetch *fetch) {
+    ClientConn *conn = fetch->owner;
+    size_t encodingLength;
+    conn->statusCode = fetch->statusCode;
+    const char *encoding = fetchResponseHeader(fetch, "Content-Encoding", &encodingLength);
+    // Only complete 200 responses are cached; a failed open or a busy disk just means streaming through
+    if (fetch->statusCode == 200 && conn->shard != NULL && !conn->noStore && relayAdmitted(conn)) {
+        cacheShardFillResponse(conn->shard, &conn->request, conn->cacheFile, conn->requestHeaders, fetch->in->data,
+                               fetch->headerLength, fetch->contentLength, &conn->fill);
+        if (conn->fill.active) {
+            conn->stats->fills++;
+            conn->fillCounted = 1;
+        }
+    }
+    // Stored as is under the URL's own key: a text body is compressed once it is complete
+    size_t typeLength;
+    const char *type = fetchResponseHeader(fetch, "Content-Type", &typeLength);
+    if (conn->fill.active && conn->fill.path == conn->cacheFile && encoding == NULL && type != NULL &&
+        gzipCompressible(type, typeLength)) {
+        conn->contentType = arenaStrndup(&conn->request.arena, type, typeLength);
+    }
+    // The origin was asked for gzip whatever the client takes
+    if (encoding != NULL && gzipIsEncoding(encoding, encodingLength) && !conn->acceptsGzip) {
+        gzipStreamBegin(&conn->inflater, 0);
+    }
+}
 
-            // If the port contains non-digit characters, throw an error
-            if (!isDigit) {
-                fprintf(stderr, "Invalid port format: %.*s\n", (int) (portEnd - portStart), portStart);
-                free(hostname);
-                exit(EXIT_FAILURE);
-            }
+// The response header without what no longer holds for a decoded body
+static IoBuffer *relayDecodedHeader(const Fetch *fetch, const IoBuffer *chunk) {
+    static const char *const encodedOnly[] = {"content-encoding", "content-length"};
+    const char *response = chunk->data;
+    size_t statusLength = (size_t) (strstr(response, "\r\n") + 2 - response);
+    IoBuffer *header = bufferAcquire(&ioBuffers, 2 * fetch->headerLength + 2);
+    if (header == NULL) {
+        return NULL;
+    }
+    memcpy(header->data, response, statusLength);
+    header->len = statusLength;
+    header->len += httpWithoutHeaders(header->data + statusLength, response + statusLength,
+                                      fetch->headerLength - statusLength, encodedOnly, 2);
+    memcpy(header->data + header->len, "\r\n", 2);
+    header->len += 2;
+    return header;
+}
 
-            // Extract port
-            port = malloc(portEnd - portStart);
-            strncpy(port, portStart + 1, portEnd - portStart - 1);
-            port[portEnd - portStart - 1] = '\0';
+static int relayChunk(Fetch *fetch, size_t bodyOffset) {
+    ClientConn *conn = fetch->owner;
 
-            // Extract filepath
-            filepath = malloc(strlen(portEnd) + 1);
-            strcpy(filepath, portEnd);
-        } else {
-            // No slash after port, throw an error
-            fprintf(stderr, "Invalid port format: %s\n", portStart);
-            free(hostname);
-            exit(EXIT_FAILURE);
+    conn->stats->originBytes += fetch->in->len - bodyOffset;
+    if (conn->fill.active) {
+        uint64_t writeStart = timingClock(conn->timing);
+        int error = cacheFillWrite(&conn->fill, fetch->in->data + bodyOffset, fetch->in->len - bodyOffset);
+        timingSince(conn->timing, TIMING_DISK, writeStart);
+        if (error != 0) {
+            cacheShardFillAbort(&conn->fill, error);
         }
+    }
+
+    // The receive buffer itself moves to the client, no copy
+    IoBuffer *chunk = fetch->in;
+    fetch->in = NULL;
+    int queued;
+    if (conn->inflater.active) {
+        // Or to the decoder, after the header has gone out without the encoding
+        conn->inflateIn = chunk;
+        chunk->sent = bodyOffset;
+        conn->out = bodyOffset > 0 ? relayDecodedHeader(fetch, chunk) : NULL;
+        queued = bodyOffset > 0 && conn->out == NULL ? -1 : clientPumpInflate(conn);
     } else {
-        // No port specified or port appears after a slash
-        if (pathStart != NULL) {
-            // Extract hostname up to the first "/"
-            hostname = malloc(pathStart - hostnameStart + 1);
-            strncpy(hostname, hostnameStart, pathStart - hostnameStart);
-            hostname[pathStart - hostnameStart] = '\0';
-
-            // Extract filepath
-            port = malloc(3);
-            strcpy(port, "80");
-            filepath = malloc(strlen(pathStart) + 1);
-            strcpy(filepath, pathStart);
-        } else {
-            // No port and no path specified
-            hostname = malloc(strlen(hostnameStart) + 1);
-            strcpy(hostname, hostnameStart);
-
-            // Check for colon (:) without a number until the first "/"
-            const char *colonStart = strchr(hostnameStart, ':');
-            if (colonStart != NULL && (pathStart == NULL || colonStart < pathStart)) {
-                // Colon without a number after it, throw an error
-                fprintf(stderr, "Invalid port format: %s\n", colonStart);
-                free(hostname);
-                exit(EXIT_FAILURE);
-            } else {
-                // No port, set to "80"
-                port = malloc(3);
-                strcpy(port, "80");
-            }
+        queued = clientQueue(conn, chunk);
+    }
+    if (queued == -1) {
+        clientClose(conn);
+        return -1;
+    }
+    if (queued == 1) {
+        // The client is slower than the origin: stop reading until it catches up
+        loopModFd(fetch->loop, &fetch->io, 0);
+        loopCancelTimer(fetch->loop, &fetch->phaseTimer);
+        loopModFd(conn->loop, &conn->io, EPOLLIN | EPOLLOUT);
+        loopArmTimer(conn->loop, &conn->timer, serverTimeouts->idleMs);
+    }
+    return 0;
+}
 
-            // Set filepath to "/"
-            filepath = malloc(12);
-            strcpy(filepath, "/index.html");
-            lenUrl+=12;
+static void relayFinish(Fetch *fetch) {
+    ClientConn *conn = fetch->owner;
+
+    conn->bodyBytes = fetch->bodyBytes;
+    if (conn->fill.active) {
+        int committed = -1;
+        if (fetch->contentLength < 0 || fetch->bodyBytes == fetch->contentLength) {
+            uint64_t commitStart = timingClock(conn->timing);
+            committed = cacheShardFillCommit(&conn->fill);
+            timingSince(conn->timing, TIMING_COMMIT, commitStart);
+            if (committed == 0 && conn->contentType != NULL &&
+                compressQueueAdd(&serverCompress, conn->shard, &conn->request, conn->contentType,
+                                 strlen(conn->contentType), fetch->bodyBytes) &&
+                !timerArmed(&compressStep)) {
+                loopArmTimer(conn->loop, &compressStep, COMPRESS_STEP_MS);
+            }
+        } else {
+            cacheShardFillAbort(&conn->fill, CPROXY_ERR_IO);
         }
+        CPROXY_PROBE3(fill_done, conn->request.cacheKey, fetch->bodyBytes, committed == 0);
+        clientFillEnded(conn);
+    }
+    relayRelease(fetch);
+    conn->fetch = NULL;
+    conn->originDone = 1;
+    conn->stats->requests++;
+    if (conn->out == NULL && conn->inflateIn == NULL) {
+        clientClose(conn);
     }
-
-    // Call splitAndStorePath to store path segments in the linked list
-    splitAndStorePath(filepath);
 }
 
+static void relayFail(Fetch *fetch) {
+    ClientConn *conn = fetch->owner;
+    // Nothing reaches the client before the whole response header has arrived
+    int forwarded = fetch->headerRead;
 
-/**
- * @brief Prints and displays the values in the linked list.
- */
-void printPathList() {
-    printf("Path List:");
-    Node *current = pathList;
-    while (current != NULL) {
-        printf("%s\n", current->value);
-        current = current->next;
+    fprintf(stderr, "%s%s: %s\n", fetch->hostname, fetch->filepath, cproxyStrerror(fetch->error));
+    conn->bodyBytes = fetch->bodyBytes;
+    if (conn->timing != NULL) {
+        conn->timing->error = fetch->error;
+    }
+    cacheShardFillAbort(&conn->fill, fetch->error);
+    relayRelease(fetch);
+    conn->fetch = NULL;
+    if (forwarded) {
+        clientClose(conn);
+    } else {
+        clientRespondError(conn, "502 Bad Gateway");
     }
 }
 
+static const FetchHandler relayHandler = {relayHeader, relayChunk, relayFinish, relayFail};
+
+static void clientStartRelay(ClientConn *conn) {
+    Fetch *fetch = calloc(1, sizeof(Fetch));
+    if (fetch == NULL) {
+        clientRespondError(conn, "503 Service Unavailable");
+        return;
+    }
+    fetch->handler = &relayHandler;
+    fetch->owner = conn;
+    fetch->hostname = conn->request.hostname;
+    fetch->filepath = conn->request.filepath;
+    fetch->cacheKey = conn->request.cacheKey;
+    fetch->requestHeaders = conn->requestHeaders;
+    fetch->timing = conn->timing;
+    deferredInit(&fetch->release, free, fetch);
+    int error = fetchStart(fetch, conn->loop, &ioBuffers, serverTimeouts, conn->request.port);
+    if (error != 0) {
+        fprintf(stderr, "%s%s: %s\n", fetch->hostname, fetch->filepath, cproxyStrerror(error));
+        if (conn->timing != NULL) {
+            conn->timing->error = error;
+        }
+        free(fetch);
+        clientRespondError(conn, "502 Bad Gateway");
+        return;
+    }
+    conn->fetch = fetch;
+    conn->state = CLIENT_RELAYING;
+    conn->stats->misses++;
+    // The fetch has its own deadlines; keep watching the client only to notice it leaving
+    loopCancelTimer(conn->loop, &conn->timer);
+}
 
 /**
- * @brief Generates an HTTP response for a file.
- *
- * Given a file path, this function generates an HTTP response
- * with the following format:
- * HTTP/1.0 200 OK\r\n
- * Content-Length: N\r\n\r\n
- * Where N is the file size in bytes.
- *
- * @param filePath The path to the file.
+ * @brief Maps the requested URL to its cache file and serves it or fetches it.
  */
-void generateHTTPResponse(const char *filePath) {
-    // Open the file
-    FILE *file = fopen(filePath, "rb");
-    if (file == NULL) {
-        perror("Error opening file");
-        freeAll();
-        exit(EXIT_FAILURE);
+static void clientHandleRequest(ClientConn *conn) {
+    const char *request = conn->in->data;
+    size_t requestLength = conn->in->len;
+    char url[conn->in->capacity];
+
+    loopCancelTimer(conn->loop, &conn->timer);
+    conn->started = timingNow();
+    if (timingEnabled()) {
+        timingStart(&conn->timingData);
+        conn->timing = &conn->timingData;
+    }
+    if (strncmp(request, "GET ", 4) != 0) {
+        clientRespondError(conn, "501 Not Implemented");
+        return;
+    }
+    const char *target = request + 4;
+    size_t targetLen = strcspn(target, " \r\n");
+    const char *lines = strstr(request, "\r\n") + 2;
+    size_t linesLength = (size_t) (strstr(request, "\r\n\r\n") + 2 - lines);
+    if (target[0] == '/') {
+        // Origin-form request: take the host from the Host header, whatever the case of its name
+        size_t hostLength;
+        const char *host = httpHeaderFind(lines, linesLength, "Host", &hostLength);
+        if (host == NULL) {
+            clientRespondError(conn, "400 Bad Request");
+            return;
+        }
+        snprintf(url, sizeof(url), "http://%.*s%.*s", (int) hostLength, host, (int) targetLen, target);
+    } else {
+        snprintf(url, sizeof(url), "%.*s", (int) targetLen, target);
+    }
+    // The header lines after the request line go on to the origin, minus hop-by-hop ones
+    char headers[2 * linesLength + sizeof(HTTP_ACCEPT_GZIP)];
+    size_t headersLength = httpForwardHeaders(headers, lines, linesLength);
+    size_t authorizationLength;
+    conn->noStore = httpHeaderFind(lines, linesLength, "Authorization", &authorizationLength) != NULL;
+    conn->acceptsGzip = gzipAccepted(lines, linesLength);
+    // The request has been consumed; nothing is in flight from the client any more
+    bufferRelease(&ioBuffers, conn->in);
+    conn->in = NULL;
+    if (!isValidProxyURL(url)) {
+        clientRespondError(conn, "400 Bad Request");
+        return;
     }
 
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    long fileSize = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    // Generate HTTP response
-    printf("HTTP/1.0 200 OK\r\n");
-    printf("Content-Length: %ld\r\n\r\n", fileSize);
-
-    // Print file content to stdout (you might want to send it to the client in a real proxy)
-    char buffer[1024];
-    size_t bytesRead;
-    size_t totalBytes = 0;  // Variable to track total response bytes
-
-    while ((bytesRead = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-        fwrite(buffer, 1, bytesRead, stdout);
-        totalBytes += bytesRead;  // Update total response bytes
+    // Everything derived from the URL is bump-allocated from one pool buffer and released with it
+    conn->requestStorage = bufferAcquire(&ioBuffers, bufferClassSize(0));
+    if (conn->requestStorage == NULL) {
+        clientRespondError(conn, "503 Service Unavailable");
+        return;
+    }
+    RequestContext *ctx = &conn->request;
+    requestContextInit(ctx, conn->requestStorage->data, conn->requestStorage->capacity);
+    int error = splitURL(ctx, url);
+    if (error == 0) {
+        error = canonicalizeURL(ctx, &serverKeyRules);
+    }
+    if (error == 0) {
+        conn->requestHeaders = arenaStrndup(&ctx->arena, headers, headersLength);
+        error = conn->requestHeaders == NULL ? CPROXY_ERR_NOMEM : 0;
+    }
+    if (error != 0) {
+        clientRespondError(conn, error == CPROXY_ERR_URL ? "400 Bad Request" : "503 Service Unavailable");
+        return;
+    }
+    // With every disk down the proxy still relays, it just stores nothing
+    conn->shard = cacheSetPick(&serverCache, ctx);
+    conn->cacheFile = conn->shard != NULL ? cachePathFor(&conn->shard->cache, ctx) : NULL;
+    if (conn->shard != NULL && conn->cacheFile == NULL) {
+        clientRespondError(conn, "503 Service Unavailable");
+        return;
+    }
+    timingMark(conn->timing, TIMING_PARSE);
+    CPROXY_PROBE2(request_start, ctx->cacheKey, requestLength);
+
+    CacheObject object;
+    const char *objectPath = conn->cacheFile;
+    const char *objectHeaders;
+    unsigned long corrupt = conn->shard != NULL ? conn->shard->cache.corrupt : 0;
+    int hit = conn->shard != NULL &&
+              cacheLookup(&conn->shard->cache, ctx, conn->requestHeaders, &objectPath, &object, &objectHeaders) == 0;
+    timingMark(conn->timing, TIMING_LOOKUP);
+    CPROXY_PROBE3(cache_lookup, ctx->cacheKey, hit, hit ? (long) object.length : 0L);
+    if (conn->shard != NULL && conn->shard->cache.corrupt != corrupt) {
+        conn->stats->refused++;
+    }
+    if (hit) {
+        conn->statusCode = 200;
+        conn->bodyBytes = (long) object.length;
+        conn->fileFd = object.fd;
+        conn->fileOffset = object.offset;
+        conn->fileEnd = object.offset + object.length;
+        pageStreamRead(&conn->pages, object.fd, object.offset, object.length, &conn->shard->cache.pages);
+        conn->stats->probedPages += conn->pages.probed;
+        conn->stats->residentPages += conn->pages.resident;
+        // A variant brings the headers that describe it, e.g. its Content-Encoding
+        const char *extra = objectHeaders != NULL ? objectHeaders : "";
+        size_t extraLength = strlen(extra);
+        size_t encodingLength;
+        const char *encoding = httpHeaderFind(extra, extraLength, "Content-Encoding", &encodingLength);
+        conn->out = bufferAcquire(&ioBuffers, 64 + extraLength);
+        if (conn->out == NULL) {
+            clientClose(conn);
+            return;
+        }
+        if (encoding != NULL && gzipIsEncoding(encoding, encodingLength) && !conn->acceptsGzip &&
+            gzipStreamBegin(&conn->inflater, 0) == 0) {
+            // Decoded on the way out; its length is known only at the end, which the close marks
+            static const char *const encodedOnly[] = {"content-encoding"};
+            memcpy(conn->out->data, "HTTP/1.0 200 OK\r\n", 17);
+            conn->out->len = 17 + httpWithoutHeaders(conn->out->data + 17, extra, extraLength, encodedOnly, 1);
+            memcpy(conn->out->data + conn->out->len, "\r\n", 2);
+            conn->out->len += 2;
+        } else {
+            conn->out->len = (size_t) snprintf(conn->out->data, conn->out->capacity,
+                                               "HTTP/1.0 200 OK\r\nContent-Length: %ld\r\n%s\r\n",
+                                               (long) object.length, extra);
+        }
+        conn->state = CLIENT_SENDING_FILE;
+        conn->stats->requests++;
+        conn->stats->hits++;
+        clientContinueFile(conn);
+        return;
     }
+    clientStartRelay(conn);
+}
 
-    //TODO:CHEECK IF ALSO PRINT AND ALSO OPEN
-    if (saveLocally == 1) {
-        char *full = build_full_path(currentPath);
-        openInBrowser(full);
-        free(full);
+static void clientReadRequest(ClientConn *conn) {
+    // Borrow a buffer only now that the request is actually arriving
+    if (conn->in == NULL) {
+        conn->in = bufferAcquire(&ioBuffers, 4096);
+        if (conn->in == NULL) {
+            clientClose(conn);
+            return;
+        }
     }
-    // Close the file
-    fclose(file);
+    IoBuffer *in = conn->in;
+    ssize_t bytesRead = recv(conn->io.fd, in->data + in->len, in->capacity - 1 - in->len, 0);
+    if (bytesRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (in->len == 0) {
+            bufferRelease(&ioBuffers, in);
+            conn->in = NULL;
+        }
+        return;
+    }
+    if (bytesRead <= 0) {
+        clientClose(conn);
+        return;
+    }
+    in->len += (size_t) bytesRead;
+    in->data[in->len] = '\0';
+    if (httpHeaderEnd(in->data, in->len) != NULL) {
+        if (conn->metrics) {
+            clientServeMetrics(conn);
+        } else {
+            clientHandleRequest(conn);
+        }
+    } else if (in->len == in->capacity - 1) {
+        clientRespondError(conn, "431 Request Header Fields Too Large");
+    }
+}
 
-    char responseHeader[1024];  // Adjust the size as needed
-    sprintf(responseHeader, "HTTP/1.0 200 OK\r\nContent-Length: %ld\r\n\r\n", fileSize);
+static void clientOnIo(IoWatcher *watcher, uint32_t events) {
+    ClientConn *conn = watcher->arg;
+
+    switch (conn->state) {
+        case CLIENT_READING:
+            clientReadRequest(conn);
+            break;
+        case CLIENT_SENDING_FILE:
+            clientContinueFile(conn);
+            break;
+        case CLIENT_FLUSHING:
+            if (clientFlush(conn) != 1) {
+                clientClose(conn);
+            }
+            break;
+        case CLIENT_RELAYING:
+            if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                // Nothing more is expected from the client; this only detects it going away
+                char scratch[512];
+                ssize_t bytesRead = recv(watcher->fd, scratch, sizeof(scratch), 0);
+                if (bytesRead == 0 || (bytesRead == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    clientClose(conn);
+                    return;
+                }
+            }
+            if (events & EPOLLOUT) {
+                int flushed = conn->inflater.active ? clientPumpInflate(conn) : clientFlush(conn);
+                if (flushed == -1 || (flushed == 0 && conn->originDone)) {
+                    clientClose(conn);
+                } else if (flushed == 0) {
+                    // Caught up: resume reading from the origin
+                    loopCancelTimer(conn->loop, &conn->timer);
+                    loopModFd(conn->loop, &conn->io, EPOLLIN);
+                    loopModFd(conn->fetch->loop, &conn->fetch->io, EPOLLIN);
+                    loopArmTimer(conn->fetch->loop, &conn->fetch->phaseTimer, serverTimeouts->idleMs);
+                }
+            }
+            break;
+    }
+}
 
-    // Print total response bytes
-    printf("\nTotal response bytes: %zu\n", totalBytes + strlen(responseHeader));
+static void clientOnTimeout(Timer *timer, void *arg) {
+    (void) timer;
+    clientClose(arg);
 }
 
 /**
- * @brief Checks if the specified directory structure exists.
- *
- * Given a hostname and a linked list representing the path, this function
- * checks if the specified directory structure exists. The last segment in
- * the path list is assumed to be a file.
- *
- * @param hostname The hostname for the top-level directory.
- * @param pathList Linked list representing the internal folders.
+ * @brief Takes a freshly accepted client socket into the worker's connection pool.
  */
-void checkDirectoryExistence(const char *hostname, Node *pathList) {
-
-    buildPath(hostname, pathList);
+static ClientConn *clientAccept(EventLoop *loop, int clientFd, WorkerStats *stats) {
+    ClientConn *conn = clientAlloc();
+    if (conn == NULL) {
+        close(clientFd);
+        return NULL;
+    }
+    conn->loop = loop;
+    conn->stats = stats;
+    workerStats = stats;
+    conn->state = CLIENT_READING;
+    if (accessLogging) {
+        struct sockaddr_in peer;
+        socklen_t peerLength = sizeof(peer);
+        if (getpeername(clientFd, (struct sockaddr *) &peer, &peerLength) == 0 && peer.sin_family == AF_INET) {
+            conn->peer = peer.sin_addr.s_addr;
+        }
+    }
+    conn->fileFd = -1;
+    stats->active++;
+    watcherInit(&conn->io, clientFd, clientOnIo, conn);
+    timerInit(&conn->timer, clientOnTimeout, conn);
+    deferredInit(&conn->release, clientRelease, conn);
+    if (loopAddFd(loop, &conn->io, EPOLLIN) == -1) {
+        perror("epoll_ctl");
+        close(clientFd);
+        stats->active--;
+        clientRelease(conn);
+        return NULL;
+    }
+    loopArmTimer(loop, &conn->timer, serverTimeouts->headerMs);
+    return conn;
+}
 
-    // Check if the file exists locally
-    if (access(currentPath, F_OK) == -1) {
-        printf("File does not exist locally: %s\n", currentPath);
+static void acceptClient(EventLoop *loop, int clientFd, WorkerStats *stats) {
+    clientAccept(loop, clientFd, stats);
+}
 
-        // Use the new function to send HTTP request and receive response
-        sendHTTPRequestAndReceiveResponse(hostname, port, filepath);
-    } else {
-        generateHTTPResponse(currentPath);
-        printf("Directory structure and file exist locally: %s\n", currentPath);
-        printf("File is given from the local filesystem\n");
+// A scrape takes a connection from the same pool, so a flood of them is bounded like clients are
+static void acceptMetricsClient(EventLoop *loop, int clientFd, WorkerStats *stats) {
+    ClientConn *conn = clientAccept(loop, clientFd, stats);
+    if (conn != NULL) {
+        conn->metrics = 1;
     }
 }
 
@@ -713,7 +1268,130 @@ void checkDirectoryExistence(const char *hostname, Node *pathList) {
 //    return 0;
 //}
 
-int main() {
+// Say when a disk leaves or rejoins the ring
+static void reportCacheRoots(void) {
+    for (unsigned int i = 0; i < serverCache.count; i++) {
+        const CacheShard *shard = &serverCache.shards[i];
+        const char *root = shard->root != NULL ? shard->root : ".";
+        if (shard->up && !serverRootWasUp[i]) {
+            fprintf(stderr, "Cache root %s is up\n", root);
+        } else if (!shard->up && serverRootWasUp[i]) {
+            fprintf(stderr, "Cache root %s is down, its objects go to the other roots\n", root);
+        }
+        serverRootWasUp[i] = shard->up;
+    }
+}
+
+static void onCacheMaintenance(Timer *timer, void *arg) {
+    cacheSetMaintain(&serverCache);
+    if (workerStats != NULL) {
+        publishBufferPool(workerStats);
+    }
+    reportCacheRoots();
+    loopArmTimer(arg, timer, CACHE_MAINTENANCE_MS);
+}
+
+/**
+ * @brief Opens the cache in a freshly forked worker.
+ *
+ * The segment store's active segment and the lock on it belong to one
+ * process, so every worker opens its own.
+ */
+static void workerStart(EventLoop *loop, int index) {
+    int error = cacheSetInit(&serverCache, serverCacheRoots, serverCacheRootCount, serverPackLimit);
+    if (error == CPROXY_ERR_NOMEM) {
+        fprintf(stderr, "Could not set up the cache, relaying without it\n");
+    } else if (error != 0 && index == 0) {
+        fprintf(stderr, "Cache roots, segments, blobs or index unavailable, running without them\n");
+    }
+    // Every worker probes the same disks; only the first one says so at startup
+    for (unsigned int i = 0; i < serverCache.count; i++) {
+        serverRootWasUp[i] = index == 0 || serverCache.shards[i].up;
+    }
+    reportCacheRoots();
+    timerInit(&cacheMaintenance, onCacheMaintenance, loop);
+    loopArmTimer(loop, &cacheMaintenance, CACHE_MAINTENANCE_MS);
+    compressQueueInit(&serverCompress);
+    timerInit(&compressStep, onCompressStep, loop);
+    if (timingSummaries != NULL) {
+        timingSummary = &timingSummaries[index];
+    }
+    if (accessLogPath != NULL) {
+        if (accessLogOpen(&accessLog, accessLogPath) == 0) {
+            accessLogging = 1;
+        } else if (index == 0) {
+            perror(accessLogPath);
+        }
+    }
+}
+
+// Runs in every worker once its loop has stopped
+static void workerStop(int index) {
+    (void) index;
+    if (accessLogging) {
+        accessLogClose(&accessLog);
+        accessLogging = 0;
+    }
+}
+
+/**
+ * @brief Prints what the index holds and how much sharing identical bodies saves
+ * in the cache under root, NULL for the working directory.
+ *
+ * @return 0 on success, -1 if the blob directory could not be read.
+ */
+static int printCacheReport(const char *root) {
+    Cache cache;
+    DedupReport report;
+    if (serverCacheRootCount > 1) {
+        printf("Cache root %s:\n", root);
+    }
+    cacheInit(&cache, root, 0);
+    if (!cache.dedup || dedupReport(&cache.blobs, &report) == -1) {
+        fprintf(stderr, "Could not read the cache's blob directory\n");
+        cacheClose(&cache);
+        return -1;
+    }
+    if (cache.indexed) {
+        printf("Indexed file-backed objects: %zu, %llu bytes\n", cache.index.entries,
+               (unsigned long long) cache.index.bytes);
+    }
+    cacheClose(&cache);
+    printf("File-backed objects: %lu sharing %lu distinct bodies\n", report.references, report.blobs);
+    printf("Logical size: %llu bytes, stored: %llu bytes\n",
+           (unsigned long long) report.logicalBytes, (unsigned long long) report.physicalBytes);
+    printf("Dedup ratio: %.2f, bytes saved: %llu\n",
+           report.physicalBytes > 0 ? (double) report.logicalBytes / (double) report.physicalBytes : 1.0,
+           (unsigned long long) (report.logicalBytes - report.physicalBytes));
+    return 0;
+}
+
+/**
+ * @brief Prints and displays the path segments.
+ */
+static void printPathList(const RequestContext *ctx) {
+    printf("Path List:");
+    for (size_t i = 0; i < ctx->segmentCount; i++) {
+        printf("%s\n", ctx->segments[i]);
+    }
+}
+
+static void printUsage(const char *program) {
+    fprintf(stderr, "Usage: %s [<URL>]\n", program);
+    fprintf(stderr, "       %s -l <port> [-m <metrics port>] [-w <workers>] [-p] [-c <connections>] [-k <pack limit>]\n",
+            program);
+    fprintf(stderr, "          [-d <cache dir>]... [-a <access log>] [-A <requests before a response is stored>]\n");
+    fprintf(stderr, "          [-s <query parameter to ignore>]... [-o (keep query parameter order)]\n");
+    fprintf(stderr, "       -t <file, - for stderr> (one JSON line of phase timings per request)\n");
+    fprintf(stderr, "       -T (latency histograms of the request phases at exit)\n");
+    fprintf(stderr, "       -D (one-shot: print the URL components, the path list and the response)\n");
+    fprintf(stderr, "       %s [-d <cache dir>]... -R <depth> [-j <fetches at once>] [-n <max pages>] [-H <host>]... <URL>\n",
+            program);
+    fprintf(stderr, "          (mirror: fetch the page and the same-site pages it links to into the cache)\n");
+    fprintf(stderr, "       %s [-d <cache dir>]... -r    (report cache contents and deduplication)\n", program);
+}
+
+int main(int argc, char *argv[]) {
     //const char *url = "http://www.yoyo.com:aaaaaa/pub/files/fo1.html"; // error
 
     //const char *url=  "http://www1.bobmovies.us";
@@ -725,32 +1403,213 @@ int main() {
     //const char *url ="http://www.josephwcarrillo.com/news.html";//4--open folder+browser
     //const char *url =" http://www.josephwcarrillo.com";//5--open folder+browser
     const char *url = "http://www.josephwcarrillo.com/JosephWhitfieldCarrillo.jpg";
-    lenUrl = strlen(url);
+
+    // Proxy server mode: -l <port> starts the workers instead of fetching one URL
+    WorkerConfig config;
+    memset(&config, 0, sizeof(config));
+    config.workers = 1;
+    bufferPoolInit(&ioBuffers);
+    serverKeyRules = defaultKeyRules;
+    memcpy(serverStripParams, defaultKeyRules.stripParams, defaultKeyRules.stripCount * sizeof(const char *));
+    serverKeyRules.stripParams = serverStripParams;
+    int report = 0;
+    int summary = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "l:m:w:pc:k:d:s:ort:Ta:A:DR:j:n:H:")) != -1) {
+        switch (opt) {
+            case 'l':
+                config.port = atoi(optarg);
+                break;
+            case 'm':
+                config.metricsPort = atoi(optarg);
+                break;
+            case 'w':
+                config.workers = atoi(optarg);
+                break;
+            case 'p':
+                config.pinCpus = 1;
+                break;
+            case 'c':
+                maxClientConnections = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'k':
+                serverPackLimit = (size_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                // Repeated for several disks; objects are spread over all of them
+                if (serverCacheRootCount == CACHE_MAX_SHARDS) {
+                    fprintf(stderr, "At most %d cache directories\n", CACHE_MAX_SHARDS);
+                    exit(EXIT_FAILURE);
+                }
+                serverCacheRoots[serverCacheRootCount++] = optarg;
+                break;
+            case 's':
+                // Query parameters that do not change the response, e.g. "sessionid" or "ref_*"
+                if (serverKeyRules.stripCount == sizeof(serverStripParams) / sizeof(serverStripParams[0])) {
+                    fprintf(stderr, "Too many parameters to strip\n");
+                    exit(EXIT_FAILURE);
+                }
+                serverStripParams[serverKeyRules.stripCount++] = optarg;
+                break;
+            case 'o':
+                serverKeyRules.keepOrder = 1;
+                break;
+            case 'r':
+                report = 1;
+                break;
+            case 't':
+                timingLogFd = strcmp(optarg, "-") == 0 ? STDERR_FILENO
+                                                       : open(optarg, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                if (timingLogFd == -1) {
+                    perror(optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'T':
+                summary = 1;
+                break;
+            case 'a':
+                accessLogPath = optarg;
+                break;
+            case 'A':
+                serverAdmitAfter = (unsigned int) strtoul(optarg, NULL, 10);
+                if (serverAdmitAfter > 15) {
+                    fprintf(stderr, "The sketch counts up to 15 requests\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'D':
+                debugOutput = 1;
+                break;
+            case 'R':
+                mirrorDepth = atoi(optarg);
+                break;
+            case 'j':
+                mirrorOptions.concurrency = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                mirrorOptions.maxPages = strtoul(optarg, NULL, 10);
+                break;
+            case 'H':
+                // Other hosts of the same site, e.g. a static content server
+                if (mirrorOptions.hostCount == sizeof(mirrorHosts) / sizeof(mirrorHosts[0])) {
+                    fprintf(stderr, "Too many hosts\n");
+                    exit(EXIT_FAILURE);
+                }
+                mirrorHosts[mirrorOptions.hostCount++] = optarg;
+                break;
+            default:
+                printUsage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (report) {
+        int status = EXIT_SUCCESS;
+        for (unsigned int i = 0; i < serverCacheRootCount || (i == 0 && serverCacheRootCount == 0); i++) {
+            if (printCacheReport(serverCacheRoots[i]) != 0) {
+                status = EXIT_FAILURE;
+            }
+        }
+        return status;
+    }
+    if (config.port > 0) {
+        config.onStart = workerStart;
+        config.onStop = workerStop;
+        size_t summariesSize = sizeof(TimingSummary) * (size_t) (config.workers > 0 ? config.workers : 1);
+        if (serverAdmitAfter > 0 && admissionInit(&serverAdmission, ADMISSION_ENTRIES, serverAdmitAfter) != 0) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        if (summary) {
+            // Every worker records into its own; the master merges them once the workers are gone
+            timingSummaries = mmap(NULL, summariesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (timingSummaries == MAP_FAILED) {
+                perror("mmap");
+                exit(EXIT_FAILURE);
+            }
+        }
+        int status = runWorkers(&config, acceptClient, acceptMetricsClient) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        admissionFree(&serverAdmission);
+        if (timingSummaries != NULL) {
+            TimingSummary total;
+            timingSummaryInit(&total);
+            for (int i = 0; i < config.workers; i++) {
+                timingSummaryMerge(&total, &timingSummaries[i]);
+            }
+            printTimingSummary(&total);
+            munmap(timingSummaries, summariesSize);
+        }
+        return status;
+    }
+    if (optind < argc) {
+        url = argv[optind];
+    }
+    char storage[512];
+    RequestContext ctx;
+    requestContextInit(&ctx, storage, sizeof(storage));
 
     // Split the URL
-    splitURL(url);
+    if (splitURL(&ctx, url) != 0) {
+        fprintf(stderr, "Invalid URL format: %s\n", url);
+        requestContextFree(&ctx);
+        exit(EXIT_FAILURE);
+    }
 
-    // Print original components
-    printf("Original Components:\n");
-    printf("Protocol: %s\n", protocol);
-    printf("Hostname: %s\n", hostname);
-    printf("Port: %s (Length: %zu)\n", port, strlen(port));
-    printf("Filepath: %s\n", filepath);
+    if (debugOutput) {
+        // Print original components
+        printf("Original Components:\n");
+        printf("Protocol: %s\n", ctx.protocol);
+        printf("Hostname: %s\n", ctx.hostname);
+        printf("Port: %s (Length: %zu)\n", ctx.port, strlen(ctx.port));
+        printf("Filepath: %s\n", ctx.filepath);
 
-    // Display stored path segments
-    printPathList();
+        // Display stored path segments
+        printPathList(&ctx);
+    }
 
-    // Check directory existence
-    checkDirectoryExistence(hostname, pathList);
+    // Look the object up in the cache and fetch it if it is missing
+    CproxyOptions options;
+    memset(&options, 0, sizeof(options));
+    options.cacheRoots = serverCacheRoots;
+    options.cacheRootCount = serverCacheRootCount;
+    options.keyRules = &serverKeyRules;
+    options.admitAfter = serverAdmitAfter;
+    TimingSummary oneShotSummary;
+    if (summary) {
+        timingSummaryInit(&oneShotSummary);
+        timingSummary = &oneShotSummary;
+    }
+    options.timing = timingEnabled();
+    CproxyClient *client = cproxyCreate(&options);
+    if (client == NULL) {
+        perror("Could not create the proxy client");
+        requestContextFree(&ctx);
+        exit(EXIT_FAILURE);
+    }
+    if (mirrorDepth >= 0) {
+        int status = runMirror(client, url, &serverKeyRules);
+        cproxyDestroy(client);
+        if (timingSummary != NULL) {
+            printTimingSummary(timingSummary);
+        }
+        requestContextFree(&ctx);
+        return status;
+    }
+    OneShot oneShot = {&ctx, EXIT_SUCCESS};
+    int error = cproxySubmit(client, url, oneShotDone, &oneShot);
+    if (error != CPROXY_OK) {
+        fprintf(stderr, "%s: %s\n", url, cproxyStrerror(error));
+        oneShot.status = EXIT_FAILURE;
+    } else {
+        cproxyRun(client);
+    }
+    cproxyDestroy(client);
+    if (timingSummary != NULL) {
+        printTimingSummary(timingSummary);
+    }
 
     // Free allocated memory
-    free(hostname);
-    free(port);
-    free(filepath);
-    free(currentPath);
-
-    // Free memory allocated for the linked list
-    freePathList();
+    requestContextFree(&ctx);
 
-    return 0;
+    return oneShot.status;
 }
\ No newline at end of file
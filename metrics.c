@@ -0,0 +1,157 @@
+#include "metrics.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+// Upper bounds of the latency buckets, in microseconds: 100 us to 10 s
+static const unsigned long latencyBoundsUs[LATENCY_BUCKETS] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+// Other workers write while a scrape reads; a relaxed load keeps the compiler from tearing or caching it
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+/**
+ * @brief Counts one request of ns nanoseconds; only the owning worker calls it.
+ */
+void latencyRecord(LatencyCounts *counts, uint64_t ns) {
+    unsigned int bucket = 0;
+    uint64_t us = ns / 1000;
+    // Most requests land in the first few buckets
+    while (bucket < LATENCY_BUCKETS && us > latencyBoundsUs[bucket]) {
+        bucket++;
+    }
+    counts->buckets[bucket]++;
+    counts->sumNs += ns;
+}
+
+static void append(char *out, size_t size, size_t *length, const char *format, ...) {
+    if (*length >= size) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(out + *length, size - *length, format, args);
+    va_end(args);
+    *length += written < 0 ? size : (size_t) written;
+}
+
+static void appendHeader(char *out, size_t size, size_t *length, const char *name, const char *type,
+                         const char *help) {
+    append(out, size, length, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void appendValue(char *out, size_t size, size_t *length, const char *name, const char *type, const char *help,
+                        unsigned long long value) {
+    appendHeader(out, size, length, name, type, help);
+    append(out, size, length, "%s %llu\n", name, value);
+}
+
+static void appendLatency(char *out, size_t size, size_t *length, const char *cache, const LatencyCounts *counts) {
+    unsigned long long cumulative = 0;
+    for (unsigned int i = 0; i <= LATENCY_BUCKETS; i++) {
+        cumulative += counts->buckets[i];
+        if (i < LATENCY_BUCKETS) {
+            append(out, size, length, "cproxy_request_duration_seconds_bucket{cache=\"%s\",le=\"%g\"} %llu\n", cache,
+                   (double) latencyBoundsUs[i] / 1e6, cumulative);
+        } else {
+            append(out, size, length, "cproxy_request_duration_seconds_bucket{cache=\"%s\",le=\"+Inf\"} %llu\n",
+                   cache, cumulative);
+        }
+    }
+    append(out, size, length, "cproxy_request_duration_seconds_sum{cache=\"%s\"} %.9f\n", cache,
+           (double) counts->sumNs / 1e9);
+    append(out, size, length, "cproxy_request_duration_seconds_count{cache=\"%s\"} %llu\n", cache, cumulative);
+}
+
+static void addLatency(LatencyCounts *into, const LatencyCounts *from) {
+    for (unsigned int i = 0; i <= LATENCY_BUCKETS; i++) {
+        into->buckets[i] += LOAD(from->buckets[i]);
+    }
+    into->sumNs += LOAD(from->sumNs);
+}
+
+/**
+ * @brief Sums the counters of every worker into the Prometheus text format.
+ *
+ * This is the only place the per-worker counters are added up, so the
+ * request paths never share a cache line or take a lock to count.
+ *
+ * @return Length of the text, or 0 if it does not fit in size bytes.
+ */
+size_t metricsFormat(char *out, size_t size, const WorkerStats *stats, int workers, unsigned long connectionLimit) {
+    WorkerStats total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < workers; i++) {
+        const WorkerStats *worker = &stats[i];
+        total.accepted += LOAD(worker->accepted);
+        total.requests += LOAD(worker->requests);
+        total.hits += LOAD(worker->hits);
+        total.active += LOAD(worker->active);
+        total.probedPages += LOAD(worker->probedPages);
+        total.residentPages += LOAD(worker->residentPages);
+        total.misses += LOAD(worker->misses);
+        total.refused += LOAD(worker->refused);
+        total.fills += LOAD(worker->fills);
+        total.admitted += LOAD(worker->admitted);
+        total.rejected += LOAD(worker->rejected);
+        total.cacheBytes += LOAD(worker->cacheBytes);
+        total.originBytes += LOAD(worker->originBytes);
+        for (int j = 0; j < BUFFER_CLASSES; j++) {
+            total.buffersInUse[j] += LOAD(worker->buffersInUse[j]);
+        }
+        total.bufferSlabs += LOAD(worker->bufferSlabs);
+        total.logDropped += LOAD(worker->logDropped);
+        addLatency(&total.hitLatency, &worker->hitLatency);
+        addLatency(&total.missLatency, &worker->missLatency);
+    }
+
+    size_t length = 0;
+    appendValue(out, size, &length, "cproxy_workers", "gauge", "Worker processes.", (unsigned long long) workers);
+    appendValue(out, size, &length, "cproxy_connections_accepted_total", "counter", "Client connections accepted.",
+                total.accepted);
+    appendValue(out, size, &length, "cproxy_connections_active", "gauge", "Client connections open.", total.active);
+    appendValue(out, size, &length, "cproxy_connections_limit", "gauge",
+                "Client connections the workers take at most.", connectionLimit);
+    appendValue(out, size, &length, "cproxy_requests_total", "counter", "Requests answered.", total.requests);
+    appendValue(out, size, &length, "cproxy_cache_hits_total", "counter", "Requests answered from the cache.",
+                total.hits);
+    appendValue(out, size, &length, "cproxy_cache_misses_total", "counter", "Requests relayed to the origin.",
+                total.misses);
+    appendValue(out, size, &length, "cproxy_cache_refused_total", "counter",
+                "Stored copies found but refused for failing their checksum, and refetched.", total.refused);
+    appendValue(out, size, &length, "cproxy_cache_fills_in_progress", "gauge", "Responses being stored.",
+                total.fills);
+    appendValue(out, size, &length, "cproxy_cache_admitted_total", "counter",
+                "Responses stored because their URL was asked for often enough lately.", total.admitted);
+    appendValue(out, size, &length, "cproxy_cache_rejected_total", "counter",
+                "Responses relayed without being stored because their URL was not.", total.rejected);
+
+    appendHeader(out, size, &length, "cproxy_body_bytes_total", "counter",
+                 "Body bytes served from the cache or received from origins.");
+    append(out, size, &length, "cproxy_body_bytes_total{source=\"cache\"} %llu\n", total.cacheBytes);
+    append(out, size, &length, "cproxy_body_bytes_total{source=\"origin\"} %llu\n", total.originBytes);
+
+    appendHeader(out, size, &length, "cproxy_io_buffers_in_use", "gauge",
+                 "Pooled I/O buffers holding bytes in flight, by size.");
+    for (int i = 0; i < BUFFER_CLASSES; i++) {
+        append(out, size, &length, "cproxy_io_buffers_in_use{size=\"%zu\"} %lu\n", bufferClassSize(i),
+               total.buffersInUse[i]);
+    }
+    appendValue(out, size, &length, "cproxy_io_buffer_slabs", "gauge", "1 MB slabs the buffer pools hold.",
+                total.bufferSlabs);
+
+    appendValue(out, size, &length, "cproxy_access_log_dropped_total", "counter",
+                "Access log entries dropped because the writer was behind.", total.logDropped);
+    appendValue(out, size, &length, "cproxy_page_cache_probed_pages_total", "counter",
+                "Pages of cache hits looked up in the page cache.", total.probedPages);
+    appendValue(out, size, &length, "cproxy_page_cache_resident_pages_total", "counter",
+                "Of those, pages that were resident.", total.residentPages);
+
+    appendHeader(out, size, &length, "cproxy_request_duration_seconds", "histogram",
+                 "From the request header until the response is sent.");
+    appendLatency(out, size, &length, "hit", &total.hitLatency);
+    appendLatency(out, size, &length, "miss", &total.missLatency);
+    return length < size ? length : 0;
+}
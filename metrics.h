@@ -0,0 +1,12 @@
+#ifndef CPROXY_METRICS_H
+#define CPROXY_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "worker.h"
+
+void latencyRecord(LatencyCounts *counts, uint64_t ns);
+size_t metricsFormat(char *out, size_t size, const WorkerStats *stats, int workers, unsigned long connectionLimit);
+
+#endif //CPROXY_METRICS_H
@@ -0,0 +1,679 @@
+#include "mirror.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "gzip.h"
+#include "url.h"
+
+#define DEFAULT_CONCURRENCY 16
+#define DEFAULT_MAX_PAGES 100000
+// Bytes of a body read from the cache at a time
+#define SCAN_CHUNK 65536
+
+enum {
+    SCAN_TEXT,
+    SCAN_OPEN,              // After "<"
+    SCAN_BANG,              // After "<!", maybe a comment
+    SCAN_DECLARATION,       // <!DOCTYPE ...>
+    SCAN_COMMENT,
+    SCAN_TAG_NAME,
+    SCAN_ATTRIBUTES,        // Between attributes
+    SCAN_NAME,
+    SCAN_AFTER_NAME,
+    SCAN_BEFORE_VALUE,
+    SCAN_VALUE
+};
+
+void linkScannerInit(LinkScanner *scanner, void (*onLink)(const char *link, size_t length, void *arg), void *arg) {
+    scanner->state = SCAN_TEXT;
+    scanner->onLink = onLink;
+    scanner->arg = arg;
+}
+
+static int isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f';
+}
+
+static void scannerStartName(LinkScanner *scanner, char c) {
+    scanner->name[0] = c >= 'A' && c <= 'Z' ? (char) (c - 'A' + 'a') : c;
+    scanner->nameLength = 1;
+    scanner->state = SCAN_NAME;
+}
+
+static void scannerEndName(LinkScanner *scanner) {
+    scanner->wanted = (scanner->nameLength == 3 && memcmp(scanner->name, "src", 3) == 0) ||
+                      (scanner->nameLength == 4 && memcmp(scanner->name, "href", 4) == 0);
+}
+
+static void scannerAppend(LinkScanner *scanner, char c) {
+    if (!scanner->wanted) {
+        return;
+    }
+    if (scanner->valueLength < MIRROR_MAX_URL) {
+        scanner->value[scanner->valueLength++] = c;
+    } else {
+        scanner->valueLength = MIRROR_MAX_URL + 1;
+    }
+}
+
+static void scannerEmit(LinkScanner *scanner) {
+    if (!scanner->wanted || scanner->valueLength > MIRROR_MAX_URL) {
+        return;
+    }
+    // "&amp;" is how a query separator has to be written in an attribute
+    size_t n = 0;
+    for (size_t i = 0; i < scanner->valueLength; i++) {
+        scanner->value[n++] = scanner->value[i];
+        if (scanner->value[i] == '&' && i + 4 < scanner->valueLength &&
+            memcmp(scanner->value + i + 1, "amp;", 4) == 0) {
+            i += 4;
+        }
+    }
+    scanner->onLink(scanner->value, n, scanner->arg);
+}
+
+/**
+ * @brief Scans the next piece of a body, calling onLink for every src or href value completed in it.
+ */
+void linkScannerFeed(LinkScanner *scanner, const char *data, size_t length) {
+    const char *end = data + length;
+    for (const char *p = data; p < end; p++) {
+        char c = *p;
+        switch (scanner->state) {
+            case SCAN_TEXT: {
+                const char *open = memchr(p, '<', (size_t) (end - p));
+                if (open == NULL) {
+                    return;
+                }
+                p = open;
+                scanner->state = SCAN_OPEN;
+                break;
+            }
+            case SCAN_OPEN:
+                if (c == '!') {
+                    scanner->dashes = 0;
+                    scanner->state = SCAN_BANG;
+                } else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '/') {
+                    scanner->state = SCAN_TAG_NAME;
+                } else {
+                    // "a < b" in text
+                    scanner->state = c == '<' ? SCAN_OPEN : SCAN_TEXT;
+                }
+                break;
+            case SCAN_BANG:
+                if (c == '-' && ++scanner->dashes == 2) {
+                    scanner->dashes = 0;
+                    scanner->state = SCAN_COMMENT;
+                } else if (c == '>') {
+                    scanner->state = SCAN_TEXT;
+                } else if (c != '-') {
+                    scanner->state = SCAN_DECLARATION;
+                }
+                break;
+            case SCAN_DECLARATION:
+                if (c == '>') {
+                    scanner->state = SCAN_TEXT;
+                }
+                break;
+            case SCAN_COMMENT:
+                if (c == '>' && scanner->dashes >= 2) {
+                    scanner->state = SCAN_TEXT;
+                }
+                scanner->dashes = c == '-' ? scanner->dashes + 1 : 0;
+                break;
+            case SCAN_TAG_NAME:
+                if (c == '>') {
+                    scanner->state = SCAN_TEXT;
+                } else if (isSpace(c)) {
+                    scanner->state = SCAN_ATTRIBUTES;
+                }
+                break;
+            case SCAN_ATTRIBUTES:
+                if (c == '>') {
+                    scanner->state = SCAN_TEXT;
+                } else if (!isSpace(c) && c != '/') {
+                    scannerStartName(scanner, c);
+                }
+                break;
+            case SCAN_NAME:
+                if (c == '=') {
+                    scannerEndName(scanner);
+                    scanner->state = SCAN_BEFORE_VALUE;
+                } else if (c == '>') {
+                    scanner->state = SCAN_TEXT;
+                } else if (isSpace(c)) {
+                    scannerEndName(scanner);
+                    scanner->state = SCAN_AFTER_NAME;
+                } else if (scanner->nameLength < sizeof(scanner->name)) {
+                    // A name longer than the buffer is none the scanner wants
+                    scanner->name[scanner->nameLength++] = c >= 'A' && c <= 'Z' ? (char) (c - 'A' + 'a') : c;
+                }
+                break;
+            case SCAN_AFTER_NAME:
+                if (c == '=') {
+                    scanner->state = SCAN_BEFORE_VALUE;
+                } else if (c == '>') {
+                    scanner->state = SCAN_TEXT;
+                } else if (!isSpace(c)) {
+                    scannerStartName(scanner, c);
+                }
+                break;
+            case SCAN_BEFORE_VALUE:
+                if (isSpace(c)) {
+                    break;
+                }
+                if (c == '>') {
+                    scanner->state = SCAN_TEXT;
+                    break;
+                }
+                scanner->valueLength = 0;
+                scanner->quote = c == '"' || c == '\'' ? c : 0;
+                scanner->state = SCAN_VALUE;
+                if (scanner->quote == 0) {
+                    // The first byte of an unquoted value
+                    scannerAppend(scanner, c);
+                }
+                break;
+            case SCAN_VALUE:
+                if (scanner->quote != 0 ? c == scanner->quote : isSpace(c) || c == '>') {
+                    scannerEmit(scanner);
+                    scanner->state = c == '>' && scanner->quote == 0 ? SCAN_TEXT : SCAN_ATTRIBUTES;
+                } else {
+                    scannerAppend(scanner, c);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static uint64_t mixHash(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/**
+ * @brief Sizes the set for a crawl of at most pages URLs.
+ *
+ * @return 0 on success, CPROXY_ERR_NOMEM otherwise.
+ */
+int visitedInit(VisitedSet *set, unsigned long pages) {
+    set->bloom = pages > MIRROR_EXACT_PAGES;
+    size_t size = 64;
+    size_t wanted = set->bloom ? (size_t) pages * MIRROR_BLOOM_BITS : 2 * (size_t) pages;
+    while (size < wanted) {
+        size *= 2;
+    }
+    set->words = calloc(set->bloom ? size / 64 : size, sizeof(uint64_t));
+    set->mask = size - 1;
+    set->count = 0;
+    return set->words != NULL ? 0 : CPROXY_ERR_NOMEM;
+}
+
+void visitedFree(VisitedSet *set) {
+    free(set->words);
+    set->words = NULL;
+}
+
+/**
+ * @brief Adds the hash of a URL's cache key.
+ *
+ * @return 1 if it was not in the set, 0 if it was (or, with a Bloom
+ * filter, seems to have been) or the set is full.
+ */
+int visitedAdd(VisitedSet *set, uint64_t hash) {
+    if (set->bloom) {
+        // Double hashing: probe i is h1 + i * h2
+        uint64_t step = mixHash(hash) | 1;
+        int added = 0;
+        for (uint64_t i = 0; i < MIRROR_BLOOM_PROBES; i++) {
+            uint64_t bit = (hash + i * step) & set->mask;
+            uint64_t mask = (uint64_t) 1 << (bit & 63);
+            if ((set->words[bit >> 6] & mask) == 0) {
+                set->words[bit >> 6] |= mask;
+                added = 1;
+            }
+        }
+        set->count += (size_t) added;
+        return added;
+    }
+    hash |= 1;
+    size_t slot = hash & set->mask;
+    while (set->words[slot] != 0) {
+        if (set->words[slot] == hash) {
+            return 0;
+        }
+        slot = (slot + 1) & set->mask;
+    }
+    if (2 * (set->count + 1) > set->mask + 1) {
+        return 0;
+    }
+    set->words[slot] = hash;
+    set->count++;
+    return 1;
+}
+
+// ---- Resolving links ----
+
+// Removes "." and ".." segments from a path that starts with "/", in place; returns the new length
+static size_t removeDotSegments(char *path, size_t length) {
+    size_t w = 0;
+    for (size_t r = 0; r < length;) {
+        size_t start = r + 1;
+        size_t end = start;
+        while (end < length && path[end] != '/') {
+            end++;
+        }
+        size_t segmentLength = end - start;
+        int last = end == length;
+        if (segmentLength == 1 && path[start] == '.') {
+            if (last) {
+                path[w++] = '/';
+            }
+        } else if (segmentLength == 2 && path[start] == '.' && path[start + 1] == '.') {
+            while (w > 0 && path[--w] != '/') {
+            }
+            if (last) {
+                path[w++] = '/';
+            }
+        } else {
+            path[w++] = '/';
+            memmove(path + w, path + start, segmentLength);
+            w += segmentLength;
+        }
+        r = end;
+    }
+    if (w == 0) {
+        path[w++] = '/';
+    }
+    return w;
+}
+
+/**
+ * @brief Makes an absolute http:// URL of a link found on the page at base.
+ *
+ * @return 0, or -1 for a link to another scheme, an empty one or one that
+ * does not fit in size bytes.
+ */
+static int resolveLink(const char *base, const char *link, size_t length, char *out, size_t size) {
+    while (length > 0 && isSpace(*link)) {
+        link++;
+        length--;
+    }
+    const char *fragment = memchr(link, '#', length);
+    if (fragment != NULL) {
+        length = (size_t) (fragment - link);
+    }
+    while (length > 0 && isSpace(link[length - 1])) {
+        length--;
+    }
+    if (length == 0) {
+        return -1;
+    }
+    // A scheme is letters and digits, "+", "-" and "." up to a ":" before any "/" or "?"
+    size_t schemeLength = 0;
+    while (schemeLength < length && link[schemeLength] != ':' && link[schemeLength] != '/' &&
+           link[schemeLength] != '?') {
+        schemeLength++;
+    }
+    int absolute = schemeLength < length && link[schemeLength] == ':';
+    if (absolute && !(schemeLength == 4 && strncasecmp(link, "http", 4) == 0)) {
+        return -1;
+    }
+
+    // The base's parts: "http://authority", then the path, which ends at "?" or "#"
+    const char *authority = strstr(base, "://");
+    authority = authority != NULL ? authority + 3 : base;
+    size_t originLength = (size_t) (authority - base) + strcspn(authority, "/?#");
+    const char *basePath = base + originLength;
+    size_t basePathLength = strcspn(basePath, "?#");
+
+    size_t prefixLength;
+    const char *prefix = base;
+    if (absolute) {
+        prefixLength = 0;
+    } else if (length >= 2 && link[0] == '/' && link[1] == '/') {
+        prefix = "http:";
+        prefixLength = 5;
+    } else if (link[0] == '/') {
+        prefixLength = originLength;
+    } else if (link[0] == '?') {
+        prefixLength = originLength + basePathLength;
+    } else {
+        // Relative to the directory of the base
+        size_t directory = basePathLength;
+        while (directory > 0 && basePath[directory - 1] != '/') {
+            directory--;
+        }
+        prefixLength = originLength + directory;
+    }
+    int slash = !absolute && prefix == base && prefixLength == originLength && link[0] != '/';
+    if (prefixLength + (size_t) slash + length + 1 > size) {
+        return -1;
+    }
+    memcpy(out, prefix, prefixLength);
+    if (slash) {
+        // The base has no path at all: "http://host" and "a.png" make "http://host/a.png"
+        out[prefixLength] = '/';
+    }
+    memcpy(out + prefixLength + (size_t) slash, link, length);
+    size_t total = prefixLength + (size_t) slash + length;
+    out[total] = '\0';
+
+    // Dot segments are resolved in the path only, up to the query
+    char *host = strstr(out, "://");
+    if (host == NULL) {
+        return -1;
+    }
+    host += 3;
+    char *path = host + strcspn(host, "/?");
+    if (*path == '/') {
+        size_t pathLength = strcspn(path, "?");
+        size_t resolved = removeDotSegments(path, pathLength);
+        memmove(path + resolved, path + pathLength, strlen(path + pathLength) + 1);
+    }
+    return 0;
+}
+
+// ---- The crawl ----
+
+typedef struct MirrorLink {
+    struct MirrorLink *next;
+    unsigned int depth;
+    char url[];
+} MirrorLink;
+
+typedef struct Mirror {
+    CproxyClient *client;
+    MirrorOptions options;
+    MirrorStats *stats;
+    char origin[256];           // Authority of the first page, as its cache key spells it
+    VisitedSet visited;
+    MirrorLink *head;           // Waiting to be fetched, breadth first
+    MirrorLink *tail;
+    unsigned int inFlight;
+    unsigned long accepted;     // URLs queued, the first page included
+} Mirror;
+
+typedef struct MirrorFetch {
+    Mirror *mirror;
+    unsigned int depth;
+} MirrorFetch;
+
+typedef struct MirrorPage {
+    Mirror *mirror;
+    const char *url;
+    unsigned int depth;         // Of the links found on the page
+} MirrorPage;
+
+/**
+ * @brief The hash of a URL's cache key and the authority the key starts with.
+ *
+ * @return 0, or the CproxyError of parsing the URL.
+ */
+static int mirrorKey(const Mirror *mirror, const char *url, uint64_t *hash, char *authority, size_t size) {
+    char storage[MIRROR_MAX_URL * 2];
+    RequestContext ctx;
+    requestContextInit(&ctx, storage, sizeof(storage));
+    int error = splitURL(&ctx, url);
+    if (error == 0) {
+        error = canonicalizeURL(&ctx, mirror->options.keyRules);
+    }
+    if (error == 0) {
+        const char *key = ctx.cacheKey;
+        size_t length = strcspn(key, "/?");
+        uint64_t h = 1469598103934665603ULL;
+        for (const char *c = key; *c != '\0'; c++) {
+            h ^= (unsigned char) *c;
+            h *= 1099511628211ULL;
+        }
+        *hash = mixHash(h);
+        if (length >= size) {
+            length = size - 1;
+        }
+        memcpy(authority, key, length);
+        authority[length] = '\0';
+    }
+    requestContextFree(&ctx);
+    return error;
+}
+
+static int mirrorAllowed(const Mirror *mirror, const char *authority) {
+    if (strcmp(authority, mirror->origin) == 0) {
+        return 1;
+    }
+    for (unsigned int i = 0; i < mirror->options.hostCount; i++) {
+        if (strcasecmp(authority, mirror->options.hosts[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void mirrorQueue(Mirror *mirror, const char *url, unsigned int depth) {
+    size_t length = strlen(url);
+    MirrorLink *link = malloc(sizeof(MirrorLink) + length + 1);
+    if (link == NULL) {
+        return;
+    }
+    link->next = NULL;
+    link->depth = depth;
+    memcpy(link->url, url, length + 1);
+    if (mirror->tail != NULL) {
+        mirror->tail->next = link;
+    } else {
+        mirror->head = link;
+    }
+    mirror->tail = link;
+    mirror->accepted++;
+}
+
+static void mirrorOnLink(const char *link, size_t length, void *arg) {
+    MirrorPage *page = arg;
+    Mirror *mirror = page->mirror;
+    mirror->stats->links++;
+    char url[MIRROR_MAX_URL + 256];
+    char authority[256];
+    uint64_t hash;
+    if (resolveLink(page->url, link, length, url, sizeof(url)) != 0 ||
+        mirrorKey(mirror, url, &hash, authority, sizeof(authority)) != 0 || !mirrorAllowed(mirror, authority)) {
+        mirror->stats->offsite++;
+        return;
+    }
+    if (mirror->accepted < mirror->options.maxPages && visitedAdd(&mirror->visited, hash)) {
+        mirrorQueue(mirror, url, page->depth);
+        mirror->stats->queued++;
+    }
+}
+
+/**
+ * @brief Feeds a stored body to the link scanner, decoding it if the cache keeps it gzipped.
+ *
+ * Only bodies that start with markup are scanned; an image is not looked into.
+ */
+static void mirrorScan(Mirror *mirror, const CproxyResult *result, unsigned int depth) {
+    MirrorPage page = {mirror, result->url, depth + 1};
+    LinkScanner *scanner = malloc(sizeof(LinkScanner));
+    char *buffer = malloc(2 * SCAN_CHUNK);
+    GzipStream decoder;
+    decoder.active = 0;
+    if (scanner == NULL || buffer == NULL || (result->gzip && gzipStreamBegin(&decoder, 0) == -1)) {
+        free(scanner);
+        free(buffer);
+        return;
+    }
+    char *decoded = buffer + SCAN_CHUNK;
+    linkScannerInit(scanner, mirrorOnLink, &page);
+    int sniffed = 0;
+    for (long offset = 0; offset < result->bodyBytes;) {
+        size_t wanted = (size_t) (result->bodyBytes - offset) < SCAN_CHUNK ? (size_t) (result->bodyBytes - offset)
+                                                                          : SCAN_CHUNK;
+        ssize_t got = pread(result->fd, buffer, wanted, (off_t) (result->offset + offset));
+        if (got <= 0) {
+            break;
+        }
+        offset += got;
+        size_t used = 0;
+        int ended = 0;
+        while (!ended && (used < (size_t) got || (result->gzip && decoder.pending))) {
+            const char *text = buffer + used;
+            size_t textLength = (size_t) got - used;
+            if (result->gzip) {
+                size_t consumed;
+                ended = gzipStreamStep(&decoder, buffer + used, (size_t) got - used, &consumed, decoded, SCAN_CHUNK,
+                                       &textLength, 0);
+                used += consumed;
+                text = decoded;
+                if (ended == 0 && consumed == 0 && textLength == 0) {
+                    break;
+                }
+            } else {
+                used = (size_t) got;
+            }
+            if (ended == -1) {
+                break;
+            }
+            if (!sniffed && textLength > 0) {
+                size_t i = 0;
+                if (textLength >= 3 && memcmp(text, "\xef\xbb\xbf", 3) == 0) {
+                    i = 3;
+                }
+                while (i < textLength && isSpace(text[i])) {
+                    i++;
+                }
+                if (i == textLength) {
+                    continue;
+                }
+                if (text[i] != '<') {
+                    offset = result->bodyBytes;
+                    break;
+                }
+                sniffed = 1;
+                mirror->stats->scanned++;
+            }
+            linkScannerFeed(scanner, text, textLength);
+        }
+        if (ended == -1) {
+            break;
+        }
+    }
+    if (decoder.active) {
+        gzipStreamEnd(&decoder);
+    }
+    free(scanner);
+    free(buffer);
+}
+
+static void mirrorDone(const CproxyResult *result, void *arg);
+
+// Starts queued fetches until the concurrency limit is reached
+static void mirrorPump(Mirror *mirror) {
+    while (mirror->inFlight < mirror->options.concurrency && mirror->head != NULL) {
+        MirrorLink *link = mirror->head;
+        mirror->head = link->next;
+        if (mirror->head == NULL) {
+            mirror->tail = NULL;
+        }
+        MirrorFetch *fetch = malloc(sizeof(MirrorFetch));
+        int error = fetch != NULL ? cproxySubmit(mirror->client, link->url, mirrorDone, fetch) : CPROXY_ERR_NOMEM;
+        if (error == CPROXY_OK) {
+            fetch->mirror = mirror;
+            fetch->depth = link->depth;
+            mirror->inFlight++;
+        } else {
+            free(fetch);
+            CproxyResult failed;
+            memset(&failed, 0, sizeof(failed));
+            failed.url = link->url;
+            failed.error = error;
+            failed.fd = -1;
+            mirror->stats->pages++;
+            mirror->stats->failed++;
+            if (mirror->options.onPage != NULL) {
+                mirror->options.onPage(&failed, link->depth, mirror->options.arg);
+            }
+        }
+        free(link);
+    }
+}
+
+static void mirrorDone(const CproxyResult *result, void *arg) {
+    MirrorFetch *fetch = arg;
+    Mirror *mirror = fetch->mirror;
+    unsigned int depth = fetch->depth;
+    free(fetch);
+    mirror->inFlight--;
+    mirror->stats->pages++;
+    mirror->stats->fromCache += (unsigned long) (result->fromCache != 0);
+    if (result->error != CPROXY_OK || result->statusCode != 200) {
+        mirror->stats->failed++;
+    } else {
+        mirror->stats->bytes += (unsigned long long) result->bodyBytes;
+        if (depth < mirror->options.maxDepth && result->fd >= 0) {
+            mirrorScan(mirror, result, depth);
+        }
+    }
+    if (mirror->options.onPage != NULL) {
+        mirror->options.onPage(result, depth, mirror->options.arg);
+    }
+    mirrorPump(mirror);
+}
+
+/**
+ * @brief Fetches a page and, breadth first, what it links to, through the client's cache.
+ *
+ * Every fetched body that starts with markup is scanned for src and href
+ * values; those that lead to the first page's host, or to one of
+ * options->hosts, and were not queued before are queued, up to
+ * options->maxDepth links away and options->maxPages URLs in all. Up to
+ * options->concurrency fetches are in flight at once, and a new one starts
+ * as soon as one completes. Returns once the queue is empty.
+ *
+ * @return 0, or a CproxyError if the crawl could not start or the client failed.
+ */
+int mirrorRun(CproxyClient *client, const char *url, const MirrorOptions *options, MirrorStats *stats) {
+    Mirror mirror;
+    memset(&mirror, 0, sizeof(mirror));
+    memset(stats, 0, sizeof(*stats));
+    mirror.client = client;
+    mirror.stats = stats;
+    if (options != NULL) {
+        mirror.options = *options;
+    }
+    if (mirror.options.concurrency == 0) {
+        mirror.options.concurrency = DEFAULT_CONCURRENCY;
+    }
+    if (mirror.options.maxPages == 0) {
+        mirror.options.maxPages = DEFAULT_MAX_PAGES;
+    }
+    if (mirror.options.keyRules == NULL) {
+        mirror.options.keyRules = &defaultKeyRules;
+    }
+    uint64_t hash;
+    int error = mirrorKey(&mirror, url, &hash, mirror.origin, sizeof(mirror.origin));
+    if (error != 0) {
+        return error;
+    }
+    if (visitedInit(&mirror.visited, mirror.options.maxPages) != 0) {
+        return CPROXY_ERR_NOMEM;
+    }
+    visitedAdd(&mirror.visited, hash);
+    mirrorQueue(&mirror, url, 0);
+    mirrorPump(&mirror);
+    error = cproxyRun(client);
+    while (mirror.head != NULL) {
+        MirrorLink *link = mirror.head;
+        mirror.head = link->next;
+        free(link);
+    }
+    visitedFree(&mirror.visited);
+    return error;
+}
@@ -0,0 +1,92 @@
+#ifndef CPROXY_MIRROR_H
+#define CPROXY_MIRROR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cachekey.h"
+#include "cproxy.h"
+
+// Longest link the scanner keeps; longer attribute values are skipped
+#define MIRROR_MAX_URL 2048
+// Up to this many pages the visited set is exact; beyond, a Bloom filter
+#define MIRROR_EXACT_PAGES 65536
+// Bits of Bloom filter per page, about 1% false positives with 7 probes
+#define MIRROR_BLOOM_BITS 10
+#define MIRROR_BLOOM_PROBES 7
+
+/**
+ * @brief Pulls src and href attribute values out of HTML fed in pieces.
+ *
+ * A byte-at-a-time state machine, so a tag or a value split across two
+ * reads is found all the same. Comments are skipped; "&amp;" in a value
+ * is decoded, other entities are left as they are.
+ */
+typedef struct LinkScanner {
+    int state;
+    char quote;             // Of the value being read, 0 when unquoted
+    int wanted;             // The attribute being read is src or href
+    size_t nameLength;
+    char name[8];           // Attribute name so far, lower case, cut short
+    size_t valueLength;     // MIRROR_MAX_URL + 1 once the value is too long
+    char value[MIRROR_MAX_URL + 1];
+    unsigned int dashes;    // Of a comment's end, or of its start
+    void (*onLink)(const char *link, size_t length, void *arg);
+    void *arg;
+} LinkScanner;
+
+void linkScannerInit(LinkScanner *scanner, void (*onLink)(const char *link, size_t length, void *arg), void *arg);
+void linkScannerFeed(LinkScanner *scanner, const char *data, size_t length);
+
+/**
+ * @brief URLs a crawl has queued, so none is fetched twice.
+ *
+ * Keyed by the hash of the canonical cache key, so spellings the cache
+ * merges are one URL to the crawl too. Small crawls keep the hashes
+ * themselves; a crawl allowed more than MIRROR_EXACT_PAGES pages uses a
+ * Bloom filter of MIRROR_BLOOM_BITS bits per page instead, and skips the
+ * odd unseen URL a false positive takes for seen.
+ */
+typedef struct VisitedSet {
+    uint64_t *words;        // Hashes, 0 for a free slot; or the filter's bits
+    size_t mask;            // Slots - 1, or bits - 1
+    size_t count;
+    int bloom;
+} VisitedSet;
+
+int visitedInit(VisitedSet *set, unsigned long pages);
+void visitedFree(VisitedSet *set);
+int visitedAdd(VisitedSet *set, uint64_t hash);
+
+/**
+ * @brief Limits of a crawl; zero fields take the defaults.
+ */
+typedef struct MirrorOptions {
+    unsigned int concurrency;       // Fetches in flight at once (default 16)
+    unsigned int maxDepth;          // Links followed from the first page, 0 for the page alone
+    unsigned long maxPages;         // URLs fetched at most, the first page included (default 100000)
+    const char *const *hosts;       // Hosts besides the first page's that links may lead to
+    unsigned int hostCount;
+    const CacheKeyRules *keyRules;  // Must match the client's, so the visited set merges what the cache does
+    // Optional: called for every URL once it has been fetched, or has failed
+    void (*onPage)(const CproxyResult *result, unsigned int depth, void *arg);
+    void *arg;
+} MirrorOptions;
+
+/**
+ * @brief What a crawl did.
+ */
+typedef struct MirrorStats {
+    unsigned long pages;        // URLs fetched
+    unsigned long fromCache;    // ... answered from the cache
+    unsigned long failed;       // ... that failed or did not answer 200
+    unsigned long long bytes;   // Body bytes stored
+    unsigned long scanned;      // Bodies scanned for links
+    unsigned long links;        // Links found in them
+    unsigned long queued;       // ... queued to be fetched
+    unsigned long offsite;      // ... skipped for leading to another host or scheme
+} MirrorStats;
+
+int mirrorRun(CproxyClient *client, const char *url, const MirrorOptions *options, MirrorStats *stats);
+
+#endif //CPROXY_MIRROR_H
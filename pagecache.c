@@ -0,0 +1,178 @@
+#define _GNU_SOURCE
+
+#include "pagecache.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Where streams count when the caller keeps no statistics
+static PageCacheStats uncounted;
+
+// Count how many of the object's first pages are in the page cache
+static void probe(PageStream *stream) {
+    off_t pageSize = (off_t) sysconf(_SC_PAGESIZE);
+    off_t first = stream->start & ~(pageSize - 1);
+    off_t pages = (stream->end - first + pageSize - 1) / pageSize;
+    if (pages > PAGECACHE_PROBE_PAGES) {
+        pages = PAGECACHE_PROBE_PAGES;
+    }
+    if (pages <= 0) {
+        return;
+    }
+    // Mapping faults nothing in: it only gives mincore() an address range
+    size_t span = (size_t) (pages * pageSize);
+    void *map = mmap(NULL, span, PROT_READ, MAP_SHARED, stream->fd, first);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    unsigned char resident[PAGECACHE_PROBE_PAGES];
+    if (mincore(map, span, resident) == 0) {
+        stream->probed = (unsigned int) pages;
+        for (off_t i = 0; i < pages; i++) {
+            stream->resident += resident[i] & 1;
+        }
+    }
+    munmap(map, span);
+}
+
+/**
+ * @brief Applies the read policy to length bytes at offset in fd, about to be sent.
+ *
+ * @param stats Where to count, NULL for nowhere.
+ */
+void pageStreamRead(PageStream *stream, int fd, off_t offset, off_t length, PageCacheStats *stats) {
+    memset(stream, 0, sizeof(*stream));
+    stream->fd = fd;
+    stream->start = offset;
+    stream->end = offset + length;
+    stream->dropped = offset;
+    stream->stats = stats != NULL ? stats : &uncounted;
+    probe(stream);
+    stream->stats->probedPages += stream->probed;
+    stream->stats->residentPages += stream->resident;
+
+    if (length >= PAGECACHE_LARGE_OBJECT) {
+        // Doubles the kernel's readahead window for the file
+        posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+        // Mostly on disk: nobody else is reading it right now
+        stream->dropBehind = stream->resident * 2 < stream->probed;
+        stream->stats->streamed += (unsigned long) stream->dropBehind;
+    } else if (stream->resident < stream->probed) {
+        // One request for the whole body rather than readahead growing page by page
+        posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+        stream->stats->prefetched++;
+    }
+}
+
+/**
+ * @brief Notes that everything before position has been read.
+ *
+ * Pages are handed back a step behind: what sendfile() passed on last may
+ * still sit in socket buffers, and the kernel keeps pages in use.
+ */
+void pageStreamReadTo(PageStream *stream, off_t position) {
+    off_t behind = position - PAGECACHE_DROP_STEP;
+    if (!stream->dropBehind || behind - stream->dropped < PAGECACHE_DROP_STEP) {
+        return;
+    }
+    posix_fadvise(stream->fd, stream->dropped, behind - stream->dropped, POSIX_FADV_DONTNEED);
+    stream->stats->droppedBytes += (unsigned long long) (behind - stream->dropped);
+    stream->dropped = behind;
+}
+
+/**
+ * @brief Starts the write policy for a file being filled from its start.
+ *
+ * @param stats Where to count, NULL for nowhere.
+ */
+void pageStreamWrite(PageStream *stream, int fd, PageCacheStats *stats) {
+    memset(stream, 0, sizeof(*stream));
+    stream->fd = fd;
+    stream->stats = stats != NULL ? stats : &uncounted;
+}
+
+// Offset of the first whole page in [from, to) that is still in the page cache, or to if none is
+static off_t firstResident(int fd, off_t from, off_t to) {
+    off_t pageSize = (off_t) sysconf(_SC_PAGESIZE);
+    // Pages cut by either end are shared with a neighbour and kept by POSIX_FADV_DONTNEED
+    off_t first = (from + pageSize - 1) & ~(pageSize - 1);
+    off_t last = to & ~(pageSize - 1);
+    unsigned char resident[PAGECACHE_PROBE_PAGES];
+    while (first < last) {
+        off_t pages = (last - first) / pageSize;
+        if (pages > PAGECACHE_PROBE_PAGES) {
+            pages = PAGECACHE_PROBE_PAGES;
+        }
+        size_t span = (size_t) (pages * pageSize);
+        void *map = mmap(NULL, span, PROT_READ, MAP_SHARED, fd, first);
+        if (map == MAP_FAILED) {
+            return first;
+        }
+        int checked = mincore(map, span, resident) == 0;
+        munmap(map, span);
+        if (!checked) {
+            return first;
+        }
+        for (off_t i = 0; i < pages; i++) {
+            if (resident[i] & 1) {
+                return first + i * pageSize;
+            }
+        }
+        first += (off_t) span;
+    }
+    return to;
+}
+
+/**
+ * @brief Notes that the file has been written up to position.
+ *
+ * Once the file is large, each step starts the writeback of the latest
+ * step and hands back the pages of the steps before it. Nothing here
+ * waits for the disk, as a fill is written from the event loop: pages
+ * still dirty or under writeback are skipped by the kernel, a residency
+ * check finds where the clean part ends, and the next step tries again
+ * from there. At most PAGECACHE_DROP_CATCHUP steps are looked at per
+ * step, so a stream far behind a slow disk catches up without any one
+ * write paying for the whole backlog.
+ */
+void pageStreamWroteTo(PageStream *stream, off_t position) {
+    stream->end = position;
+    if (position < PAGECACHE_LARGE_OBJECT || position - stream->flushed < PAGECACHE_DROP_STEP) {
+        return;
+    }
+    if (!stream->dropBehind) {
+        stream->dropBehind = 1;
+        stream->stats->streamed++;
+    }
+    sync_file_range(stream->fd, stream->flushed, position - stream->flushed, SYNC_FILE_RANGE_WRITE);
+    off_t upTo = stream->flushed;
+    if (upTo - stream->dropped > PAGECACHE_DROP_CATCHUP * PAGECACHE_DROP_STEP) {
+        upTo = stream->dropped + PAGECACHE_DROP_CATCHUP * PAGECACHE_DROP_STEP;
+    }
+    if (upTo > stream->dropped) {
+        posix_fadvise(stream->fd, stream->dropped, upTo - stream->dropped, POSIX_FADV_DONTNEED);
+        off_t clean = firstResident(stream->fd, stream->dropped, upTo);
+        stream->stats->droppedBytes += (unsigned long long) (clean - stream->dropped);
+        stream->dropped = clean;
+    }
+    stream->flushed = position;
+}
+
+/**
+ * @brief Ends a stream before its descriptor is closed, handing back what
+ * is left of a large object: the tail, what was read ahead, or the clean
+ * part of a fill. Idle streams are left alone.
+ */
+void pageStreamEnd(PageStream *stream) {
+    if (stream->dropBehind) {
+        // From the start again, for pages that were locked for I/O when their step was dropped;
+        // a length of 0 runs to the end of the file
+        posix_fadvise(stream->fd, stream->start, 0, POSIX_FADV_DONTNEED);
+        if (stream->end > stream->dropped) {
+            stream->stats->droppedBytes += (unsigned long long) (stream->end - stream->dropped);
+        }
+    }
+    stream->dropBehind = 0;
+}
@@ -0,0 +1,54 @@
+#ifndef CPROXY_PAGECACHE_H
+#define CPROXY_PAGECACHE_H
+
+#include <sys/types.h>
+
+// Objects at least this big are streamed through the page cache instead of being kept in it
+#define PAGECACHE_LARGE_OBJECT ((off_t) 32 << 20)
+// Pages looked at when an object is opened; the start of an object stands for the rest
+#define PAGECACHE_PROBE_PAGES 256
+// Streams hand pages back to the kernel in steps of this many bytes behind their position
+#define PAGECACHE_DROP_STEP ((off_t) 8 << 20)
+// Steps of a fill a write tries to hand back at most, when earlier ones were still dirty
+#define PAGECACHE_DROP_CATCHUP 4
+
+/**
+ * @brief How well the page cache serves the cache's objects, for tuning
+ * PAGECACHE_LARGE_OBJECT.
+ */
+typedef struct PageCacheStats {
+    unsigned long long probedPages;     // Pages of opened objects looked at
+    unsigned long long residentPages;   // ... that were in the page cache
+    unsigned long prefetched;           // Small objects given a readahead hint
+    unsigned long streamed;             // Large objects read or written without keeping them
+    unsigned long long droppedBytes;    // Handed back behind streams
+} PageCacheStats;
+
+/**
+ * @brief The page cache policy for one object being read or written.
+ *
+ * Small objects are what the page cache is for: one read from disk is
+ * hinted to come in whole. A large object read from disk, or written, is
+ * streamed: its pages are handed back a step behind the position, so a
+ * multi-GB body does not push the hot small objects out. A large object
+ * found in the page cache already is left there, as others are reading it.
+ */
+typedef struct PageStream {
+    int fd;
+    off_t start;            // The object's bytes in the file
+    off_t end;
+    off_t dropped;          // Pages before this have been handed back
+    off_t flushed;          // Writing: writeback was started up to here
+    int dropBehind;
+    unsigned int probed;    // Pages looked at when opened, and how many were resident
+    unsigned int resident;
+    PageCacheStats *stats;
+} PageStream;
+
+void pageStreamRead(PageStream *stream, int fd, off_t offset, off_t length, PageCacheStats *stats);
+void pageStreamReadTo(PageStream *stream, off_t position);
+void pageStreamWrite(PageStream *stream, int fd, PageCacheStats *stats);
+void pageStreamWroteTo(PageStream *stream, off_t position);
+void pageStreamEnd(PageStream *stream);
+
+#endif //CPROXY_PAGECACHE_H
@@ -0,0 +1,94 @@
+#ifndef CPROXY_PROBES_H
+#define CPROXY_PROBES_H
+
+#include <stdint.h>
+
+/*
+ * USDT probes of provider "cproxy", for bpftrace, perf and SystemTap. Every
+ * probe starts with the request's cache key, which stays at one address for
+ * the whole request and so also identifies it:
+ *
+ *   request_start(key, requestBytes)       URL parsed, before the cache lookup
+ *   cache_lookup(key, hit, bodyBytes)      bodyBytes of the stored copy, 0 on a miss
+ *   dns_done(key, hostname)
+ *   connect_done(key, hostname)
+ *   first_byte(key, bytesRead)             First read from the origin
+ *   fill_done(key, bodyBytes, stored)      Origin body complete; stored is 0 if it was not cached
+ *   serve_done(key, statusCode, bodyBytes, cached)
+ *
+ * A probe site is a single nop plus an ELF note saying where its arguments
+ * are; until a tracer patches the nop nothing else runs. The arguments are
+ * still computed, so each one is a value the code has at hand anyway.
+ * probes.bt turns them into latency histograms.
+ *
+ * sys/sdt.h from SystemTap emits the notes when it is installed. Without
+ * it, the same note layout is emitted here on x86-64; elsewhere, or with
+ * CPROXY_NO_PROBES defined, the probes compile to nothing.
+ */
+#if defined(CPROXY_NO_PROBES)
+#define CPROXY_PROBES_OFF
+#elif defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define CPROXY_PROBES_SDT
+#endif
+#endif
+
+#if defined(CPROXY_PROBES_SDT)
+
+#include <sys/sdt.h>
+
+#define CPROXY_PROBE2(name, a1, a2) DTRACE_PROBE2(cproxy, name, a1, a2)
+#define CPROXY_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(cproxy, name, a1, a2, a3)
+#define CPROXY_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(cproxy, name, a1, a2, a3, a4)
+
+#elif !defined(CPROXY_PROBES_OFF) && defined(__x86_64__) && defined(__GNUC__)
+
+// Every argument goes out as a signed 64-bit value: a register, memory operand or constant
+#define CPROXY_PROBE_ARG(x) ((int64_t) (intptr_t) (x))
+
+// The note sys/sdt.h emits: probe address, base for prelink, no semaphore, provider, name, argument locations
+#define CPROXY_PROBE_NOTE(name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte 0\n" \
+    ".asciz \"cproxy\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+#define CPROXY_PROBE2(name, a1, a2) \
+    __asm__ __volatile__(CPROXY_PROBE_NOTE(name, "-8@%[p1] -8@%[p2]") \
+                         :: [p1] "nor" (CPROXY_PROBE_ARG(a1)), [p2] "nor" (CPROXY_PROBE_ARG(a2)))
+#define CPROXY_PROBE3(name, a1, a2, a3) \
+    __asm__ __volatile__(CPROXY_PROBE_NOTE(name, "-8@%[p1] -8@%[p2] -8@%[p3]") \
+                         :: [p1] "nor" (CPROXY_PROBE_ARG(a1)), [p2] "nor" (CPROXY_PROBE_ARG(a2)), \
+                            [p3] "nor" (CPROXY_PROBE_ARG(a3)))
+#define CPROXY_PROBE4(name, a1, a2, a3, a4) \
+    __asm__ __volatile__(CPROXY_PROBE_NOTE(name, "-8@%[p1] -8@%[p2] -8@%[p3] -8@%[p4]") \
+                         :: [p1] "nor" (CPROXY_PROBE_ARG(a1)), [p2] "nor" (CPROXY_PROBE_ARG(a2)), \
+                            [p3] "nor" (CPROXY_PROBE_ARG(a3)), [p4] "nor" (CPROXY_PROBE_ARG(a4)))
+
+#else
+
+#define CPROXY_PROBE2(name, a1, a2) do { } while (0)
+#define CPROXY_PROBE3(name, a1, a2, a3) do { } while (0)
+#define CPROXY_PROBE4(name, a1, a2, a3, a4) do { } while (0)
+
+#endif
+
+#endif //CPROXY_PROBES_H
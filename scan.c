@@ -0,0 +1,239 @@
+#include "scan.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+static const char *(*headerEnd)(const char *data, size_t length);
+static const char *(*firstOf)(const char *data, size_t length, char a, char b);
+static ScanLevel level;
+
+/**
+ * @brief The first CR LF CR LF in data, byte by byte.
+ *
+ * The reference the vector versions are checked against, and what runs
+ * on CPUs without them.
+ */
+const char *scanHeaderEndScalar(const char *data, size_t length) {
+    for (size_t i = 0; i + 3 < length; i++) {
+        if (data[i] == '\r' && data[i + 1] == '\n' && data[i + 2] == '\r' && data[i + 3] == '\n') {
+            return data + i;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief The first byte of data equal to a or b, byte by byte.
+ */
+const char *scanFirstOfScalar(const char *data, size_t length, char a, char b) {
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] == a || data[i] == b) {
+            return data + i;
+        }
+    }
+    return NULL;
+}
+
+#ifdef SCAN_X86
+
+/*
+ * Sixteen or thirty-two candidate positions per step: the block is loaded
+ * at offsets 0 to 3 and compared with CR, LF, CR, LF, so a set bit in the
+ * combined mask is a position where all four bytes match.
+ *
+ * The bytes after the last whole step are covered by one more step that
+ * ends exactly at the end of the data, overlapping positions already
+ * found empty, so no byte loop runs unless the data is shorter than a step.
+ */
+__attribute__((target("sse2")))
+static unsigned int headerEndMask16(const char *at) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    __m128i match = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) at), cr),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (at + 1)), lf)),
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (at + 2)), cr),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (at + 3)), lf)));
+    return (unsigned int) _mm_movemask_epi8(match);
+}
+
+__attribute__((target("sse2")))
+static const char *headerEndSse2(const char *data, size_t length) {
+    if (length < 16 + 3) {
+        return scanHeaderEndScalar(data, length);
+    }
+    size_t i = 0;
+    for (; i + 16 + 3 <= length; i += 16) {
+        unsigned int mask = headerEndMask16(data + i);
+        if (mask != 0) {
+            return data + i + (size_t) __builtin_ctz(mask);
+        }
+    }
+    if (i + 3 < length) {
+        i = length - 16 - 3;
+        unsigned int mask = headerEndMask16(data + i);
+        if (mask != 0) {
+            return data + i + (size_t) __builtin_ctz(mask);
+        }
+    }
+    return NULL;
+}
+
+__attribute__((target("sse2")))
+static const char *firstOfSse2(const char *data, size_t length, char a, char b) {
+    if (length < 16) {
+        return scanFirstOfScalar(data, length, a, b);
+    }
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    for (size_t i = 0;; i += 16) {
+        // The last step ends at the end of the data, overlapping the one before
+        if (i + 16 > length) {
+            i = length - 16;
+        }
+        __m128i block = _mm_loadu_si128((const __m128i *) (data + i));
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(
+                _mm_or_si128(_mm_cmpeq_epi8(block, va), _mm_cmpeq_epi8(block, vb)));
+        if (mask != 0) {
+            return data + i + (size_t) __builtin_ctz(mask);
+        }
+        if (i + 16 == length) {
+            return NULL;
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static unsigned int headerEndMask32(const char *at) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    __m256i match = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) at), cr),
+                             _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (at + 1)), lf)),
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (at + 2)), cr),
+                             _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (at + 3)), lf)));
+    return (unsigned int) _mm256_movemask_epi8(match);
+}
+
+__attribute__((target("avx2")))
+static const char *headerEndAvx2(const char *data, size_t length) {
+    if (length < 32 + 3) {
+        return headerEndSse2(data, length);
+    }
+    size_t i = 0;
+    for (; i + 32 + 3 <= length; i += 32) {
+        unsigned int mask = headerEndMask32(data + i);
+        if (mask != 0) {
+            return data + i + (size_t) __builtin_ctz(mask);
+        }
+    }
+    if (i + 3 < length) {
+        i = length - 32 - 3;
+        unsigned int mask = headerEndMask32(data + i);
+        if (mask != 0) {
+            return data + i + (size_t) __builtin_ctz(mask);
+        }
+    }
+    return NULL;
+}
+
+__attribute__((target("avx2")))
+static const char *firstOfAvx2(const char *data, size_t length, char a, char b) {
+    if (length < 32) {
+        return firstOfSse2(data, length, a, b);
+    }
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    for (size_t i = 0;; i += 32) {
+        if (i + 32 > length) {
+            i = length - 32;
+        }
+        __m256i block = _mm256_loadu_si256((const __m256i *) (data + i));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(
+                _mm256_or_si256(_mm256_cmpeq_epi8(block, va), _mm256_cmpeq_epi8(block, vb)));
+        if (mask != 0) {
+            return data + i + (size_t) __builtin_ctz(mask);
+        }
+        if (i + 32 == length) {
+            return NULL;
+        }
+    }
+}
+
+#endif
+
+/**
+ * @brief Switches the scanners to the given instruction set, for benchmarks and checks.
+ *
+ * Not safe while other threads scan.
+ *
+ * @return 0 on success, -1 if the CPU does not have it.
+ */
+int scanUse(ScanLevel wanted) {
+    switch (wanted) {
+        case SCAN_SCALAR:
+            headerEnd = scanHeaderEndScalar;
+            firstOf = scanFirstOfScalar;
+            break;
+#ifdef SCAN_X86
+        case SCAN_SSE2:
+            if (!__builtin_cpu_supports("sse2")) {
+                return -1;
+            }
+            headerEnd = headerEndSse2;
+            firstOf = firstOfSse2;
+            break;
+        case SCAN_AVX2:
+            if (!__builtin_cpu_supports("avx2")) {
+                return -1;
+            }
+            headerEnd = headerEndAvx2;
+            firstOf = firstOfAvx2;
+            break;
+#endif
+        default:
+            return -1;
+    }
+    level = wanted;
+    return 0;
+}
+
+// Picked once at load time, before any thread can be scanning
+__attribute__((constructor))
+static void scanInit(void) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+#endif
+    if (scanUse(SCAN_AVX2) != 0 && scanUse(SCAN_SSE2) != 0) {
+        scanUse(SCAN_SCALAR);
+    }
+}
+
+/**
+ * @brief The first CR LF CR LF in data, the end of an HTTP header.
+ *
+ * @return Its position, or NULL if data holds none.
+ */
+const char *scanHeaderEnd(const char *data, size_t length) {
+    return headerEnd(data, length);
+}
+
+/**
+ * @brief The first byte of data equal to a or b; pass a twice for a single byte.
+ *
+ * @return Its position, or NULL if there is none.
+ */
+const char *scanFirstOf(const char *data, size_t length, char a, char b) {
+    return firstOf(data, length, a, b);
+}
+
+/**
+ * @brief The instruction set the scanners run on.
+ */
+ScanLevel scanLevel(void) {
+    return level;
+}
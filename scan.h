@@ -0,0 +1,22 @@
+#ifndef CPROXY_SCAN_H
+#define CPROXY_SCAN_H
+
+#include <stddef.h>
+
+/**
+ * @brief Instruction sets the byte scanners can run on.
+ */
+typedef enum {
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2
+} ScanLevel;
+
+const char *scanHeaderEnd(const char *data, size_t length);
+const char *scanFirstOf(const char *data, size_t length, char a, char b);
+const char *scanHeaderEndScalar(const char *data, size_t length);
+const char *scanFirstOfScalar(const char *data, size_t length, char a, char b);
+ScanLevel scanLevel(void);
+int scanUse(ScanLevel level);
+
+#endif //CPROXY_SCAN_H
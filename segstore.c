@@ -0,0 +1,843 @@
+#include "segstore.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "timerwheel.h"
+
+#define SEGMENT_MAGIC 0x32535043u       // "CPS2"
+// Records of the first version, whose header ends before the CRC; still read, never written
+#define SEGMENT_MAGIC_V1 0x47535043u    // "CPSG"
+#define SEGMENT_MAX_KEY 4096
+#define SEGMENT_SCAN_BUFFER (1 << 20)
+#define SEGMENT_TABLE_MIN 1024
+// A miss re-reads the directory at most this often, to find what other workers stored
+#define SEGMENT_REFRESH_MS 100
+// Descriptors kept open beyond those of the active and the compacted segment
+#define SEGMENT_OPEN_LIMIT 64
+// Segments smaller than the limit divided by this are merged into the active one
+#define SEGMENT_SMALL_DIVISOR 16
+
+// FNV-1a
+static uint64_t hashKey(const char *key, size_t length) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// The entry holding hash, or the empty entry where it would go
+static SegmentEntry *tableFind(const SegmentStore *store, uint64_t hash) {
+    size_t mask = store->tableSize - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        SegmentEntry *entry = &store->table[i];
+        if (entry->segment == 0 || entry->hash == hash) {
+            return entry;
+        }
+    }
+}
+
+// Rehash into a table of the given size, leaving out the entries of one slot (-1 for none)
+static int tableRebuild(SegmentStore *store, size_t size, int dropSlot) {
+    SegmentEntry *old = store->table;
+    size_t oldSize = store->tableSize;
+    SegmentEntry *table = calloc(size, sizeof(SegmentEntry));
+    if (table == NULL) {
+        return -1;
+    }
+    store->table = table;
+    store->tableSize = size;
+    store->entries = 0;
+    for (size_t i = 0; i < oldSize; i++) {
+        if (old[i].segment != 0 && (int) old[i].segment != dropSlot + 1) {
+            *tableFind(store, old[i].hash) = old[i];
+            store->entries++;
+        }
+    }
+    free(old);
+    return 0;
+}
+
+// Whether record sequence a was written after b. The counter wraps, so this goes by distance; 0 comes first
+static int sequenceAfter(uint32_t a, uint32_t b) {
+    if (a == 0 || b == 0) {
+        return b == 0 && a != 0;
+    }
+    return (int32_t) (a - b) > 0;
+}
+
+static uint32_t slotBit(int slot) {
+    return 1u << (slot % 32);
+}
+
+// Index a record unless one of the key written after it is indexed already
+static int tableInsert(SegmentStore *store, uint64_t hash, int slot, off_t offset, uint32_t length, uint32_t crc,
+                       uint32_t flags, uint32_t sequence) {
+    // Keep the load factor under 70%
+    if ((store->entries + 1) * 10 > store->tableSize * 7 &&
+        tableRebuild(store, store->tableSize * 2, -1) == -1) {
+        return -1;
+    }
+    if (sequenceAfter(sequence, store->newest)) {
+        store->newest = sequence;
+    }
+    SegmentEntry *entry = tableFind(store, hash);
+    if (entry->segment != 0 && sequenceAfter(entry->sequence, sequence)) {
+        entry->older |= slotBit(slot);
+        return 0;   // Dead on arrival
+    }
+    uint32_t older = 0;
+    if (entry->segment != 0) {
+        // The older record is dead from now on
+        store->segments[entry->segment - 1].liveBytes -= entry->length;
+        older = entry->older;
+        if ((int) entry->segment != slot + 1 || entry->offset != (uint64_t) offset) {
+            older |= slotBit((int) entry->segment - 1);
+        }
+    } else {
+        store->entries++;
+    }
+    entry->hash = hash;
+    entry->offset = (uint64_t) offset;
+    entry->segment = (uint32_t) slot + 1;
+    entry->length = length;
+    entry->crc = crc;
+    entry->flags = flags;
+    entry->sequence = sequence;
+    entry->older = older;
+    store->segments[slot].liveBytes += length;
+    return 0;
+}
+
+// Forget an entry, moving the entries probed after it back so that lookups still reach them
+static void tableRemove(SegmentStore *store, SegmentEntry *entry) {
+    size_t mask = store->tableSize - 1;
+    size_t hole = (size_t) (entry - store->table);
+    store->segments[entry->segment - 1].liveBytes -= entry->length;
+    store->entries--;
+    for (size_t i = (hole + 1) & mask; store->table[i].segment != 0; i = (i + 1) & mask) {
+        // An entry may fill the hole unless its home slot lies after the hole
+        size_t home = store->table[i].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            store->table[hole] = store->table[i];
+            hole = i;
+        }
+    }
+    memset(&store->table[hole], 0, sizeof(SegmentEntry));
+}
+
+// Whether the index points into a segment for a key that is stored, not removed
+static int tableHoldsObjects(const SegmentStore *store, int slot) {
+    for (size_t i = 0; i < store->tableSize; i++) {
+        if (store->table[i].segment == (uint32_t) slot + 1 && !(store->table[i].flags & SEGMENT_REMOVED)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+typedef struct ScanBuffer {
+    char *data;
+    off_t start;
+    size_t len;
+} ScanBuffer;
+
+static int segmentAdd(SegmentStore *store, const char *name, ino_t inode, int fd) {
+    int slot = -1;
+    for (uint32_t i = 0; i < store->segmentCount; i++) {
+        if (!store->segments[i].used) {
+            slot = (int) i;
+            break;
+        }
+    }
+    if (slot == -1) {
+        Segment *segments = realloc(store->segments, (store->segmentCount + 1) * sizeof(Segment));
+        if (segments == NULL) {
+            return -1;
+        }
+        store->segments = segments;
+        slot = (int) store->segmentCount++;
+    }
+    Segment *segment = &store->segments[slot];
+    memset(segment, 0, sizeof(*segment));
+    segment->used = 1;
+    segment->fd = fd;
+    segment->inode = inode;
+    segment->lastUsed = ++store->clock;
+    snprintf(segment->name, sizeof(segment->name), "%s", name);
+    if (fd != -1) {
+        store->openFds++;
+    }
+    return slot;
+}
+
+static void segmentClose(SegmentStore *store, int slot) {
+    Segment *segment = &store->segments[slot];
+    if (segment->fd != -1) {
+        close(segment->fd);
+        segment->fd = -1;
+        store->openFds--;
+    }
+}
+
+// Close the least recently used descriptors over SEGMENT_OPEN_LIMIT; the active and the compacted segment keep theirs
+static void segmentCloseIdle(SegmentStore *store) {
+    while (store->openFds > SEGMENT_OPEN_LIMIT) {
+        int idle = -1;
+        for (uint32_t i = 0; i < store->segmentCount; i++) {
+            Segment *segment = &store->segments[i];
+            if (segment->fd != -1 && (int) i != store->active && (int) i != store->compacting &&
+                (idle == -1 || segment->lastUsed < store->segments[idle].lastUsed)) {
+                idle = (int) i;
+            }
+        }
+        if (idle == -1) {
+            return;
+        }
+        segmentClose(store, idle);
+    }
+}
+
+// The segment's descriptor, opened again if it was closed; -1 if the file is gone
+static int segmentFd(SegmentStore *store, int slot) {
+    Segment *segment = &store->segments[slot];
+    segment->lastUsed = ++store->clock;
+    if (segment->fd != -1) {
+        return segment->fd;
+    }
+    int fd = openat(store->dirFd, segment->name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || st.st_ino != segment->inode) {
+        close(fd);
+        return -1;
+    }
+    segment->fd = fd;
+    store->openFds++;
+    segmentCloseIdle(store);
+    return fd;
+}
+
+static int segmentScan(SegmentStore *store, int slot, ScanBuffer *buffer);
+
+static void segmentDrop(SegmentStore *store, int slot) {
+    Segment *segment = &store->segments[slot];
+    // Tombstones are let go by compaction once nothing is left for them to hide
+    if (segment->liveBytes != 0 && tableHoldsObjects(store, slot)) {
+        // A compacted copy keeps the sequence of its original, so the original wins if it was indexed
+        // last; index the other segments again to find the copies before forgetting this one
+        ScanBuffer buffer = {malloc(SEGMENT_SCAN_BUFFER), 0, 0};
+        for (uint32_t i = 0; buffer.data != NULL && i < store->segmentCount; i++) {
+            if (store->segments[i].used && (int) i != slot && (int) i != store->active &&
+                (int) i != store->compacting) {
+                store->segments[i].scanned = 0;
+                segmentScan(store, (int) i, &buffer);
+            }
+        }
+        free(buffer.data);
+    }
+    if (segment->liveBytes != 0) {
+        tableRebuild(store, store->tableSize, slot);
+    }
+    segmentClose(store, slot);
+    segment->used = 0;
+}
+
+// Bytes of header a record with this magic has, 0 if it starts no record
+static size_t headerLength(uint32_t magic) {
+    if (magic == SEGMENT_MAGIC) {
+        return sizeof(SegmentRecord);
+    }
+    return magic == SEGMENT_MAGIC_V1 ? offsetof(SegmentRecord, crc) : 0;
+}
+
+// What the index keeps of a record's checksum, and whether it removes its key
+static uint32_t recordFlags(const SegmentRecord *record) {
+    if (record->bodyLength == SEGMENT_TOMBSTONE) {
+        return SEGMENT_REMOVED;
+    }
+    return record->magic == SEGMENT_MAGIC ? SEGMENT_CHECKSUM : 0;
+}
+
+// Header, key and body; a tombstone has no body
+static off_t recordLength(const SegmentRecord *record) {
+    off_t length = (off_t) (headerLength(record->magic) + record->keyLength);
+    return record->bodyLength == SEGMENT_TOMBSTONE ? length : length + (off_t) record->bodyLength;
+}
+
+// Makes bytes [pos, pos + n) of the file available, or returns NULL past its end
+static const char *scanAt(int fd, ScanBuffer *buffer, off_t pos, size_t n) {
+    if (pos >= buffer->start && pos + (off_t) n <= buffer->start + (off_t) buffer->len) {
+        return buffer->data + (pos - buffer->start);
+    }
+    ssize_t got = pread(fd, buffer->data, SEGMENT_SCAN_BUFFER, pos);
+    buffer->start = pos;
+    buffer->len = got > 0 ? (size_t) got : 0;
+    return buffer->len >= n ? buffer->data : NULL;
+}
+
+// Keep track of the oldest record a segment holds, see tombstoneNeeded()
+static void segmentNoteRecord(Segment *segment, off_t offset, uint32_t sequence) {
+    if (offset == 0 || sequenceAfter(segment->oldest, sequence)) {
+        segment->oldest = sequence;
+    }
+}
+
+/**
+ * @brief Indexes the records appended to a segment since it was last scanned.
+ *
+ * @return 0 once every complete record is indexed, -1 if it had to stop short.
+ */
+static int segmentScan(SegmentStore *store, int slot, ScanBuffer *buffer) {
+    int fd = segmentFd(store, slot);
+    off_t pos = store->segments[slot].scanned;
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        return -1;
+    }
+    if (st.st_size <= pos) {
+        return 0;
+    }
+    int error = 0;
+    buffer->len = 0;
+    for (;;) {
+        const char *header = scanAt(fd, buffer, pos, offsetof(SegmentRecord, crc));
+        if (header == NULL) {
+            break;
+        }
+        SegmentRecord record = {0};
+        memcpy(&record, header, offsetof(SegmentRecord, crc));
+        size_t headerBytes = headerLength(record.magic);
+        if (headerBytes == 0 || record.keyLength == 0 || record.keyLength > SEGMENT_MAX_KEY) {
+            break;  // Not a record: stop here rather than index garbage
+        }
+        off_t length = recordLength(&record);
+        if (pos + length > st.st_size) {
+            break;  // Still being written
+        }
+        header = scanAt(fd, buffer, pos, headerBytes);
+        if (header == NULL) {
+            break;
+        }
+        memcpy(&record, header, headerBytes);
+        const char *key = scanAt(fd, buffer, pos + (off_t) headerBytes, record.keyLength);
+        if (key == NULL || tableInsert(store, hashKey(key, record.keyLength), slot, pos, (uint32_t) length,
+                                       record.crc, recordFlags(&record), record.sequence) == -1) {
+            error = -1;
+            break;
+        }
+        segmentNoteRecord(&store->segments[slot], pos, record.sequence);
+        pos += length;
+    }
+    store->segments[slot].scanned = pos;
+    return error;
+}
+
+/**
+ * @brief Picks up segments created by other workers and records appended to them.
+ *
+ * Segments that disappeared (compacted by another worker) are forgotten.
+ */
+void segStoreRefresh(SegmentStore *store) {
+    store->lastRefresh = monotonicMillis();
+    int fd = dup(store->dirFd);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (dir == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    rewinddir(dir);
+    ScanBuffer buffer = {malloc(SEGMENT_SCAN_BUFFER), 0, 0};
+    if (buffer.data == NULL) {
+        closedir(dir);
+        return;
+    }
+
+    char seen[store->segmentCount + 1];
+    memset(seen, 0, sizeof(seen));
+    uint32_t known = store->segmentCount;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        if (strncmp(entry->d_name, "seg.", 4) != 0 || strlen(entry->d_name) >= sizeof(store->segments[0].name) ||
+            fstatat(store->dirFd, entry->d_name, &st, 0) == -1) {
+            continue;
+        }
+        int slot = -1;
+        for (uint32_t i = 0; i < store->segmentCount; i++) {
+            if (store->segments[i].used && store->segments[i].inode == st.st_ino &&
+                strcmp(store->segments[i].name, entry->d_name) == 0) {
+                slot = (int) i;
+                break;
+            }
+        }
+        if (slot == -1) {
+            slot = segmentAdd(store, entry->d_name, st.st_ino, -1);
+            if (slot == -1) {
+                continue;
+            }
+        }
+        if ((uint32_t) slot < known) {
+            seen[slot] = 1;
+        }
+        // Only segments that grew need their descriptor
+        if (st.st_size > store->segments[slot].scanned) {
+            segmentScan(store, slot, &buffer);
+        }
+    }
+    closedir(dir);
+    free(buffer.data);
+
+    for (uint32_t i = 0; i < known; i++) {
+        if (!seen[i] && store->segments[i].used && (int) i != store->active && (int) i != store->compacting) {
+            segmentDrop(store, (int) i);
+        }
+    }
+}
+
+/**
+ * @brief Maps the counter every process numbers its records from.
+ *
+ * @return 0 on success, -1 with errno set on failure.
+ */
+static int openSequence(SegmentStore *store) {
+    int fd = openat(store->dirFd, "sequence", O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    struct stat st;
+    if (fd == -1) {
+        return -1;
+    }
+    // Growing the file from nothing leaves it zero; it never shrinks, so racing openers agree
+    if (fstat(fd, &st) == -1 || (st.st_size < (off_t) sizeof(uint32_t) && ftruncate(fd, sizeof(uint32_t)) == -1)) {
+        close(fd);
+        return -1;
+    }
+    void *mapping = mmap(NULL, sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return -1;
+    }
+    store->counter = mapping;
+    return 0;
+}
+
+// A counter lost or behind the segments would number new records before what they replace
+static void raiseSequence(SegmentStore *store) {
+    uint32_t current = __atomic_load_n(store->counter, __ATOMIC_RELAXED);
+    while (sequenceAfter(store->newest, current) &&
+           !__atomic_compare_exchange_n(store->counter, &current, store->newest, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+    }
+}
+
+static uint32_t nextSequence(SegmentStore *store) {
+    uint32_t sequence = __atomic_add_fetch(store->counter, 1, __ATOMIC_RELAXED);
+    // 0 marks records written before there was a sequence
+    return sequence != 0 ? sequence : __atomic_add_fetch(store->counter, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Opens the store in dir (created if missing) and indexes what is there.
+ *
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int segStoreOpen(SegmentStore *store, const char *dir, off_t segmentLimit) {
+    memset(store, 0, sizeof(*store));
+    store->active = -1;
+    store->compacting = -1;
+    store->segmentLimit = segmentLimit;
+    if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    store->dirFd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (store->dirFd == -1) {
+        return -1;
+    }
+    store->table = calloc(SEGMENT_TABLE_MIN, sizeof(SegmentEntry));
+    if (store->table == NULL) {
+        close(store->dirFd);
+        return -1;
+    }
+    store->tableSize = SEGMENT_TABLE_MIN;
+    if (openSequence(store) == -1) {
+        int error = errno;
+        free(store->table);
+        close(store->dirFd);
+        errno = error;
+        return -1;
+    }
+    segStoreRefresh(store);
+    raiseSequence(store);
+    return 0;
+}
+
+void segStoreClose(SegmentStore *store) {
+    for (uint32_t i = 0; i < store->segmentCount; i++) {
+        segmentClose(store, (int) i);
+    }
+    free(store->segments);
+    free(store->table);
+    if (store->counter != NULL) {
+        munmap(store->counter, sizeof(uint32_t));
+    }
+    close(store->dirFd);
+    memset(store, 0, sizeof(*store));
+    store->dirFd = -1;
+}
+
+/**
+ * @brief Finds the newest record for a key.
+ *
+ * @return Its index entry, with a descriptor of its own and the body's
+ * offset and length; NULL if the key is not stored. The entry is only
+ * valid until the next change to the store.
+ */
+SegmentEntry *segStoreLookup(SegmentStore *store, const char *key, int *fd, off_t *offset, off_t *length) {
+    size_t keyLength = strlen(key);
+    if (keyLength == 0 || keyLength > SEGMENT_MAX_KEY) {
+        return NULL;
+    }
+    uint64_t hash = hashKey(key, keyLength);
+    SegmentEntry *entry = tableFind(store, hash);
+    if (entry->segment == 0) {
+        // Another worker may have stored it since the directory was last read
+        if (monotonicMillis() - store->lastRefresh < SEGMENT_REFRESH_MS) {
+            return NULL;
+        }
+        segStoreRefresh(store);
+        entry = tableFind(store, hash);
+        if (entry->segment == 0) {
+            return NULL;
+        }
+    }
+
+    // The index only has the hash: check the key stored with the record
+    int source = segmentFd(store, (int) entry->segment - 1);
+    if (source == -1) {
+        return NULL;
+    }
+    char header[sizeof(SegmentRecord) + keyLength];
+    ssize_t got = pread(source, header, sizeof(header), (off_t) entry->offset);
+    SegmentRecord record = {0};
+    memcpy(&record, header, offsetof(SegmentRecord, crc));
+    size_t headerBytes = headerLength(record.magic);
+    if (got < (ssize_t) offsetof(SegmentRecord, crc) || headerBytes == 0 || got < (ssize_t) (headerBytes + keyLength) ||
+        record.keyLength != keyLength || memcmp(header + headerBytes, key, keyLength) != 0 ||
+        record.bodyLength == SEGMENT_TOMBSTONE) {
+        return NULL;
+    }
+    // A descriptor of its own keeps the body readable even if the segment is compacted meanwhile
+    *fd = fcntl(source, F_DUPFD_CLOEXEC, 0);
+    if (*fd == -1) {
+        return NULL;
+    }
+    *offset = (off_t) (entry->offset + headerBytes + keyLength);
+    *length = (off_t) record.bodyLength;
+    return entry;
+}
+
+static int segmentCreate(SegmentStore *store) {
+    static const int attempts = 1000;
+    char name[sizeof(store->segments[0].name)];
+
+    for (int attempt = 0; attempt < attempts; attempt++) {
+        snprintf(name, sizeof(name), "seg.%d.%u", (int) getpid(), store->sequence++);
+        int fd = openat(store->dirFd, name, O_RDWR | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0666);
+        if (fd == -1) {
+            if (errno == EEXIST) {
+                continue;   // Left behind by an earlier process with the same pid
+            }
+            return -1;
+        }
+        // Held for as long as this process appends, so that nobody compacts the segment underneath.
+        // Another process may have taken the new file over already: leave it to them
+        struct stat st;
+        if (flock(fd, LOCK_EX | LOCK_NB) == -1 || fstat(fd, &st) == -1) {
+            close(fd);
+            continue;
+        }
+        int slot = segmentAdd(store, name, st.st_ino, fd);
+        if (slot == -1) {
+            unlinkat(store->dirFd, name, 0);
+            close(fd);
+            return -1;
+        }
+        store->active = slot;
+        segmentCloseIdle(store);
+        return slot;
+    }
+    return -1;
+}
+
+/**
+ * @brief Takes over an unsealed segment that no process holds, e.g. left by
+ * one that has exited, so that short-lived processes share a file.
+ *
+ * @return Its slot, now active, or -1 if there is none.
+ */
+static int segmentAdopt(SegmentStore *store) {
+    ScanBuffer buffer = {NULL, 0, 0};
+    for (uint32_t i = 0; i < store->segmentCount; i++) {
+        Segment *segment = &store->segments[i];
+        if (!segment->used || (int) i == store->compacting || segment->scanned >= store->segmentLimit) {
+            continue;
+        }
+        int fd = openat(store->dirFd, segment->name, O_RDWR | O_APPEND | O_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        // A compactor may have unlinked it between the open and the lock
+        struct stat open, linked;
+        if (flock(fd, LOCK_EX | LOCK_NB) == -1 || fstat(fd, &open) == -1 || open.st_ino != segment->inode ||
+            fstatat(store->dirFd, segment->name, &linked, 0) == -1 || linked.st_ino != open.st_ino) {
+            close(fd);
+            continue;
+        }
+        segmentClose(store, (int) i);
+        segment->fd = fd;
+        store->openFds++;
+        if (buffer.data == NULL && (buffer.data = malloc(SEGMENT_SCAN_BUFFER)) == NULL) {
+            segmentClose(store, (int) i);
+            return -1;
+        }
+        // Appends go to the end of the file, so it must end with the last record indexed
+        segmentScan(store, (int) i, &buffer);
+        if (segment->scanned == open.st_size && segment->scanned < store->segmentLimit) {
+            free(buffer.data);
+            store->active = (int) i;
+            segmentCloseIdle(store);
+            return (int) i;
+        }
+        segmentClose(store, (int) i);
+    }
+    free(buffer.data);
+    return -1;
+}
+
+static int appendRecord(SegmentStore *store, const char *key, size_t keyLength, const char *body,
+                        uint64_t bodyLength, uint32_t crc, uint32_t sequence) {
+    if (store->active != -1 && store->segments[store->active].scanned >= store->segmentLimit) {
+        // Sealed: from now on any worker may compact it
+        flock(store->segments[store->active].fd, LOCK_UN);
+        store->active = -1;
+    }
+    if (store->active == -1 && segmentAdopt(store) == -1 && segmentCreate(store) == -1) {
+        return -1;
+    }
+
+    int slot = store->active;
+    Segment *segment = &store->segments[slot];
+    SegmentRecord record = {SEGMENT_MAGIC, (uint32_t) keyLength, bodyLength, crc, sequence};
+    off_t length = recordLength(&record);
+    struct iovec iov[3] = {
+        {&record, sizeof(record)},
+        {(void *) key, keyLength},
+        {(void *) body, (size_t) (length - (off_t) (sizeof(record) + keyLength))},
+    };
+    ssize_t written = writev(segment->fd, iov, 3);
+    if (written != (ssize_t) length) {
+        // Cut off a torn record so that the segment stays scannable
+        if (written > 0 && ftruncate(segment->fd, segment->scanned) == -1) {
+            flock(segment->fd, LOCK_UN);
+            store->active = -1;
+        }
+        return -1;
+    }
+    off_t offset = segment->scanned;
+    segment->scanned += length;
+    segmentNoteRecord(segment, offset, sequence);
+    return tableInsert(store, hashKey(key, keyLength), slot, offset, (uint32_t) length, crc, recordFlags(&record),
+                       sequence);
+}
+
+/**
+ * @brief Appends an object to this process's active segment and indexes it.
+ *
+ * @param crc CRC32C of the body, stored with it for readers to check.
+ * @return 0 on success, -1 on failure.
+ */
+int segStoreAppend(SegmentStore *store, const char *key, const char *body, size_t bodyLength, uint32_t crc) {
+    size_t keyLength = strlen(key);
+    if (keyLength == 0 || keyLength > SEGMENT_MAX_KEY) {
+        return -1;
+    }
+    return appendRecord(store, key, keyLength, body, bodyLength, crc, nextSequence(store));
+}
+
+/**
+ * @brief Hides any stored record for a key, e.g. once the object is kept elsewhere.
+ *
+ * @return 0 on success, -1 if the tombstone could not be written.
+ */
+int segStoreRemove(SegmentStore *store, const char *key) {
+    size_t keyLength = strlen(key);
+    if (keyLength == 0 || keyLength > SEGMENT_MAX_KEY || tableFind(store, hashKey(key, keyLength))->segment == 0) {
+        return 0;
+    }
+    return appendRecord(store, key, keyLength, NULL, SEGMENT_TOMBSTONE, 0, nextSequence(store));
+}
+
+// At least half dead, or small
+static int compactWorthwhile(const SegmentStore *store, const Segment *segment) {
+    return segment->scanned != 0 && (segment->liveBytes * 2 <= segment->scanned ||
+                                     segment->scanned < store->segmentLimit / SEGMENT_SMALL_DIVISOR);
+}
+
+// A segment worth compacting that no other worker is writing or compacting
+static int compactCandidate(SegmentStore *store) {
+    ScanBuffer buffer = {NULL, 0, 0};
+    for (uint32_t i = 0; i < store->segmentCount; i++) {
+        Segment *segment = &store->segments[i];
+        if (!segment->used || (int) i == store->active || !compactWorthwhile(store, segment)) {
+            continue;
+        }
+        int fd = segmentFd(store, (int) i);
+        if (fd == -1 || flock(fd, LOCK_EX | LOCK_NB) == -1) {
+            continue;
+        }
+        // Another worker may have compacted and unlinked it already
+        struct stat linked, open;
+        if (fstatat(store->dirFd, segment->name, &linked, 0) == 0 && fstat(fd, &open) == 0 &&
+            linked.st_ino == open.st_ino) {
+            // Its writer may have appended records since the last scan: they have to move too
+            if (buffer.data == NULL) {
+                buffer.data = malloc(SEGMENT_SCAN_BUFFER);
+            }
+            if (buffer.data != NULL && segmentScan(store, (int) i, &buffer) == 0 && compactWorthwhile(store, segment)) {
+                free(buffer.data);
+                return (int) i;
+            }
+        }
+        flock(fd, LOCK_UN);
+    }
+    free(buffer.data);
+    return -1;
+}
+
+// Whether a segment other than the one being compacted may still hold a record the tombstone hides
+static int tombstoneNeeded(const SegmentStore *store, int slot, const SegmentEntry *entry) {
+    for (uint32_t i = 0; i < store->segmentCount; i++) {
+        const Segment *segment = &store->segments[i];
+        if (segment->used && (int) i != slot && (entry->older & slotBit((int) i)) && segment->scanned != 0 &&
+            !sequenceAfter(segment->oldest, entry->sequence)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Moves up to budget bytes of records out of mostly dead or small segments.
+ *
+ * Live records are re-appended to the active segment; once a whole
+ * segment has been walked it is unlinked and the next one is taken while
+ * budget remains, so the files left by many short-lived processes are
+ * merged quickly. Meant to be called periodically from the event loop so
+ * that compaction never stalls requests for long.
+ *
+ * @return 1 if compaction work remains, 0 when there is nothing to compact.
+ */
+int segStoreCompactStep(SegmentStore *store, off_t budget) {
+    char key[SEGMENT_MAX_KEY + 1];
+    char *body = NULL;
+    size_t bodyCapacity = 0;
+
+    while (budget > 0) {
+        if (store->compacting == -1) {
+            store->compacting = compactCandidate(store);
+            store->compactCursor = 0;
+            if (store->compacting == -1) {
+                free(body);
+                return 0;
+            }
+        }
+        int slot = store->compacting;
+        int fd = store->segments[slot].fd;
+
+        while (budget > 0 && store->compactCursor < store->segments[slot].scanned) {
+            off_t pos = store->compactCursor;
+            SegmentRecord record = {0};
+            size_t headerBytes = 0;
+            if (pread(fd, &record, offsetof(SegmentRecord, crc), pos) == (ssize_t) offsetof(SegmentRecord, crc)) {
+                headerBytes = headerLength(record.magic);
+            }
+            if (headerBytes == 0 || pread(fd, &record, headerBytes, pos) != (ssize_t) headerBytes ||
+                record.keyLength == 0 || record.keyLength > SEGMENT_MAX_KEY ||
+                pread(fd, key, record.keyLength, pos + (off_t) headerBytes) != (ssize_t) record.keyLength) {
+                store->compactCursor = store->segments[slot].scanned;
+                break;
+            }
+            key[record.keyLength] = '\0';
+            off_t length = recordLength(&record);
+            SegmentEntry *entry = tableFind(store, hashKey(key, record.keyLength));
+
+            if (entry->segment == (uint32_t) slot + 1 && entry->offset == (uint64_t) pos &&
+                record.bodyLength == SEGMENT_TOMBSTONE) {
+                if (!tombstoneNeeded(store, slot, entry)) {
+                    // The segments that held older records of the key have been compacted: nothing left to hide
+                    tableRemove(store, entry);
+                } else if (appendRecord(store, key, record.keyLength, NULL, SEGMENT_TOMBSTONE, 0,
+                                        record.sequence) == -1) {
+                    break;
+                }
+            } else if (entry->segment == (uint32_t) slot + 1 && entry->offset == (uint64_t) pos) {
+                if (record.bodyLength > bodyCapacity) {
+                    char *grown = realloc(body, record.bodyLength);
+                    if (grown == NULL) {
+                        break;
+                    }
+                    body = grown;
+                    bodyCapacity = record.bodyLength;
+                }
+                off_t bodyOffset = pos + (off_t) (headerBytes + record.keyLength);
+                if (pread(fd, body, record.bodyLength, bodyOffset) != (ssize_t) record.bodyLength) {
+                    break;
+                }
+                // The copy keeps the CRC of the original, so damage done meanwhile still shows
+                if (record.magic != SEGMENT_MAGIC) {
+                    record.crc = crc32cUpdate(0, body, record.bodyLength);
+                }
+                // Under the original's sequence, so that it never hides a record written after the original
+                if (appendRecord(store, key, record.keyLength, body, record.bodyLength, record.crc,
+                                 record.sequence) == -1) {
+                    break;
+                }
+            }
+            store->compactCursor = pos + length;
+            budget -= length;
+        }
+
+        if (store->compactCursor < store->segments[slot].scanned) {
+            free(body);
+            if (budget > 0) {
+                // Gave up on an error: release the segment for another attempt later
+                flock(fd, LOCK_UN);
+                store->compacting = -1;
+                return 0;
+            }
+            return 1;
+        }
+        // Every live record has moved: the segment can go
+        unlinkat(store->dirFd, store->segments[slot].name, 0);
+        store->compacting = -1;
+        segmentDrop(store, slot);
+    }
+    free(body);
+    return 1;
+}
@@ -0,0 +1,91 @@
+#ifndef CPROXY_SEGSTORE_H
+#define CPROXY_SEGSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Body length of a record that removes its key
+#define SEGMENT_TOMBSTONE UINT64_MAX
+
+// Every record starts with this header, followed by the key and the body
+typedef struct SegmentRecord {
+    uint32_t magic;
+    uint32_t keyLength;
+    uint64_t bodyLength;
+    uint32_t crc;           // CRC32C of the body; records of the first version end the header before it
+    uint32_t sequence;      // Write order among the records of every process; 0 in records older than it
+} SegmentRecord;
+
+// SegmentEntry flags
+#define SEGMENT_CHECKSUM 1      // The record carries the CRC of its body
+#define SEGMENT_VERIFIED 2      // This process has checked the body against it
+#define SEGMENT_REMOVED 4       // The record is a tombstone
+
+typedef struct Segment {
+    int used;               // 0 for a free slot
+    int fd;                 // -1 while closed; only the least recently used few stay open
+    ino_t inode;            // Tells the file from a later one under the same name
+    char name[64];
+    off_t scanned;          // Bytes indexed so far; segments only ever grow
+    off_t liveBytes;        // Bytes of the records the index still points to
+    uint32_t oldest;        // Sequence of the oldest record scanned, dead ones included
+    uint64_t lastUsed;      // SegmentStore.clock when the descriptor was last wanted
+} Segment;
+
+// Index entry: 64-bit key hash to the location of the newest record
+typedef struct SegmentEntry {
+    uint64_t hash;
+    uint64_t offset;        // Offset of the record in its segment
+    uint32_t segment;       // Segment slot + 1, 0 for an empty entry
+    uint32_t length;        // Whole record, header and key included
+    uint32_t crc;
+    uint32_t flags;
+    uint32_t sequence;      // Of the record, see SegmentRecord
+    uint32_t older;         // Bit slot % 32 set for each segment seen holding an older record of the key
+} SegmentEntry;
+
+/**
+ * @brief Small objects packed into large append-only segment files.
+ *
+ * Each process appends only to its own active segment, which it holds an
+ * exclusive flock() on, and indexes every segment in the directory so it
+ * also finds what other workers stored. The unsealed segment of a process
+ * that has gone is taken over by the next one that needs to append, rather
+ * than starting another file. Every record takes a number from a
+ * counter the processes share, so a record becomes dead once one written
+ * after it for the same key is indexed, whatever order the segments are
+ * read in. Segments that are mostly dead or small are compacted a step at
+ * a time by copying their live records, numbers and all, into the active
+ * segment and unlinking them. A tombstone is copied only while a segment
+ * that held an older record of its key is still there.
+ */
+typedef struct SegmentStore {
+    int dirFd;
+    Segment *segments;
+    uint32_t segmentCount;      // Slots, free ones included
+    unsigned int openFds;       // Segments with a descriptor open
+    uint64_t clock;             // Counts descriptor uses, see Segment.lastUsed
+    SegmentEntry *table;        // Open addressing, linear probing
+    size_t tableSize;           // Power of two
+    size_t entries;
+    int active;                 // Slot being appended to, -1 when none
+    off_t segmentLimit;         // Size at which the active segment is sealed
+    uint64_t lastRefresh;       // Milliseconds, see segStoreRefresh()
+    int compacting;             // Slot being compacted, -1 when idle
+    off_t compactCursor;
+    unsigned int sequence;      // Makes segment names unique within the process
+    uint32_t *counter;          // Shared record sequence, mapped from the "sequence" file
+    uint32_t newest;            // Latest sequence indexed
+} SegmentStore;
+
+int segStoreOpen(SegmentStore *store, const char *dir, off_t segmentLimit);
+void segStoreClose(SegmentStore *store);
+
+SegmentEntry *segStoreLookup(SegmentStore *store, const char *key, int *fd, off_t *offset, off_t *length);
+int segStoreAppend(SegmentStore *store, const char *key, const char *body, size_t bodyLength, uint32_t crc);
+int segStoreRemove(SegmentStore *store, const char *key);
+void segStoreRefresh(SegmentStore *store);
+int segStoreCompactStep(SegmentStore *store, off_t budget);
+
+#endif //CPROXY_SEGSTORE_H
@@ -0,0 +1,112 @@
+// Event loop test: the origin finishes and the client hangs up in the same
+// epoll_wait() batch, and whichever is dispatched first closes the relay.
+// The other watcher must get no event and the relay must be freed only
+// once the batch is over.
+//
+// Usage: eventloop_test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "eventloop.h"
+
+typedef struct Relay {
+    EventLoop *loop;
+    IoWatcher origin;
+    IoWatcher client;
+    Deferred release;
+    int closed;
+} Relay;
+
+static int lateEvents = 0;
+static int releasedEarly = 0;
+static int released = 0;
+
+static void relayRelease(void *arg) {
+    Relay *relay = arg;
+    if (relay->loop->dispatching) {
+        releasedEarly++;
+    }
+    released++;
+    free(relay);
+}
+
+static void relayClose(Relay *relay) {
+    loopDelFd(relay->loop, &relay->origin);
+    loopDelFd(relay->loop, &relay->client);
+    close(relay->origin.fd);
+    close(relay->client.fd);
+    relay->closed = 1;
+    loopDefer(relay->loop, &relay->release);
+}
+
+static void onReady(IoWatcher *watcher, uint32_t events) {
+    Relay *relay = watcher->arg;
+    char buffer[256];
+    (void) events;
+    if (relay->closed) {
+        lateEvents++;
+        return;
+    }
+    // Drain up to the end of the stream: the response for the origin, nothing for the client
+    while (read(watcher->fd, buffer, sizeof(buffer)) > 0) {
+    }
+    relayClose(relay);
+}
+
+// One relay whose two sockets are both ready before the loop waits
+static int runRound(EventLoop *loop, int clientFirst) {
+    static const char response[] = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+    int origin[2], client[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, origin) == -1 || socketpair(AF_UNIX, SOCK_STREAM, 0, client) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    Relay *relay = calloc(1, sizeof(Relay));
+    if (relay == NULL) {
+        return -1;
+    }
+    relay->loop = loop;
+    watcherInit(&relay->origin, origin[0], onReady, relay);
+    watcherInit(&relay->client, client[0], onReady, relay);
+    deferredInit(&relay->release, relayRelease, relay);
+    loopAddFd(loop, clientFirst ? &relay->client : &relay->origin, EPOLLIN);
+    loopAddFd(loop, clientFirst ? &relay->origin : &relay->client, EPOLLIN);
+
+    // The origin sends the whole response and closes; the client hangs up
+    if (write(origin[1], response, sizeof(response) - 1) != (ssize_t) (sizeof(response) - 1)) {
+        perror("write");
+        return -1;
+    }
+    close(origin[1]);
+    close(client[1]);
+    return loopRunOnce(loop, 1000);
+}
+
+int main(void) {
+    static const int rounds = 1000;
+    EventLoop loop;
+    if (loopInit(&loop) == -1) {
+        return EXIT_FAILURE;
+    }
+    int batched = 0;
+    for (int i = 0; i < rounds; i++) {
+        int ready = runRound(&loop, i % 2);
+        if (ready == -1) {
+            return EXIT_FAILURE;
+        }
+        batched += ready == 2;
+    }
+    loopClose(&loop);
+
+    printf("rounds:          %d, both sockets in one batch in %d\n", rounds, batched);
+    printf("late events:     %d\n", lateEvents);
+    printf("released:        %d, %d of them during the batch\n", released, releasedEarly);
+    int ok = batched == rounds && lateEvents == 0 && released == rounds && releasedEarly == 0 &&
+             loop.watchers == 0;
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,184 @@
+#include "timerwheel.h"
+
+#include <string.h>
+#include <time.h>
+
+// Largest delta the top level can hold; anything further out is parked there and re-cascaded
+#define WHEEL_MAX_DELTA ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+/**
+ * @brief Returns the monotonic clock in milliseconds.
+ *
+ * CLOCK_MONOTONIC is served from the vDSO on Linux, so reading it once per
+ * loop iteration does not cost a system call.
+ */
+uint64_t monotonicMillis(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+void wheelInit(TimerWheel *wheel, uint64_t now) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->current = now;
+}
+
+void timerInit(Timer *timer, TimerCallback callback, void *arg) {
+    memset(timer, 0, sizeof(*timer));
+    timer->level = -1;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+int timerArmed(const Timer *timer) {
+    return timer->level >= 0;
+}
+
+// Link a timer into the slot matching its distance from the current tick
+static void wheelPlace(TimerWheel *wheel, Timer *timer) {
+    uint64_t delta = timer->expires > wheel->current ? timer->expires - wheel->current : 0;
+    uint64_t due = timer->expires;
+    if (delta > WHEEL_MAX_DELTA) {
+        delta = WHEEL_MAX_DELTA;
+        due = wheel->current + WHEEL_MAX_DELTA;
+    }
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    int slot = (int) ((due >> (WHEEL_BITS * level)) & WHEEL_MASK);
+
+    timer->level = level;
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = wheel->slots[level][slot];
+    if (timer->next != NULL) {
+        timer->next->prev = timer;
+    }
+    wheel->slots[level][slot] = timer;
+    wheel->occupied[level] |= 1ULL << slot;
+}
+
+static void wheelUnlink(TimerWheel *wheel, Timer *timer) {
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        wheel->slots[timer->level][timer->slot] = timer->next;
+        if (timer->next == NULL) {
+            wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+        }
+    }
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+    timer->next = timer->prev = NULL;
+    timer->level = -1;
+}
+
+/**
+ * @brief Arms (or re-arms) a timer to fire timeoutMs after the current tick.
+ *
+ * Re-arming an armed timer simply moves it, which is what idle deadlines do
+ * on every read.
+ */
+void wheelArm(TimerWheel *wheel, Timer *timer, uint64_t timeoutMs) {
+    if (timerArmed(timer)) {
+        wheelUnlink(wheel, timer);
+        wheel->count--;
+    }
+    if (timeoutMs == 0) {
+        timeoutMs = 1;  // The current tick has already been processed
+    }
+    timer->expires = wheel->current + timeoutMs;
+    wheelPlace(wheel, timer);
+    wheel->count++;
+}
+
+void wheelCancel(TimerWheel *wheel, Timer *timer) {
+    if (!timerArmed(timer)) {
+        return;
+    }
+    wheelUnlink(wheel, timer);
+    wheel->count--;
+}
+
+// Move every timer of one upper-level slot down to where it now belongs
+static void wheelCascade(TimerWheel *wheel, int level, uint64_t tick) {
+    int slot = (int) ((tick >> (WHEEL_BITS * level)) & WHEEL_MASK);
+    Timer *timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~(1ULL << slot);
+
+    while (timer != NULL) {
+        Timer *next = timer->next;
+        wheelPlace(wheel, timer);
+        timer = next;
+    }
+
+    if (slot == 0 && level + 1 < WHEEL_LEVELS) {
+        wheelCascade(wheel, level + 1, tick);
+    }
+}
+
+/**
+ * @brief Returns the number of milliseconds until the wheel needs attention.
+ *
+ * The result is meant to be passed straight to epoll_wait(); -1 means there
+ * is no armed timer and the caller may block indefinitely.
+ */
+int wheelNextTimeout(const TimerWheel *wheel) {
+    if (wheel->count == 0) {
+        return -1;
+    }
+    uint64_t bits = wheel->occupied[0];
+    if (bits != 0) {
+        // Rotate so that the slot of the next tick becomes bit 0
+        unsigned start = (unsigned) ((wheel->current + 1) & WHEEL_MASK);
+        uint64_t rotated = start == 0 ? bits : (bits >> start) | (bits << (WHEEL_SLOTS - start));
+        return __builtin_ctzll(rotated) + 1;
+    }
+    // Nothing in level 0: wake up at the next cascade boundary
+    return (int) (((wheel->current | WHEEL_MASK) + 1) - wheel->current);
+}
+
+/**
+ * @brief Processes every tick up to now and fires the timers that are due.
+ *
+ * @return The number of timers fired.
+ */
+unsigned long wheelAdvance(TimerWheel *wheel, uint64_t now) {
+    unsigned long fired = 0;
+
+    while (wheel->current < now) {
+        if (wheel->count == 0) {
+            wheel->current = now;
+            break;
+        }
+        // Skip straight to the next cascade boundary when level 0 is empty
+        if (wheel->occupied[0] == 0) {
+            uint64_t boundary = (wheel->current | WHEEL_MASK) + 1;
+            if (boundary > now) {
+                wheel->current = now;
+                break;
+            }
+            wheel->current = boundary - 1;
+        }
+
+        uint64_t tick = ++wheel->current;
+        int slot = (int) (tick & WHEEL_MASK);
+        if (slot == 0) {
+            wheelCascade(wheel, 1, tick);
+        }
+
+        // Pop one timer at a time so callbacks may safely cancel or arm others
+        Timer *timer;
+        while ((timer = wheel->slots[0][slot]) != NULL) {
+            wheelUnlink(wheel, timer);
+            wheel->count--;
+            fired++;
+            timer->callback(timer, timer->arg);
+        }
+    }
+    return fired;
+}
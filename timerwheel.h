@@ -0,0 +1,55 @@
+#ifndef CPROXY_TIMERWHEEL_H
+#define CPROXY_TIMERWHEEL_H
+
+#include <stdint.h>
+
+// Number of levels in the wheel and slots per level (64 slots -> one 64-bit bitmap per level)
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+struct Timer;
+typedef void (*TimerCallback)(struct Timer *timer, void *arg);
+
+/**
+ * @brief A timer embedded in its owner (usually a connection).
+ *
+ * Timers are intrusive doubly linked list nodes, so arming and cancelling
+ * never allocate and run in O(1).
+ */
+typedef struct Timer {
+    struct Timer *next;
+    struct Timer *prev;
+    uint64_t expires;       // Absolute expiry, in wheel ticks (milliseconds)
+    int level;              // Level the timer currently sits in, -1 when not armed
+    int slot;
+    TimerCallback callback;
+    void *arg;
+} Timer;
+
+/**
+ * @brief Hierarchical timer wheel with 1 ms ticks.
+ *
+ * Level 0 covers the next 64 ms, level 1 the next ~4 s, level 2 the next
+ * ~4.5 min and level 3 the next ~4.7 h. Timers further out are clamped to
+ * the last level and re-cascaded until they are due.
+ */
+typedef struct TimerWheel {
+    uint64_t current;                           // Last tick that has been processed
+    uint64_t occupied[WHEEL_LEVELS];            // Bit i set when slot i of a level is non-empty
+    Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    unsigned long count;                        // Number of armed timers
+} TimerWheel;
+
+uint64_t monotonicMillis(void);
+
+void wheelInit(TimerWheel *wheel, uint64_t now);
+void timerInit(Timer *timer, TimerCallback callback, void *arg);
+void wheelArm(TimerWheel *wheel, Timer *timer, uint64_t timeoutMs);
+void wheelCancel(TimerWheel *wheel, Timer *timer);
+int timerArmed(const Timer *timer);
+int wheelNextTimeout(const TimerWheel *wheel);
+unsigned long wheelAdvance(TimerWheel *wheel, uint64_t now);
+
+#endif //CPROXY_TIMERWHEEL_H
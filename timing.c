@@ -0,0 +1,240 @@
+#include "timing.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "cproxy.h"
+
+const char *const timingPhaseNames[TIMING_PHASES] = {
+    "parse", "lookup", "dns", "connect", "send", "first_byte", "header", "body", "disk", "commit"
+};
+
+/**
+ * @brief Returns the monotonic clock in nanoseconds; a vDSO call, no system call.
+ */
+uint64_t timingNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+void timingStart(RequestTiming *timing) {
+    memset(timing, 0, sizeof(*timing));
+    timing->start = timing->mark = timingNow();
+}
+
+/**
+ * @brief Ends phase at the current time; it began where the previous one ended.
+ *
+ * Does nothing when timing is NULL, i.e. off for this request.
+ */
+void timingMark(RequestTiming *timing, TimingPhase phase) {
+    if (timing == NULL) {
+        return;
+    }
+    uint64_t now = timingNow();
+    timing->phases[phase] += now - timing->mark;
+    timing->seen |= 1u << phase;
+    timing->mark = now;
+}
+
+/**
+ * @brief Start of a phase nested in another one, for timingSince(); 0 when timing is off.
+ */
+uint64_t timingClock(const RequestTiming *timing) {
+    return timing != NULL ? timingNow() : 0;
+}
+
+// Adds the time since a timingClock() reading to phase, leaving the sequence of timingMark() alone
+void timingSince(RequestTiming *timing, TimingPhase phase, uint64_t since) {
+    if (timing == NULL) {
+        return;
+    }
+    timing->phases[phase] += timingNow() - since;
+    timing->seen |= 1u << phase;
+}
+
+void timingEnd(RequestTiming *timing) {
+    if (timing != NULL) {
+        timing->end = timingNow();
+    }
+}
+
+// Bounded appends: once out runs out, *length stays past size and the result is dropped
+static void appendFormat(char *out, size_t size, size_t *length, const char *format, ...) {
+    if (*length >= size) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(out + *length, size - *length, format, args);
+    va_end(args);
+    *length += written < 0 ? size : (size_t) written;
+}
+
+static void appendEscaped(char *out, size_t size, size_t *length, const char *text) {
+    for (; *text != '\0' && *length < size; text++) {
+        unsigned char c = (unsigned char) *text;
+        if (c == '"' || c == '\\') {
+            appendFormat(out, size, length, "\\%c", c);
+        } else if (c < 0x20) {
+            appendFormat(out, size, length, "\\u%04x", c);
+        } else {
+            out[(*length)++] = (char) c;
+        }
+    }
+}
+
+static void appendText(char *out, size_t size, size_t *length, const char *text, size_t textLength) {
+    if (*length + textLength >= size) {
+        *length = size;
+        return;
+    }
+    memcpy(out + *length, text, textLength);
+    *length += textLength;
+}
+
+// printf() would parse its format for every field of every request; these are formatted by hand
+static void appendMicros(char *out, size_t size, size_t *length, const char *name, uint64_t ns) {
+    char digits[32];
+    char *end = digits + sizeof(digits), *p = end;
+    for (int i = 0; i < 3; i++, ns /= 10) {
+        *--p = (char) ('0' + ns % 10);
+    }
+    *--p = '.';
+    do {
+        *--p = (char) ('0' + ns % 10);
+        ns /= 10;
+    } while (ns > 0);
+    appendText(out, size, length, ",\"", 2);
+    appendText(out, size, length, name, strlen(name));
+    appendText(out, size, length, "_us\":", 5);
+    appendText(out, size, length, p, (size_t) (end - p));
+}
+
+/**
+ * @brief Formats a finished request as one line of JSON, newline included.
+ *
+ * Times are in microseconds with nanosecond digits; phases that did not
+ * happen are left out.
+ *
+ * @return Length of the line, or 0 if it does not fit in size bytes.
+ */
+size_t timingFormatJson(const RequestTiming *timing, const char *url, char *out, size_t size) {
+    size_t length = 0;
+    appendFormat(out, size, &length, "{\"url\":\"");
+    appendEscaped(out, size, &length, url != NULL ? url : "");
+    appendFormat(out, size, &length, "\",\"status\":%d,\"cache\":\"%s\",\"bytes\":%ld", timing->statusCode,
+                 timing->cached ? "hit" : "miss", timing->bodyBytes);
+    if (timing->error != 0) {
+        appendFormat(out, size, &length, ",\"error\":\"%s\"", cproxyStrerror(timing->error));
+    }
+    appendMicros(out, size, &length, "total", timing->end - timing->start);
+    for (int phase = 0; phase < TIMING_PHASES; phase++) {
+        if (timing->seen & (1u << phase)) {
+            appendMicros(out, size, &length, timingPhaseNames[phase], timing->phases[phase]);
+        }
+    }
+    appendFormat(out, size, &length, "}\n");
+    return length < size ? length : 0;
+}
+
+static unsigned int bucketOf(uint64_t value) {
+    if (value >> TIMING_MAX_BITS) {
+        value = ((uint64_t) 1 << TIMING_MAX_BITS) - 1;
+    }
+    if (value < (1u << TIMING_SUB_BITS)) {
+        return (unsigned int) value;
+    }
+    unsigned int exponent = 63 - (unsigned int) __builtin_clzll(value);
+    unsigned int sub = (unsigned int) (value >> (exponent - TIMING_SUB_BITS)) & ((1u << TIMING_SUB_BITS) - 1);
+    return ((exponent - TIMING_SUB_BITS + 1) << TIMING_SUB_BITS) + sub;
+}
+
+// Largest value that falls into bucket
+static uint64_t bucketTop(unsigned int bucket) {
+    if (bucket < (1u << TIMING_SUB_BITS)) {
+        return bucket;
+    }
+    unsigned int shift = (bucket >> TIMING_SUB_BITS) - 1;
+    uint64_t sub = bucket & ((1u << TIMING_SUB_BITS) - 1);
+    return (((1u << TIMING_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+void histogramRecord(TimingHistogram *histogram, uint64_t value) {
+    if (histogram->count == 0 || value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+    histogram->count++;
+    histogram->sum += value;
+    histogram->buckets[bucketOf(value)]++;
+}
+
+void histogramMerge(TimingHistogram *into, const TimingHistogram *from) {
+    if (from->count == 0) {
+        return;
+    }
+    if (into->count == 0 || from->min < into->min) {
+        into->min = from->min;
+    }
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+    for (unsigned int i = 0; i < TIMING_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+}
+
+/**
+ * @brief Value below which percentile % of the recorded values fall.
+ *
+ * Exact to within the width of a bucket: it returns the top of the bucket,
+ * so it never under-reports.
+ */
+uint64_t histogramPercentile(const TimingHistogram *histogram, double percentile) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (percentile / 100.0 * (double) histogram->count + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < TIMING_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            uint64_t top = bucketTop(i);
+            return top < histogram->max ? top : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+void timingSummaryInit(TimingSummary *summary) {
+    memset(summary, 0, sizeof(*summary));
+}
+
+void timingSummaryRecord(TimingSummary *summary, const RequestTiming *timing) {
+    summary->requests++;
+    histogramRecord(&summary->total, timing->end - timing->start);
+    for (int phase = 0; phase < TIMING_PHASES; phase++) {
+        if (timing->seen & (1u << phase)) {
+            histogramRecord(&summary->phases[phase], timing->phases[phase]);
+        }
+    }
+}
+
+void timingSummaryMerge(TimingSummary *into, const TimingSummary *from) {
+    into->requests += from->requests;
+    histogramMerge(&into->total, &from->total);
+    for (int phase = 0; phase < TIMING_PHASES; phase++) {
+        histogramMerge(&into->phases[phase], &from->phases[phase]);
+    }
+}
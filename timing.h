@@ -0,0 +1,91 @@
+#ifndef CPROXY_TIMING_H
+#define CPROXY_TIMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Where the time of one request went, in the order the phases happen.
+ *
+ * A hit goes through parse, lookup and body; a miss through parse, lookup,
+ * then the origin phases from dns to body. Disk and commit are the part of
+ * the body spent writing the cache and then publishing the object, so they
+ * overlap body instead of following it.
+ */
+typedef enum {
+    TIMING_PARSE,           // URL split, canonicalized and mapped to its cache file
+    TIMING_LOOKUP,          // Cache lookup, including opening and verifying the object
+    TIMING_DNS,             // Resolving the origin
+    TIMING_CONNECT,         // TCP handshake
+    TIMING_SEND,            // Sending the request
+    TIMING_FIRST_BYTE,      // Request sent until the first response byte
+    TIMING_HEADER,          // First byte until the end of the response header
+    TIMING_BODY,            // The body: from the origin on a miss, to the client on a hit
+    TIMING_DISK,            // Writing the body to the cache
+    TIMING_COMMIT,          // Publishing the stored object
+    TIMING_PHASES
+} TimingPhase;
+
+extern const char *const timingPhaseNames[TIMING_PHASES];
+
+/**
+ * @brief Monotonic phase timestamps of one request.
+ *
+ * Embedded in whoever serves the request and passed down as a pointer that
+ * is NULL while timing is off, so a disabled request pays one test per
+ * phase boundary.
+ */
+typedef struct RequestTiming {
+    uint64_t start;                     // ns, CLOCK_MONOTONIC
+    uint64_t mark;                      // End of the last phase
+    uint64_t end;                       // Set by timingEnd()
+    uint64_t phases[TIMING_PHASES];     // ns spent in each phase
+    unsigned int seen;                  // Bit per phase that happened
+    int statusCode;
+    int cached;                         // Answered from the cache
+    long bodyBytes;
+    int error;                          // CproxyError, 0 on success
+} RequestTiming;
+
+// Histogram buckets: exact below 2^TIMING_SUB_BITS ns, then that many per power of two (6% wide)
+#define TIMING_SUB_BITS 4
+#define TIMING_MAX_BITS 40      // Values are clamped to 2^40 ns, about 18 minutes
+#define TIMING_BUCKETS ((TIMING_MAX_BITS - TIMING_SUB_BITS + 1) << TIMING_SUB_BITS)
+
+/**
+ * @brief Log-linear latency histogram in the style of HdrHistogram.
+ *
+ * Fixed size and never allocates, so one can live in shared memory and
+ * histograms of several workers merge by adding their buckets.
+ */
+typedef struct TimingHistogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[TIMING_BUCKETS];
+} TimingHistogram;
+
+typedef struct TimingSummary {
+    uint64_t requests;
+    TimingHistogram total;
+    TimingHistogram phases[TIMING_PHASES];
+} TimingSummary;
+
+uint64_t timingNow(void);
+void timingStart(RequestTiming *timing);
+void timingMark(RequestTiming *timing, TimingPhase phase);
+uint64_t timingClock(const RequestTiming *timing);
+void timingSince(RequestTiming *timing, TimingPhase phase, uint64_t since);
+void timingEnd(RequestTiming *timing);
+size_t timingFormatJson(const RequestTiming *timing, const char *url, char *out, size_t size);
+
+void histogramRecord(TimingHistogram *histogram, uint64_t value);
+void histogramMerge(TimingHistogram *into, const TimingHistogram *from);
+uint64_t histogramPercentile(const TimingHistogram *histogram, double percentile);
+
+void timingSummaryInit(TimingSummary *summary);
+void timingSummaryRecord(TimingSummary *summary, const RequestTiming *timing);
+void timingSummaryMerge(TimingSummary *into, const TimingSummary *from);
+
+#endif //CPROXY_TIMING_H
@@ -0,0 +1,211 @@
+#include "url.h"
+
+#include <ctype.h>
+#include <string.h>
+
+#include "cproxy.h"
+#include "scan.h"
+
+/**
+ * @brief Prepares an empty context whose arena starts in the given storage.
+ *
+ * Typical URLs fit in a few hundred bytes and never reach malloc.
+ */
+void requestContextInit(RequestContext *ctx, void *storage, size_t storageSize) {
+    memset(ctx, 0, sizeof(RequestContext));
+    arenaInit(&ctx->arena, storage, storageSize);
+}
+
+/**
+ * @brief Releases every string of the request at once and clears the context.
+ */
+void requestContextFree(RequestContext *ctx) {
+    arenaReset(&ctx->arena);
+    ctx->protocol = NULL;
+    ctx->hostname = ctx->port = ctx->filepath = ctx->currentPath = ctx->cacheKey = NULL;
+    ctx->segments = NULL;
+    ctx->segmentCount = 0;
+}
+
+// Function to find the last value in the path
+const char *get_last_value(const RequestContext *ctx) {
+    if (ctx->segmentCount == 0) {
+        return NULL;  // List is empty
+    }
+
+    // Handle the case where there is only one segment
+    if (ctx->segmentCount == 1) {
+        return ctx->hostname;
+    }
+
+    return ctx->segments[ctx->segmentCount - 1];
+}
+
+/**
+ * @brief Builds the path made of the hostname and the path segments.
+ *
+ * @return 0 on success, CPROXY_ERR_NOMEM if the arena could not grow.
+ */
+int buildPath(RequestContext *ctx) {
+    // The exact length is known up front, so the path can never overflow
+    size_t length = strlen(ctx->hostname);
+    for (size_t i = 0; i < ctx->segmentCount; i++) {
+        length += strlen(ctx->segments[i]) + (i > 0 ? 1 : 0);
+    }
+    ctx->currentPath = arenaAlloc(&ctx->arena, length + 1);
+    if (ctx->currentPath == NULL) {
+        return CPROXY_ERR_NOMEM;
+    }
+
+    char *out = ctx->currentPath;
+    size_t hostnameLength = strlen(ctx->hostname);
+    memcpy(out, ctx->hostname, hostnameLength);
+    out += hostnameLength;
+
+    // The first segment is appended as is, the following ones after a separator
+    for (size_t i = 0; i < ctx->segmentCount; i++) {
+        if (i > 0) {
+            *out++ = '/';
+        }
+        size_t segmentLength = strlen(ctx->segments[i]);
+        memcpy(out, ctx->segments[i], segmentLength);
+        out += segmentLength;
+    }
+    *out = '\0';
+    return 0;
+}
+
+/**
+ * @brief Splits a path and stores each segment in the context.
+ *
+ * Given a path, this function splits it at each "/" in a single pass: the
+ * path is copied once into the arena and every "/" is replaced by a
+ * terminator, so the segments point into that copy. A trailing empty
+ * segment is not stored.
+ *
+ * @param path The input path to be split and stored.
+ * @return 0 on success, CPROXY_ERR_NOMEM if the arena could not grow.
+ */
+int splitAndStorePath(RequestContext *ctx, const char *path) {
+    size_t pathLength = strlen(path);
+    size_t separators = 0;
+    for (const char *c = path; *c != '\0'; c++) {
+        if (*c == '/') {
+            separators++;
+        }
+    }
+
+    char *copy = arenaStrndup(&ctx->arena, path, pathLength);
+    ctx->segments = arenaAlloc(&ctx->arena, (separators + 1) * sizeof(char *));
+    if (copy == NULL || ctx->segments == NULL) {
+        return CPROXY_ERR_NOMEM;
+    }
+    ctx->segmentCount = 0;
+
+    char *segmentStart = copy;
+    for (char *c = copy; *c != '\0'; c++) {
+        if (*c == '/') {
+            *c = '\0';
+            ctx->segments[ctx->segmentCount++] = segmentStart;
+            segmentStart = c + 1;
+        }
+    }
+
+    // Handle the last segment after the last "/"
+    if (*segmentStart != '\0') {
+        ctx->segments[ctx->segmentCount++] = segmentStart;
+    }
+    return 0;
+}
+
+/**
+ * @brief Splits a URL into its components.
+ *
+ * Given a URL, this function extracts the protocol, hostname, port, and filepath
+ * into the request context. It also calls splitAndStorePath to store the path
+ * segments. Nothing is printed; the caller decides how to report an error.
+ *
+ * @param url The input URL to be split.
+ * @return 0 on success, CPROXY_ERR_URL for a malformed URL or CPROXY_ERR_NOMEM.
+ */
+int splitURL(RequestContext *ctx, const char *url) {
+    const char *urlEnd = url + strlen(url);
+
+    // Find the position of "://"
+    const char *protocolEnd = scanFirstOf(url, (size_t) (urlEnd - url), ':', ':');
+    while (protocolEnd != NULL && strncmp(protocolEnd, "://", 3) != 0) {
+        protocolEnd = scanFirstOf(protocolEnd + 1, (size_t) (urlEnd - protocolEnd - 1), ':', ':');
+    }
+    if (protocolEnd == NULL) {
+        return CPROXY_ERR_URL;
+    }
+    ctx->protocol = "http://";
+
+    // Move to the hostname part
+    const char *hostnameStart = protocolEnd + 3;
+
+    // The hostname ends at the first ":" or "/"; only a ":" before any "/" starts a port
+    const char *hostnameEnd = scanFirstOf(hostnameStart, (size_t) (urlEnd - hostnameStart), ':', '/');
+    const char *portStart = hostnameEnd != NULL && *hostnameEnd == ':' ? hostnameEnd : NULL;
+    const char *pathStart = portStart != NULL ? scanFirstOf(portStart, (size_t) (urlEnd - portStart), '/', '/')
+                                              : hostnameEnd;
+
+    if (portStart != NULL) {
+        // Extract hostname up to the port
+        ctx->hostname = arenaStrndup(&ctx->arena, hostnameStart, portStart - hostnameStart);
+
+        // Move to the port part
+        const char *portEnd = pathStart;
+
+        // Check if the port contains only digits
+        if (portEnd != NULL && portEnd > portStart + 1) {
+            int isDigit = 1;
+            for (const char *digitCheck = portStart + 1; digitCheck < portEnd; ++digitCheck) {
+                if (!isdigit(*digitCheck)) {
+                    isDigit = 0;
+                    break;
+                }
+            }
+
+            // If the port contains non-digit characters, reject the URL
+            if (!isDigit) {
+                return CPROXY_ERR_URL;
+            }
+
+            // Extract port
+            ctx->port = arenaStrndup(&ctx->arena, portStart + 1, portEnd - portStart - 1);
+
+            // Extract filepath
+            ctx->filepath = arenaStrndup(&ctx->arena, portEnd, (size_t) (urlEnd - portEnd));
+        } else {
+            // No slash after port, reject the URL
+            return CPROXY_ERR_URL;
+        }
+    } else {
+        // No port specified or port appears after a slash
+        if (pathStart != NULL) {
+            // Extract hostname up to the first "/"
+            ctx->hostname = arenaStrndup(&ctx->arena, hostnameStart, pathStart - hostnameStart);
+
+            // Extract filepath
+            ctx->port = "80";
+            ctx->filepath = arenaStrndup(&ctx->arena, pathStart, (size_t) (urlEnd - pathStart));
+        } else {
+            // No port and no path specified
+            ctx->hostname = arenaStrndup(&ctx->arena, hostnameStart, (size_t) (urlEnd - hostnameStart));
+
+            // No port either: a lone ":" would have taken the port branch and been rejected there
+            ctx->port = "80";
+
+            // Set filepath to "/", which is what the origin is asked for
+            ctx->filepath = "/";
+        }
+    }
+
+    if (ctx->hostname == NULL || ctx->port == NULL || ctx->filepath == NULL) {
+        return CPROXY_ERR_NOMEM;
+    }
+
+    // Call splitAndStorePath to store path segments
+    return splitAndStorePath(ctx, ctx->filepath);
+}
@@ -0,0 +1,36 @@
+#ifndef CPROXY_URL_H
+#define CPROXY_URL_H
+
+#include <stddef.h>
+
+#include "arena.h"
+
+/**
+ * @brief Everything parsed from one request URL.
+ *
+ * All strings and the segment array live in the context's arena, so a
+ * request is released with one arenaReset() and concurrent requests share
+ * no state. The caller provides the first arena block: a stack array for
+ * the one-shot client, a pool buffer for a proxied request.
+ */
+typedef struct RequestContext {
+    Arena arena;
+    const char *protocol;
+    const char *hostname;
+    const char *port;
+    const char *filepath;
+    char *currentPath;      // hostname followed by the path segments, built by buildPath()
+    char *cacheKey;         // Canonical form of the URL, built by canonicalizeURL()
+    char **segments;        // Path segments, split at each "/"
+    size_t segmentCount;
+} RequestContext;
+
+void requestContextInit(RequestContext *ctx, void *storage, size_t storageSize);
+void requestContextFree(RequestContext *ctx);
+
+int splitURL(RequestContext *ctx, const char *url);
+int splitAndStorePath(RequestContext *ctx, const char *path);
+int buildPath(RequestContext *ctx);
+const char *get_last_value(const RequestContext *ctx);
+
+#endif //CPROXY_URL_H
@@ -0,0 +1,341 @@
+#include "vary.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "cproxy.h"
+#include "httpheader.h"
+
+#define VARIANT_MAGIC 0x48565043    // "CPVH"
+
+// Response headers that describe the representation; a hit on a variant sends them along
+static const char *const representationHeaders[] = {"Content-Type", "Content-Encoding", "Content-Language", "Vary"};
+
+typedef struct VaryName {
+    const char *start;
+    size_t length;
+} VaryName;
+
+static char lowerCase(char c) {
+    return c >= 'A' && c <= 'Z' ? (char) (c - 'A' + 'a') : c;
+}
+
+static int compareVaryNames(const VaryName *a, const VaryName *b) {
+    size_t common = a->length < b->length ? a->length : b->length;
+    for (size_t i = 0; i < common; i++) {
+        char left = lowerCase(a->start[i]);
+        char right = lowerCase(b->start[i]);
+        if (left != right) {
+            return left < right ? -1 : 1;
+        }
+    }
+    return a->length < b->length ? -1 : a->length > b->length;
+}
+
+/**
+ * @brief Brings a Vary header value into one spelling: lower case names,
+ * sorted, without duplicates, separated by single commas.
+ *
+ * @return The length written to out, or -1 if the response varies on "*"
+ * or the list does not fit, i.e. it cannot be cached.
+ */
+int varyNormalize(const char *value, size_t length, char *out, size_t size) {
+    size_t count = 1;
+    for (size_t i = 0; i < length; i++) {
+        count += value[i] == ',';
+    }
+    VaryName names[count];
+    size_t found = 0;
+    for (const char *cursor = value, *end = value + length; cursor < end;) {
+        const char *comma = memchr(cursor, ',', (size_t) (end - cursor));
+        const char *nameEnd = comma != NULL ? comma : end;
+        const char *start = cursor;
+        while (start < nameEnd && (*start == ' ' || *start == '\t')) {
+            start++;
+        }
+        const char *stop = nameEnd;
+        while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t')) {
+            stop--;
+        }
+        if (stop - start == 1 && *start == '*') {
+            return -1;
+        }
+        if (stop > start) {
+            VaryName name = {start, (size_t) (stop - start)};
+            size_t j = found;
+            for (; j > 0 && compareVaryNames(&names[j - 1], &name) > 0; j--) {
+                names[j] = names[j - 1];
+            }
+            names[j] = name;
+            found++;
+        }
+        cursor = nameEnd + 1;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < found; i++) {
+        if (i > 0 && compareVaryNames(&names[i - 1], &names[i]) == 0) {
+            continue;
+        }
+        if (n + names[i].length + 2 > size) {
+            return -1;
+        }
+        if (n > 0) {
+            out[n++] = ',';
+        }
+        for (size_t j = 0; j < names[i].length; j++) {
+            out[n++] = lowerCase(names[i].start[j]);
+        }
+    }
+    out[n] = '\0';
+    return (int) n;
+}
+
+/**
+ * @brief Builds what is stored in front of a variant's body: a VariantHeader
+ * and the representation headers found in the response header block.
+ *
+ * Headers that do not fit in size are left out.
+ *
+ * @return The number of bytes written.
+ */
+size_t varyRepresentationHeaders(char *out, size_t size, const char *block, size_t length) {
+    VariantHeader header = {VARIANT_MAGIC, 0};
+    size_t n = sizeof(header);
+    for (size_t i = 0; i < sizeof(representationHeaders) / sizeof(representationHeaders[0]); i++) {
+        size_t valueLength;
+        const char *value = httpHeaderFind(block, length, representationHeaders[i], &valueLength);
+        if (value == NULL) {
+            continue;
+        }
+        // snprintf() needs room for the terminating NUL as well
+        size_t lineLength = strlen(representationHeaders[i]) + 2 + valueLength + 2;
+        if (n + lineLength < size) {
+            n += (size_t) snprintf(out + n, size - n, "%s: %.*s\r\n", representationHeaders[i], (int) valueLength,
+                                   value);
+        }
+    }
+    header.length = (uint32_t) (n - sizeof(header));
+    memcpy(out, &header, sizeof(header));
+    return n;
+}
+
+/**
+ * @brief Maps a request to the variant selected by the request headers a
+ * response varies on.
+ *
+ * The secondary key is the cache key followed by each listed header and
+ * its value, trimmed and with runs of whitespace collapsed; a header the
+ * request lacks has an empty value. vary must be normalized.
+ *
+ * @return The path, or NULL if the arena could not grow.
+ */
+const char *cacheVariantPathFor(const Cache *cache, RequestContext *ctx, const char *vary,
+                                const char *requestHeaders) {
+    const char *headers = requestHeaders != NULL ? requestHeaders : "";
+    size_t headersLength = strlen(headers);
+    size_t keyLength = strlen(ctx->cacheKey);
+    size_t size = keyLength + 1 + strlen(vary) + 2;
+    for (const char *name = vary; *name != '\0';) {
+        size_t nameLength = strcspn(name, ",");
+        char header[nameLength + 1];
+        memcpy(header, name, nameLength);
+        header[nameLength] = '\0';
+        size_t valueLength = 0;
+        httpHeaderFind(headers, headersLength, header, &valueLength);
+        size += nameLength + valueLength + 2;
+        name += nameLength + (name[nameLength] == ',');
+    }
+
+    char *key = arenaAlloc(&ctx->arena, size);
+    if (key == NULL) {
+        return NULL;
+    }
+    memcpy(key, ctx->cacheKey, keyLength);
+    size_t n = keyLength;
+    key[n++] = '#';
+    for (const char *name = vary; *name != '\0';) {
+        size_t nameLength = strcspn(name, ",");
+        char header[nameLength + 1];
+        memcpy(header, name, nameLength);
+        header[nameLength] = '\0';
+        size_t valueLength = 0;
+        const char *value = httpHeaderFind(headers, headersLength, header, &valueLength);
+        memcpy(key + n, name, nameLength);
+        n += nameLength;
+        key[n++] = '=';
+        for (size_t i = 0; i < valueLength; i++) {
+            int space = value[i] == ' ' || value[i] == '\t';
+            if (!space || (key[n - 1] != ' ' && i + 1 < valueLength)) {
+                key[n++] = space ? ' ' : value[i];
+            }
+        }
+        key[n++] = '\n';
+        name += nameLength + (name[nameLength] == ',');
+    }
+    return cachePathForKey(cache, ctx, key, n);
+}
+
+static const char *varyRecordPath(const Cache *cache, RequestContext *ctx) {
+    size_t keyLength = strlen(ctx->cacheKey);
+    char key[keyLength + sizeof("#vary")];
+    memcpy(key, ctx->cacheKey, keyLength);
+    memcpy(key + keyLength, "#vary", sizeof("#vary"));
+    return cachePathForKey(cache, ctx, key, keyLength + sizeof("#vary") - 1);
+}
+
+// The Vary list recorded for the request's URL, into vary[VARY_MAX]
+static int readVaryRecord(Cache *cache, const char *path, char *vary) {
+    CacheObject record;
+    if (cacheOpen(cache, path, &record) == -1) {
+        return -1;
+    }
+    ssize_t got = record.length < VARY_MAX ? pread(record.fd, vary, (size_t) record.length, record.offset) : -1;
+    close(record.fd);
+    if (got != record.length) {
+        return -1;
+    }
+    vary[got] = '\0';
+    return 0;
+}
+
+/**
+ * @brief Records that the request's URL varies on the given headers.
+ *
+ * The record is a small object under a key derived from the URL's. When
+ * it is first written or changes, the object stored under the URL itself,
+ * from before the response varied, is removed: it would otherwise keep
+ * answering every request.
+ *
+ * @return 0 on success, CPROXY_ERR_CACHE or CPROXY_ERR_NOMEM.
+ */
+int cacheRecordVary(Cache *cache, RequestContext *ctx, const char *primaryPath, const char *vary) {
+    const char *path = varyRecordPath(cache, ctx);
+    if (path == NULL) {
+        return CPROXY_ERR_NOMEM;
+    }
+    char recorded[VARY_MAX];
+    if (readVaryRecord(cache, path, recorded) == 0 && strcmp(recorded, vary) == 0) {
+        return 0;
+    }
+    CacheFill fill;
+    size_t length = strlen(vary);
+    int error = cacheFillBegin(cache, ctx, path, (long) length, &fill);
+    if (error == 0) {
+        error = cacheFillWrite(&fill, vary, length);
+    }
+    if (error == 0) {
+        error = cacheFillCommit(&fill);
+    } else {
+        cacheFillAbort(&fill);
+    }
+    if (error == 0) {
+        cacheRemove(cache, primaryPath);
+    }
+    return error;
+}
+
+/**
+ * @brief Finds the object answering a request, following a Vary record to
+ * the variant the request headers select.
+ *
+ * *path holds the request's path from cachePathFor() on entry and the path
+ * of the object found on return. For a variant, *object covers only the
+ * body and *responseHeaders holds the representation headers stored with
+ * it (CRLF-terminated lines in the request's arena); otherwise it is NULL.
+ * Takes a lookup for a URL that does not vary and three for one that does.
+ *
+ * @return 0 on a hit, -1 on a miss.
+ */
+int cacheLookup(Cache *cache, RequestContext *ctx, const char *requestHeaders, const char **path, CacheObject *object,
+                const char **responseHeaders) {
+    *responseHeaders = NULL;
+    if (cacheOpen(cache, *path, object) == 0) {
+        return 0;
+    }
+    const char *recordPath = varyRecordPath(cache, ctx);
+    char vary[VARY_MAX];
+    if (recordPath == NULL || readVaryRecord(cache, recordPath, vary) == -1) {
+        return -1;
+    }
+    const char *variantPath = cacheVariantPathFor(cache, ctx, vary, requestHeaders);
+    if (variantPath == NULL || cacheOpen(cache, variantPath, object) == -1) {
+        return -1;
+    }
+
+    VariantHeader header;
+    char *headers = NULL;
+    if (pread(object->fd, &header, sizeof(header), object->offset) == (ssize_t) sizeof(header) &&
+        header.magic == VARIANT_MAGIC && header.length <= VARY_HEADERS_MAX &&
+        (off_t) (sizeof(header) + header.length) <= object->length) {
+        headers = arenaAlloc(&ctx->arena, header.length + 1);
+    }
+    if (headers == NULL ||
+        pread(object->fd, headers, header.length, object->offset + (off_t) sizeof(header)) != (ssize_t) header.length) {
+        close(object->fd);
+        return -1;
+    }
+    headers[header.length] = '\0';
+    object->offset += (off_t) (sizeof(header) + header.length);
+    object->length -= (off_t) (sizeof(header) + header.length);
+    *path = variantPath;
+    *responseHeaders = headers;
+    return 0;
+}
+
+/**
+ * @brief Starts storing a 200 response on a shard, as a variant if it has Vary.
+ *
+ * response holds the headerLength bytes of the response header. Responses
+ * that vary on "*" or on too many headers are not stored. An encoded
+ * response is taken to vary on Accept-Encoding whether it says so or not.
+ *
+ * @return 0 with the fill active, or not active when the response is not
+ * to be stored; otherwise the error of the fill, which is not active then.
+ */
+int cacheShardFillResponse(CacheShard *shard, RequestContext *ctx, const char *path, const char *requestHeaders,
+                           const char *response, size_t headerLength, long contentLength, CacheFill *fill) {
+    fill->active = 0;
+    size_t valueLength = 0;
+    const char *value = httpHeaderFind(response, headerLength, "Vary", &valueLength);
+    // An encoded body answers the Accept-Encoding the proxy sent: stored as a variant, it keeps its Content-Encoding
+    size_t encodingLength;
+    const char *encoding = httpHeaderFind(response, headerLength, "Content-Encoding", &encodingLength);
+    char list[valueLength + sizeof(",accept-encoding")];
+    if (encoding != NULL && !(encodingLength == 8 && strncasecmp(encoding, "identity", 8) == 0)) {
+        if (value != NULL) {
+            memcpy(list, value, valueLength);
+        }
+        memcpy(list + valueLength, ",accept-encoding", sizeof(",accept-encoding"));
+        value = list;
+        valueLength += sizeof(",accept-encoding") - 1;
+    }
+    char vary[VARY_MAX];
+    int varyLength = value != NULL ? varyNormalize(value, valueLength, vary, sizeof(vary)) : 0;
+    if (varyLength < 0) {
+        return 0;
+    }
+    if (varyLength == 0) {
+        return cacheShardFillBegin(shard, ctx, path, contentLength, fill);
+    }
+    const char *variantPath = cacheVariantPathFor(&shard->cache, ctx, vary, requestHeaders);
+    if (variantPath == NULL) {
+        return CPROXY_ERR_NOMEM;
+    }
+    int error = cacheRecordVary(&shard->cache, ctx, path, vary);
+    char prefix[VARY_HEADERS_MAX];
+    size_t prefixLength = varyRepresentationHeaders(prefix, sizeof(prefix), response, headerLength);
+    if (error == 0) {
+        error = cacheShardFillBegin(shard, ctx, variantPath,
+                                    contentLength >= 0 ? contentLength + (long) prefixLength : -1, fill);
+    }
+    if (error == 0) {
+        error = cacheFillWrite(fill, prefix, prefixLength);
+        if (error != 0) {
+            cacheShardFillAbort(fill, error);
+        }
+    }
+    return error;
+}
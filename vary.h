@@ -0,0 +1,37 @@
+#ifndef CPROXY_VARY_H
+#define CPROXY_VARY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cache.h"
+#include "cacheset.h"
+
+// Longest Vary list, normalized, that is recorded; longer ones are not cached
+#define VARY_MAX 256
+// Room for the representation headers stored in front of a variant's body
+#define VARY_HEADERS_MAX 1024
+
+/**
+ * @brief Header stored in front of the body of a variant.
+ *
+ * Followed by length bytes of CRLF-terminated header lines that describe
+ * the representation (Content-Type, Content-Encoding, ...), which a hit
+ * has to send along with the body.
+ */
+typedef struct VariantHeader {
+    uint32_t magic;
+    uint32_t length;
+} VariantHeader;
+
+int varyNormalize(const char *value, size_t length, char *out, size_t size);
+size_t varyRepresentationHeaders(char *out, size_t size, const char *block, size_t length);
+
+const char *cacheVariantPathFor(const Cache *cache, RequestContext *ctx, const char *vary, const char *requestHeaders);
+int cacheRecordVary(Cache *cache, RequestContext *ctx, const char *primaryPath, const char *vary);
+int cacheLookup(Cache *cache, RequestContext *ctx, const char *requestHeaders, const char **path, CacheObject *object,
+                const char **responseHeaders);
+int cacheShardFillResponse(CacheShard *shard, RequestContext *ctx, const char *path, const char *requestHeaders,
+                           const char *response, size_t headerLength, long contentLength, CacheFill *fill);
+
+#endif //CPROXY_VARY_H
@@ -0,0 +1,335 @@
+#define _GNU_SOURCE
+#include "worker.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef struct Listener {
+    IoWatcher io;
+    EventLoop *loop;
+    AcceptHandler onAccept;
+    WorkerStats *stats;
+    int counted;            // Connections count as accepted clients, unlike scrapes
+} Listener;
+
+static volatile sig_atomic_t masterStopping = 0;
+static EventLoop *workerLoop = NULL;
+static const WorkerStats *allStats = NULL;
+static int allStatsCount = 0;
+
+static void onMasterSignal(int sig) {
+    (void) sig;
+    masterStopping = 1;
+}
+
+static void onWorkerSignal(int sig) {
+    (void) sig;
+    if (workerLoop != NULL) {
+        loopStop(workerLoop);
+    }
+}
+
+/**
+ * @brief Opens a non-blocking listener that shares its port with the other workers.
+ *
+ * With SO_REUSEPORT every worker owns a separate accept queue and the kernel
+ * spreads incoming connections across them, so there is no thundering herd
+ * and no shared accept lock.
+ */
+static int openListener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("Socket creation failed");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+        perror("SO_REUSEPORT");
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((uint16_t) port);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, SOMAXCONN) == -1) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void onListenerReadable(IoWatcher *watcher, uint32_t events) {
+    Listener *listener = watcher->arg;
+    (void) events;
+
+    // Drain the accept queue; the listener is level-triggered so nothing is lost if we stop early
+    for (;;) {
+        int fd = accept4(watcher->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+        if (listener->counted) {
+            listener->stats->accepted++;
+        }
+        listener->onAccept(listener->loop, fd, listener->stats);
+    }
+}
+
+static int pinToCpu(int index) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return -1;
+    }
+    int cpu = (int) (index % cpus);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        perror("sched_setaffinity");
+        return -1;
+    }
+    return cpu;
+}
+
+static int addListener(Listener *listener, EventLoop *loop, int port, AcceptHandler onAccept, WorkerStats *stats,
+                       int counted) {
+    int fd = openListener(port);
+    if (fd == -1) {
+        return -1;
+    }
+    listener->loop = loop;
+    listener->onAccept = onAccept;
+    listener->stats = stats;
+    listener->counted = counted;
+    watcherInit(&listener->io, fd, onListenerReadable, listener);
+    if (loopAddFd(loop, &listener->io, EPOLLIN) == -1) {
+        perror("epoll_ctl");
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void workerMain(const WorkerConfig *config, int index, AcceptHandler onAccept, AcceptHandler onMetricsAccept,
+                       WorkerStats *stats) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onWorkerSignal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    stats->pid = getpid();
+    stats->cpu = config->pinCpus ? pinToCpu(index) : -1;
+
+    EventLoop loop;
+    if (loopInit(&loop) == -1) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    workerLoop = &loop;
+    if (config->onStart != NULL) {
+        config->onStart(&loop, index);
+    }
+
+    Listener listener, metrics;
+    if (addListener(&listener, &loop, config->port, onAccept, stats, 1) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    // Every worker can answer a scrape: the counters of all of them are in the shared mapping
+    int scraped = config->metricsPort > 0 && onMetricsAccept != NULL;
+    if (scraped && addListener(&metrics, &loop, config->metricsPort, onMetricsAccept, stats, 0) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (loopRun(&loop) == -1) {
+        perror("epoll_wait");
+    }
+    if (config->onStop != NULL) {
+        config->onStop(index);
+    }
+
+    loopDelFd(&loop, &listener.io);
+    close(listener.io.fd);
+    if (scraped) {
+        loopDelFd(&loop, &metrics.io);
+        close(metrics.io.fd);
+    }
+    loopClose(&loop);
+    exit(EXIT_SUCCESS);
+}
+
+static pid_t spawnWorker(const WorkerConfig *config, int index, AcceptHandler onAccept, AcceptHandler onMetricsAccept,
+                         WorkerStats *stats) {
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        workerMain(config, index, onAccept, onMetricsAccept, &stats[index]);
+    }
+    return pid;
+}
+
+static void printWorkerSummary(const WorkerConfig *config, const WorkerStats *stats) {
+    unsigned long total = 0;
+    unsigned long busiest = 0;
+    for (int i = 0; i < config->workers; i++) {
+        total += stats[i].requests;
+        if (stats[i].requests > busiest) {
+            busiest = stats[i].requests;
+        }
+    }
+    fprintf(stderr, "Worker summary:\n");
+    for (int i = 0; i < config->workers; i++) {
+        double share = total ? 100.0 * (double) stats[i].requests / (double) total : 0.0;
+        fprintf(stderr, "worker %d (cpu %d): %lu connections, %lu requests (%.1f%%), %lu cache hits\n",
+                i, stats[i].cpu, stats[i].accepted, stats[i].requests, share, stats[i].hits);
+    }
+    unsigned long probed = 0, resident = 0;
+    for (int i = 0; i < config->workers; i++) {
+        probed += stats[i].probedPages;
+        resident += stats[i].residentPages;
+    }
+    if (probed > 0) {
+        fprintf(stderr, "page cache: %.1f%% of %lu probed pages of cache hits resident\n",
+                100.0 * (double) resident / (double) probed, probed);
+    }
+    unsigned long dropped = 0;
+    for (int i = 0; i < config->workers; i++) {
+        dropped += stats[i].logDropped;
+    }
+    if (dropped > 0) {
+        fprintf(stderr, "access log: %lu entries dropped\n", dropped);
+    }
+    double mean = (double) total / (double) config->workers;
+    fprintf(stderr, "load imbalance (busiest / mean): %.2f\n", mean > 0 ? (double) busiest / mean : 0.0);
+}
+
+/**
+ * @brief Starts the worker processes and supervises them until SIGINT or SIGTERM.
+ *
+ * Each worker runs its own listener, event loop and connection pool, so
+ * nothing is shared between them except the on-disk cache. A worker that
+ * dies is restarted. With a metrics port, every worker also takes scrape
+ * connections there and hands them to onMetricsAccept.
+ *
+ * @return 0 on a clean shutdown, -1 if the workers could not be started.
+ */
+int runWorkers(const WorkerConfig *config, AcceptHandler onAccept, AcceptHandler onMetricsAccept) {
+    if (config->workers < 1 || config->workers > MAX_WORKERS) {
+        fprintf(stderr, "Invalid number of workers: %d\n", config->workers);
+        return -1;
+    }
+
+    WorkerStats *stats = mmap(NULL, sizeof(WorkerStats) * config->workers, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    memset(stats, 0, sizeof(WorkerStats) * config->workers);
+    allStats = stats;
+    allStatsCount = config->workers;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onMasterSignal;     // No SA_RESTART so that wait() returns on a signal
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    pid_t pids[MAX_WORKERS];
+    for (int i = 0; i < config->workers; i++) {
+        pids[i] = spawnWorker(config, i, onAccept, onMetricsAccept, stats);
+        if (pids[i] == -1) {
+            for (int j = 0; j < i; j++) {
+                kill(pids[j], SIGTERM);
+            }
+            return -1;
+        }
+    }
+    fprintf(stderr, "Listening on port %d with %d worker(s)\n", config->port, config->workers);
+
+    while (!masterStopping) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        int alive = 0;
+        for (int i = 0; i < config->workers; i++) {
+            if (pids[i] == pid && !masterStopping) {
+                if (WIFSIGNALED(status)) {
+                    fprintf(stderr, "worker %d killed by signal %d, restarting\n", i, WTERMSIG(status));
+                    stats[i].active = 0;
+                    stats[i].fills = 0;
+                    pids[i] = spawnWorker(config, i, onAccept, onMetricsAccept, stats);
+                } else {
+                    // A worker that exits on its own failed to start; restarting would only spin
+                    fprintf(stderr, "worker %d exited with status %d\n", i, WEXITSTATUS(status));
+                    pids[i] = 0;
+                }
+            }
+            if (pids[i] > 0) {
+                alive++;
+            }
+        }
+        if (alive == 0) {
+            break;
+        }
+    }
+
+    for (int i = 0; i < config->workers; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+        }
+    }
+    while (wait(NULL) > 0 || errno == EINTR) {
+    }
+
+    printWorkerSummary(config, stats);
+    munmap(stats, sizeof(WorkerStats) * config->workers);
+    allStats = NULL;
+    return 0;
+}
+
+/**
+ * @brief The counters of every worker, for a scrape answered by any of them.
+ *
+ * Other workers keep writing while they are read; each counter is a
+ * single aligned word, so a reader sees either its old or its new value.
+ */
+const WorkerStats *workerStatsAll(int *count) {
+    *count = allStatsCount;
+    return allStats;
+}
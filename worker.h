@@ -0,0 +1,71 @@
+#ifndef CPROXY_WORKER_H
+#define CPROXY_WORKER_H
+
+#include "bufpool.h"
+#include "eventloop.h"
+
+#define MAX_WORKERS 256
+
+// Request latency buckets of /metrics; their upper bounds are in metrics.c
+#define LATENCY_BUCKETS 16
+
+/**
+ * @brief Request latencies counted per bucket, exported as a Prometheus histogram.
+ */
+typedef struct LatencyCounts {
+    unsigned long buckets[LATENCY_BUCKETS + 1];     // The last one is above every bound
+    unsigned long long sumNs;
+} LatencyCounts;
+
+/**
+ * @brief Counters one worker publishes to the master process.
+ *
+ * Lives in a shared anonymous mapping; each worker only writes its own
+ * entry, which is aligned to a cache line so workers never share one.
+ * Every counter has a single writer, so the hot paths increment it without
+ * atomics or locks; readers sum all entries when they need a total, e.g.
+ * for a /metrics scrape.
+ */
+typedef struct WorkerStats {
+    unsigned long accepted;     // Client connections accepted
+    unsigned long requests;     // Requests answered
+    unsigned long hits;         // Answered from the cache
+    unsigned long active;       // Connections currently open
+    unsigned long probedPages;  // Pages of cache hits looked at in the page cache
+    unsigned long residentPages;    // ... that were there
+    int cpu;                    // CPU the worker is pinned to, -1 when not pinned
+    int pid;
+    unsigned long misses;       // Requests relayed to the origin
+    unsigned long refused;      // Stored copies found but refused for failing their checksum
+    unsigned long fills;        // Cache fills in progress
+    unsigned long admitted;     // 200 responses the admission sketch let into the cache, with -A
+    unsigned long rejected;     // ... and kept out, relayed without being stored
+    unsigned long long cacheBytes;  // Body bytes served from the cache
+    unsigned long long originBytes; // ... and received from origins
+    unsigned long buffersInUse[BUFFER_CLASSES];     // I/O buffer pool, published once a second
+    unsigned long bufferSlabs;
+    unsigned long logDropped;   // Access log entries dropped because the writer was behind
+    LatencyCounts hitLatency;
+    LatencyCounts missLatency;
+} __attribute__((aligned(64))) WorkerStats;
+
+typedef struct WorkerConfig {
+    int port;
+    int metricsPort;            // Second listener for scrapes, 0 for none
+    int workers;                // Number of worker processes
+    int pinCpus;                // Pin worker i to CPU i modulo the online CPUs
+    // Optional: runs in every worker after fork(), before the first client is accepted
+    void (*onStart)(EventLoop *loop, int index);
+    // Optional: runs in every worker once its loop has stopped, before it exits
+    void (*onStop)(int index);
+} WorkerConfig;
+
+/**
+ * @brief Called by a worker for every accepted client socket (already non-blocking).
+ */
+typedef void (*AcceptHandler)(EventLoop *loop, int clientFd, WorkerStats *stats);
+
+int runWorkers(const WorkerConfig *config, AcceptHandler onAccept, AcceptHandler onMetricsAccept);
+const WorkerStats *workerStatsAll(int *count);
+
+#endif //CPROXY_WORKER_H